@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#include <unistd.h>
+#include <emmintrin.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#undef _GNU_SOURCE
+
+#include "topology.h"
+#include "barrier.h"
+
+
+// each level in its own cache line
+typedef union node {
+	struct {
+		volatile int generation;
+		volatile int count;
+		volatile int waiters;
+		int size;
+		union node *parent;
+	};
+	char line[64];
+} node_t;
+
+struct barrier {
+	int spin;
+	node_t *nodes;
+	node_t **leaf;
+};
+
+barrier_t *barrier_init(int threads, const int *cpu,
+                        const int *numa_node, const int *group)
+{
+	int t, l, n, numa = 0, leaves = 0;
+	int *leaf_numa = malloc(threads * sizeof(int));
+	int *leaf_group = malloc(threads * sizeof(int));
+	int *thread_leaf = malloc(threads * sizeof(int));
+	for (t = 0 ; t != threads ; ++t)
+		if (numa_node[t] >= numa)
+			numa = numa_node[t] + 1;
+	// leaves are the (numa node, group) pairs
+	for (t = 0 ; t != threads ; ++t) {
+		int g = group != NULL ? group[t] : topology_l3_of_cpu(cpu[t]);
+		for (l = 0 ; l != leaves ; ++l)
+			if (leaf_numa[l] == numa_node[t] && leaf_group[l] == g)
+				break;
+		if (l == leaves) {
+			leaf_numa[leaves] = numa_node[t];
+			leaf_group[leaves++] = g;
+		}
+		thread_leaf[t] = l;
+	}
+	// root, then numa nodes, then leaves
+	barrier_t *b = malloc(sizeof(barrier_t));
+	void *ptr = NULL;
+	int r = posix_memalign(&ptr, 64, (1 + numa + leaves) * sizeof(node_t));
+	assert(r == 0);
+	b->nodes = ptr;
+	for (n = 0 ; n != 1 + numa + leaves ; ++n) {
+		b->nodes[n].generation = 0;
+		b->nodes[n].count = 0;
+		b->nodes[n].waiters = 0;
+		b->nodes[n].size = 0;
+		b->nodes[n].parent = NULL;
+	}
+	node_t *root = &b->nodes[0];
+	for (n = 0 ; n != numa ; ++n)
+		b->nodes[1 + n].parent = root;
+	for (l = 0 ; l != leaves ; ++l) {
+		node_t *node = &b->nodes[1 + leaf_numa[l]];
+		if (node->size++ == 0) root->size++;
+		b->nodes[1 + numa + l].parent = node;
+	}
+	b->leaf = malloc(threads * sizeof(node_t*));
+	for (t = 0 ; t != threads ; ++t) {
+		b->leaf[t] = &b->nodes[1 + numa + thread_leaf[t]];
+		b->leaf[t]->size++;
+	}
+	// sleep right away if threads share cpus
+	b->spin = threads <= topology()->online_cpus ? 1 << 14 : 0;
+	free(leaf_numa);
+	free(leaf_group);
+	free(thread_leaf);
+	return b;
+}
+
+static void arrive(barrier_t *b, node_t *node, int levels)
+{
+	int s, generation = node->generation;
+	if (__sync_add_and_fetch(&node->count, 1) == node->size) {
+		// last thread climbs and then releases the level
+		node->count = 0;
+		if (levels) arrive(b, node->parent, levels - 1);
+		__sync_fetch_and_add(&node->generation, 1);
+		if (node->waiters)
+			syscall(SYS_futex, &node->generation, FUTEX_WAKE_PRIVATE,
+				INT_MAX, NULL, NULL, 0);
+		return;
+	}
+	for (s = 0 ; s != b->spin ; ++s) {
+		if (node->generation != generation) return;
+		_mm_pause();
+	}
+	__sync_fetch_and_add(&node->waiters, 1);
+	while (node->generation == generation)
+		syscall(SYS_futex, &node->generation, FUTEX_WAIT_PRIVATE,
+			generation, NULL, NULL, 0);
+	__sync_fetch_and_sub(&node->waiters, 1);
+}
+
+void barrier_wait(barrier_t *b, int id, int scope)
+{
+	arrive(b, b->leaf[id], scope);
+}
+
+void barrier_destroy(barrier_t *b)
+{
+	free(b->nodes);
+	free(b->leaf);
+	free(b);
+}
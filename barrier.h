@@ -0,0 +1,29 @@
+#ifndef _BARRIER_H_
+#define _BARRIER_H_
+
+/* Tree barrier shaped after the thread placement:
+ *
+ *   group (L3 domain) -> NUMA node -> all threads
+ *
+ * A thread arrives at the group of its CPU. The last thread of a
+ * level climbs to the next one, up to the level of the scope, and
+ * then releases the levels on its way back. Other threads spin for
+ * a while and then sleep on a futex. Every level counts generations,
+ * so one barrier serves all the phases of a sort.
+ */
+
+#define BARRIER_GROUP	0
+#define BARRIER_NUMA	1
+#define BARRIER_GLOBAL	2
+
+typedef struct barrier barrier_t;
+
+// groups are the L3 domains of the cpus unless given
+barrier_t *barrier_init(int threads, const int *cpu,
+                        const int *numa_node, const int *group);
+
+void barrier_wait(barrier_t *barrier, int id, int scope);
+
+void barrier_destroy(barrier_t *barrier);
+
+#endif
@@ -48,7 +48,10 @@ done
 
 echo ""
 
-echo -n "Chiplet aware"
+for placement in local mixed smt
+do
+
+echo -n "Chiplet aware ($placement)"
 
 for k in 1 10 100 1000
 do
@@ -56,8 +59,8 @@ tmp=0
 for i in {1..10}
 do
 # Run the program and capture its output
-echo "./chiplet_lsb_32 $k $core 1 $bit 0 1 $skew" &>> res_chiplet_skew_out_file.txt
-output=$(./chiplet_lsb_32 $k $core 1 $bit 0 1 $skew 2>&1)
+echo "./chiplet_lsb_32 $k $core 1 $bit 0 1 $skew --placement=$placement" &>> res_chiplet_skew_out_file.txt
+output=$(./chiplet_lsb_32 $k $core 1 $bit 0 1 $skew --placement=$placement 2>&1)
 echo "$output" &>> res_chiplet_skew_out_file.txt
 echo " " &>> res_chiplet_skew_out_file.txt
 
@@ -74,6 +77,8 @@ done
 
 echo ""
 
+done
+
 done
 done
 done
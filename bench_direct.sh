@@ -0,0 +1,57 @@
+#!/bin/bash
+
+# the range-radix pass of lsb_32 with the NUMA transfer (CHIPLET_DIRECT=0)
+# against the direct scatter to the nodes (CHIPLET_DIRECT=1)
+
+for numa in 2 4
+do
+
+echo " "
+echo "NUMA: $numa"
+echo " "
+
+for core in 16 32 64 96 128
+do
+
+echo " "
+echo "Core: $core"
+echo " "
+
+for direct in 0 1
+do
+
+if [ $direct -eq 0 ]
+then
+echo -n "Transfer"
+else
+echo -n "Direct"
+fi
+
+for k in 100 1000
+do
+tmp=0
+for i in {1..10}
+do
+# Run the program and capture its output
+echo "CHIPLET_DIRECT=$direct ./lsb_32 $k $core $numa 32" &>> res_direct_out_file.txt
+output=$(CHIPLET_DIRECT=$direct ./lsb_32 $k $core $numa 32 2>&1)
+echo "$output" &>> res_direct_out_file.txt
+echo " " &>> res_direct_out_file.txt
+
+# Extract the GB / sec value from the last line
+gbps=$(echo "$output" | grep -oP '(?<=\().*?(?= GB / sec)' | tail -n 1)
+
+tmp=$(echo "$tmp + $gbps" | bc)
+done
+
+average_gbps=$(echo "scale=2; $tmp / 10" | bc)
+
+echo -n ",$average_gbps"
+done
+
+echo ""
+
+done
+
+done
+done
@@ -0,0 +1,1202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <numa.h>
+#include <sys/time.h>
+#include <immintrin.h>
+
+#include "rand.h"
+#include "topology.h"
+#include "placement.h"
+#include "pool.h"
+#include "stable.h"
+#include "sample.h"
+#include "chipletsort.h"
+
+
+// passes over memory of the MSB engines whatever the key width: the
+// histogram, the range pass and the write back of the ranges sorted in
+// cache, CHIPLETSORT_AUTO takes them when the LSB engines need more
+#define AUTO_MSB_PASSES		3
+
+// engine entry points (every engine is built with CHIPLETSORT_LIBRARY)
+int lsb_32_sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
+                int threads, int numa, int bits, double fudge,
+                uint32_t **keys_buf, uint32_t **rids_buf, int payload,
+                char **description, uint64_t *times, int interleaved);
+
+int chiplet_lsb_32_sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
+                        int threads, int numa, int bits, double fudge,
+                        uint32_t **keys_buf, uint32_t **rids_buf,
+                        char **description, uint64_t *times, int interleaved);
+
+int cmp_32_sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
+                int threads, int numa, double fudge,
+                uint32_t **keys_buf, uint32_t **rids_buf, uint16_t **ranges,
+                char **description, uint64_t *times, int interleaved);
+
+void msb_32_sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
+                 int threads, int numa, double fudge, int fanout,
+                 char **description, uint64_t *times);
+
+int lsb_64_sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
+                int numa, int bits, double fudge, uint64_t **keys_buf, uint64_t **rids_buf,
+                int payload, int record, int key_words, char **description, uint64_t *times,
+                int interleaved);
+
+int chiplet_lsb_64_sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
+                        int numa, int bits, double fudge, uint64_t **keys_buf, uint64_t **rids_buf,
+                        char **description, uint64_t *times, int interleaved);
+
+int cmp_64_sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
+                int numa, double fudge, uint64_t **keys_buf, uint64_t **rids_buf,
+                uint16_t **ranges, char **description, uint64_t *times, int interleaved);
+
+int chiplet_cmp_64_sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
+                        int numa, double fudge, uint64_t **keys_buf, uint64_t **rids_buf,
+                        uint16_t **ranges, char **description, uint64_t *times, int interleaved);
+
+void msb_64_sort(uint64_t **keys, uint64_t **rids, uint64_t *size,
+                 int threads, int numa, double fudge, int fanout,
+                 char **description, uint64_t *times);
+
+
+struct chipletsort {
+	int threads;
+	int numa;
+	char *placement;
+	int *cpu;
+	int *numa_node;
+	// per logical node: staged keys, rids and their buffers
+	char **stage;
+	uint64_t *stage_size;
+	// per logical node: range tags of the comparison engines
+	char **ranges;
+	uint64_t *ranges_size;
+	// per logical node: scratch rids of key-only sorts on engines
+	// that always move a payload
+	char **scratch;
+	uint64_t *scratch_size;
+	chipletsort_key_t key_type;
+	int stable;
+};
+
+// order-preserving transform of the keys at the start of rows of record
+// bytes, applied while copying them (decode undoes it)
+typedef struct {
+	chipletsort_key_t type;
+	int width;
+	int record;
+	int decode;
+} key_codec_t;
+
+// sampled statistics of an input
+typedef struct {
+	uint64_t size;
+	uint64_t sample_size;
+	uint64_t distinct;
+	int key_bits;
+	double heavy;
+	// largest share of the sample in a range of the node split and of
+	// the split per thread
+	double node_range;
+	double thread_range;
+} input_stats_t;
+
+typedef struct {
+	int id;
+	int threads;
+	int numa;
+	int copies;
+	char **dst;
+	char **src;
+	uint64_t *bytes;
+	const key_codec_t *codec;
+} copy_data_t;
+
+typedef struct {
+	int id;
+	int threads;
+	int numa;
+	int columns;
+	const uint32_t *perm;
+	uint64_t size;
+	char **dst;
+	char **src;
+	const int *widths;
+} gather_data_t;
+
+static uint64_t micro_time(void)
+{
+	struct timeval t;
+	struct timezone z;
+	gettimeofday(&t, &z);
+	return t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static const char *algorithm_name[] = {"lsb", "msb", "cmp", "chiplet_lsb", "chiplet_cmp", "none"};
+
+static uint64_t align_64(uint64_t bytes)
+{
+	return (bytes + 63) & ~63;
+}
+
+// grow a node-local area and drop its contents
+static char *grow(chipletsort_t *ctx, char **area, uint64_t *area_size,
+                  int n, uint64_t bytes)
+{
+	if (area_size[n] < bytes) {
+		if (area[n] != NULL)
+			numa_free(area[n], area_size[n]);
+		area[n] = numa_alloc_onnode(bytes, topology_numa_of_cpu(ctx->cpu[n]));
+		assert(area[n] != NULL);
+		area_size[n] = bytes;
+	}
+	return area[n];
+}
+
+chipletsort_t *chipletsort_create(int threads, int numa, const char *placement)
+{
+	assert(numa > 0 && numa <= 64);
+	assert(threads >= numa && threads % numa == 0);
+	if (placement != NULL && placement_set(placement) < 0)
+		return NULL;
+	chipletsort_t *ctx = calloc(1, sizeof(chipletsort_t));
+	ctx->threads = threads;
+	ctx->numa = numa;
+	if (placement != NULL)
+		ctx->placement = strdup(placement);
+	ctx->cpu = malloc(threads * sizeof(int));
+	ctx->numa_node = malloc(threads * sizeof(int));
+	placement_schedule(ctx->cpu, ctx->numa_node, threads, numa);
+	ctx->stage = calloc(numa, sizeof(char*));
+	ctx->stage_size = calloc(numa, sizeof(uint64_t));
+	ctx->ranges = calloc(numa, sizeof(char*));
+	ctx->ranges_size = calloc(numa, sizeof(uint64_t));
+	ctx->scratch = calloc(numa, sizeof(char*));
+	ctx->scratch_size = calloc(numa, sizeof(uint64_t));
+	return ctx;
+}
+
+void chipletsort_key_type(chipletsort_t *ctx, chipletsort_key_t type)
+{
+	ctx->key_type = type;
+}
+
+void chipletsort_stable(chipletsort_t *ctx, int stable)
+{
+	ctx->stable = stable;
+}
+
+void chipletsort_destroy(chipletsort_t *ctx)
+{
+	int n;
+	for (n = 0 ; n != ctx->numa ; ++n) {
+		if (ctx->stage[n] != NULL)
+			numa_free(ctx->stage[n], ctx->stage_size[n]);
+		if (ctx->ranges[n] != NULL)
+			numa_free(ctx->ranges[n], ctx->ranges_size[n]);
+		if (ctx->scratch[n] != NULL)
+			numa_free(ctx->scratch[n], ctx->scratch_size[n]);
+	}
+	free(ctx->stage);
+	free(ctx->stage_size);
+	free(ctx->ranges);
+	free(ctx->ranges_size);
+	free(ctx->scratch);
+	free(ctx->scratch_size);
+	free(ctx->cpu);
+	free(ctx->numa_node);
+	free(ctx->placement);
+	free(ctx);
+}
+
+// signed keys flip the sign bit, floating-point keys flip all bits of
+// negatives and the sign bit of the rest, then all compare as unsigned
+static uint32_t code_32(uint32_t key, chipletsort_key_t type, int decode)
+{
+	uint32_t sign = 1u << 31;
+	if (type == CHIPLETSORT_SIGNED)
+		return key ^ sign;
+	if (decode)
+		return key ^ (((key >> 31) - 1) | sign);
+	return key ^ (-(key >> 31) | sign);
+}
+
+static uint64_t code_64(uint64_t key, chipletsort_key_t type, int decode)
+{
+	uint64_t sign = 1ull << 63;
+	if (type == CHIPLETSORT_SIGNED)
+		return key ^ sign;
+	if (decode)
+		return key ^ (((key >> 63) - 1) | sign);
+	return key ^ (-(key >> 63) | sign);
+}
+
+// copy rows with their keys transformed, dst may be src, only the most
+// significant word of keys of two words is
+static void code_keys(char *dst, const char *src, uint64_t rows, const key_codec_t *c)
+{
+	uint64_t i;
+	int coded = c->width == sizeof(uint32_t) ? sizeof(uint32_t) : sizeof(uint64_t);
+	for (i = 0 ; i != rows ; ++i) {
+		const char *in = &src[i * c->record];
+		char *out = &dst[i * c->record];
+		if (c->width == sizeof(uint32_t))
+			*(uint32_t*) out = code_32(*(const uint32_t*) in, c->type, c->decode);
+		else
+			*(uint64_t*) out = code_64(*(const uint64_t*) in, c->type, c->decode);
+		if (c->record != coded && out != in)
+			memcpy(&out[coded], &in[coded], c->record - coded);
+	}
+}
+
+static void *copy_thread(void *arg)
+{
+	copy_data_t *d = (copy_data_t*) arg;
+	int c, numa_node = d->id % d->numa;
+	int threads_per_numa = d->threads / d->numa;
+	int numa_local_id = d->id / d->numa;
+	// copy the share of this thread from the copies on its node
+	for (c = numa_node ; c < d->copies ; c += d->numa) {
+		// the first numa copies have the keys
+		if (d->codec != NULL && c < d->numa) {
+			uint64_t rows = d->bytes[c] / d->codec->record;
+			uint64_t first = (rows * numa_local_id) / threads_per_numa;
+			uint64_t last = (rows * (numa_local_id + 1)) / threads_per_numa;
+			uint64_t at = first * d->codec->record;
+			code_keys(&d->dst[c][at], &d->src[c][at], last - first, d->codec);
+			continue;
+		}
+		uint64_t from = (d->bytes[c] * numa_local_id) / threads_per_numa;
+		uint64_t to = (d->bytes[c] * (numa_local_id + 1)) / threads_per_numa;
+		memcpy(&d->dst[c][from], &d->src[c][from], to - from);
+	}
+	return NULL;
+}
+
+// copy i runs on the threads of logical node i % numa, the keys are
+// transformed by the codec if any
+static void parallel_copy(chipletsort_t *ctx, int copies, char **dst, char **src,
+                          uint64_t *bytes, const key_codec_t *codec)
+{
+	int t, threads = ctx->threads;
+	copy_data_t *data = malloc(threads * sizeof(copy_data_t));
+	for (t = 0 ; t != threads ; ++t) {
+		data[t].id = t;
+		data[t].threads = threads;
+		data[t].numa = ctx->numa;
+		data[t].copies = copies;
+		data[t].dst = dst;
+		data[t].src = src;
+		data[t].bytes = bytes;
+		data[t].codec = codec;
+	}
+	pool_start(threads, ctx->cpu, copy_thread, data, sizeof(copy_data_t));
+	pool_wait();
+	free(data);
+}
+
+static int uint64_compare(const void *x, const void *y)
+{
+	uint64_t a = *((const uint64_t*) x);
+	uint64_t b = *((const uint64_t*) y);
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+// largest share of the sorted sample in a range split of it into parts,
+// with the delimiters the engines take from their own sample
+static double largest_range(const uint64_t *sample, uint64_t sample_size, int parts)
+{
+	uint64_t i = 0, largest = 0;
+	uint64_t *delimiter = calloc(parts, sizeof(uint64_t));
+	int p;
+	delimiter[parts - 1] = ~ (uint64_t) 0;
+	sample_delimiters_64(sample, sample_size, delimiter, NULL);
+	for (p = 0 ; p != parts ; ++p) {
+		uint64_t from = i;
+		while (i != sample_size && sample[i] <= delimiter[p]) i++;
+		if (i - from > largest) largest = i - from;
+	}
+	free(delimiter);
+	return largest / (double) sample_size;
+}
+
+// sample 0.1% of the keys (at most 100000) as the LSB engines do for
+// their node split, at least 1000 for the statistics
+static void sample_input(void **keys, const uint64_t *size, int parts,
+                         int width, int numa, int threads, input_stats_t *stats)
+{
+	int n;
+	uint64_t i, j, total = 0;
+	for (n = 0 ; n != parts ; ++n)
+		total += size[n];
+	uint64_t sample_size = total * 0.001;
+	if (sample_size > 100000) sample_size = 100000;
+	if (sample_size < 1000) sample_size = total < 1000 ? total : 1000;
+	memset(stats, 0, sizeof(input_stats_t));
+	stats->size = total;
+	stats->sample_size = sample_size;
+	if (sample_size == 0) return;
+	uint64_t *sample = malloc(sample_size * sizeof(uint64_t));
+	rand64_t *gen = rand64_init(micro_time());
+	for (i = 0 ; i != sample_size ; ++i) {
+		uint64_t p = rand64_next(gen) % total;
+		for (n = 0 ; p >= size[n] ; ++n)
+			p -= size[n];
+		sample[i] = width == 4 ? ((uint32_t*) keys[n])[p] : ((uint64_t*) keys[n])[p];
+	}
+	free(gen);
+	qsort(sample, sample_size, sizeof(uint64_t), uint64_compare);
+	// runs of equal keys
+	uint64_t seen = 0, once = 0, twice = 0, max_run = 0, varying = 0;
+	for (i = 0 ; i != sample_size ; i = j) {
+		for (j = i + 1 ; j != sample_size && sample[j] == sample[i] ; ++j);
+		if (j - i == 1) once++;
+		if (j - i == 2) twice++;
+		if (j - i > max_run) max_run = j - i;
+		varying |= sample[i] ^ sample[0];
+		seen++;
+	}
+	// the range splits of the engines: across nodes for the LSB and the
+	// comparison engines, a sampled range per thread for the MSB ones
+	stats->node_range = largest_range(sample, sample_size, numa);
+	stats->thread_range = largest_range(sample, sample_size, threads);
+	free(sample);
+	// unseen keys from the ones seen once or twice (Chao1)
+	double unseen = once * (double) once / (2.0 * (twice ? twice : 1));
+	stats->distinct = seen + unseen < total ? seen + unseen : total;
+	while (stats->key_bits != 64 && (varying >> stats->key_bits) != 0)
+		stats->key_bits++;
+	stats->heavy = max_run / (double) sample_size;
+}
+
+// passes of the LSB engines over the key bits and the bits of the node
+// split, the limits of distribute_bits() in lsb_32.c and lsb_64.c
+static int lsb_passes(int width, int key_bits, int numa)
+{
+	static const int limit_32[] = {12, 24, 38};
+	static const int limit_64[] = {12, 23, 34, 45, 56, 67, 78};
+	const int *limit = width == 4 ? limit_32 : limit_64;
+	int passes = 0, numa_bits = 0;
+	while ((1 << numa_bits) < numa) numa_bits++;
+	while (limit[passes++] < key_bits + numa_bits);
+	return passes;
+}
+
+// ranges of the MSB engines, the least of 128 or more with two per thread
+static int msb_fanout(int threads)
+{
+	int fanout;
+	for (fanout = 128 ; fanout < threads * 2 ; fanout <<= 1);
+	return fanout;
+}
+
+// the MSB engines leave a block open per range in every thread and need
+// room for them within the fudge factor of a node, with blocks of 64
+// tuples at least, and as many blocks per thread as ranges
+static int msb_fits(uint64_t size, int threads_per_numa, int fanout)
+{
+	uint64_t blocks = size / 64;
+	return (uint64_t) (size * CHIPLETSORT_FUDGE) / 64 >=
+	       2 + blocks + (uint64_t) threads_per_numa * fanout &&
+	       blocks / threads_per_numa >= (uint64_t) fanout;
+}
+
+// the MSB engines also split a node in shares of whole blocks, so every
+// node must hold a multiple of 4 tuples
+static int msb_sizes(const uint64_t *size, int numa, int threads)
+{
+	int n;
+	for (n = 0 ; n != numa ; ++n)
+		if ((size[n] & 3) != 0 || !msb_fits(size[n], threads / numa, msb_fanout(threads)))
+			return 0;
+	return 1;
+}
+
+// first tuple of node n when a contiguous array is staged on the nodes,
+// the splits are multiples of 4 tuples for the MSB engines
+static uint64_t node_from(uint64_t size, int n, int numa)
+{
+	return n == numa ? size : ((size * n) / numa) & ~(uint64_t) 3;
+}
+
+// the sample is taken from the parts of keys, node_size[] are the sizes
+// the engines will get
+static chipletsort_algorithm_t auto_algorithm(chipletsort_t *ctx, int width,
+                                              void **keys, const uint64_t *size,
+                                              int parts, const uint64_t *node_size,
+                                              int payload)
+{
+	input_stats_t stats;
+	chipletsort_algorithm_t algorithm;
+	const topology_t *topo = topology();
+	int chiplets = topo->l3_domains > topo->numa_nodes;
+	int threads = ctx->threads, numa = ctx->numa;
+	sample_input(keys, size, parts, width, numa, threads, &stats);
+	int passes = lsb_passes(width, stats.key_bits, numa);
+	// every engine gives a node its whole range in buffers of fudge
+	// times its share, none can sort if a range does not fit
+	if (numa > 1 && stats.node_range * numa > CHIPLETSORT_FUDGE)
+		algorithm = CHIPLETSORT_AUTO;
+	// bare keys skip the rid stream only on the LSB engine, the others
+	// carry scratch rids
+	else if (payload == 0)
+		algorithm = CHIPLETSORT_LSB;
+	// the MSB engines run on up to 512 threads and pay off when the LSB
+	// ones need more passes, unless they would refuse the node sizes or
+	// a thread gets more than fudge times its share of the local sort
+	else if (threads <= 512 && passes > AUTO_MSB_PASSES &&
+	         msb_sizes(node_size, numa, threads) &&
+	         stats.thread_range * threads <= CHIPLETSORT_FUDGE)
+		algorithm = CHIPLETSORT_MSB;
+	else
+		algorithm = chiplets && numa <= 8 ? CHIPLETSORT_CHIPLET_LSB : CHIPLETSORT_LSB;
+	if (getenv("CHIPLETSORT_VERBOSE") != NULL)
+		fprintf(stderr, "Auto: %s (%lu keys, sample %lu, ~%lu distinct, %d key bits, "
+		        "heavy %.2f%%, %d LSB passes, node range x%.2f, thread range x%.2f)\n",
+		        algorithm_name[algorithm], stats.size, stats.sample_size,
+		        stats.distinct, stats.key_bits, stats.heavy * 100, passes,
+		        stats.node_range * numa, stats.thread_range * threads);
+	return algorithm;
+}
+
+// rids have payload bytes each, or there are none if payload is 0,
+// keys are records of record bytes led by the key unless record is width
+static int run(chipletsort_t *ctx, chipletsort_algorithm_t algorithm, int width,
+               int record, void **keys, void **rids, int payload, uint64_t *size,
+               void **keys_buf, void **rids_buf, int bits,
+               chipletsort_timings_t *timings)
+{
+	int n, p, r = -1, threads = ctx->threads, numa = ctx->numa;
+	double fudge = CHIPLETSORT_FUDGE;
+	char *description[CHIPLETSORT_MAX_PHASES + 1];
+	uint64_t times[CHIPLETSORT_MAX_PHASES + 1];
+	uint16_t *ranges[numa];
+	void *scratch[numa], *scratch_buf[numa];
+	// the rids of equal keys are put in order after the engines that
+	// are not stable, unless they are scratch rids
+	int stable = ctx->stable && rids != NULL;
+	// only the LSB engine moves rids of another width than the keys,
+	// whole records and keys of two words
+	int mixed = (payload != 0 && payload != width) || record != width ||
+	            width > (int) sizeof(uint64_t);
+	assert(record == width || (width >= (int) sizeof(uint64_t) && rids == NULL));
+	if (algorithm == CHIPLETSORT_AUTO)
+		algorithm = mixed ? CHIPLETSORT_LSB :
+		            auto_algorithm(ctx, width, keys, size, numa, size, payload);
+	if (algorithm == CHIPLETSORT_AUTO)
+		return -1;
+	if (mixed && algorithm != CHIPLETSORT_LSB)
+		return -1;
+	// the chiplet LSB engines range partition across up to 8 nodes
+	if (algorithm == CHIPLETSORT_CHIPLET_LSB && numa > 8)
+		return -1;
+	// ranges of the first pass: the nodes, or the MSB fanout
+	int split = algorithm == CHIPLETSORT_MSB ? msb_fanout(threads) : numa;
+	// the MSB engines range partition up to 1024 ways, two per thread
+	// at least, and need room for their open blocks on every node
+	if (algorithm == CHIPLETSORT_MSB && (threads > 512 || !msb_sizes(size, numa, threads)))
+		return -1;
+	// only the LSB engine sorts bare keys, the others carry scratch rids
+	if (payload == 0 && algorithm != CHIPLETSORT_LSB) {
+		for (n = 0 ; n != numa ; ++n) {
+			uint64_t bytes = align_64((uint64_t) (size[n] * fudge) * width);
+			char *area = grow(ctx, ctx->scratch, ctx->scratch_size, n, bytes * 2);
+			scratch[n] = &area[0];
+			scratch_buf[n] = &area[bytes];
+		}
+		rids = scratch;
+		rids_buf = scratch_buf;
+		payload = width;
+	}
+	for (n = 0 ; n != numa ; ++n) {
+		// only the MSB engines sort in place
+		assert(algorithm == CHIPLETSORT_MSB ||
+		       (keys_buf[n] != NULL && (rids == NULL || rids_buf[n] != NULL)));
+		ranges[n] = NULL;
+	}
+	if (algorithm == CHIPLETSORT_CMP || algorithm == CHIPLETSORT_CHIPLET_CMP)
+		for (n = 0 ; n != numa ; ++n) {
+			uint64_t bytes = (uint64_t) (size[n] * fudge) * sizeof(uint16_t);
+			ranges[n] = (uint16_t*) grow(ctx, ctx->ranges, ctx->ranges_size,
+			                             n, align_64(bytes));
+		}
+	// the placement file may have gone since the context was created
+	if (ctx->placement != NULL && placement_set(ctx->placement) < 0)
+		return -1;
+	description[0] = NULL;
+	uint64_t t = micro_time();
+	if (width == 4)
+		switch (algorithm) {
+		case CHIPLETSORT_LSB:
+			r = lsb_32_sort((uint32_t**) keys, (uint32_t**) rids, size,
+			                threads, numa, bits, fudge,
+			                (uint32_t**) keys_buf, (uint32_t**) rids_buf, payload,
+			                description, times, 0);
+			break;
+		case CHIPLETSORT_CHIPLET_LSB:
+			r = chiplet_lsb_32_sort((uint32_t**) keys, (uint32_t**) rids, size,
+			                        threads, numa, bits, fudge,
+			                        (uint32_t**) keys_buf, (uint32_t**) rids_buf,
+			                        description, times, 0);
+			break;
+		case CHIPLETSORT_CMP:
+			r = cmp_32_sort((uint32_t**) keys, (uint32_t**) rids, size,
+			                threads, numa, fudge,
+			                (uint32_t**) keys_buf, (uint32_t**) rids_buf, ranges,
+			                description, times, 0);
+			break;
+		case CHIPLETSORT_MSB:
+			msb_32_sort((uint32_t**) keys, (uint32_t**) rids, size,
+			            threads, numa, fudge, split, description, times);
+			r = 0;
+			break;
+		default:
+			return -1;
+		}
+	else
+		switch (algorithm) {
+		case CHIPLETSORT_LSB:
+			r = lsb_64_sort((uint64_t**) keys, (uint64_t**) rids, size, threads,
+			                numa, bits, fudge, (uint64_t**) keys_buf, (uint64_t**) rids_buf,
+			                payload, record, width / sizeof(uint64_t), description, times, 0);
+			break;
+		case CHIPLETSORT_CHIPLET_LSB:
+			r = chiplet_lsb_64_sort((uint64_t**) keys, (uint64_t**) rids, size, threads,
+			                        numa, bits, fudge, (uint64_t**) keys_buf, (uint64_t**) rids_buf,
+			                        description, times, 0);
+			break;
+		case CHIPLETSORT_CMP:
+			r = cmp_64_sort((uint64_t**) keys, (uint64_t**) rids, size, threads,
+			                numa, fudge, (uint64_t**) keys_buf, (uint64_t**) rids_buf,
+			                ranges, description, times, 0);
+			break;
+		case CHIPLETSORT_CHIPLET_CMP:
+			r = chiplet_cmp_64_sort((uint64_t**) keys, (uint64_t**) rids, size, threads,
+			                        numa, fudge, (uint64_t**) keys_buf, (uint64_t**) rids_buf,
+			                        ranges, description, times, 0);
+			break;
+		case CHIPLETSORT_MSB:
+			msb_64_sort((uint64_t**) keys, (uint64_t**) rids, size,
+			            threads, numa, fudge, split, description, times);
+			r = 0;
+			break;
+		default:
+			return -1;
+		}
+	// the NUMA transfer of the LSB engines keeps the input order, the
+	// 64-bit chiplet engine has none
+	int lsb = algorithm == CHIPLETSORT_LSB || (algorithm == CHIPLETSORT_CHIPLET_LSB &&
+	                                           (numa == 1 || width == sizeof(uint32_t)));
+	if (stable && r >= 0 && !lsb) {
+		uint64_t tim = micro_time();
+		stable_ties(r > 0 ? keys_buf : keys, r > 0 ? rids_buf : rids, size, numa,
+		            width, payload, threads, ctx->cpu);
+		tim = micro_time() - tim;
+		for (p = 0 ; description[p] != NULL ; ++p);
+		if (p != CHIPLETSORT_MAX_PHASES) {
+			description[p] = "Stable tie-break time:     ";
+			description[p + 1] = NULL;
+			times[p] = tim;
+		}
+	}
+	t = micro_time() - t;
+	if (timings != NULL) {
+		for (p = 0 ; p != CHIPLETSORT_MAX_PHASES && description[p] != NULL ; ++p) {
+			timings->name[p] = description[p];
+			timings->time[p] = times[p];
+		}
+		timings->algorithm = algorithm;
+		timings->ranges = split;
+		timings->phases = p;
+		timings->total = t;
+	}
+	return r;
+}
+
+// the NUMA-split calls transform signed and floating-point keys in place
+// before the sort and restore them in the output after it
+static int run_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm, int width,
+                    int record, void **keys, void **rids, int payload, uint64_t *size,
+                    void **keys_buf, void **rids_buf, int bits,
+                    chipletsort_timings_t *timings)
+{
+	int n, r, numa = ctx->numa;
+	char *k[numa];
+	uint64_t bytes[numa];
+	key_codec_t encode = {ctx->key_type, width, record, 0};
+	key_codec_t decode = {ctx->key_type, width, record, 1};
+	if (ctx->key_type == CHIPLETSORT_UNSIGNED)
+		return run(ctx, algorithm, width, record, keys, rids, payload, size,
+		           keys_buf, rids_buf, bits, timings);
+	for (n = 0 ; n != numa ; ++n) {
+		k[n] = keys[n];
+		bytes[n] = size[n] * record;
+	}
+	parallel_copy(ctx, numa, k, k, bytes, &encode);
+	r = run(ctx, algorithm, width, record, keys, rids, payload, size,
+	        keys_buf, rids_buf, bits, timings);
+	// the sizes have changed and the output may be in the buffers
+	for (n = 0 ; n != numa ; ++n) {
+		k[n] = r > 0 ? keys_buf[n] : keys[n];
+		bytes[n] = size[n] * record;
+	}
+	parallel_copy(ctx, numa, k, k, bytes, &decode);
+	return r;
+}
+
+// stage a contiguous array on the nodes, sort it and gather it back
+static int run_contiguous(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                          int width, int record, char *keys, char *rids, int payload,
+                          uint64_t size, int bits, chipletsort_timings_t *timings)
+{
+	int n, r, numa = ctx->numa;
+	// key-only sorts stage and gather no rids
+	int arrays = payload != 0 ? 2 : 1;
+	int mixed = (payload != 0 && payload != width) || record != width ||
+	            width > (int) sizeof(uint64_t);
+	void *k[numa], *v[numa], *k_buf[numa], *v_buf[numa];
+	char *dst[numa + numa], *src[numa + numa];
+	uint64_t part[numa], bytes[numa + numa];
+	uint64_t tuples = (size / numa + 4) * CHIPLETSORT_FUDGE;
+	uint64_t cap = align_64(tuples * record);
+	uint64_t rids_cap = align_64(tuples * payload);
+	for (n = 0 ; n != numa ; ++n)
+		part[n] = node_from(size, n + 1, numa) - node_from(size, n, numa);
+	if (algorithm == CHIPLETSORT_AUTO) {
+		void *whole = keys;
+		algorithm = mixed ? CHIPLETSORT_LSB :
+		            auto_algorithm(ctx, width, &whole, &size, 1, part, payload);
+	}
+	if (algorithm == CHIPLETSORT_AUTO)
+		return -1;
+	if (mixed && algorithm != CHIPLETSORT_LSB)
+		return -1;
+	// signed and floating-point keys are transformed while staged and
+	// restored while gathered
+	key_codec_t encode = {ctx->key_type, width, record, 0};
+	key_codec_t decode = {ctx->key_type, width, record, 1};
+	int coded = ctx->key_type != CHIPLETSORT_UNSIGNED;
+	// the LSB engines keep the tuples on a single node where they are,
+	// if their passes can stream whole cache lines to them
+	int direct = numa == 1 && !coded &&
+	             ((63 & (uint64_t) keys) | (63 & (uint64_t) rids)) == 0 &&
+	             (algorithm == CHIPLETSORT_LSB || algorithm == CHIPLETSORT_CHIPLET_LSB);
+	for (n = 0 ; n != numa ; ++n) {
+		char *stage = grow(ctx, ctx->stage, ctx->stage_size, n, (cap + rids_cap) * 2);
+		k[n] = &stage[0];
+		k_buf[n] = &stage[cap];
+		v[n] = payload != 0 ? &stage[cap * 2] : NULL;
+		v_buf[n] = payload != 0 ? &stage[cap * 2 + rids_cap] : NULL;
+		uint64_t from = node_from(size, n, numa);
+		dst[n] = k[n];
+		dst[n + numa] = v[n];
+		src[n] = &keys[from * record];
+		src[n + numa] = payload != 0 ? &rids[from * payload] : NULL;
+		bytes[n] = part[n] * record;
+		bytes[n + numa] = part[n] * payload;
+	}
+	if (direct) {
+		k[0] = keys;
+		v[0] = rids;
+	} else
+		parallel_copy(ctx, numa * arrays, dst, src, bytes, coded ? &encode : NULL);
+	r = run(ctx, algorithm, width, record, k, payload != 0 ? v : NULL, payload, part,
+	        k_buf, payload != 0 ? v_buf : NULL, bits, timings);
+	if (r < 0 || (direct && r == 0)) return r < 0 ? r : 0;
+	// gather the nodes in order
+	uint64_t offset = 0;
+	for (n = 0 ; n != numa ; ++n) {
+		src[n] = r ? k_buf[n] : k[n];
+		src[n + numa] = r ? v_buf[n] : v[n];
+		dst[n] = &keys[offset * record];
+		dst[n + numa] = payload != 0 ? &rids[offset * payload] : NULL;
+		bytes[n] = part[n] * record;
+		bytes[n + numa] = part[n] * payload;
+		offset += part[n];
+	}
+	assert(offset == size);
+	parallel_copy(ctx, numa * arrays, dst, src, bytes, coded ? &decode : NULL);
+	return 0;
+}
+
+int chipletsort_u32_pairs_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                               uint32_t **keys, uint32_t **rids, uint64_t *size,
+                               uint32_t **keys_buf, uint32_t **rids_buf, int bits,
+                               chipletsort_timings_t *timings)
+{
+	return run_numa(ctx, algorithm, sizeof(uint32_t), sizeof(uint32_t),
+	                (void**) keys, (void**) rids, sizeof(uint32_t), size,
+	                (void**) keys_buf, (void**) rids_buf, bits, timings);
+}
+
+int chipletsort_u64_pairs_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                               uint64_t **keys, uint64_t **rids, uint64_t *size,
+                               uint64_t **keys_buf, uint64_t **rids_buf, int bits,
+                               chipletsort_timings_t *timings)
+{
+	return run_numa(ctx, algorithm, sizeof(uint64_t), sizeof(uint64_t),
+	                (void**) keys, (void**) rids, sizeof(uint64_t), size,
+	                (void**) keys_buf, (void**) rids_buf, bits, timings);
+}
+
+int chipletsort_u32_pairs(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                          uint32_t *keys, uint32_t *rids, uint64_t size, int bits,
+                          chipletsort_timings_t *timings)
+{
+	return run_contiguous(ctx, algorithm, sizeof(uint32_t), sizeof(uint32_t),
+	                      (char*) keys, (char*) rids, sizeof(uint32_t), size,
+	                      bits, timings);
+}
+
+int chipletsort_u64_pairs(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                          uint64_t *keys, uint64_t *rids, uint64_t size, int bits,
+                          chipletsort_timings_t *timings)
+{
+	return run_contiguous(ctx, algorithm, sizeof(uint64_t), sizeof(uint64_t),
+	                      (char*) keys, (char*) rids, sizeof(uint64_t), size,
+	                      bits, timings);
+}
+
+int chipletsort_u32_keys_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                              uint32_t **keys, uint64_t *size, uint32_t **keys_buf,
+                              int bits, chipletsort_timings_t *timings)
+{
+	return run_numa(ctx, algorithm, sizeof(uint32_t), sizeof(uint32_t),
+	                (void**) keys, NULL, 0, size, (void**) keys_buf, NULL, bits,
+	                timings);
+}
+
+int chipletsort_u64_keys_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                              uint64_t **keys, uint64_t *size, uint64_t **keys_buf,
+                              int bits, chipletsort_timings_t *timings)
+{
+	return run_numa(ctx, algorithm, sizeof(uint64_t), sizeof(uint64_t),
+	                (void**) keys, NULL, 0, size, (void**) keys_buf, NULL, bits,
+	                timings);
+}
+
+int chipletsort_u32_keys(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                         uint32_t *keys, uint64_t size, int bits,
+                         chipletsort_timings_t *timings)
+{
+	return run_contiguous(ctx, algorithm, sizeof(uint32_t), sizeof(uint32_t),
+	                      (char*) keys, NULL, 0, size, bits, timings);
+}
+
+int chipletsort_u64_keys(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                         uint64_t *keys, uint64_t size, int bits,
+                         chipletsort_timings_t *timings)
+{
+	return run_contiguous(ctx, algorithm, sizeof(uint64_t), sizeof(uint64_t),
+	                      (char*) keys, NULL, 0, size, bits, timings);
+}
+
+int chipletsort_u32_tuples_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                                uint32_t **keys, void **rids, int rid_bytes, uint64_t *size,
+                                uint32_t **keys_buf, void **rids_buf, int bits,
+                                chipletsort_timings_t *timings)
+{
+	return run_numa(ctx, algorithm, sizeof(uint32_t), sizeof(uint32_t),
+	                (void**) keys, rids, rid_bytes, size, (void**) keys_buf,
+	                rids_buf, bits, timings);
+}
+
+int chipletsort_u64_tuples_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                                uint64_t **keys, void **rids, int rid_bytes, uint64_t *size,
+                                uint64_t **keys_buf, void **rids_buf, int bits,
+                                chipletsort_timings_t *timings)
+{
+	return run_numa(ctx, algorithm, sizeof(uint64_t), sizeof(uint64_t),
+	                (void**) keys, rids, rid_bytes, size, (void**) keys_buf,
+	                rids_buf, bits, timings);
+}
+
+int chipletsort_u32_tuples(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                           uint32_t *keys, void *rids, int rid_bytes, uint64_t size,
+                           int bits, chipletsort_timings_t *timings)
+{
+	return run_contiguous(ctx, algorithm, sizeof(uint32_t), sizeof(uint32_t),
+	                      (char*) keys, (char*) rids, rid_bytes, size, bits,
+	                      timings);
+}
+
+int chipletsort_u64_tuples(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                           uint64_t *keys, void *rids, int rid_bytes, uint64_t size,
+                           int bits, chipletsort_timings_t *timings)
+{
+	return run_contiguous(ctx, algorithm, sizeof(uint64_t), sizeof(uint64_t),
+	                      (char*) keys, (char*) rids, rid_bytes, size, bits,
+	                      timings);
+}
+
+int chipletsort_u64_records_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                                 void **records, int record_bytes, uint64_t *size,
+                                 void **records_buf, int bits,
+                                 chipletsort_timings_t *timings)
+{
+	return run_numa(ctx, algorithm, sizeof(uint64_t), record_bytes, records, NULL, 0,
+	                size, records_buf, NULL, bits, timings);
+}
+
+int chipletsort_u64_records(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                            void *records, int record_bytes, uint64_t size, int bits,
+                            chipletsort_timings_t *timings)
+{
+	return run_contiguous(ctx, algorithm, sizeof(uint64_t), record_bytes,
+	                      (char*) records, NULL, 0, size, bits, timings);
+}
+
+int chipletsort_u128_records_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                                  void **records, int record_bytes, uint64_t *size,
+                                  void **records_buf, chipletsort_timings_t *timings)
+{
+	return run_numa(ctx, algorithm, 2 * sizeof(uint64_t), record_bytes, records, NULL, 0,
+	                size, records_buf, NULL, 64, timings);
+}
+
+int chipletsort_u128_records(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                             void *records, int record_bytes, uint64_t size,
+                             chipletsort_timings_t *timings)
+{
+	return run_contiguous(ctx, algorithm, 2 * sizeof(uint64_t), record_bytes,
+	                      (char*) records, NULL, 0, size, 64, timings);
+}
+
+// positions [from, to) of the output of a thread, the output is split
+// across the logical nodes as the contiguous calls stage it
+static void gather_range(const gather_data_t *d, uint64_t *from, uint64_t *to)
+{
+	int numa_node = d->id % d->numa;
+	int threads_per_numa = d->threads / d->numa;
+	int numa_local_id = d->id / d->numa;
+	uint64_t lo = node_from(d->size, numa_node, d->numa);
+	uint64_t hi = node_from(d->size, numa_node + 1, d->numa);
+	*from = lo + ((hi - lo) * numa_local_id) / threads_per_numa;
+	*to = lo + ((hi - lo) * (numa_local_id + 1)) / threads_per_numa;
+}
+
+static void *positions_thread(void *arg)
+{
+	gather_data_t *d = (gather_data_t*) arg;
+	uint32_t *perm = (uint32_t*) d->dst[0];
+	uint64_t i, from, to;
+	gather_range(d, &from, &to);
+	for (i = from ; i != to ; ++i)
+		_mm_stream_si32((int*) &perm[i], i);
+	_mm_sfence();
+	return NULL;
+}
+
+// rows are fetched GATHER_PREFETCH positions ahead
+#define GATHER_PREFETCH	16
+
+// the width is constant in each caller so the copies are specialized,
+// 4 and 8-byte rows are streamed
+static inline __attribute__((always_inline))
+void gather_column(char *dst, const char *src, const uint32_t *perm,
+                   uint64_t size, int width)
+{
+	uint64_t i;
+	for (i = 0 ; i != size ; ++i) {
+		if (i + GATHER_PREFETCH < size)
+			__builtin_prefetch(&src[(uint64_t) perm[i + GATHER_PREFETCH] * width]);
+		const char *row = &src[(uint64_t) perm[i] * width];
+		if (width == 4)
+			_mm_stream_si32((int*) &dst[i * 4], *(const int*) row);
+		else if (width == 8)
+			_mm_stream_si64((long long int*) &dst[i * 8], *(const long long int*) row);
+		else
+			memcpy(&dst[i * width], row, width);
+	}
+}
+
+static void *gather_thread(void *arg)
+{
+	gather_data_t *d = (gather_data_t*) arg;
+	uint64_t from, to;
+	int c;
+	gather_range(d, &from, &to);
+	for (c = 0 ; c != d->columns ; ++c) {
+		int width = d->widths[c];
+		char *dst = &d->dst[c][from * width];
+		const uint32_t *perm = &d->perm[from];
+		if (width == 1)
+			gather_column(dst, d->src[c], perm, to - from, 1);
+		else if (width == 2)
+			gather_column(dst, d->src[c], perm, to - from, 2);
+		else if (width == 4)
+			gather_column(dst, d->src[c], perm, to - from, 4);
+		else if (width == 8)
+			gather_column(dst, d->src[c], perm, to - from, 8);
+		else
+			gather_column(dst, d->src[c], perm, to - from, width);
+	}
+	_mm_sfence();
+	return NULL;
+}
+
+static void run_gather(chipletsort_t *ctx, void *(*func)(void*), const uint32_t *perm,
+                       uint64_t size, int columns, void **dst, void **src,
+                       const int *widths)
+{
+	int t, threads = ctx->threads;
+	gather_data_t *data = malloc(threads * sizeof(gather_data_t));
+	for (t = 0 ; t != threads ; ++t) {
+		data[t].id = t;
+		data[t].threads = threads;
+		data[t].numa = ctx->numa;
+		data[t].columns = columns;
+		data[t].perm = perm;
+		data[t].size = size;
+		data[t].dst = (char**) dst;
+		data[t].src = (char**) src;
+		data[t].widths = widths;
+	}
+	pool_start(threads, ctx->cpu, func, data, sizeof(gather_data_t));
+	pool_wait();
+	free(data);
+}
+
+// the keys are sorted with their 32-bit positions as rids
+static int argsort(chipletsort_t *ctx, chipletsort_algorithm_t algorithm, int width,
+                   char *keys, uint32_t *perm, uint64_t size, int bits,
+                   chipletsort_timings_t *timings)
+{
+	void *dst[1] = {perm};
+	if (size > ((uint64_t) 1 << 32))
+		return -1;
+	run_gather(ctx, positions_thread, NULL, size, 0, dst, NULL, NULL);
+	return run_contiguous(ctx, algorithm, width, width, keys, (char*) perm,
+	                      sizeof(uint32_t), size, bits, timings);
+}
+
+int chipletsort_u32_argsort(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                            uint32_t *keys, uint32_t *perm, uint64_t size, int bits,
+                            chipletsort_timings_t *timings)
+{
+	return argsort(ctx, algorithm, sizeof(uint32_t), (char*) keys, perm,
+	               size, bits, timings);
+}
+
+int chipletsort_u64_argsort(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                            uint64_t *keys, uint32_t *perm, uint64_t size, int bits,
+                            chipletsort_timings_t *timings)
+{
+	return argsort(ctx, algorithm, sizeof(uint64_t), (char*) keys, perm,
+	               size, bits, timings);
+}
+
+void chipletsort_gather(chipletsort_t *ctx, const uint32_t *perm, uint64_t size,
+                        int columns, void **dst, void **src, const int *widths)
+{
+	run_gather(ctx, gather_thread, perm, size, columns, dst, src, widths);
+}
+
+// tied runs of strings shorter than this are insertion sorted
+#define STRING_INSERT_CUTOFF	16
+
+// string i is data[offsets[i], offsets[i + 1]), all start with the
+// same common bytes
+typedef struct {
+	const char *data;
+	const uint64_t *offsets;
+	uint64_t common;
+} strings_t;
+
+// a tied string sorted by its 8 bytes at a depth
+typedef struct {
+	uint64_t prefix;
+	uint32_t rest;
+	uint32_t pos;
+} string_key_t;
+
+// the 8 bytes of a string from a depth as a big-endian integer padded
+// with zeros, so that integer order is byte order
+static inline uint64_t string_prefix(const strings_t *s, uint32_t pos, uint64_t depth)
+{
+	uint64_t prefix = 0;
+	uint64_t len = s->offsets[pos + 1] - s->offsets[pos] - depth;
+	memcpy(&prefix, &s->data[s->offsets[pos] + depth], len < 8 ? len : 8);
+	return __builtin_bswap64(prefix);
+}
+
+// the bytes of a string past a depth, up to 9 (more than the prefix)
+static inline uint32_t string_rest(const strings_t *s, uint32_t pos, uint64_t depth)
+{
+	uint64_t len = s->offsets[pos + 1] - s->offsets[pos] - depth;
+	return len < 9 ? len : 9;
+}
+
+static int string_compare(const strings_t *s, uint32_t x, uint32_t y, uint64_t depth)
+{
+	uint64_t x_len = s->offsets[x + 1] - s->offsets[x] - depth;
+	uint64_t y_len = s->offsets[y + 1] - s->offsets[y] - depth;
+	int c = memcmp(&s->data[s->offsets[x] + depth], &s->data[s->offsets[y] + depth],
+	               x_len < y_len ? x_len : y_len);
+	return c != 0 ? c : (x_len > y_len) - (x_len < y_len);
+}
+
+static int string_key_compare(const void *x, const void *y)
+{
+	const string_key_t *a = (const string_key_t*) x;
+	const string_key_t *b = (const string_key_t*) y;
+	if (a->prefix != b->prefix)
+		return a->prefix < b->prefix ? -1 : 1;
+	return (a->rest > b->rest) - (a->rest < b->rest);
+}
+
+// order strings that share their first depth bytes: by the next 8 bytes
+// and how many bytes are left, then the groups that still tie and go on
+// past these bytes from the next depth, keys is grown as needed
+static void string_refine(const strings_t *s, uint64_t *perm, uint64_t size,
+                          uint64_t depth, string_key_t **keys, uint64_t *keys_size)
+{
+	uint64_t i, j;
+	if (size < STRING_INSERT_CUTOFF) {
+		for (i = 1 ; i < size ; ++i) {
+			uint64_t pos = perm[i];
+			for (j = i ; j && string_compare(s, perm[j - 1], pos, depth) > 0 ; --j)
+				perm[j] = perm[j - 1];
+			perm[j] = pos;
+		}
+		return;
+	}
+	if (size > *keys_size) {
+		free(*keys);
+		*keys = malloc(size * sizeof(string_key_t));
+		*keys_size = size;
+	}
+	string_key_t *k = *keys;
+	for (i = 0 ; i != size ; ++i) {
+		k[i].prefix = string_prefix(s, perm[i], depth);
+		k[i].rest = string_rest(s, perm[i], depth);
+		k[i].pos = perm[i];
+	}
+	qsort(k, size, sizeof(string_key_t), string_key_compare);
+	for (i = 0 ; i != size ; ++i)
+		perm[i] = k[i].pos;
+	// equal strings end within these bytes, the rest tie on them
+	for (i = 0 ; i != size ; i = j) {
+		uint64_t prefix = string_prefix(s, perm[i], depth);
+		uint32_t rest = string_rest(s, perm[i], depth);
+		for (j = i + 1 ; j != size && string_prefix(s, perm[j], depth) == prefix &&
+		                 string_rest(s, perm[j], depth) == rest ; ++j);
+		if (rest > 8 && j - i > 1)
+			string_refine(s, &perm[i], j - i, depth + 8, keys, keys_size);
+	}
+}
+
+// the bytes that the strings in the share of the thread have in common
+// with the first string, stopping at the shortest common run seen
+static void *string_common_thread(void *arg)
+{
+	gather_data_t *d = (gather_data_t*) arg;
+	const strings_t *s = (const strings_t*) d->src[0];
+	uint64_t *common = (uint64_t*) d->dst[0];
+	const char *first = &s->data[s->offsets[0]];
+	uint64_t i, c, from, to, min = s->offsets[1] - s->offsets[0];
+	gather_range(d, &from, &to);
+	for (i = from ; i != to && min != 0 ; ++i) {
+		const char *str = &s->data[s->offsets[i]];
+		uint64_t len = s->offsets[i + 1] - s->offsets[i];
+		if (len < min)
+			min = len;
+		for (c = 0 ; c != min && str[c] == first[c] ; ++c);
+		min = c;
+	}
+	common[d->id] = min;
+	return NULL;
+}
+
+static void *string_prefix_thread(void *arg)
+{
+	gather_data_t *d = (gather_data_t*) arg;
+	const strings_t *s = (const strings_t*) d->src[0];
+	uint64_t *prefixes = (uint64_t*) d->dst[0];
+	uint64_t *positions = (uint64_t*) d->dst[1];
+	uint64_t i, from, to;
+	gather_range(d, &from, &to);
+	for (i = from ; i != to ; ++i) {
+		_mm_stream_si64((long long int*) &prefixes[i], string_prefix(s, i, s->common));
+		_mm_stream_si64((long long int*) &positions[i], i);
+	}
+	_mm_sfence();
+	return NULL;
+}
+
+// a run of equal sorted prefixes, its positions ordered by the rest of
+// the strings
+static void string_order(uint64_t *rids, uint64_t size, void *arg)
+{
+	const strings_t *s = (const strings_t*) arg;
+	string_key_t *keys = NULL;
+	uint64_t keys_size = 0;
+	string_refine(s, rids, size, s->common, &keys, &keys_size);
+	free(keys);
+}
+
+static void *string_perm_thread(void *arg)
+{
+	gather_data_t *d = (gather_data_t*) arg;
+	const uint64_t *positions = (const uint64_t*) d->dst[1];
+	uint32_t *perm = (uint32_t*) d->dst[2];
+	uint64_t i, from, to;
+	gather_range(d, &from, &to);
+	for (i = from ; i != to ; ++i)
+		_mm_stream_si32((int*) &perm[i], positions[i]);
+	_mm_sfence();
+	return NULL;
+}
+
+// the prefixes are sorted with 64-bit positions as rids so that every
+// engine takes them, a shared first run of bytes is skipped
+int chipletsort_str_argsort(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                            const char *data, const uint64_t *offsets, uint32_t *perm,
+                            uint64_t size, chipletsort_timings_t *timings)
+{
+	int t, threads = ctx->threads;
+	strings_t strings = {data, offsets, 0};
+	chipletsort_key_t key_type = ctx->key_type;
+	uint64_t common[threads];
+	void *src[1] = {&strings};
+	void *dst[3] = {common, NULL, perm};
+	if (size > ((uint64_t) 1 << 32))
+		return -1;
+	if (size == 0)
+		return 0;
+	run_gather(ctx, string_common_thread, NULL, size, 0, dst, src, NULL);
+	strings.common = common[0];
+	for (t = 1 ; t != threads ; ++t)
+		if (common[t] < strings.common)
+			strings.common = common[t];
+	uint64_t bytes = align_64(size * sizeof(uint64_t));
+	char *area = aligned_alloc(64, bytes * 2);
+	dst[0] = &area[0];
+	dst[1] = &area[bytes];
+	run_gather(ctx, string_prefix_thread, NULL, size, 0, dst, src, NULL);
+	// the prefixes are unsigned whatever the key type
+	ctx->key_type = CHIPLETSORT_UNSIGNED;
+	int r = run_contiguous(ctx, algorithm, sizeof(uint64_t), sizeof(uint64_t),
+	                       (char*) dst[0], (char*) dst[1], sizeof(uint64_t), size, 64,
+	                       timings);
+	ctx->key_type = key_type;
+	if (r >= 0) {
+		uint64_t tim = micro_time();
+		// the runs are walked as for a stable order, on one array
+		stable_runs(&dst[0], &dst[1], &size, 1, sizeof(uint64_t), sizeof(uint64_t),
+		            threads, ctx->cpu, string_order, &strings);
+		run_gather(ctx, string_perm_thread, NULL, size, 0, dst, src, NULL);
+		tim = micro_time() - tim;
+		if (timings != NULL && timings->phases != CHIPLETSORT_MAX_PHASES) {
+			timings->name[timings->phases] = "String tie-break time:     ";
+			timings->time[timings->phases++] = tim;
+			timings->total += tim;
+		}
+	}
+	free(area);
+	return r;
+}
@@ -0,0 +1,253 @@
+#ifndef _CHIPLETSORT_H_
+#define _CHIPLETSORT_H_
+
+#include <stdint.h>
+
+/* Library interface of the sorting engines (libchipletsort.a):
+ *
+ * A context fixes the number of threads, the number of logical NUMA
+ * nodes (up to 64, the chiplet LSB engines take up to 8) and the
+ * thread placement (see placement.h, NULL keeps the current one).
+ * chipletsort_create() returns NULL for an unknown placement or a
+ * placement file that cannot be read or lists no CPUs.
+ * Worker threads are shared by all contexts and are kept between
+ * sorts, the context keeps the per-node staging buffers that the
+ * sorts need and only grows them.
+ *
+ * The NUMA-split calls take keys[n] and rids[n] for n < numa, which
+ * live on logical node n, are 16-byte aligned and have room for
+ * size[n] * CHIPLETSORT_FUDGE tuples, as do keys_buf[n] and
+ * rids_buf[n]. Tuples move across nodes and size[] is updated. They
+ * return 1 if the output is in the buffers and 0 if it is in keys and
+ * rids. The MSB engines always sort in place. The contiguous calls
+ * sort keys and rids in place.
+ *
+ * Only the LSB engines use bits (the low bits of the keys to sort),
+ * the others always sort the whole key. All calls return -1 if the
+ * algorithm has no engine for the key width or the number of nodes.
+ * The MSB engines also need every node to hold a multiple of 4 tuples
+ * and room for their blocks, the contiguous calls split the nodes at
+ * multiples of 4.
+ */
+
+#define CHIPLETSORT_FUDGE	1.2
+
+#define CHIPLETSORT_MAX_PHASES	16
+
+typedef enum {
+	CHIPLETSORT_UNSIGNED,
+	CHIPLETSORT_SIGNED,
+	CHIPLETSORT_FLOAT
+} chipletsort_key_t;
+
+// CHIPLETSORT_AUTO picks the engine from a sample of the input, split
+// with the delimiters of the engines (sample.h): none (-1 is returned)
+// if a range of the node split would not fit the fudge factor, else LSB
+// for bare keys, else MSB if the LSB engines need more than 3 passes
+// over the varying key bits, the range of every thread fits and the
+// MSB engines take the node sizes (see above), else LSB. The choice and the
+// ranges of its first pass are returned in the timings and printed with
+// the statistics (distinct keys, heaviest key) if CHIPLETSORT_VERBOSE is
+// set.
+typedef enum {
+	CHIPLETSORT_LSB,
+	CHIPLETSORT_MSB,
+	CHIPLETSORT_CMP,
+	CHIPLETSORT_CHIPLET_LSB,
+	CHIPLETSORT_CHIPLET_CMP,
+	CHIPLETSORT_AUTO
+} chipletsort_algorithm_t;
+
+// per-phase times in microseconds, averaged over the threads
+typedef struct {
+	chipletsort_algorithm_t algorithm;
+	// ranges of the first pass: the nodes or the MSB fanout
+	int ranges;
+	int phases;
+	const char *name[CHIPLETSORT_MAX_PHASES];
+	uint64_t time[CHIPLETSORT_MAX_PHASES];
+	uint64_t total;
+} chipletsort_timings_t;
+
+typedef struct chipletsort chipletsort_t;
+
+chipletsort_t *chipletsort_create(int threads, int numa, const char *placement);
+
+void chipletsort_destroy(chipletsort_t *ctx);
+
+/* Key types:
+ *
+ * Keys are unsigned unless the context sets another key type. Signed
+ * keys flip their sign bit, and floating-point keys (float for 32-bit,
+ * double for 64-bit) flip all bits when negative and else the sign
+ * bit, so that all compare as unsigned. The contiguous calls do it
+ * while staging the keys on the nodes and undo it while gathering them
+ * back, so it adds no pass over memory, except that single-node LSB
+ * sorts then stage the keys instead of sorting them where they are.
+ * The NUMA-split calls transform the keys in place before the sort and
+ * restore the output after it. Floating-point order is total:
+ * -NaN < -inf < ... < -0.0 < +0.0 < ... < +inf < +NaN, with NaNs
+ * ordered by their payload bits. bits counts the low bits of the
+ * transformed keys, so sort the whole key for these types.
+ */
+
+// key type of the following sorts (CHIPLETSORT_UNSIGNED by default)
+void chipletsort_key_type(chipletsort_t *ctx, chipletsort_key_t type);
+
+/* Stable sorts:
+ *
+ * With the stable flag of the context set, equal keys come out in the
+ * order of their rids, so rids that are row ids (such as the argsort
+ * positions) keep the input order of ties, as needed for multi-key
+ * sorts done column by column. The LSB engines are stable (the 64-bit
+ * chiplet one on a single node), after the others the threads sort the
+ * rids of every run of equal keys (see stable.h), an extra pass over
+ * the output. Key-only sorts need nothing, records are not made stable.
+ */
+
+// order equal keys by their rids in the following sorts (off by default)
+void chipletsort_stable(chipletsort_t *ctx, int stable);
+
+int chipletsort_u32_pairs_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                               uint32_t **keys, uint32_t **rids, uint64_t *size,
+                               uint32_t **keys_buf, uint32_t **rids_buf, int bits,
+                               chipletsort_timings_t *timings);
+
+int chipletsort_u64_pairs_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                               uint64_t **keys, uint64_t **rids, uint64_t *size,
+                               uint64_t **keys_buf, uint64_t **rids_buf, int bits,
+                               chipletsort_timings_t *timings);
+
+int chipletsort_u32_pairs(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                          uint32_t *keys, uint32_t *rids, uint64_t size, int bits,
+                          chipletsort_timings_t *timings);
+
+int chipletsort_u64_pairs(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                          uint64_t *keys, uint64_t *rids, uint64_t size, int bits,
+                          chipletsort_timings_t *timings);
+
+/* Key-only sorts:
+ *
+ * The keys calls sort bare keys without rids and take the same
+ * arguments less the rids. Only the LSB engine moves just the keys (16
+ * 32-bit keys per buffered cache line and no payload across nodes), so
+ * CHIPLETSORT_AUTO picks it for them. The other engines carry scratch
+ * rids kept in the context and cost as much as a sort of pairs.
+ */
+
+int chipletsort_u32_keys_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                              uint32_t **keys, uint64_t *size, uint32_t **keys_buf,
+                              int bits, chipletsort_timings_t *timings);
+
+int chipletsort_u64_keys_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                              uint64_t **keys, uint64_t *size, uint64_t **keys_buf,
+                              int bits, chipletsort_timings_t *timings);
+
+int chipletsort_u32_keys(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                         uint32_t *keys, uint64_t size, int bits,
+                         chipletsort_timings_t *timings);
+
+int chipletsort_u64_keys(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                         uint64_t *keys, uint64_t size, int bits,
+                         chipletsort_timings_t *timings);
+
+/* Rids of any width:
+ *
+ * The tuples calls take rids of rid_bytes each (1, 2, 4 or 8), such as
+ * pointers next to 32-bit keys, in rids[n] and rids_buf[n] sized for
+ * that width. Only the LSB engine moves rids of another width than the
+ * keys, the other algorithms return -1 for them and CHIPLETSORT_AUTO
+ * picks the LSB engine.
+ */
+
+int chipletsort_u32_tuples_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                                uint32_t **keys, void **rids, int rid_bytes, uint64_t *size,
+                                uint32_t **keys_buf, void **rids_buf, int bits,
+                                chipletsort_timings_t *timings);
+
+int chipletsort_u64_tuples_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                                uint64_t **keys, void **rids, int rid_bytes, uint64_t *size,
+                                uint64_t **keys_buf, void **rids_buf, int bits,
+                                chipletsort_timings_t *timings);
+
+int chipletsort_u32_tuples(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                           uint32_t *keys, void *rids, int rid_bytes, uint64_t size,
+                           int bits, chipletsort_timings_t *timings);
+
+int chipletsort_u64_tuples(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                           uint64_t *keys, void *rids, int rid_bytes, uint64_t size,
+                           int bits, chipletsort_timings_t *timings);
+
+/* Records:
+ *
+ * The records calls sort rows of record_bytes (16 to 64, a multiple of
+ * 8) by the 64-bit key in their first 8 bytes, moving whole rows in
+ * every pass instead of sorting pairs and gathering the rows after.
+ * records[n] and records_buf[n] are 64-byte aligned. Only the LSB
+ * engine sorts records, the other algorithms return -1.
+ *
+ * The u128 records calls sort rows (16 to 64 bytes) by a composite key
+ * of the two 64-bit words in their first 16 bytes, most significant
+ * word first, such as (tenant, timestamp). Pack 96-bit keys such as
+ * (u32, u32, u32) into the two words, the constant bits cost no pass.
+ * The first pass splits the rows across nodes by 128-bit delimiters
+ * from the sample, the local passes go over the bits that vary in the
+ * low word and then in the high word. They sort all bits and the key
+ * type applies to the high word.
+ */
+
+int chipletsort_u64_records_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                                 void **records, int record_bytes, uint64_t *size,
+                                 void **records_buf, int bits,
+                                 chipletsort_timings_t *timings);
+
+int chipletsort_u64_records(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                            void *records, int record_bytes, uint64_t size, int bits,
+                            chipletsort_timings_t *timings);
+
+int chipletsort_u128_records_numa(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                                  void **records, int record_bytes, uint64_t *size,
+                                  void **records_buf, chipletsort_timings_t *timings);
+
+int chipletsort_u128_records(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                             void *records, int record_bytes, uint64_t size,
+                             chipletsort_timings_t *timings);
+
+/* Argsort and gather:
+ *
+ * The argsort calls sort the keys with their 32-bit positions as rids
+ * and return the sorted order in perm (at most 2^32 keys, else -1).
+ * 64-bit keys take the LSB engine as for the tuples calls.
+ *
+ * The string argsort sorts variable-length strings or binary keys,
+ * string i being data[offsets[i], offsets[i + 1]), in byte order with
+ * shorter strings before the longer ones they start. Bytes that all
+ * strings start with are skipped, the engines sort the next 8 bytes of
+ * every string as a big-endian 64-bit key with its 64-bit position,
+ * then the threads order every run of equal prefixes by the next 8
+ * bytes, and so on only where strings still tie (sorting short runs by
+ * insertion). Every algorithm applies and the key type is ignored.
+ *
+ * The gather call applies perm to any number of other columns of rows
+ * of widths[c] bytes (aligned to their width), dst[c][i] =
+ * src[c][perm[i]], with the threads of each node writing a contiguous
+ * share of the output with prefetched reads and, for 4 and 8-byte
+ * rows, streaming stores.
+ */
+
+int chipletsort_u32_argsort(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                            uint32_t *keys, uint32_t *perm, uint64_t size, int bits,
+                            chipletsort_timings_t *timings);
+
+int chipletsort_u64_argsort(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                            uint64_t *keys, uint32_t *perm, uint64_t size, int bits,
+                            chipletsort_timings_t *timings);
+
+int chipletsort_str_argsort(chipletsort_t *ctx, chipletsort_algorithm_t algorithm,
+                            const char *data, const uint64_t *offsets, uint32_t *perm,
+                            uint64_t size, chipletsort_timings_t *timings);
+
+void chipletsort_gather(chipletsort_t *ctx, const uint32_t *perm, uint64_t size,
+                        int columns, void **dst, void **src, const int *widths);
+
+#endif
@@ -57,6 +57,11 @@
 
 #include "rand.h"
 #include "util.h"
+#include "placement.h"
+#include "barrier.h"
+#include "pool.h"
+#include "options.h"
+#include "stable.h"
 
 
 uint64_t micro_time(void)
@@ -109,35 +114,7 @@ void *mamalloc(size_t size)
 
 void schedule_threads(int *cpu, int *numa_node, int threads, int numa)
 {
-	int max_numa = numa_max_node() + 1;
-	int max_threads = hardware_threads();
-	int max_threads_per_numa = max_threads / max_numa;
-	int t, threads_per_numa = threads / numa;
-	assert(numa > 0 && threads >= numa && threads % numa == 0);
-	if (numa > max_numa ||
-	    threads > max_threads ||
-	    threads_per_numa > max_threads_per_numa)
-		for (t = 0 ; t != threads ; ++t) {
-			cpu[t] = t;
-			numa_node[t] = t / threads_per_numa;
-		}
-	else {
-		int *thread_numa = malloc(max_threads * sizeof(int));
-		for (t = 0 ; t != max_threads ; ++t)
-			thread_numa[t] = numa_node_of_cpu(t);
-		for (t = 0 ; t != threads ; ++t) {
-			int i, n = t % numa;
-			for (i = 0 ; i != max_threads ; ++i)
-				if (thread_numa[i] == n) break;
-			assert(i != max_threads);
-			thread_numa[i] = -1;
-			cpu[t] = i;
-			if (numa_node != NULL)
-				numa_node[t] = n;
-			assert(numa_node_of_cpu(i) == n);
-		}
-		free(thread_numa);
-	}
+	placement_schedule(cpu, numa_node, threads, numa);
 }
 
 void decide_partitions(uint64_t size, uint64_t part[2], int numa, int print)
@@ -1262,7 +1239,7 @@ void known_partition(uint32_t *keys, uint32_t *rids, uint16_t *ranges,
 
 void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
                     uint64_t **hist, uint8_t shift_bits, uint8_t radix_bits,
-                    int thread_id, int threads, pthread_barrier_t *barrier)
+                    int thread_id, int threads, barrier_t *barrier)
 {
 	// inputs and outputs must be aligned
 	assert(0 == (15 & (size_t) keys));
@@ -1293,7 +1270,7 @@ void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete histogram generation
-	pthread_barrier_wait(&barrier[0]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// initialize buffer
 	uint64_t *index = malloc(partitions * sizeof(uint64_t));
 	uint32_t *buf = mamalloc((partitions << 4) * sizeof(uint32_t));
@@ -1337,7 +1314,7 @@ void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete main partition part
-	pthread_barrier_wait(&barrier[1]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// flush remaining items from buffers to output
 	for (p = 0 ; p != partitions ; ++p) {
 		uint32_t *src = &buf[p << 4];
@@ -1351,7 +1328,7 @@ void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 			_mm_stream_si32(&keys_out[indexl++], src[offset++]);
 	}
 	// wait all threads to complete last partition part
-	pthread_barrier_wait(&barrier[2]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	free(index);
 	free(buf);
 }
@@ -1401,9 +1378,9 @@ typedef struct {
 	int max_numa;
 	volatile uint64_t *numa_counter;
 	volatile uint64_t *part_counter;
-	pthread_barrier_t *global_barrier;
-	pthread_barrier_t **local_barrier;
+	barrier_t *barrier;
 	pthread_barrier_t *sample_barrier;
+	int stable;
 } global_data_t;
 
 typedef struct {
@@ -1434,13 +1411,12 @@ void *sort_thread(void *arg)
 	thread_data_t *a = (thread_data_t*) arg;
 	global_data_t *d = a->global;
 	uint64_t s, p, r, i, j, o, k, t, n;
-	uint64_t lb = 0, gb = 0, id = a->id;
+	uint64_t id = a->id;
 	uint64_t numa = d->numa;
 	uint64_t numa_node = d->numa_node[id];
 	uint64_t threads = d->threads;
 	uint64_t threads_per_numa = threads / numa;
-	pthread_barrier_t *local_barrier = d->local_barrier[numa_node];
-	pthread_barrier_t *global_barrier = d->global_barrier;
+	barrier_t *barrier = d->barrier;
 	// id in local numa threads
 	uint64_t numa_local_id = 0;
 	for (i = 0 ; i != id ; ++i)
@@ -1460,12 +1436,13 @@ void *sort_thread(void *arg)
 	uint64_t partitions_2 = d->partitions_2;
 	uint64_t max_partitions = partitions_1 > partitions_2 ?
 	                          partitions_1 : partitions_2;
-	uint32_t *index = malloc(max_partitions * sizeof(uint32_t));
+	uint32_t *index = pool_scratch(id, 3, max_partitions * sizeof(uint32_t));
 	uint32_t *delim_1 = malloc((partitions_1 - 1) * sizeof(uint32_t));
 	uint32_t *delim_2 = malloc((partitions_2 - 1) * sizeof(uint32_t));
-	uint64_t *count = calloc(partitions_1, sizeof(uint64_t));
-	uint64_t *offsets = malloc(max_partitions * sizeof(uint64_t));
-	uint64_t *buf = mamalloc((max_partitions << 4) * sizeof(uint64_t));
+	uint64_t *count = pool_scratch(id, 1, partitions_1 * sizeof(uint64_t));
+	memset(count, 0, partitions_1 * sizeof(uint64_t));
+	uint64_t *offsets = pool_scratch(id, 0, max_partitions * sizeof(uint64_t));
+	uint64_t *buf = pool_scratch(id, 2, (max_partitions << 4) * sizeof(uint64_t));
 	d->count[numa_node][numa_local_id] = count;
 	uint64_t numa_size = d->size[numa_node];
 	uint64_t size = (numa_size / threads_per_numa) & ~7;
@@ -1486,7 +1463,7 @@ void *sort_thread(void *arg)
 				d->ranges[numa_node]   = mamalloc(cap * sizeof(uint16_t));
 			}
 		}
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 	}
 	uint32_t *keys = &d->keys[numa_node][offset];
 	uint32_t *rids = &d->rids[numa_node][offset];
@@ -1501,7 +1478,7 @@ void *sort_thread(void *arg)
 			_mm_stream_si32(&rids_out[p], 0);
 		for (p = 0 ; p != size_aligned ; p += 2)
 			_mm_stream_si32((int32_t*) &ranges[p], 0);
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 	}
 	tim = micro_time() - tim;
 	a->alloc_time = tim;
@@ -1520,14 +1497,13 @@ void *sort_thread(void *arg)
 #endif
 	// (in-parallel) LSB radix-sort the sample
 	partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 0, 8,
-	               id, threads, &global_barrier[gb]);
+	               id, threads, barrier);
 	partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 8, 8,
-	               id, threads, &global_barrier[gb + 3]);
+	               id, threads, barrier);
 	partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 16, 8,
-	               id, threads, &global_barrier[gb + 6]);
+	               id, threads, barrier);
 	partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 24, 8,
-	               id, threads, &global_barrier[gb + 9]);
-	gb += 12;
+	               id, threads, barrier);
 	// get delimiters for 1st phase range partitioning
 	j = d->sample_size / partitions_1;
 	for (i = 0 ; i != partitions_1 - 1 ; ++i)
@@ -1563,7 +1539,7 @@ void *sort_thread(void *arg)
 #ifdef BG
 	if (id == 0) fprintf(stderr, "1st histogram done!\n");
 #endif
-	pthread_barrier_wait(&local_barrier[lb++]);
+	barrier_wait(barrier, id, BARRIER_NUMA);
 	uint64_t **counts = d->count[numa_node];
 	// align to cache lines if single NUMA
 	tim = micro_time();
@@ -1683,7 +1659,7 @@ void *sort_thread(void *arg)
 			copy(tr->dst_key, tr->src_key, tr->size);
 			copy(tr->dst_rid, tr->src_rid, tr->size);
 		}
-		pthread_barrier_wait(&global_barrier[gb++]);
+		barrier_wait(barrier, id, BARRIER_GLOBAL);
 	}
 	tim = micro_time() - tim;
 	a->numa_shuffle_time = tim;
@@ -1692,7 +1668,8 @@ void *sort_thread(void *arg)
 	// space for smaller samples
 	sample_size = (partitions_2 << 3) - 1;
 	sample = malloc(sample_size * sizeof(uint32_t));
-	count = calloc(partitions_2, sizeof(uint64_t));
+	count = pool_scratch(id, 4, partitions_2 * sizeof(uint64_t));
+	memset(count, 0, partitions_2 * sizeof(uint64_t));
 	// partition again and sort
 	uint64_t h_tim = 0, p_tim = 0;
 	volatile uint64_t *part_counter = &d->part_counter[numa_node << 8];
@@ -1789,11 +1766,7 @@ void *sort_thread(void *arg)
 	a->histogram_2_time = h_tim;
 	a->partition_2_time = p_tim;
 	a->sorting_time = tim - p_tim - h_tim;
-	free(buf);
-	free(index);
-	free(count);
 	free(sample);
-	free(offsets);
 	free(delim_1);
 	free(delim_2);
 #ifdef BG
@@ -1801,38 +1774,25 @@ void *sort_thread(void *arg)
 #endif
 	if (numa > 1 && !numa_local_id)
 		d->size[numa_node] = size_per_numa[numa_node];
-	pthread_exit(NULL);
+	return NULL;
 }
 
-int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
-         int threads, int numa, double fudge,
-         uint32_t **keys_buf, uint32_t **rids_buf, uint16_t **ranges,
+int cmp_32_sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
+                int threads, int numa, double fudge,
+                uint32_t **keys_buf, uint32_t **rids_buf, uint16_t **ranges,
 	      char **description, uint64_t *times, int interleaved)
 {
 	int i, j, p, t, n;
 	int threads_per_numa = threads / numa;
-	pthread_t *id = malloc(threads * sizeof(pthread_t));
 	thread_data_t *data = malloc(threads * sizeof(thread_data_t));
 	// check aligned input
 	for (i = 0 ; i != numa ; ++i) {
 		assert((15 & (uint64_t) keys[i]) == 0);
 		assert((15 & (uint64_t) rids[i]) == 0);
 	}
-	// initialize global barriers
-	int local_barriers = 5;
-	int global_barriers = 30;
+	// initialize sample barrier
 	pthread_barrier_t sample_barrier;
-	pthread_barrier_t *global_barrier = malloc(global_barriers * sizeof(pthread_barrier_t));
-	pthread_barrier_t **local_barrier = malloc(numa * sizeof(pthread_barrier_t*));
 	pthread_barrier_init(&sample_barrier, NULL, threads + 1);
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_init(&global_barrier[t], NULL, threads);
-	// initialize local barriers
-	for (n = 0 ; n != numa ; ++n) {
-		local_barrier[n] = malloc(local_barriers * sizeof(pthread_barrier_t));
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_init(&local_barrier[n][t], NULL, threads_per_numa);
-	}
 	// universal meta data
 	global_data_t global;
 	global.numa = numa;
@@ -1847,8 +1807,6 @@ int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	global.max_threads = hardware_threads();
 	global.max_numa = numa_max_node() + 1;
 	global.interleaved = interleaved;
-	global.global_barrier = global_barrier;
-	global.local_barrier = local_barrier;
 	global.sample_barrier = &sample_barrier;
 	// compute total size
 	uint64_t total_size = 0;
@@ -1891,24 +1849,25 @@ int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
 	schedule_threads(global.cpu, global.numa_node, threads, numa);
+	global.barrier = barrier_init(threads, global.cpu, global.numa_node, NULL);
 	global.seed = malloc(numa * sizeof(int));
 	for (n = 0 ; n != numa ; ++n)
 		global.seed[n] = rand();
-	// spawn threads
+	// start workers
 	for (t = 0 ; t != threads ; ++t) {
 		data[t].id = t;
 		data[t].seed = rand();
 		data[t].global = &global;
-		pthread_create(&id[t], NULL, sort_thread, (void*) &data[t]);
 	}
+	pool_start(threads, NULL,
+	           sort_thread, data, sizeof(thread_data_t));
 	// free sample data
 	pthread_barrier_wait(&sample_barrier);
 	pthread_barrier_destroy(&sample_barrier);
 	numa_free(global.sample,     global.sample_size * sizeof(uint32_t));
 	numa_free(global.sample_buf, global.sample_size * sizeof(uint32_t));
-	// join threads
-	for (t = 0 ; t != threads ; ++t)
-		pthread_join(id[t], NULL);
+	// wait for workers
+	pool_wait();
 	// assemble times
 	uint64_t  at = 0, sat = 0, h1t = 0, h2t = 0;
 	uint64_t nst = 0, p1t = 0, p2t = 0, sot = 0;
@@ -1931,33 +1890,23 @@ int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	times[6] = p2t / threads;   description[6] = "2nd partition time: ";
 	times[7] = sot / threads;   description[7] = "Cache sorting time: ";
 	description[8] = NULL;
-	// destroy barriers
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_destroy(&global_barrier[t]);
-	for (n = 0 ; n != numa ; ++n) {
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_destroy(&local_barrier[n][t]);
-		free(local_barrier[n]);
-	}
-	free(local_barrier);
-	free(global_barrier);
+	// destroy barrier
+	barrier_destroy(global.barrier);
 	// release memory
 	free(global.numa_node);
 	free(global.seed);
 	free(global.cpu);
-	for (n = 0 ; n != numa ; ++n) {
-		for (t = 0 ; t != threads_per_numa ; ++t)
-			free(global.count[n][t]);
+	for (n = 0 ; n != numa ; ++n)
 		free(global.count[n]);
-	}
 	free(global.count);
 	free((void*) global.numa_counter);
 	free((void*) global.part_counter);
 	free(data);
-	free(id);
 	return (numa == 1) ^ (global.partitions_2 == 1);
 }
 
+#ifndef CHIPLETSORT_LIBRARY
+
 void *check_thread(void *arg)
 {
 	thread_data_t *a = (thread_data_t*) arg;
@@ -1984,10 +1933,14 @@ void *check_thread(void *arg)
 		rids =	&d->rids[numa_node][offset];
 	uint32_t *keys_end = &keys[size];
 	uint64_t sum = 0;
-	uint32_t pkey = 0;
+	uint32_t pkey = 0, prid = 0;
 	while (keys != keys_end) {
 		uint32_t key = *keys++;
-		if (rids) assert(key == *rids++);
+		// stable sorts keep equal keys in the order of their rids
+		if (rids && d->stable) {
+			assert(key != pkey || *rids >= prid);
+			prid = *rids++;
+		} else if (rids) assert(key == *rids++);
 		assert(key >= pkey);
 		sum += key;
 		pkey = key;
@@ -1996,7 +1949,7 @@ void *check_thread(void *arg)
 	pthread_exit(NULL);
 }
 
-uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int same)
+uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int same, int stable)
 {
 	int max_threads = hardware_threads();
 	int n, t, threads = 0;
@@ -2007,7 +1960,8 @@ uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int s
 	global.threads = threads;
 	global.numa = numa;
 	global.keys = keys;
-	global.rids = same ? rids : NULL;
+	global.rids = same || stable ? rids : NULL;
+	global.stable = stable;
 	global.size = size;
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
@@ -2021,6 +1975,10 @@ uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int s
 	}
 	for (n = 1 ; n != numa ; ++n)
 		assert(keys[n][0] >= keys[n - 1][size[n - 1] - 1]);
+	if (stable)
+		for (n = 1 ; n != numa ; ++n)
+			assert(keys[n][0] != keys[n - 1][size[n - 1] - 1] ||
+			       rids[n][0] >= rids[n - 1][size[n - 1] - 1]);
 	uint64_t checksum = 0;
 	for (t = 0 ; t != threads ; ++t) {
 		pthread_join(id[t], NULL);
@@ -2077,6 +2035,11 @@ int main(int argc, char **argv)
 {
 	int i, r, n, max_threads = hardware_threads();
 	int max_numa = numa_max_node() + 1;
+	placement_init(&argc, argv, "linear");
+	// equal keys in the order of their rids, which are the input positions,
+	// at the cost of a tie-break pass over the output (stable.h)
+	const char *stable_option = option(&argc, argv, "stable", "CHIPLET_STABLE");
+	int stable = stable_option != NULL && atoi(stable_option);
 	uint64_t tuples = argc > 1 ? atoi(argv[1]) : 1000;
 	tuples *= 1000000;
 	int threads = argc > 2 ? atoi(argv[2]) : max_threads;
@@ -2124,6 +2087,7 @@ int main(int argc, char **argv)
 	fprintf(stderr, "Hardware threads: %d (%d per NUMA)\n",
 			max_threads, max_threads / max_numa);
 	fprintf(stderr, "Threads: %d (%d per NUMA)\n", threads, threads / numa);
+	fprintf(stderr, "Placement: %s\n", placement_name());
 	for (i = 0 ; i != numa ; ++i) {
 		size[i] = tuples_per_numa;
 		cap[i] = size[i] * fudge;
@@ -2173,6 +2137,13 @@ int main(int argc, char **argv)
 		init_32(rids_buf, size, cap, threads, numa, 0, 0.0, 0, interleaved);
 		init_32(ranges_32, half_size, half_cap, threads, numa, 0, 0.0, 0, interleaved);
 	}
+	if (stable) {
+		uint64_t p, at = 0;
+		for (i = 0 ; i != numa ; ++i)
+			for (p = 0 ; p != size[i] ; ++p)
+				rids[i][p] = at++;
+		same_key_payload = 0;
+	}
 	t = micro_time() - t;
 	fprintf(stderr, "Generation time: %ld us\n", t);
 	fprintf(stderr, "Generation rate: %.1f mrps\n", tuples * 1.0 / t);
@@ -2181,13 +2152,21 @@ int main(int argc, char **argv)
 	uint64_t times[12];
 	// call parallel sort
 	t = micro_time();
-	r = sort(keys, rids, size, threads, numa, fudge,
-	         keys_buf, rids_buf, ranges, desc, times, interleaved);
+	r = cmp_32_sort(keys, rids, size, threads, numa, fudge,
+	                keys_buf, rids_buf, ranges, desc, times, interleaved);
+	// put the rids of equal keys in order
+	uint64_t stable_time = micro_time();
+	if (stable)
+		stable_ties((void**) (r ? keys_buf : keys), (void**) (r ? rids_buf : rids),
+		            size, numa, sizeof(uint32_t), sizeof(uint32_t), threads, NULL);
+	stable_time = micro_time() - stable_time;
 	t = micro_time() - t;
 	// show partition sizes
 	decide_partitions(tuples, NULL, numa, 1);
 	// print sort times
 	fprintf(stderr, "Sort time: %ld us\n", t);
+	if (stable)
+		fprintf(stderr, "Stable tie-break time: %ld us\n", stable_time);
 	double gigs = (tuples * 8.0) / (1024 * 1024 * 1024);
 	fprintf(stderr, "Sort rate: %.1f mrps (%.2f GB / sec)\n",
 		tuples * 1.0 / t, (gigs * 1000000) / t);
@@ -2208,7 +2187,7 @@ int main(int argc, char **argv)
 	else fprintf(stderr, "Destination remained the same\n");
 	uint32_t **keys_out = r ? keys_buf : keys;
 	uint32_t **rids_out = r ? rids_buf : rids;
-	uint64_t checksum = check(keys_out, rids_out, size, numa, same_key_payload);
+	uint64_t checksum = check(keys_out, rids_out, size, numa, same_key_payload, stable);
 	assert(checksum == sum_k);
 	// free sort data
 	for (i = 0 ; i != numa ; ++i)
@@ -2229,3 +2208,5 @@ int main(int argc, char **argv)
 		tuples * 1.0 / t, (gigs * 1000000) / t);
 	return EXIT_SUCCESS;
 }
+
+#endif
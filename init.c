@@ -50,6 +50,7 @@
 #undef _GNU_SOURCE_
 
 #include "rand.h"
+#include "placement.h"
 
 
 static uint64_t micro_time(void)
@@ -72,19 +73,6 @@ static int hardware_threads(void)
 	return 128;
 }
 
-static void cpu_bind(int cpu_id)
-{
-	int cpus = hardware_threads();
-	size_t size = CPU_ALLOC_SIZE(cpus);
-	cpu_set_t *cpu_set = CPU_ALLOC(cpus);
-	assert(cpu_set != NULL);
-	CPU_ZERO_S(size, cpu_set);
-	CPU_SET_S(cpu_id, size, cpu_set);
-	//assert(pthread_setaffinity_np(pthread_self(),
-	//       size, cpu_set) == 0);
-	CPU_FREE(cpu_set);
-}
-
 static void memory_bind(int numa_id)
 {
 	char numa_id_str[12];
@@ -101,39 +89,6 @@ static void *mamalloc(size_t size)
 	return posix_memalign(&ptr, 64, size) ? NULL : ptr;
 }
 
-static void schedule_threads(int *cpu, int *numa_node, int threads, int numa)
-{
-	int max_numa = numa_max_node() + 1;
-	int max_threads = hardware_threads();
-	int max_threads_per_numa = max_threads / max_numa;
-	int t, threads_per_numa = threads / numa;
-	assert(threads >= numa && threads % numa == 0);
-	if (numa > max_numa ||
-	    threads > max_threads ||
-	    threads_per_numa > max_threads_per_numa)
-		for (t = 0 ; t != threads ; ++t) {
-			cpu[t] = t;
-			numa_node[t] = t / threads_per_numa;
-		}
-	else {
-		int *thread_numa = malloc(max_threads * sizeof(int));
-		for (t = 0 ; t != max_threads ; ++t)
-			thread_numa[t] = numa_node_of_cpu(t);
-		for (t = 0 ; t != threads ; ++t) {
-			int i, n = t % numa;
-			for (i = 0 ; i != max_threads ; ++i)
-				if (thread_numa[i] == n) break;
-			assert(i != max_threads);
-			thread_numa[i] = -1;
-			cpu[t] = i;
-			if (numa_node != NULL)
-				numa_node[t] = n;
-			assert(numa_node_of_cpu(i) == n);
-		}
-		free(thread_numa);
-	}
-}
-
 static uint64_t rand_64(void)
 {
 	uint64_t r1 = rand() >> 11;
@@ -241,7 +196,7 @@ static void *init_thread(void *arg)
 			numa_local_id++;
 	// bind thread and its allocation
 	if (threads <= d->max_threads)
-		cpu_bind(d->cpu[id]);
+		placement_bind(d->cpu[id]);
 	if (numa <= d->max_numa)
 		memory_bind(d->numa_node[id]);
 	// allocate space
@@ -388,7 +343,7 @@ static uint64_t init(void **data, int length, uint64_t *size, uint64_t *cap, int
 	global.barrier = &barrier;
 	global.cpu = malloc(global.threads * sizeof(int));
 	global.numa_node = malloc(global.threads * sizeof(int));
-	schedule_threads(global.cpu, global.numa_node, threads, numa);
+	placement_schedule(global.cpu, global.numa_node, threads, numa);
 	pthread_barrier_init(&barrier, NULL, threads);
 	init_local_data_t *thread_data;
 	thread_data = malloc(threads * sizeof(init_local_data_t));
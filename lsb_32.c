@@ -49,16 +49,21 @@
 #include <numa.h>
 #undef _GNU_SOURCE
 
-#ifdef AVX
 #include <immintrin.h>
-#else
-#include <smmintrin.h>
-#endif
 
 #include "rand.h"
 #include "util.h"
+#include "placement.h"
+#include "barrier.h"
+#include "pool.h"
+#include "options.h"
+#include "transfer.h"
+#include "sample.h"
+#include "simd.h"
 
+#ifndef CHIPLETSORT_LIBRARY
 #include "perf_counter.h"
+#endif
 
 
 uint64_t micro_time(void)
@@ -126,35 +131,7 @@ inline uint64_t mulhi(uint64_t x, uint64_t y)
 
 void schedule_threads(int *cpu, int *numa_node, int threads, int numa)
 {
-	int max_numa = numa_max_node() + 1;
-	int max_threads = hardware_threads();
-	int max_threads_per_numa = max_threads / max_numa;
-	int t, threads_per_numa = threads / numa;
-	assert(numa > 0 && threads >= numa && threads % numa == 0);
-	if (numa > max_numa ||
-	    threads > max_threads ||
-	    threads_per_numa > max_threads_per_numa)
-		for (t = 0 ; t != threads ; ++t) {
-			cpu[t] = t;
-			numa_node[t] = t / threads_per_numa;
-		}
-	else {
-		int *thread_numa = malloc(max_threads * sizeof(int));
-		for (t = 0 ; t != max_threads ; ++t)
-			thread_numa[t] = numa_node_of_cpu(t);
-		for (t = 0 ; t != threads ; ++t) {
-			int i, n = t % numa;
-			for (i = 0 ; i != max_threads ; ++i)
-				if (thread_numa[i] == n) break;
-			assert(i != max_threads);
-			thread_numa[i] = -1;
-			cpu[t] = i;
-			if (numa_node != NULL)
-				numa_node[t] = n;
-			assert(numa_node_of_cpu(i) == n);
-		}
-		free(thread_numa);
-	}
+	placement_schedule(cpu, numa_node, threads, numa);
 }
 
 int ceil_div(int x, int y)
@@ -176,8 +153,9 @@ int distribute_bits(int bits, int numa, int pass[], int print)
 	int numa_bits = ceil_log_2(numa);
 	int end_bits = numa_bits > 0 ? 1 : 0;
 	int total_bits = bits + numa_bits;
-	assert(total_bits <= 35);
-	int limit[] = {12, 24, 35};
+	// 32 key bits and the bits of up to 64 nodes
+	assert(total_bits <= 38);
+	int limit[] = {12, 24, 38};
 	// determine how many passes to do
 	int p, passes = 0;
 	while (limit[passes++] < total_bits);
@@ -202,9 +180,36 @@ int distribute_bits(int bits, int numa, int pass[], int print)
 	return passes;
 }
 
+// re-plan the passes after the first on the bits that vary across keys
+// the first pass keeps its bits, returns the shift of the second pass
+int replan_bits(uint32_t varying, const int bits[], int pass[])
+{
+	int p, passes, max_bits = 0;
+	int low = bits[0], high = bits[0];
+	for (p = 1 ; bits[p] != 0 ; ++p) {
+		if (bits[p] > max_bits)
+			max_bits = bits[p];
+		high += bits[p];
+	}
+	// trim the constant low and high bits
+	while (low < high && !(varying & (((uint32_t) 1) << low)))
+		low++;
+	while (high > low && !(varying & (((uint32_t) 1) << (high - 1))))
+		high--;
+	passes = low == high ? 0 : ceil_div(high - low, max_bits);
+	int rem_bits = high - low;
+	pass[0] = bits[0];
+	for (p = 1 ; p <= passes ; ++p) {
+		pass[p] = ceil_div(rem_bits, passes - p + 1);
+		rem_bits -= pass[p];
+	}
+	pass[p] = 0;
+	return low;
+}
+
 void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
                     uint64_t **hist, uint8_t shift_bits, uint8_t radix_bits,
-                    int thread_id, int threads, pthread_barrier_t *barrier)
+                    int thread_id, int threads, barrier_t *barrier)
 {
 	// inputs and outputs must be aligned
 	assert(0 == (15 & (size_t) keys));
@@ -235,7 +240,7 @@ void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete histogram generation
-	pthread_barrier_wait(&barrier[0]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// initialize buffer
 	uint64_t *index = malloc(partitions * sizeof(uint64_t));
 	uint32_t *buf = mamalloc((partitions << 4) * sizeof(uint32_t));
@@ -279,7 +284,7 @@ void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete main partition part
-	pthread_barrier_wait(&barrier[1]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// flush remaining items from buffers to output
 	for (p = 0 ; p != partitions ; ++p) {
 		uint32_t *src = &buf[p << 4];
@@ -293,14 +298,75 @@ void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 			_mm_stream_si32(&keys_out[indexl++], src[offset++]);
 	}
 	// wait all threads to complete last partition part
-	pthread_barrier_wait(&barrier[2]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	free(index);
 	free(buf);
 }
 
+// store the OR and the AND of all keys seen by a histogram
+void key_bits(__m128i k_or, __m128i k_and, uint32_t or_bits, uint32_t and_bits,
+              uint32_t *key_or, uint32_t *key_and)
+{
+	int i;
+	uint32_t v_or[4], v_and[4];
+	if (key_or == NULL) return;
+	_mm_storeu_si128((__m128i*) v_or, k_or);
+	_mm_storeu_si128((__m128i*) v_and, k_and);
+	for (i = 0 ; i != 4 ; ++i) {
+		or_bits |= v_or[i];
+		and_bits &= v_and[i];
+	}
+	*key_or = or_bits;
+	*key_and = and_bits;
+}
+
+// replicated counters for skewed input: lane j of a vector counts in
+// copy j % copies, the copies follow the histogram and are folded into it
+__m128i copy_lanes(int copies, uint64_t partitions)
+{
+	__m128i j = _mm_and_si128(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32(copies - 1));
+	return _mm_mullo_epi32(j, _mm_set1_epi32(partitions));
+}
+
+void clear_copies(uint64_t *count, uint64_t partitions, int copies)
+{
+	memset(&count[partitions], 0, (copies - 1) * partitions * sizeof(uint64_t));
+}
+
+void fold_copies(uint64_t *count, uint64_t partitions, int copies)
+{
+	uint64_t i; int j;
+	for (j = 1 ; j < copies ; ++j)
+		for (i = 0 ; i != partitions ; ++i)
+			count[i] += count[j * partitions + i];
+}
+
+// range of the node of a key, the number of delimiters below it by a
+// branchless binary search (delim[] has the upper bound of all ranges
+// but the last, in order)
+static inline int numa_range(uint32_t key, const uint32_t *delim, int ranges)
+{
+	const uint32_t *base = delim;
+	int n = ranges - 1;
+	while (n > 1) {
+		int half = n >> 1;
+		base = key > base[half - 1] ? &base[half] : base;
+		n -= half;
+	}
+	return (base - delim) + (n == 1 && key > base[0]);
+}
+
 void histogram_numa_2(uint32_t *keys, uint64_t size, uint64_t *count,
-                      uint8_t radix_bits, uint32_t delim[])
+                      uint8_t radix_bits, uint32_t delim[],
+                      int copies, uint32_t *key_or, uint32_t *key_and)
 {
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 2) << radix_bits;
+	__m128i lanes = copy_lanes(copies, copy_size);
+	clear_copies(count, copy_size, copies);
+	__m128i k_or = _mm_setzero_si128();
+	__m128i k_and = _mm_set1_epi32(-1);
+	uint32_t or_bits = 0, and_bits = ~0;
 	uint32_t convert = ((uint32_t) 1) << 31;
 	__m128i s = _mm_set_epi32(0, 0, 0, radix_bits);
 	__m128i m = _mm_set1_epi32((1 << radix_bits) - 1);
@@ -310,8 +376,11 @@ void histogram_numa_2(uint32_t *keys, uint64_t size, uint64_t *count,
 	// check for unaligned keys
 	uint64_t p = 0; i = 0;
 	uint32_t unaligned_keys[4];
-	while ((15 & ((uint64_t) keys)) && i != size)
+	while ((15 & ((uint64_t) keys)) && i != size) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	uint32_t *keys_aligned_end = &keys[(size - i) & ~3];
 	uint32_t *keys_end = &keys[size - i];
 	if (i) {
@@ -321,6 +390,8 @@ void histogram_numa_2(uint32_t *keys, uint64_t size, uint64_t *count,
 	while (keys != keys_aligned_end) {
 		k = _mm_load_si128((__m128i*) keys);
 		keys += 4; i = 4;
+		k_or = _mm_or_si128(k_or, k);
+		k_and = _mm_and_si128(k_and, k);
 		unaligned_intro:;
 		__m128i h = _mm_and_si128(k, m);
 		__m128i k_c = _mm_sub_epi32(k, c);
@@ -329,6 +400,7 @@ void histogram_numa_2(uint32_t *keys, uint64_t size, uint64_t *count,
 		r = _mm_sub_epi32(r, e);
 		r = _mm_sll_epi32(r, s);
 		h = _mm_or_si128(h, r);
+		h = _mm_add_epi32(h, lanes);
 		do {
 			asm("movd	%1, %%eax" : "=a"(p) : "x"(h), "0"(p));
 			count[p]++;
@@ -337,23 +409,31 @@ void histogram_numa_2(uint32_t *keys, uint64_t size, uint64_t *count,
 	}
 	// histogram last 0-3 unaligned items
 	i = 0; p = 0;
-	while (keys != keys_end)
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	if (i) {
 		k = _mm_loadu_si128((__m128i*) unaligned_keys);
 		keys_aligned_end = keys_end;
 		goto unaligned_intro;
 	}
+	fold_copies(count, copy_size, copies);
+	key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
 }
 
 void partition_numa_2(uint32_t *keys, uint32_t *rids, uint64_t size,
                       uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
-                      uint32_t *keys_out, uint32_t *rids_out,
+                      uint32_t **keys_out, uint32_t **rids_out,
                       uint8_t radix_bits, uint32_t delim[])
 {
-	assert((63 & (uint64_t) keys_out) == 0);
-	assert((63 & (uint64_t) rids_out) == 0);
 	int i, partitions = 1 << (radix_bits + 1);
+	// an output per node, the local one or the node of the range
+	for (i = 0 ; i != 2 ; ++i) {
+		assert((63 & (uint64_t) keys_out[i]) == 0);
+		assert((63 & (uint64_t) rids_out[i]) == 0);
+	}
 	// initialize buffers
 	for (i = 0 ; i != partitions ; ++i)
 		buf[(i << 4) | 15] = offsets[i];
@@ -403,8 +483,9 @@ void partition_numa_2(uint32_t *keys, uint32_t *rids, uint64_t size,
 			__m128i kvxx = _mm_unpacklo_epi32(k, v);
 			_mm_storel_epi64((__m128i*) &src[offset], kvxx);
 			if (offset == 15) {
-				float *dest_x = (float*) &keys_out[index - 15];
-				float *dest_y = (float*) &rids_out[index - 15];
+				uint64_t node = p >> (radix_bits + 4);
+				float *dest_x = (float*) &keys_out[node][index - 15];
+				float *dest_y = (float*) &rids_out[node][index - 15];
 				// load cache line from cache to 8 128-bit registers
 				__m128 r0 = _mm_load_ps((float*) &src[0]);
 				__m128 r1 = _mm_load_ps((float*) &src[2]);
@@ -465,8 +546,16 @@ void partition_numa_2(uint32_t *keys, uint32_t *rids, uint64_t size,
 }
 
 void histogram_numa_4(uint32_t *keys, uint64_t size, uint64_t *count,
-                      uint8_t radix_bits, uint32_t delim[])
+                      uint8_t radix_bits, uint32_t delim[],
+                      int copies, uint32_t *key_or, uint32_t *key_and)
 {
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 4) << radix_bits;
+	__m128i lanes = copy_lanes(copies, copy_size);
+	clear_copies(count, copy_size, copies);
+	__m128i k_or = _mm_setzero_si128();
+	__m128i k_and = _mm_set1_epi32(-1);
+	uint32_t or_bits = 0, and_bits = ~0;
 	uint32_t convert = ((uint32_t) 1) << 31;
 	__m128i s = _mm_set_epi32(0, 0, 0, radix_bits);
 	__m128i m = _mm_set1_epi32((1 << (radix_bits)) - 1);
@@ -478,8 +567,11 @@ void histogram_numa_4(uint32_t *keys, uint64_t size, uint64_t *count,
 	// check for unaligned keys
 	uint64_t p = 0; i = 0;
 	uint32_t unaligned_keys[4];
-	while ((15 & ((uint64_t) keys)) && i != size)
+	while ((15 & ((uint64_t) keys)) && i != size) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	uint32_t *keys_aligned_end = &keys[(size - i) & ~3];
 	uint32_t *keys_end = &keys[size - i];
 	if (i) {
@@ -489,6 +581,8 @@ void histogram_numa_4(uint32_t *keys, uint64_t size, uint64_t *count,
 	while (keys != keys_aligned_end) {
 		k = _mm_load_si128((__m128i*) keys);
 		keys += 4; i = 4;
+		k_or = _mm_or_si128(k_or, k);
+		k_and = _mm_and_si128(k_and, k);
 		unaligned_intro:;
 		__m128i k_c = _mm_sub_epi32(k, c);
 		__m128i e1 = _mm_cmpgt_epi32(k_c, d2);
@@ -501,6 +595,7 @@ void histogram_numa_4(uint32_t *keys, uint64_t size, uint64_t *count,
 		r = _mm_sub_epi32(r, e2);
 		r = _mm_sll_epi32(r, s);
 		h = _mm_or_si128(h, r);
+		h = _mm_add_epi32(h, lanes);
 		do {
 			asm("movd	%1, %%eax" : "=a"(p) : "x"(h), "0"(p));
 			count[p]++;
@@ -509,23 +604,31 @@ void histogram_numa_4(uint32_t *keys, uint64_t size, uint64_t *count,
 	}
 	// histogram last 0-3 unaligned items
 	i = 0; p = 0;
-	while (keys != keys_end)
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	if (i) {
 		k = _mm_loadu_si128((__m128i*) unaligned_keys);
 		keys_aligned_end = keys_end;
 		goto unaligned_intro;
 	}
+	fold_copies(count, copy_size, copies);
+	key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
 }
 
 void partition_numa_4(uint32_t *keys, uint32_t *rids, uint64_t size,
 		      uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
-		      uint32_t *keys_out, uint32_t *rids_out,
+		      uint32_t **keys_out, uint32_t **rids_out,
 		      uint8_t radix_bits, uint32_t delim[])
 {
-	assert((63 & (uint64_t) keys_out) == 0);
-	assert((63 & (uint64_t) rids_out) == 0);
 	int i, partitions = 1 << (radix_bits + 2);
+	// an output per node, the local one or the node of the range
+	for (i = 0 ; i != 4 ; ++i) {
+		assert((63 & (uint64_t) keys_out[i]) == 0);
+		assert((63 & (uint64_t) rids_out[i]) == 0);
+	}
 	// initialize buffers
 	for (i = 0 ; i != partitions ; ++i)
 		buf[(i << 4) | 15] = offsets[i];
@@ -581,8 +684,9 @@ void partition_numa_4(uint32_t *keys, uint32_t *rids, uint64_t size,
 			__m128i kvxx = _mm_unpacklo_epi32(k, v);
 			_mm_storel_epi64((__m128i*) &src[offset], kvxx);
 			if (offset == 15) {
-				float *dest_x = (float*) &keys_out[index - 15];
-				float *dest_y = (float*) &rids_out[index - 15];
+				uint64_t node = p >> (radix_bits + 4);
+				float *dest_x = (float*) &keys_out[node][index - 15];
+				float *dest_y = (float*) &rids_out[node][index - 15];
 				// load cache line from cache to 8 128-bit registers
 				__m128 r0 = _mm_load_ps((float*) &src[0]);
 				__m128 r1 = _mm_load_ps((float*) &src[2]);
@@ -643,8 +747,16 @@ void partition_numa_4(uint32_t *keys, uint32_t *rids, uint64_t size,
 }
 
 void histogram_numa_8(uint32_t *keys, uint64_t size, uint64_t *count,
-                      uint8_t radix_bits, uint32_t delim[])
+                      uint8_t radix_bits, uint32_t delim[],
+                      int copies, uint32_t *key_or, uint32_t *key_and)
 {
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 8) << radix_bits;
+	__m128i lanes = copy_lanes(copies, copy_size);
+	clear_copies(count, copy_size, copies);
+	__m128i k_or = _mm_setzero_si128();
+	__m128i k_and = _mm_set1_epi32(-1);
+	uint32_t or_bits = 0, and_bits = ~0;
 	uint32_t convert = ((uint32_t) 1) << 31;
 	__m128i s = _mm_set_epi32(0, 0, 0, radix_bits);
 	__m128i m = _mm_set1_epi32((1 << (radix_bits)) - 1);
@@ -660,8 +772,11 @@ void histogram_numa_8(uint32_t *keys, uint64_t size, uint64_t *count,
 	// check for unaligned keys
 	uint64_t p = 0; i = 0;
 	uint32_t unaligned_keys[4];
-	while ((15 & ((uint64_t) keys)) && i != size)
+	while ((15 & ((uint64_t) keys)) && i != size) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	uint32_t *keys_aligned_end = &keys[(size - i) & ~3];
 	uint32_t *keys_end = &keys[size - i];
 	if (i) {
@@ -671,6 +786,8 @@ void histogram_numa_8(uint32_t *keys, uint64_t size, uint64_t *count,
 	while (keys != keys_aligned_end) {
 		k = _mm_load_si128((__m128i*) keys);
 		keys += 4; i = 4;
+		k_or = _mm_or_si128(k_or, k);
+		k_and = _mm_and_si128(k_and, k);
 		unaligned_intro:;
 		__m128i k_c = _mm_sub_epi32(k, c);
 		__m128i e1 = _mm_cmpgt_epi32(k_c, d4);
@@ -689,6 +806,7 @@ void histogram_numa_8(uint32_t *keys, uint64_t size, uint64_t *count,
 		r = _mm_sub_epi32(r, e3);
 		r = _mm_sll_epi32(r, s);
 		h = _mm_or_si128(h, r);
+		h = _mm_add_epi32(h, lanes);
 		do {
 			asm("movd	%1, %%eax" : "=a"(p) : "x"(h), "0"(p));
 			count[p]++;
@@ -697,23 +815,31 @@ void histogram_numa_8(uint32_t *keys, uint64_t size, uint64_t *count,
 	}
 	// histogram last 0-3 unaligned items
 	i = 0; p = 0;
-	while (keys != keys_end)
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	if (i) {
 		k = _mm_loadu_si128((__m128i*) unaligned_keys);
 		keys_aligned_end = keys_end;
 		goto unaligned_intro;
 	}
+	fold_copies(count, copy_size, copies);
+	key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
 }
 
 void partition_numa_8(uint32_t *keys, uint32_t *rids, uint64_t size,
                       uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
-                      uint32_t *keys_out, uint32_t *rids_out,
+                      uint32_t **keys_out, uint32_t **rids_out,
                       uint8_t radix_bits, uint32_t delim[])
 {
-	assert((63 & (uint64_t) keys_out) == 0);
-	assert((63 & (uint64_t) rids_out) == 0);
 	int i, partitions = 1 << (radix_bits + 3);
+	// an output per node, the local one or the node of the range
+	for (i = 0 ; i != 8 ; ++i) {
+		assert((63 & (uint64_t) keys_out[i]) == 0);
+		assert((63 & (uint64_t) rids_out[i]) == 0);
+	}
 	// initialize buffers
 	for (i = 0 ; i != partitions ; ++i)
 		buf[(i << 4) | 15] = offsets[i];
@@ -779,8 +905,9 @@ void partition_numa_8(uint32_t *keys, uint32_t *rids, uint64_t size,
 			__m128i kvxx = _mm_unpacklo_epi32(k, v);
 			_mm_storel_epi64((__m128i*) &src[offset], kvxx);
 			if (offset == 15) {
-				float *dest_x = (float*) &keys_out[index - 15];
-				float *dest_y = (float*) &rids_out[index - 15];
+				uint64_t node = p >> (radix_bits + 4);
+				float *dest_x = (float*) &keys_out[node][index - 15];
+				float *dest_y = (float*) &rids_out[node][index - 15];
 				// load cache line from cache to 8 128-bit registers
 				__m128 r0 = _mm_load_ps((float*) &src[0]);
 				__m128 r1 = _mm_load_ps((float*) &src[2]);
@@ -840,14 +967,114 @@ void partition_numa_8(uint32_t *keys, uint32_t *rids, uint64_t size,
 #endif
 }
 
-void histogram(uint32_t *keys, uint64_t size, uint64_t *count,
-               uint8_t shift_bits, uint8_t radix_bits)
+// any number of ranges up to 64 (nodes other than 2, 3, 4 and 8), each
+// split exactly at its delimiter instead of rounded up to a power of two
+void histogram_numa_n(uint32_t *keys, uint64_t size, uint64_t *count,
+                      uint8_t radix_bits, uint32_t delim[], int ranges,
+                      int copies, uint32_t *key_or, uint32_t *key_and)
+{
+	// item i counts in copy i % copies
+	uint64_t copy_size = ((uint64_t) ranges) << radix_bits;
+	clear_copies(count, copy_size, copies);
+	uint32_t mask = (1 << radix_bits) - 1;
+	uint32_t or_bits = 0, and_bits = ~0;
+	uint64_t i;
+	for (i = 0 ; i != size ; ++i) {
+		uint32_t key = keys[i];
+		or_bits |= key;
+		and_bits &= key;
+		uint64_t p = ((uint64_t) numa_range(key, delim, ranges) << radix_bits) | (key & mask);
+		count[(i & (copies - 1)) * copy_size + p]++;
+	}
+	fold_copies(count, copy_size, copies);
+	key_bits(_mm_setzero_si128(), _mm_set1_epi32(-1), or_bits, and_bits, key_or, key_and);
+}
+
+// stream a full buffer of 16 key / rid pairs as two cache lines
+void flush_sse(uint64_t *src, uint32_t *keys_out, uint32_t *rids_out)
 {
+	__m128 r0 = _mm_load_ps((float*) &src[0]);
+	__m128 r1 = _mm_load_ps((float*) &src[2]);
+	__m128 r2 = _mm_load_ps((float*) &src[4]);
+	__m128 r3 = _mm_load_ps((float*) &src[6]);
+	__m128 r4 = _mm_load_ps((float*) &src[8]);
+	__m128 r5 = _mm_load_ps((float*) &src[10]);
+	__m128 r6 = _mm_load_ps((float*) &src[12]);
+	__m128 r7 = _mm_load_ps((float*) &src[14]);
+	float *dest_x = (float*) keys_out;
+	float *dest_y = (float*) rids_out;
+	_mm_stream_ps(&dest_x[0], _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_stream_ps(&dest_x[4], _mm_shuffle_ps(r2, r3, _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_stream_ps(&dest_x[8], _mm_shuffle_ps(r4, r5, _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_stream_ps(&dest_x[12], _mm_shuffle_ps(r6, r7, _MM_SHUFFLE(2, 0, 2, 0)));
+	_mm_stream_ps(&dest_y[0], _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(3, 1, 3, 1)));
+	_mm_stream_ps(&dest_y[4], _mm_shuffle_ps(r2, r3, _MM_SHUFFLE(3, 1, 3, 1)));
+	_mm_stream_ps(&dest_y[8], _mm_shuffle_ps(r4, r5, _MM_SHUFFLE(3, 1, 3, 1)));
+	_mm_stream_ps(&dest_y[12], _mm_shuffle_ps(r6, r7, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+void partition_numa_n(uint32_t *keys, uint32_t *rids, uint64_t size,
+                      uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                      uint32_t **keys_out, uint32_t **rids_out,
+                      uint8_t radix_bits, uint32_t delim[], int ranges)
+{
+	int r, partitions = ranges << radix_bits;
+	// an output per node, the local one or the node of the range
+	for (r = 0 ; r != ranges ; ++r) {
+		assert((63 & (uint64_t) keys_out[r]) == 0);
+		assert((63 & (uint64_t) rids_out[r]) == 0);
+	}
+	// initialize buffers
+	for (r = 0 ; r != partitions ; ++r)
+		buf[(r << 4) | 15] = offsets[r];
+	uint32_t mask = (1 << radix_bits) - 1;
+	uint64_t i;
+	for (i = 0 ; i != size ; ++i) {
+		uint32_t key = keys[i];
+		uint64_t node = numa_range(key, delim, ranges);
+		// offset in the cache line pair
+		uint64_t *src = &buf[((node << radix_bits) | (key & mask)) << 4];
+		uint64_t index = src[15]++;
+		uint64_t offset = index & 15;
+		src[offset] = key | (((uint64_t) rids[i]) << 32);
+		if (offset == 15) {
+			flush_sse(src, &keys_out[node][index - 15], &rids_out[node][index - 15]);
+			// restore overwritten pointer
+			src[15] = index + 1;
+		}
+	}
+#ifdef BG
+	// check partition sanity
+	for (r = 0 ; r != partitions ; ++r) {
+		uint64_t index = buf[(r << 4) | 15];
+		assert(index - offsets[r] == sizes[r]);
+	}
+#endif
+}
+
+void histogram_sse(uint32_t *keys, uint64_t size, uint64_t *count,
+                   uint8_t shift_bits, uint8_t radix_bits,
+                   int copies, uint32_t *key_or, uint32_t *key_and)
+{
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 1) << radix_bits;
+	__m128i lanes = copy_lanes(copies, copy_size);
+	clear_copies(count, copy_size, copies);
+	__m128i k_or = _mm_setzero_si128();
+	__m128i k_and = _mm_set1_epi32(-1);
+	uint32_t or_bits = 0, and_bits = ~0;
 	uint32_t *keys_end = &keys[size];
 	uint64_t partitions = 1 << radix_bits;
-	while ((15 & ((uint64_t) keys)) && keys != keys_end)
+	while ((15 & ((uint64_t) keys)) && keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
-	if (keys == keys_end) return;
+	}
+	if (keys == keys_end) {
+		fold_copies(count, copy_size, copies);
+		key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
+		return;
+	}
 	__m128i m = _mm_set1_epi32(partitions - 1);
 	__m128i s = _mm_set_epi32(0, 0, 0, shift_bits);
 	uint32_t *keys_aligned_end = &keys[(keys_end - keys) & ~3];
@@ -855,8 +1082,11 @@ void histogram(uint32_t *keys, uint64_t size, uint64_t *count,
 	do {
 		__m128i k = _mm_load_si128((__m128i*) keys);
 		keys += 4;
+		k_or = _mm_or_si128(k_or, k);
+		k_and = _mm_and_si128(k_and, k);
 		__m128i h = _mm_srl_epi32(k, s);
 		h = _mm_and_si128(h, m);
+		h = _mm_add_epi32(h, lanes);
 		__m128i h_s1 = _mm_shuffle_epi32(h, 1);
 		__m128i h_s2 = _mm_shuffle_epi32(h, 2);
 		__m128i h_s3 = _mm_shuffle_epi32(h, 3);
@@ -869,8 +1099,136 @@ void histogram(uint32_t *keys, uint64_t size, uint64_t *count,
 		count[p3]++;
 		count[p4]++;
 	} while (keys != keys_aligned_end);
-	while (keys != keys_end)
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	fold_copies(count, copy_size, copies);
+	key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
+}
+
+__attribute__((target("avx2")))
+void histogram_avx2(uint32_t *keys, uint64_t size, uint64_t *count,
+                    uint8_t shift_bits, uint8_t radix_bits,
+                    int copies, uint32_t *key_or, uint32_t *key_and)
+{
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 1) << radix_bits;
+	__m256i lanes = _mm256_mullo_epi32(_mm256_and_si256(_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0),
+	                                   _mm256_set1_epi32(copies - 1)), _mm256_set1_epi32(copy_size));
+	clear_copies(count, copy_size, copies);
+	__m256i k_or = _mm256_setzero_si256();
+	__m256i k_and = _mm256_set1_epi32(-1);
+	uint32_t or_bits = 0, and_bits = ~0;
+	uint32_t *keys_end = &keys[size];
+	uint32_t partitions = 1 << radix_bits;
+	uint32_t h[8] __attribute__((aligned(32)));
+	while ((31 & ((uint64_t) keys)) && keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	__m256i m = _mm256_set1_epi32(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint32_t *keys_aligned_end = &keys[(keys_end - keys) & ~7];
+	while (keys != keys_aligned_end) {
+		__m256i k = _mm256_load_si256((__m256i*) keys);
+		keys += 8;
+		k_or = _mm256_or_si256(k_or, k);
+		k_and = _mm256_and_si256(k_and, k);
+		k = _mm256_and_si256(_mm256_srl_epi32(k, s), m);
+		k = _mm256_add_epi32(k, lanes);
+		_mm256_store_si256((__m256i*) h, k);
+		count[h[0]]++;
+		count[h[1]]++;
+		count[h[2]]++;
+		count[h[3]]++;
+		count[h[4]]++;
+		count[h[5]]++;
+		count[h[6]]++;
+		count[h[7]]++;
+	}
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	__m128i lo_or  = _mm256_castsi256_si128(k_or);
+	__m128i hi_or  = _mm256_extracti128_si256(k_or, 1);
+	__m128i lo_and = _mm256_castsi256_si128(k_and);
+	__m128i hi_and = _mm256_extracti128_si256(k_and, 1);
+	fold_copies(count, copy_size, copies);
+	key_bits(_mm_or_si128(lo_or, hi_or), _mm_and_si128(lo_and, hi_and),
+	         or_bits, and_bits, key_or, key_and);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void histogram_avx512(uint32_t *keys, uint64_t size, uint64_t *count,
+                      uint8_t shift_bits, uint8_t radix_bits,
+                      int copies, uint32_t *key_or, uint32_t *key_and)
+{
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 1) << radix_bits;
+	__m512i lanes = _mm512_mullo_epi32(_mm512_and_si512(_mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+	                                                     7, 6, 5, 4, 3, 2, 1, 0),
+	                                   _mm512_set1_epi32(copies - 1)), _mm512_set1_epi32(copy_size));
+	clear_copies(count, copy_size, copies);
+	__m512i k_or = _mm512_setzero_si512();
+	__m512i k_and = _mm512_set1_epi32(-1);
+	uint32_t or_bits = 0, and_bits = ~0;
+	uint32_t *keys_end = &keys[size];
+	uint32_t partitions = 1 << radix_bits;
+	uint32_t h[16] __attribute__((aligned(64)));
+	int i;
+	while ((63 & ((uint64_t) keys)) && keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	__m512i m = _mm512_set1_epi32(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint32_t *keys_aligned_end = &keys[(keys_end - keys) & ~15];
+	while (keys != keys_aligned_end) {
+		__m512i k = _mm512_load_si512(keys);
+		keys += 16;
+		k_or = _mm512_or_si512(k_or, k);
+		k_and = _mm512_and_si512(k_and, k);
+		k = _mm512_and_si512(_mm512_srl_epi32(k, s), m);
+		k = _mm512_add_epi32(k, lanes);
+		_mm512_store_si512(h, k);
+		for (i = 0 ; i != 16 ; ++i)
+			count[h[i]]++;
+	}
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	// fold the 512-bit masks to 128 bits
+	__m256i or_256  = _mm256_or_si256(_mm512_castsi512_si256(k_or),
+	                                  _mm512_extracti64x4_epi64(k_or, 1));
+	__m256i and_256 = _mm256_and_si256(_mm512_castsi512_si256(k_and),
+	                                   _mm512_extracti64x4_epi64(k_and, 1));
+	fold_copies(count, copy_size, copies);
+	key_bits(_mm_or_si128(_mm256_castsi256_si128(or_256),
+	                      _mm256_extracti128_si256(or_256, 1)),
+	         _mm_and_si128(_mm256_castsi256_si128(and_256),
+	                       _mm256_extracti128_si256(and_256, 1)),
+	         or_bits, and_bits, key_or, key_and);
+}
+
+void histogram(uint32_t *keys, uint64_t size, uint64_t *count,
+               uint8_t shift_bits, uint8_t radix_bits,
+               int copies, uint32_t *key_or, uint32_t *key_and)
+{
+	int level = simd_level();
+	if (level == SIMD_AVX512)
+		histogram_avx512(keys, size, count, shift_bits, radix_bits, copies, key_or, key_and);
+	else if (level == SIMD_AVX2)
+		histogram_avx2(keys, size, count, shift_bits, radix_bits, copies, key_or, key_and);
+	else
+		histogram_sse(keys, size, count, shift_bits, radix_bits, copies, key_or, key_and);
 }
 
 void partition_offsets(uint64_t **count, int partitions, int id,
@@ -886,10 +1244,109 @@ void partition_offsets(uint64_t **count, int partitions, int id,
 	}
 }
 
-void partition(uint32_t *keys, uint32_t *rids, uint64_t size,
-               uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
-               uint32_t *keys_out, uint32_t *rids_out,
-               uint8_t shift_bits, uint8_t radix_bits)
+// offsets in the node of each range, partition i of a node holds the
+// parts of source nodes 0, 1, .. and of their threads in turn, the
+// layout the transfer gives
+void scatter_offsets(uint64_t ***count, int numa, int threads_per_numa,
+                     int partitions, int radix_bits, int node, int id,
+                     uint64_t *offsets)
+{	int i, n, t;
+	uint64_t p = 0;
+	for (i = 0 ; i != partitions ; ++i) {
+		if ((i & ((1 << radix_bits) - 1)) == 0)
+			p = 0;
+		for (n = 0 ; n != numa ; ++n)
+			for (t = 0 ; t != threads_per_numa ; ++t) {
+				if (n == node && t == id)
+					offsets[i] = p;
+				p += count[n][t][i];
+			}
+	}
+}
+
+// fused histogram of the next pass: partition() and finalize() count the
+// next digit of the tuples they output for the thread (owner) that reads
+// that output position in the next pass, a line is counted as it flushes
+#define FUSED_COUNT_LIMIT	(1 << 18)
+
+typedef struct {
+	uint32_t *count;
+	uint64_t base;
+	uint64_t chunk;
+	uint64_t owners;
+	uint8_t shift_bits;
+	uint8_t radix_bits;
+} next_hist_t;
+
+// count the next digit of the buffered tuples at output positions [lo, hi]
+void next_count(const next_hist_t *next, const uint64_t *src, uint64_t lo, uint64_t hi)
+{
+	uint32_t shift = next->shift_bits;
+	uint32_t mask = (1 << next->radix_bits) - 1;
+	uint64_t owner = (lo - next->base) / next->chunk;
+	uint64_t end = next->base + (owner + 1) * next->chunk;
+	// the last owner also reads the remainder
+	if (owner >= next->owners - 1) {
+		owner = next->owners - 1;
+		end = ~0;
+	}
+	uint32_t *count = &next->count[owner << next->radix_bits];
+	if (hi < end)
+		for (; lo <= hi ; ++lo)
+			count[((uint32_t) src[lo & 15] >> shift) & mask]++;
+	else
+		for (; lo <= hi ; ++lo) {
+			if (lo == end) {
+				count += mask + 1;
+				end = ++owner == next->owners - 1 ? ~ (uint64_t) 0 : end + next->chunk;
+			}
+			count[((uint32_t) src[lo & 15] >> shift) & mask]++;
+		}
+}
+// keys copied at a time while counting, the copy leaves them in cache
+#define SHUFFLE_BLOCK	1024
+
+// copy keys to output positions [index, index + size) of the NUMA shuffle
+// and count the digit of the first local pass for their owners
+void shuffle_keys(const uint32_t *keys, uint32_t *keys_out, uint64_t size,
+                  const next_hist_t *next, uint64_t index)
+{
+	const uint32_t *keys_end = &keys[size];
+	if (next == NULL) {
+		transfer_copy(keys_out, keys, size * sizeof(uint32_t));
+		return;
+	}
+	uint32_t shift = next->shift_bits;
+	uint32_t mask = (1 << next->radix_bits) - 1;
+	while (keys != keys_end) {
+		// block of keys up to the end of the owner of this position
+		uint64_t owner = (index - next->base) / next->chunk;
+		uint64_t end = next->base + (owner + 1) * next->chunk;
+		if (owner >= next->owners - 1) {
+			owner = next->owners - 1;
+			end = ~0;
+		}
+		uint32_t *count = &next->count[owner << next->radix_bits];
+		uint64_t run = keys_end - keys;
+		if (end - index < run)
+			run = end - index;
+		if (run > SHUFFLE_BLOCK)
+			run = SHUFFLE_BLOCK;
+		transfer_copy(keys_out, keys, run * sizeof(uint32_t));
+		const uint32_t *run_end = &keys[run];
+		keys_out += run;
+		index += run;
+		while (keys != run_end)
+			count[(*keys++ >> shift) & mask]++;
+	}
+}
+
+
+void partition_sse(uint32_t *keys, uint32_t *rids, uint64_t size,
+                   uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                   uint32_t *keys_out, uint32_t *rids_out,
+                   uint8_t shift_bits, uint8_t radix_bits,
+                   const next_hist_t *next)
 {
 	assert((63 & (uint64_t) keys_out) == 0);
 	assert((63 & (uint64_t) rids_out) == 0);
@@ -968,6 +1425,11 @@ void partition(uint32_t *keys, uint32_t *rids, uint64_t size,
 				_mm_stream_ps(&dest_y[4], y1);
 				_mm_stream_ps(&dest_y[8], y2);
 				_mm_stream_ps(&dest_y[12],y3);
+				// count the next digit of the tuples of this thread
+				if (next != NULL) {
+					uint64_t first = offsets[p >> 4];
+					next_count(next, src, index - 15 < first ? first : index - 15, index);
+				}
 				// restore overwritten pointer
 				src[15] = index + 1;
 			}
@@ -998,8 +1460,160 @@ void partition(uint32_t *keys, uint32_t *rids, uint64_t size,
 #endif
 }
 
+// stream a full buffer of 16 key / rid pairs as two cache lines
+__attribute__((target("avx2")))
+void flush_avx2(uint64_t *src, uint32_t *keys_out, uint32_t *rids_out)
+{
+	__m256 r0 = _mm256_load_ps((float*) &src[0]);
+	__m256 r1 = _mm256_load_ps((float*) &src[4]);
+	__m256 r2 = _mm256_load_ps((float*) &src[8]);
+	__m256 r3 = _mm256_load_ps((float*) &src[12]);
+	// split columns within lanes and fix the lane order
+	__m256i x0 = _mm256_castps_si256(_mm256_shuffle_ps(r0, r1, _MM_SHUFFLE(2, 0, 2, 0)));
+	__m256i x1 = _mm256_castps_si256(_mm256_shuffle_ps(r2, r3, _MM_SHUFFLE(2, 0, 2, 0)));
+	__m256i y0 = _mm256_castps_si256(_mm256_shuffle_ps(r0, r1, _MM_SHUFFLE(3, 1, 3, 1)));
+	__m256i y1 = _mm256_castps_si256(_mm256_shuffle_ps(r2, r3, _MM_SHUFFLE(3, 1, 3, 1)));
+	x0 = _mm256_permute4x64_epi64(x0, _MM_SHUFFLE(3, 1, 2, 0));
+	x1 = _mm256_permute4x64_epi64(x1, _MM_SHUFFLE(3, 1, 2, 0));
+	y0 = _mm256_permute4x64_epi64(y0, _MM_SHUFFLE(3, 1, 2, 0));
+	y1 = _mm256_permute4x64_epi64(y1, _MM_SHUFFLE(3, 1, 2, 0));
+	_mm256_stream_si256((__m256i*) &keys_out[0], x0);
+	_mm256_stream_si256((__m256i*) &keys_out[8], x1);
+	_mm256_stream_si256((__m256i*) &rids_out[0], y0);
+	_mm256_stream_si256((__m256i*) &rids_out[8], y1);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void flush_avx512(uint64_t *src, uint32_t *keys_out, uint32_t *rids_out)
+{
+	__m512i r0 = _mm512_load_si512(&src[0]);
+	__m512i r1 = _mm512_load_si512(&src[8]);
+	__m512i even = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16,
+	                                14, 12, 10,  8,  6,  4,  2,  0);
+	__m512i odd  = _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17,
+	                                15, 13, 11,  9,  7,  5,  3,  1);
+	// one full cache line per store
+	_mm512_stream_si512((__m512i*) keys_out, _mm512_permutex2var_epi32(r0, even, r1));
+	_mm512_stream_si512((__m512i*) rids_out, _mm512_permutex2var_epi32(r0, odd, r1));
+}
+
+__attribute__((target("avx2")))
+void partition_avx2(uint32_t *keys, uint32_t *rids, uint64_t size,
+                    uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                    uint32_t *keys_out, uint32_t *rids_out,
+                    uint8_t shift_bits, uint8_t radix_bits,
+                    const next_hist_t *next)
+{
+	assert((63 & (uint64_t) keys_out) == 0);
+	assert((63 & (uint64_t) rids_out) == 0);
+	int i, partitions = 1 << radix_bits;
+	// initialize partition buffers
+	for (i = 0 ; i != partitions ; ++i)
+		buf[(i << 4) | 15] = offsets[i];
+	__m256i m = _mm256_set1_epi32(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint32_t h[8] __attribute__((aligned(32)));
+	uint64_t j, n = 0, block;
+	while (n != size) {
+		// 8 partitions at a time from aligned keys, else one
+		if ((31 & ((uint64_t) &keys[n])) || size - n < 8) {
+			h[0] = (keys[n] >> shift_bits) & (partitions - 1);
+			block = 1;
+		} else {
+			__m256i k = _mm256_load_si256((__m256i*) &keys[n]);
+			k = _mm256_and_si256(_mm256_srl_epi32(k, s), m);
+			_mm256_store_si256((__m256i*) h, k);
+			block = 8;
+		}
+		for (j = 0 ; j != block ; ++j, ++n) {
+			// offset in the cache line pair
+			uint64_t *src = &buf[h[j] << 4];
+			uint64_t index = src[15]++;
+			uint64_t offset = index & 15;
+			src[offset] = keys[n] | (((uint64_t) rids[n]) << 32);
+			if (offset == 15) {
+				flush_avx2(src, &keys_out[index - 15], &rids_out[index - 15]);
+				// count the next digit of the tuples of this thread
+				if (next != NULL) {
+					uint64_t first = offsets[h[j]];
+					next_count(next, src, index - 15 < first ? first : index - 15, index);
+				}
+				// restore overwritten pointer
+				src[15] = index + 1;
+			}
+		}
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void partition_avx512(uint32_t *keys, uint32_t *rids, uint64_t size,
+                      uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                      uint32_t *keys_out, uint32_t *rids_out,
+                      uint8_t shift_bits, uint8_t radix_bits,
+                      const next_hist_t *next)
+{
+	assert((63 & (uint64_t) keys_out) == 0);
+	assert((63 & (uint64_t) rids_out) == 0);
+	int i, partitions = 1 << radix_bits;
+	// initialize partition buffers
+	for (i = 0 ; i != partitions ; ++i)
+		buf[(i << 4) | 15] = offsets[i];
+	__m512i m = _mm512_set1_epi32(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint32_t h[16] __attribute__((aligned(64)));
+	uint64_t j, n = 0, block;
+	while (n != size) {
+		// 16 partitions at a time from aligned keys, else one
+		if ((63 & ((uint64_t) &keys[n])) || size - n < 16) {
+			h[0] = (keys[n] >> shift_bits) & (partitions - 1);
+			block = 1;
+		} else {
+			__m512i k = _mm512_load_si512(&keys[n]);
+			k = _mm512_and_si512(_mm512_srl_epi32(k, s), m);
+			_mm512_store_si512(h, k);
+			block = 16;
+		}
+		for (j = 0 ; j != block ; ++j, ++n) {
+			// offset in the cache line pair
+			uint64_t *src = &buf[h[j] << 4];
+			uint64_t index = src[15]++;
+			uint64_t offset = index & 15;
+			src[offset] = keys[n] | (((uint64_t) rids[n]) << 32);
+			if (offset == 15) {
+				flush_avx512(src, &keys_out[index - 15], &rids_out[index - 15]);
+				// count the next digit of the tuples of this thread
+				if (next != NULL) {
+					uint64_t first = offsets[h[j]];
+					next_count(next, src, index - 15 < first ? first : index - 15, index);
+				}
+				// restore overwritten pointer
+				src[15] = index + 1;
+			}
+		}
+	}
+}
+
+void partition(uint32_t *keys, uint32_t *rids, uint64_t size,
+               uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+               uint32_t *keys_out, uint32_t *rids_out,
+               uint8_t shift_bits, uint8_t radix_bits,
+               const next_hist_t *next)
+{
+	int level = simd_level();
+	if (level == SIMD_AVX512)
+		partition_avx512(keys, rids, size, offsets, sizes, buf,
+		                 keys_out, rids_out, shift_bits, radix_bits, next);
+	else if (level == SIMD_AVX2)
+		partition_avx2(keys, rids, size, offsets, sizes, buf,
+		               keys_out, rids_out, shift_bits, radix_bits, next);
+	else
+		partition_sse(keys, rids, size, offsets, sizes, buf,
+		              keys_out, rids_out, shift_bits, radix_bits, next);
+}
+
 void finalize(uint64_t *sizes, uint64_t *buf,
-              uint32_t *keys_out, uint32_t *rids_out, int partitions)
+              uint32_t *keys_out, uint32_t *rids_out, int partitions,
+              const next_hist_t *next)
 {	int i;
 	// find offset to align output
 	assert((63 & (uint64_t) keys_out) == 0);
@@ -1013,6 +1627,8 @@ void finalize(uint64_t *sizes, uint64_t *buf,
 		if (rem > sizes[i])
 			off = rem - sizes[i];
 		index -= rem - off;
+		if (next != NULL && off != rem)
+			next_count(next, src, index, index + rem - off - 1);
 		while (off != rem) {
 			uint64_t pair = src[off++];
 			keys_out[index] = (uint32_t) pair;
@@ -1021,42 +1637,181 @@ void finalize(uint64_t *sizes, uint64_t *buf,
 	}
 }
 
-void swap_ppi(uint32_t ***a, uint32_t ***b)
+// count the next digit of the buffered keys at output positions [lo, hi]
+void next_count_column(const next_hist_t *next, const uint32_t *src, uint64_t lo, uint64_t hi)
 {
-	uint32_t **t = *a; *a = *b; *b = t;
+	uint32_t shift = next->shift_bits;
+	uint32_t mask = (1 << next->radix_bits) - 1;
+	uint64_t owner = (lo - next->base) / next->chunk;
+	uint64_t end = next->base + (owner + 1) * next->chunk;
+	if (owner >= next->owners - 1) {
+		owner = next->owners - 1;
+		end = ~0;
+	}
+	uint32_t *count = &next->count[owner << next->radix_bits];
+	for (; lo <= hi ; ++lo) {
+		if (lo == end) {
+			count += mask + 1;
+			end = ++owner == next->owners - 1 ? ~ (uint64_t) 0 : end + next->chunk;
+		}
+		count[(src[lo & 15] >> shift) & mask]++;
+	}
 }
 
-void extract_delimiters(uint32_t *sample, uint64_t sample_size, uint32_t *delimiter)
+// column buffers for rids of any width (0 for bare keys): a buffer has
+// the 16 keys in one cache line, then the 16 rids, then the output index
+// in its last slot, both columns are streamed when the buffer fills
+int column_stride(int payload)
 {
-	uint64_t i, parts = 0;
-	while (delimiter[parts] != ~0) parts++;
-	double percentile = sample_size * 1.0 / (parts + 1);
-	for (i = 0 ; i != parts ; ++i) {
-		uint64_t index = percentile * (i + 1) - 0.001;
-		delimiter[i] = sample[index];
-		// search repetitions in sample
-		uint64_t start, end;
-		for (start = index ; start ; --start)
-			if (sample[start] != delimiter[i]) break;
-		for (end = index ; end != sample_size ; ++end)
-			if (sample[end] != delimiter[i]) break;
-		// if more repetitions after, don't include
-		if (index - start < end - index && delimiter[i])
-			delimiter[i]--;
+	return (16 + 2 * payload) & ~7;
+}
+
+static inline void stream_column(void *dst, const void *src, int bytes)
+{
+	int i;
+	for (i = 0 ; i != bytes ; i += 16)
+		_mm_stream_si128((__m128i*) &((char*) dst)[i],
+		                 _mm_load_si128((__m128i*) &((char*) src)[i]));
+}
+
+// the keys are also split across the ranges of the nodes (delim[] has
+// the upper bound of all ranges but the last), the payload is constant
+// in each caller so the rid copies and flushes are specialized
+static inline __attribute__((always_inline))
+void partition_column(uint32_t *keys, uint8_t *rids, int payload, uint64_t size,
+                      uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                      uint32_t *keys_out, uint8_t *rids_out,
+                      uint8_t shift_bits, uint8_t radix_bits,
+                      const uint32_t *delim, int ranges, const next_hist_t *next)
+{
+	assert((63 & (uint64_t) keys_out) == 0);
+	assert((15 & (uint64_t) rids_out) == 0);
+	int r, stride = column_stride(payload);
+	int partitions = ranges << radix_bits;
+	uint32_t mask = (1 << radix_bits) - 1;
+	uint64_t i;
+	// initialize partition buffers
+	for (r = 0 ; r != partitions ; ++r)
+		buf[r * stride + stride - 1] = offsets[r];
+	for (i = 0 ; i != size ; ++i) {
+		uint32_t key = keys[i];
+		r = numa_range(key, delim, ranges);
+		uint64_t p = ((uint64_t) r << radix_bits) | ((key >> shift_bits) & mask);
+		uint64_t *src = &buf[p * stride];
+		uint32_t *line = (uint32_t*) src;
+		uint8_t *column = (uint8_t*) &src[8];
+		uint64_t index = src[stride - 1]++;
+		uint64_t offset = index & 15;
+		line[offset] = key;
+		memcpy(&column[offset * payload], &rids[i * payload], payload);
+		if (offset == 15) {
+			stream_column(&keys_out[index - 15], line, 64);
+			stream_column(&rids_out[(index - 15) * payload], column, 16 * payload);
+			// count the next digit of the keys of this thread
+			if (next != NULL) {
+				uint64_t first = offsets[p];
+				next_count_column(next, line, index - 15 < first ? first : index - 15, index);
+			}
+		}
 	}
+#ifdef BG
+	// check partition sanity
+	for (r = 0 ; r != partitions ; ++r) {
+		uint64_t index = buf[r * stride + stride - 1];
+		assert(index - offsets[r] == sizes[r]);
+	}
+#endif
+}
+
+void partition_columns(uint32_t *keys, uint32_t *rids, int payload, uint64_t size,
+                       uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                       uint32_t *keys_out, uint32_t *rids_out,
+                       uint8_t shift_bits, uint8_t radix_bits,
+                       const uint32_t *delim, int ranges, const next_hist_t *next)
+{
+	uint8_t *r = (uint8_t*) rids, *r_out = (uint8_t*) rids_out;
+	if (payload == 0)
+		partition_column(keys, r, 0, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else if (payload == 1)
+		partition_column(keys, r, 1, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else if (payload == 2)
+		partition_column(keys, r, 2, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else if (payload == 4)
+		partition_column(keys, r, 4, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else if (payload == 8)
+		partition_column(keys, r, 8, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else
+		assert(0);
+}
+
+void finalize_columns(uint64_t *sizes, uint64_t *buf,
+                      uint32_t *keys_out, uint32_t *rids_out, int payload,
+                      int partitions, const next_hist_t *next)
+{	int i, stride = column_stride(payload);
+	assert((63 & (uint64_t) keys_out) == 0);
+	// flush remaining tuples from buffers to output
+	for (i = 0 ; i != partitions ; ++i) {
+		uint64_t *src = &buf[i * stride];
+		uint32_t *line = (uint32_t*) src;
+		uint8_t *column = (uint8_t*) &src[8];
+		uint64_t index = src[stride - 1];
+		uint64_t rem = index & 15;
+		uint64_t off = 0;
+		if (rem > sizes[i])
+			off = rem - sizes[i];
+		index -= rem - off;
+		if (next != NULL && off != rem)
+			next_count_column(next, line, index, index + rem - off - 1);
+		memcpy(&((uint8_t*) rids_out)[index * payload], &column[off * payload],
+		       (rem - off) * payload);
+		while (off != rem)
+			keys_out[index++] = line[off++];
+	}
+}
+
+// copy rids of payload bytes for the NUMA shuffle
+void shuffle_rids(const uint32_t *rids, uint32_t *rids_out, uint64_t size, int payload)
+{
+	transfer_copy(rids_out, rids, size * payload);
+}
+
+// rids of payload bytes at an index
+uint32_t *rids_at(uint32_t *rids, uint64_t index, int payload)
+{
+	return (uint32_t*) &((uint8_t*) rids)[index * payload];
+}
+
+void swap_ppi(uint32_t ***a, uint32_t ***b)
+{
+	uint32_t **t = *a; *a = *b; *b = t;
 }
 
 typedef struct {
 	int *bits;
 	int bits_space;
+	int passes;
 	double fudge;
 	uint32_t **keys;
 	uint32_t **rids;
 	uint64_t *size;
 	uint32_t **keys_buf;
 	uint32_t **rids_buf;
+	int payload;
 	uint64_t ***count;
 	uint64_t **numa_local_count;
+	uint32_t *key_or;
+	uint32_t *key_and;
+	uint32_t **next_count;
+	uint64_t *arrived;
+	uint64_t *drained;
+	uint64_t planned;
+	int pipelined;
+	int direct;
 	uint32_t *sample;
 	uint32_t *sample_buf;
 	uint64_t **sample_hist;
@@ -1069,9 +1824,9 @@ typedef struct {
 	int numa;
 	int max_threads;
 	int max_numa;
-	pthread_barrier_t *global_barrier;
-	pthread_barrier_t **local_barrier;
+	barrier_t *barrier;
 	pthread_barrier_t *sample_barrier;
+	int stable;
 } global_data_t;
 
 typedef struct {
@@ -1081,6 +1836,7 @@ typedef struct {
 	uint64_t alloc_time;
 	uint64_t sample_time;
 	uint64_t numa_shuffle_time;
+	uint64_t numa_shuffle_bytes;
 	uint64_t hist_time[8];
 	uint64_t part_time[8];
 	global_data_t *global;
@@ -1093,19 +1849,76 @@ int uint32_compare(const void *x, const void *y)
 	return a < b ? -1 : (a > b ? 1 : 0);
 }
 
+// histogram counters are spread over copies when a key holds more than
+// 1/HEAVY_HITTER_SHARE of a sorted sample, so increments on skewed input
+// do not serialize on one location
+#define HISTOGRAM_COPIES	4
+#define HEAVY_HITTER_SHARE	16
+
+int histogram_copies(const uint32_t *sample, uint64_t sample_size)
+{
+	uint64_t i, run = 1, max_run = 1;
+	for (i = 1 ; i < sample_size ; ++i) {
+		run = sample[i] == sample[i - 1] ? run + 1 : 1;
+		if (run > max_run) max_run = run;
+	}
+	return sample_size && max_run * HEAVY_HITTER_SHARE >= sample_size ?
+	       HISTOGRAM_COPIES : 1;
+}
+
+
+// re-plan the local passes on the key bits that vary in any thread
+int plan_passes(const global_data_t *d, int pass_bits[])
+{
+	uint32_t key_or = 0, key_and = ~0;
+	int t;
+	for (t = 0 ; t != d->threads ; ++t) {
+		key_or |= d->key_or[t];
+		key_and &= d->key_and[t];
+	}
+	return replan_bits(key_or ^ key_and, d->bits, pass_bits);
+}
+
+// set up the fused histogram of the first local pass, NULL if the
+// counts of all owners for the widest local pass would not fit
+next_hist_t *fuse_passes(next_hist_t *next, global_data_t *d, int id,
+                         const int pass_bits[], int shift_bits, int owners, uint64_t chunk)
+{
+	int p, bits = 0;
+	for (p = 1 ; pass_bits[p] != 0 ; ++p)
+		if (pass_bits[p] > bits)
+			bits = pass_bits[p];
+	if (bits == 0 || chunk == 0 ||
+	    ((uint64_t) owners << bits) > FUSED_COUNT_LIMIT)
+		return NULL;
+	next->count = pool_scratch(id, 3, ((uint64_t) owners << bits) * sizeof(uint32_t));
+	next->base = 0;
+	next->chunk = chunk;
+	next->owners = owners;
+	next->shift_bits = shift_bits;
+	next->radix_bits = pass_bits[1];
+	// zero the counts of the first local pass and share them
+	memset(next->count, 0, ((uint64_t) owners << next->radix_bits) * sizeof(uint32_t));
+	d->next_count[id] = next->count;
+	return next;
+}
+
 void *sort_thread(void *arg)
 {
 	thread_data_t *a = (thread_data_t*) arg;
 	global_data_t *d = a->global;
-	int i, j, k, t, n, lb = 0, gb = 0, id = a->id;
+	int i, j, k, t, n, id = a->id;
 	int numa = d->numa;
 	int numa_node = d->numa_node[id];
 	int numa_dst, numa_src;
 	int threads = d->threads;
 	int threads_per_numa = threads / numa;
-	uint32_t seed = a->seed;
-	pthread_barrier_t *local_barrier = d->local_barrier[numa_node];
-	pthread_barrier_t *global_barrier = d->global_barrier;
+	barrier_t *barrier = d->barrier;
+	// bytes per rid (0 for bare keys), the column kernels move any
+	// width other than the key width
+	int payload = d->payload;
+	int key_only = payload == 0;
+	int columns = payload != sizeof(uint32_t);
 	// id in local numa threads
 	int numa_local_id = 0;
 	for (i = 0 ; i != id ; ++i)
@@ -1115,14 +1928,9 @@ void *sort_thread(void *arg)
 	uint64_t total_size = 0;
 	for (n = 0 ; n != numa ; ++n)
 		total_size += d->size[n];
-	// bind thread and its allocation
-	if (threads <= d->max_threads)
-		cpu_bind(d->cpu[id]);
-	if (numa <= d->max_numa)
-		memory_bind(d->numa_node[id]);
 	// size for histograms
 	int radix_bits = d->bits[0];
-	int partitions = (1 << radix_bits) * (numa == 3 ? 4 : numa);
+	int partitions = (1 << radix_bits) * numa;
 	int max_partitions = partitions;
 	for (i = 1 ; d->bits[i] != 0 ; ++i) {
 		int parts = 1 << d->bits[i];
@@ -1130,9 +1938,12 @@ void *sort_thread(void *arg)
 			max_partitions = parts;
 	}
 	// initial histogram and buffers
-	uint64_t *offsets = malloc(max_partitions * sizeof(uint64_t));
-	uint64_t *count = calloc(max_partitions, sizeof(uint64_t));
-	uint64_t *buf = mamalloc((max_partitions << 4) * sizeof(uint64_t));
+	uint64_t *offsets = pool_scratch(id, 0, max_partitions * sizeof(uint64_t));
+	// counts have room for the histogram copies
+	uint64_t *count = pool_scratch(id, 1, max_partitions * HISTOGRAM_COPIES * sizeof(uint64_t));
+	memset(count, 0, max_partitions * sizeof(uint64_t));
+	int stride = columns ? column_stride(payload) : 16;
+	uint64_t *buf = pool_scratch(id, 2, max_partitions * stride * sizeof(uint64_t));
 	d->count[numa_node][numa_local_id] = count;
 	uint64_t numa_size = d->size[numa_node];
 	uint64_t size = numa_size / threads_per_numa;
@@ -1145,26 +1956,32 @@ void *sort_thread(void *arg)
 			uint64_t cap = d->size[numa_node] * d->fudge;
 			if (d->interleaved) {
 				d->keys_buf[numa_node] = numa_alloc_interleaved(cap * sizeof(uint32_t));
-				d->rids_buf[numa_node] = numa_alloc_interleaved(cap * sizeof(uint32_t));
+				if (!key_only)
+					d->rids_buf[numa_node] = numa_alloc_interleaved(cap * payload);
 			} else {
 				d->keys_buf[numa_node] = mamalloc(cap * sizeof(uint32_t));
-				d->rids_buf[numa_node] = mamalloc(cap * sizeof(uint32_t));
+				if (!key_only)
+					d->rids_buf[numa_node] = mamalloc(cap * payload);
 			}
 		}
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 	}
 	uint32_t *keys = &d->keys[numa_node][offset];
-	uint32_t *rids = &d->rids[numa_node][offset];
-	uint32_t *keys_end = NULL, *rids_end = NULL;
+	uint32_t *rids = key_only ? NULL : rids_at(d->rids[numa_node], offset, payload);
 	if (!d->allocated) {
 		uint32_t *keys_buf = &d->keys_buf[numa_node][offset];
-		uint32_t *rids_buf = &d->rids_buf[numa_node][offset];
 		uint64_t p;
 		for (p = 0 ; p != size ; ++p)
 			_mm_stream_si32(&keys_buf[p], 0);
-		for (p = 0 ; p != size ; ++p)
-			_mm_stream_si32(&rids_buf[p], 0);
-		pthread_barrier_wait(&local_barrier[lb++]);
+		if (!key_only) {
+			uint32_t *rids_buf = rids_at(d->rids_buf[numa_node], offset, payload);
+			if (columns)
+				memset(rids_buf, 0, size * payload);
+			else
+				for (p = 0 ; p != size ; ++p)
+					_mm_stream_si32(&rids_buf[p], 0);
+		}
+		barrier_wait(barrier, id, BARRIER_NUMA);
 	}
 	tim = micro_time() - tim;
 	a->alloc_time = tim;
@@ -1183,27 +2000,47 @@ void *sort_thread(void *arg)
 			sample[p] = keys[mulhi(rand64_next(gen), size)];
 		// (in-parallel) LSB radix-sort the sample
 		partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 0, 8,
-		               id, threads, &global_barrier[gb]);
+		               id, threads, barrier);
 		partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 8, 8,
-		               id, threads, &global_barrier[gb + 3]);
+		               id, threads, barrier);
 		partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 16, 8,
-		               id, threads, &global_barrier[gb + 6]);
+		               id, threads, barrier);
 		partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 24, 8,
-		               id, threads, &global_barrier[gb + 9]);
-		gb += 12;
-		extract_delimiters(d->sample, d->sample_size, delimiter);
+		               id, threads, barrier);
+		sample_delimiters_32(d->sample, d->sample_size, delimiter, NULL);
+	}
+	// spread histogram counters if a few keys dominate
+	int copies;
+	if (numa > 1)
+		copies = histogram_copies(d->sample, d->sample_size);
+	else {
+		uint32_t local[256];
+		uint64_t p, local_size = size < 256 ? size : 256;
+		rand64_t *gen = rand64_init(a->seed ^ 1);
+		for (p = 0 ; p != local_size ; ++p)
+			local[p] = keys[mulhi(rand64_next(gen), size)];
+		free(gen);
+		qsort(local, local_size, sizeof(uint32_t), uint32_compare);
+		copies = histogram_copies(local, local_size);
 	}
 	tim = micro_time() - tim;
 	a->sample_time = tim;
 	tim = micro_time();
 	if (numa == 1)
-		histogram(keys, size, count, 0, radix_bits);
+		histogram(keys, size, count, 0, radix_bits, copies,
+		          &d->key_or[id], &d->key_and[id]);
 	else if (numa == 2)
-		histogram_numa_2(keys, size, count, radix_bits, delimiter);
-	else if (numa <= 4)
-		histogram_numa_4(keys, size, count, radix_bits, delimiter);
-	else if (numa <= 8)
-		histogram_numa_8(keys, size, count, radix_bits, delimiter);
+		histogram_numa_2(keys, size, count, radix_bits, delimiter, copies,
+		                 &d->key_or[id], &d->key_and[id]);
+	else if (numa == 4)
+		histogram_numa_4(keys, size, count, radix_bits, delimiter, copies,
+		                 &d->key_or[id], &d->key_and[id]);
+	else if (numa == 8)
+		histogram_numa_8(keys, size, count, radix_bits, delimiter, copies,
+		                 &d->key_or[id], &d->key_and[id]);
+	else
+		histogram_numa_n(keys, size, count, radix_bits, delimiter, numa, copies,
+		                 &d->key_or[id], &d->key_and[id]);
 	// local counts for numa transfer
 	tim = micro_time() - tim;
 	a->hist_time[0] = tim;
@@ -1214,38 +2051,91 @@ void *sort_thread(void *arg)
 			numa_local_count[i >> radix_bits] += count[i];
 	}
 	d->numa_local_count[id] = numa_local_count;
-	// local sync and partition
-	pthread_barrier_wait(&local_barrier[lb++]);
+	// local sync and partition, or global sync if writing to all nodes
+	barrier_wait(barrier, id, d->direct ? BARRIER_GLOBAL : BARRIER_NUMA);
+	// one node has the key bits of all threads and can count the first
+	// local pass while partitioning the first
+	int pass_bits[4], shift_bits = 0, counted = 0;
+	next_hist_t next_hist, *next = NULL;
+	if (numa == 1) {
+		shift_bits = plan_passes(d, pass_bits);
+		next = fuse_passes(&next_hist, d, id, pass_bits, shift_bits, threads,
+		                   (numa_size / threads) & ~3);
+		counted = next != NULL;
+	} else if (d->direct) {
+		// every node must fit the ranges before any thread writes to it
+		uint64_t numa_dst_size = 0;
+		for (numa_dst = 0 ; numa_dst != numa ; ++numa_dst) {
+			uint64_t dst_size = 0;
+			for (t = 0 ; t != threads ; ++t)
+				dst_size += d->numa_local_count[t][numa_dst];
+			if (dst_size > d->size[numa_dst] * d->fudge)
+				fprintf(stderr, "NUMA %d is %.2f%% of input\n", numa_dst,
+						 dst_size * 100.0 / total_size);
+			assert(dst_size <= d->size[numa_dst] * d->fudge);
+			if (numa_dst == numa_node)
+				numa_dst_size = dst_size;
+		}
+		numa_size = numa_dst_size;
+		shift_bits = plan_passes(d, pass_bits);
+	}
 	// offsets of output partitions
 	tim = micro_time();
 	uint64_t **counts = d->count[numa_node];
-	partition_offsets(counts, partitions, numa_local_id,
-			  threads_per_numa, offsets);
-	// partition range partitioned data in local nodes
+	if (d->direct)
+		scatter_offsets(d->count, numa, threads_per_numa, partitions,
+		                radix_bits, numa_node, numa_local_id, offsets);
+	else
+		partition_offsets(counts, partitions, numa_local_id,
+				  threads_per_numa, offsets);
+	// partition range partitioned data in local nodes, or in the nodes
+	// of the ranges
 	uint32_t *keys_out = d->keys_buf[numa_node];
-	uint32_t *rids_out = d->rids_buf[numa_node];
-	if (numa == 1)
+	uint32_t *rids_out = key_only ? NULL : d->rids_buf[numa_node];
+	uint32_t *keys_node[numa], *rids_node[numa];
+	if (numa > 1 && !columns)
+		for (n = 0 ; n != numa ; ++n) {
+			keys_node[n] = d->direct ? d->keys_buf[n] : keys_out;
+			rids_node[n] = d->direct ? d->rids_buf[n] : rids_out;
+		}
+	if (columns)
+		partition_columns(keys, rids, payload, size, offsets, count, buf,
+		                  keys_out, rids_out, 0, radix_bits,
+		                  delimiter, partitions >> radix_bits, next);
+	else if (numa == 1)
 		partition(keys, rids, size, offsets, count, buf,
-		          keys_out, rids_out, 0, radix_bits);
+		          keys_out, rids_out, 0, radix_bits, next);
 	else if (numa == 2)
 		partition_numa_2(keys, rids, size, offsets, count, buf,
-		                 keys_out, rids_out, radix_bits, delimiter);
-	else if (numa <= 4)
+		                 keys_node, rids_node, radix_bits, delimiter);
+	else if (numa == 4)
 		partition_numa_4(keys, rids, size, offsets, count, buf,
-		                 keys_out, rids_out, radix_bits, delimiter);
-	else if (numa <= 8)
+		                 keys_node, rids_node, radix_bits, delimiter);
+	else if (numa == 8)
 		partition_numa_8(keys, rids, size, offsets, count, buf,
-		                 keys_out, rids_out, radix_bits, delimiter);
-	// local sync and finalize
-	pthread_barrier_wait(&local_barrier[lb++]);
-	finalize(count, buf, keys_out, rids_out, partitions);
+		                 keys_node, rids_node, radix_bits, delimiter);
+	else
+		partition_numa_n(keys, rids, size, offsets, count, buf,
+		                 keys_node, rids_node, radix_bits, delimiter, numa);
+	// local sync and finalize, or global sync if written to all nodes
+	barrier_wait(barrier, id, d->direct ? BARRIER_GLOBAL : BARRIER_NUMA);
+	if (columns)
+		finalize_columns(count, buf, keys_out, rids_out, payload, partitions, next);
+	else if (d->direct)
+		for (n = 0 ; n != numa ; ++n) {
+			j = n << radix_bits;
+			finalize(&count[j], &buf[j << 4], keys_node[n], rids_node[n],
+			         1 << radix_bits, next);
+		}
+	else
+		finalize(count, buf, keys_out, rids_out, partitions, next);
 	tim = micro_time() - tim;
 	a->part_time[0] = tim;
 	// synchronize globally
 	pthread_barrier_wait(d->sample_barrier);
 	a->numa_shuffle_time = 0;
 	// copy remote partitions
-	if (numa > 1) {
+	if (numa > 1 && !d->direct) {
 		// check numa part sizes
 		uint64_t **transfer = malloc(numa * sizeof(uint64_t*));
 		for (n = 0 ; n != numa ; ++n)
@@ -1265,94 +2155,77 @@ void *sort_thread(void *arg)
 			fprintf(stderr, "NUMA %d is %.2f%% of input\n", numa_node,
 					 numa_size * 100.0 / total_size);
 		assert(numa_size <= max_size);
+		// skip passes over key bits that never vary and count the
+		// first local pass while copying
+		shift_bits = plan_passes(d, pass_bits);
+		next = fuse_passes(&next_hist, d, id, pass_bits, shift_bits, threads_per_numa,
+		                   (numa_size / threads_per_numa) & ~3);
+		counted = next != NULL;
 		tim = micro_time();
-		// compute starting numa offsets
+		// starting offsets of the partitions of this node in the sources
 		uint64_t *numa_offset = calloc(numa, sizeof(uint64_t));
-		uint64_t *numa_part = malloc(numa * sizeof(uint64_t));
 		for (numa_src = 0 ; numa_src != numa ; ++numa_src)
 			for (numa_dst = 0 ; numa_dst != numa_node ; ++numa_dst)
 				numa_offset[numa_src] += transfer[numa_src][numa_dst];
-		// order of copies
-		uint64_t *order_size = malloc(numa * sizeof(uint64_t));
-		int *order = malloc(numa * sizeof(int));
+		// sizes of the partitions of this node in each source
+		int parts = 1 << radix_bits;
+		uint64_t *numa_part = calloc((uint64_t) numa * parts, sizeof(uint64_t));
 		for (n = 0 ; n != numa ; ++n)
-			order[n] = n;
-		// copy one partition at a time
-		uint64_t output_partition_offset = 0;
-		for (i = 0 ; i != (1 << radix_bits) ; ++i) {
-			j = i | (numa_node << radix_bits);
-			// compute size per numa and size for thread to move
-			uint64_t thread_part = 0;
-			uint64_t part_size = 0;
-			for (n = 0 ; n != numa ; ++n) {
-				numa_part[n] = 0;
+			for (i = 0 ; i != parts ; ++i) {
+				j = i | (numa_node << radix_bits);
 				for (t = 0 ; t != threads_per_numa ; ++t)
-					numa_part[n] += d->count[n][t][j];
-				part_size += numa_part[n];
-				thread_part += numa_part[n] / threads_per_numa;
+					numa_part[n * parts + i] += d->count[n][t][j];
 			}
-			// compute output offset
-			uint64_t output_offset = output_partition_offset +
-						 thread_part * numa_local_id;
-			// shuffle numa order
-			rand64_t *gen = rand64_init(seed);
-			for (n = 0 ; n != numa ; ++n) {
-				swap_i(&order[n], &order[rand64_next(gen) % (numa - n) + n]);
-				// compute size
-				uint64_t input_size = numa_part[n] / threads_per_numa;
-				uint64_t input_offset = input_size * numa_local_id;
-				if (numa_local_id + 1 == threads_per_numa)
-					input_size = numa_part[n] - input_offset;
-				order_size[n] = input_size + (!n ? 0 : order_size[n - 1]);
+		// one read stream per source, sources in turn across the links
+		transfer_t *copies = malloc((uint64_t) numa * parts * sizeof(transfer_t));
+		int copy_count = transfer_plan(copies, numa_part, numa_offset, numa, parts,
+		                               numa_node, numa_local_id, threads_per_numa);
+		if (d->pipelined)
+			transfer_signal(&d->planned);
+		uint64_t remote = 0;
+		for (k = 0 ; k != copy_count ; ++k) {
+			n = copies[k].src;
+			uint64_t input_offset = copies[k].from;
+			uint64_t input_size = copies[k].size;
+			uint64_t output_offset = copies[k].to;
+			if (n != numa_node)
+				remote += input_size;
+			// copy keys and rids
+			keys = &d->keys_buf[n][input_offset];
+			keys_out = &d->keys[numa_node][output_offset];
+			shuffle_keys(keys, keys_out, input_size, next, output_offset);
+			if (!key_only) {
+				rids = rids_at(d->rids_buf[n], input_offset, payload);
+				rids_out = rids_at(d->rids[numa_node], output_offset, payload);
+				shuffle_rids(rids, rids_out, input_size, payload);
 			}
-			free(gen);
-			// random numa order
-			for (k = 0 ; k != numa ; ++k) {
-				n = order[k];
-				// compute input offset and size of copy
-				uint64_t input_size = numa_part[n] / threads_per_numa;
-				uint64_t input_offset = input_size * numa_local_id;
-				if (numa_local_id + 1 == threads_per_numa)
-					input_size = numa_part[n] - input_offset;
-				input_offset += numa_offset[n];
-				// re-ordered output offset
-				uint64_t order_output_offset = output_offset +
-							       order_size[n] - input_size;
-				// copy keys and rids
-				keys = &d->keys_buf[n][input_offset];
-				rids = &d->rids_buf[n][input_offset];
-				keys_end = &keys[input_size];
-				rids_end = &rids[input_size];
-				keys_out = &d->keys[numa_node][order_output_offset];
-				rids_out = &d->rids[numa_node][order_output_offset];
-				while (keys != keys_end)
-					_mm_stream_si32((int32_t*) keys_out++, *keys++);
-				while (rids != rids_end)
-					_mm_stream_si32((int32_t*) rids_out++, *rids++);
+			// hand the tuples to their owners and the source back to its node
+			if (d->pipelined) {
+				transfer_arrive(&d->arrived[numa_node * threads_per_numa], threads_per_numa,
+				                (numa_size / threads_per_numa) & ~3, output_offset, input_size);
+				if (copies[k].last)
+					transfer_signal(&d->drained[n]);
 			}
-			output_offset += order_size[numa - 1];
-			// update numa offsets and output offset
-			for (n = 0 ; n != numa ; ++n)
-				numa_offset[n] += numa_part[n];
-			output_partition_offset += part_size;
 		}
+		a->numa_shuffle_bytes = remote * (sizeof(uint32_t) + payload);
 		for (n = 0 ; n != numa ; ++n)
 			free(transfer[n]);
-		free(order);
-		free(order_size);
 		free(transfer);
+		free(copies);
 		free(numa_part);
 		free(numa_offset);
 		tim = micro_time() - tim;
 		a->numa_shuffle_time = tim;
-		// sync globally
-		pthread_barrier_wait(&global_barrier[gb++]);
+		// sync globally, or each thread waits for its tuples
+		if (!d->pipelined)
+			barrier_wait(barrier, id, BARRIER_GLOBAL);
 	}
 	// input and outputs
-	uint32_t **keys_a = numa > 1 ? d->keys : d->keys_buf;
-	uint32_t **rids_a = numa > 1 ? d->rids : d->rids_buf;
-	uint32_t **keys_b = numa > 1 ? d->keys_buf : d->keys;
-	uint32_t **rids_b = numa > 1 ? d->rids_buf : d->rids;
+	int shuffled = numa > 1 && !d->direct;
+	uint32_t **keys_a = shuffled ? d->keys : d->keys_buf;
+	uint32_t **rids_a = shuffled ? d->rids : d->rids_buf;
+	uint32_t **keys_b = shuffled ? d->keys_buf : d->keys;
+	uint32_t **rids_b = shuffled ? d->rids_buf : d->rids;
 	// local partitioning phases
 	size = (numa_size / threads_per_numa) & ~3;
 	offset = size * numa_local_id;
@@ -1361,82 +2234,106 @@ void *sort_thread(void *arg)
 	counts = d->count[numa_node];
 	count = d->count[numa_node][numa_local_id];
 	int pass = 0;
-	int shift_bits = 0;
-	while (d->bits[++pass] != 0) {
+	while (pass_bits[++pass] != 0) {
 		// sync transfer phase
 		if (pass != 1)
-			pthread_barrier_wait(&local_barrier[lb++]);
+			barrier_wait(barrier, id, BARRIER_NUMA);
+		else if (d->pipelined) {
+			// the histograms are free and the tuples of this thread are in
+			transfer_wait(&d->planned, threads);
+			transfer_wait(&d->arrived[numa_node * threads_per_numa + numa_local_id], size);
+		}
 		// start phase
 		keys = &keys_a[numa_node][offset];
-		rids = &rids_a[numa_node][offset];
 		keys_out = keys_b[numa_node];
-		rids_out = rids_b[numa_node];
-		shift_bits += radix_bits;
-		radix_bits = d->bits[pass];
+		if (!key_only) {
+			rids = rids_at(rids_a[numa_node], offset, payload);
+			rids_out = rids_b[numa_node];
+		}
+		radix_bits = pass_bits[pass];
 		partitions = 1 << radix_bits;
 		memset(count, 0, partitions * sizeof(uint64_t));
-		// histogram
+		// histogram, or the sum of the counts for this thread
 		tim = micro_time();
-		histogram(keys, size, count, shift_bits, radix_bits);
+		if (counted) {
+			for (t = 0 ; t != threads ; ++t)
+				if (d->numa_node[t] == numa_node) {
+					uint32_t *c = &d->next_count[t][numa_local_id << radix_bits];
+					for (i = 0 ; i != partitions ; ++i)
+						count[i] += c[i];
+				}
+		} else
+			histogram(keys, size, count, shift_bits, radix_bits, copies, NULL, NULL);
 		tim = micro_time() - tim;
 		a->hist_time[pass] = tim;
 		// sync histogram result
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
+		// the output is a source of the transfer until every thread drained it
+		if (pass == 1 && d->pipelined)
+			transfer_wait(&d->drained[numa_node], threads);
 		// compute offsets and partition
 		tim = micro_time();
 		partition_offsets(counts, partitions, numa_local_id,
 				  threads_per_numa, offsets);
-		partition(keys, rids, size, offsets, count, buf,
-			  keys_out, rids_out, shift_bits, radix_bits);
+		// count the next pass after others read the counts of this one
+		counted = next != NULL && pass_bits[pass + 1] != 0;
+		if (counted) {
+			next->shift_bits = shift_bits + radix_bits;
+			next->radix_bits = pass_bits[pass + 1];
+			memset(next->count, 0, (threads_per_numa << next->radix_bits) * sizeof(uint32_t));
+		}
+		if (columns)
+			partition_columns(keys, rids, payload, size, offsets, count, buf,
+			                  keys_out, rids_out, shift_bits, radix_bits,
+			                  NULL, 1, counted ? next : NULL);
+		else
+			partition(keys, rids, size, offsets, count, buf,
+				  keys_out, rids_out, shift_bits, radix_bits,
+				  counted ? next : NULL);
 		tim = micro_time() - tim;
 		a->part_time[pass] = tim;
 		// sync partitioning across threads
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 		// finalize partitions
-		finalize(count, buf, keys_out, rids_out, partitions);
+		if (columns)
+			finalize_columns(count, buf, keys_out, rids_out, payload, partitions,
+			                 counted ? next : NULL);
+		else
+			finalize(count, buf, keys_out, rids_out, partitions,
+				 counted ? next : NULL);
 		swap_ppi(&keys_a, &keys_b);
 		swap_ppi(&rids_a, &rids_b);
+		shift_bits += radix_bits;
 	}
-	free(buf);
-	free(offsets);
+	if (id == 0)
+		d->passes = pass;
 	if (numa > 1 && !numa_local_id)
 		d->size[numa_node] = numa_size;
-	pthread_exit(NULL);
+	return NULL;
 }
 
 inline uint64_t max(uint64_t x, uint64_t y) { return x > y ? x : y; }
 inline uint64_t min(uint64_t x, uint64_t y) { return x < y ? x : y; }
 
-int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
-         int threads, int numa, int bits, double fudge,
-         uint32_t **keys_buf, uint32_t **rids_buf,
-         char **description, uint64_t *times, int interleaved)
+int lsb_32_sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
+                int threads, int numa, int bits, double fudge,
+                uint32_t **keys_buf, uint32_t **rids_buf, int payload,
+                char **description, uint64_t *times, int interleaved)
 {
 	int i, j, p, t, n, bits_space[4];
 	int bit_passes = distribute_bits(bits, numa, bits_space, 0);
 	int threads_per_numa = threads / numa;
-	pthread_t *id = malloc(threads * sizeof(pthread_t));
-	thread_data_t *data = malloc(threads * sizeof(thread_data_t));
+	thread_data_t *data = calloc(threads, sizeof(thread_data_t));
+	// rids have payload bytes each (no rids sorts the keys alone)
+	assert(rids == NULL || payload == 1 || payload == 2 || payload == 4 || payload == 8);
 	// check aligned input
 	for (i = 0 ; i != numa ; ++i) {
 		assert((15 & (uint64_t) keys[i]) == 0);
-		assert((15 & (uint64_t) rids[i]) == 0);
+		assert(rids == NULL || (15 & (uint64_t) rids[i]) == 0);
 	}
-	// initialize global barriers
-	int local_barriers = 32;
-	int global_barriers = 16;
+	// initialize sample barrier
 	pthread_barrier_t sample_barrier;
-	pthread_barrier_t *global_barrier = malloc(global_barriers * sizeof(pthread_barrier_t));
-	pthread_barrier_t **local_barrier = malloc(numa * sizeof(pthread_barrier_t*));
 	pthread_barrier_init(&sample_barrier, NULL, threads + 1);
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_init(&global_barrier[t], NULL, threads);
-	// initialize local barriers
-	for (n = 0 ; n != numa ; ++n) {
-		local_barrier[n] = malloc(local_barriers * sizeof(pthread_barrier_t));
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_init(&local_barrier[n][t], NULL, threads_per_numa);
-	}
 	// universal meta data
 	global_data_t global;
 	global.numa = numa;
@@ -1450,9 +2347,8 @@ int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	global.size = size;
 	global.keys_buf = keys_buf;
 	global.rids_buf = rids_buf;
+	global.payload = rids == NULL ? 0 : payload;
 	global.interleaved = interleaved;
-	global.global_barrier = global_barrier;
-	global.local_barrier = local_barrier;
 	global.sample_barrier = &sample_barrier;
 	// total array size
 	uint64_t total_size = 0;
@@ -1462,8 +2358,10 @@ int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	if (numa > 1) {
 		global.sample_size = 0.001 * total_size;
 		global.sample_size &= ~15;
-		if (global.sample_size > 100000)
-			global.sample_size = 100000;
+		// as many sampled keys per range past 8 nodes
+		uint64_t max_sample = numa > 8 ? 12500 * numa : 100000;
+		if (global.sample_size > max_sample)
+			global.sample_size = max_sample;
 		global.sample	  = numa_alloc_interleaved(global.sample_size * sizeof(uint32_t));
 		global.sample_buf = numa_alloc_interleaved(global.sample_size * sizeof(uint32_t));
 		global.sample_hist = malloc(threads * sizeof(uint64_t*));
@@ -1474,12 +2372,12 @@ int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	if (keys_buf[0] == NULL)
 		for (n = 0 ; n != numa ; ++n) {
 			assert(keys_buf[n] == NULL);
-			assert(rids_buf[n] == NULL);
+			assert(rids == NULL || rids_buf[n] == NULL);
 		}
 	else
 		for (n = 0 ; n != numa ; ++n) {
 			assert(keys_buf[n] != NULL);
-			assert(rids_buf[n] != NULL);
+			assert(rids == NULL || rids_buf[n] != NULL);
 		}
 	global.allocated = keys_buf[0] != NULL;
 	// counts
@@ -1489,22 +2387,33 @@ int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
 	global.numa_local_count = malloc(threads * sizeof(uint64_t*));
+	global.key_or = malloc(threads * sizeof(uint32_t));
+	global.key_and = malloc(threads * sizeof(uint32_t));
+	global.next_count = malloc(threads * sizeof(uint32_t*));
+	// tuples in per thread, threads done per source node, plans made
+	global.arrived = calloc(threads, sizeof(uint64_t));
+	global.drained = calloc(numa, sizeof(uint64_t));
+	global.planned = 0;
+	// the range-radix pass writes to the nodes directly (no columns)
+	global.direct = numa > 1 && payload == sizeof(uint32_t) && transfer_direct();
+	global.pipelined = numa > 1 && !global.direct && transfer_pipelined();
 	schedule_threads(global.cpu, global.numa_node, threads, numa);
-	// spawn threads
+	global.barrier = barrier_init(threads, global.cpu, global.numa_node, NULL);
+	// start workers
 	for (t = 0 ; t != threads ; ++t) {
 		data[t].id = t;
 		data[t].seed = rand();
 		data[t].global = &global;
-		pthread_create(&id[t], NULL, sort_thread, (void*) &data[t]);
 	}
+	pool_start(threads, threads <= global.max_threads ? global.cpu : NULL,
+	           sort_thread, data, sizeof(thread_data_t));
 	// free sample data
 	pthread_barrier_wait(&sample_barrier);
 	pthread_barrier_destroy(&sample_barrier);
 	numa_free(global.sample,     global.sample_size * sizeof(uint32_t));
 	numa_free(global.sample_buf, global.sample_size * sizeof(uint32_t));
-	// join threads
-	for (t = 0 ; t != threads ; ++t)
-		pthread_join(id[t], NULL);
+	// wait for workers
+	pool_wait();
 	// assemble times
 	uint64_t at = 0, dt = 0, st = 0;
 	uint64_t ht[] = {0, 0, 0, 0};
@@ -1528,25 +2437,26 @@ int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	times[7] = ht[2] / threads; description[7] = "3rd radix histogram time:   ";
 	times[8] = pt[2] / threads; description[8] = "3rd radix partition time:   ";
 	description[9] = NULL;
-	// destroy barriers
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_destroy(&global_barrier[t]);
-	for (n = 0 ; n != numa ; ++n) {
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_destroy(&local_barrier[n][t]);
-		free(local_barrier[n]);
+#ifndef CHIPLETSORT_LIBRARY
+	// data moved between nodes over the time of the slowest copier
+	if (numa > 1 && !global.direct) {
+		uint64_t bytes = 0, slowest = 1;
+		for (t = 0 ; t != threads ; ++t) {
+			bytes += data[t].numa_shuffle_bytes;
+			if (data[t].numa_shuffle_time > slowest)
+				slowest = data[t].numa_shuffle_time;
+		}
+		fprintf(stderr, "Inter-node transfer: %.1f MB at %.2f GB / sec\n",
+		        bytes / (1024.0 * 1024), (bytes * 1000000.0) / (slowest * 1024.0 * 1024 * 1024));
 	}
-	free(local_barrier);
-	free(global_barrier);
+#endif
+	// destroy barrier
+	barrier_destroy(global.barrier);
 	// release memory
-	free(id);
 	free(global.numa_node);
 	free(global.cpu);
-	for (i = 0 ; i != numa ; ++i) {
-		for (j = 0 ; j != threads_per_numa ; ++j)
-			free(global.count[i][j]);
+	for (i = 0 ; i != numa ; ++i)
 		free(global.count[i]);
-	}
 	if (numa > 1) {
 		numa_free(global.sample, global.sample_size * sizeof(uint32_t));
 		numa_free(global.sample_buf, global.sample_size * sizeof(uint32_t));
@@ -1554,12 +2464,20 @@ int sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	for (i = 0 ; i != threads ; ++i)
 		free(global.numa_local_count[i]);
 	free(global.numa_local_count);
+	free(global.key_or);
+	free(global.key_and);
+	free(global.next_count);
+	free(global.arrived);
+	free(global.drained);
 	free(global.count);
 	free(data);
-	if (numa > 1) bit_passes++;
+	bit_passes = global.passes;
+	if (numa > 1 && !global.direct) bit_passes++;
 	return bit_passes & 1;
 }
 
+#ifndef CHIPLETSORT_LIBRARY
+
 void *check_thread(void *arg)
 {
 	thread_data_t *a = (thread_data_t*) arg;
@@ -1586,10 +2504,14 @@ void *check_thread(void *arg)
 		rids =	&d->rids[numa_node][offset];
 	uint32_t *keys_end = &keys[size];
 	uint64_t sum = 0;
-	uint32_t pkey = 0;
+	uint32_t pkey = 0, prid = 0;
 	while (keys != keys_end) {
 		uint32_t key = *keys++;
-		if (rids) assert(key == *rids++);
+		// stable sorts keep equal keys in the order of their rids
+		if (rids && d->stable) {
+			assert(key != pkey || *rids >= prid);
+			prid = *rids++;
+		} else if (rids) assert(key == *rids++);
 		assert(key >= pkey);
 		sum += key;
 		pkey = key;
@@ -1598,7 +2520,7 @@ void *check_thread(void *arg)
 	pthread_exit(NULL);
 }
 
-uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int same_key_payload)
+uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int same_key_payload, int stable)
 {
 	int max_threads = hardware_threads();
 	int n, t, threads = 0;
@@ -1609,7 +2531,8 @@ uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int s
 	global.threads = threads;
 	global.numa = numa;
 	global.keys = keys;
-	global.rids = same_key_payload ? rids : NULL;
+	global.rids = same_key_payload || stable ? rids : NULL;
+	global.stable = stable;
 	global.size = size;
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
@@ -1623,6 +2546,10 @@ uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int s
 	}
 	for (n = 1 ; n != numa ; ++n)
 		assert(keys[n][0] >= keys[n - 1][size[n - 1] - 1]);
+	if (stable)
+		for (n = 1 ; n != numa ; ++n)
+			assert(keys[n][0] != keys[n - 1][size[n - 1] - 1] ||
+			       rids[n][0] >= rids[n - 1][size[n - 1] - 1]);
 	uint64_t checksum = 0;
 	for (t = 0 ; t != threads ; ++t) {
 		pthread_join(id[t], NULL);
@@ -1679,6 +2606,10 @@ int main(int argc, char **argv)
 {
 	int r, i, max_threads = hardware_threads();
 	int max_numa = numa_max_node() + 1;
+	placement_init(&argc, argv, "linear");
+	// equal keys in the order of their rids, which are the input positions
+	const char *stable_option = option(&argc, argv, "stable", "CHIPLET_STABLE");
+	int stable = stable_option != NULL && atoi(stable_option);
 	uint64_t tuples = argc > 1 ? atoi(argv[1]) : 1000;
 	tuples *= 1000000;
 	int threads = argc > 2 ? atoi(argv[2]) : max_threads;
@@ -1686,7 +2617,7 @@ int main(int argc, char **argv)
 	int bits = argc > 4 ? atoi(argv[4]) : 32;
 	int interleaved = argc > 5 ? atoi(argv[5]) : 0;
 	int allocated = argc > 6 ? atoi(argv[6]) : 1;
-	assert(numa > 0 && numa <= 8);
+	assert(numa > 0 && numa <= 64);
 	assert(threads >= numa && threads % numa == 0);
 	assert(bits > 0 && bits <= 32);
 	char *name = NULL;
@@ -1726,6 +2657,8 @@ int main(int argc, char **argv)
 	fprintf(stderr, "Hardware threads: %d (%d per NUMA)\n",
 	        max_threads, max_threads / max_numa);
 	fprintf(stderr, "Threads: %d (%d per NUMA)\n", threads, threads / numa);
+	fprintf(stderr, "Placement: %s\n", placement_name());
+	fprintf(stderr, "SIMD: %s\n", simd_name(simd_level()));
 	fprintf(stderr, "Sorting bits: %d\n", bits);
 	for (i = 0 ; i != numa ; ++i) {
 		size[i] = tuples_per_numa;
@@ -1767,6 +2700,13 @@ int main(int argc, char **argv)
 		init_32(keys_buf, size, cap, threads, numa, 0, 0.0, 0, interleaved);
 		init_32(rids_buf, size, cap, threads, numa, 0, 0.0, 0, interleaved);
 	}
+	if (stable) {
+		uint64_t p, at = 0;
+		for (i = 0 ; i != numa ; ++i)
+			for (p = 0 ; p != size[i] ; ++p)
+				rids[i][p] = at++;
+		same_key_payload = 0;
+	}
 	t = micro_time() - t;
 	fprintf(stderr, "Generation time: %ld us\n", t);
 	fprintf(stderr, "Generation rate: %.1f mrps\n", tuples * 1.0 / t);
@@ -1785,8 +2725,8 @@ int main(int argc, char **argv)
     PerfCounter_startCounters(pc);
 
 	t = micro_time();
-	r = sort(keys, rids, size, threads, numa, bits, fudge,
-	         keys_buf, rids_buf, desc, times, interleaved);
+	r = lsb_32_sort(keys, rids, size, threads, numa, bits, fudge,
+	                keys_buf, rids_buf, sizeof(uint32_t), desc, times, interleaved);
 	t = micro_time() - t;
 
 	PerfCounter_stopCounters(pc);
@@ -1822,7 +2762,7 @@ int main(int argc, char **argv)
 	else fprintf(stderr, "Destination remained the same\n");
 	uint32_t **keys_out = r ? keys_buf : keys;
 	uint32_t **rids_out = r ? rids_buf : rids;
-	uint64_t checksum = check(keys_out, rids_out, size, numa, same_key_payload);
+	uint64_t checksum = check(keys_out, rids_out, size, numa, same_key_payload, stable);
 	assert(checksum == sum_k);
 	// free sort data
 	for (i = 0 ; i != numa ; ++i)
@@ -1846,3 +2786,5 @@ int main(int argc, char **argv)
 	}
 	return EXIT_SUCCESS;
 }
+
+#endif
@@ -49,16 +49,21 @@
 #include <numa.h>
 #undef _GNU_SOURCE
 
-#ifdef AVX
 #include <immintrin.h>
-#else
-#include <smmintrin.h>
-#endif
 
 #include "rand.h"
 #include "util.h"
-
+#include "placement.h"
+#include "barrier.h"
+#include "pool.h"
+#include "simd.h"
+#include "options.h"
+#include "transfer.h"
+#include "sample.h"
+
+#ifndef CHIPLETSORT_LIBRARY
 #include "perf_counter.h"
+#endif
 
 uint64_t micro_time(void)
 {
@@ -111,35 +116,7 @@ void swap_i(int *x, int *y)
 
 void schedule_threads(int *cpu, int *numa_node, int threads, int numa)
 {
-	int max_numa = numa_max_node() + 1;
-	int max_threads = hardware_threads();
-	int max_threads_per_numa = max_threads / max_numa;
-	int t, threads_per_numa = threads / numa;
-	assert(numa > 0 && threads >= numa && threads % numa == 0);
-	if (numa > max_numa ||
-	    threads > max_threads ||
-	    threads_per_numa > max_threads_per_numa)
-		for (t = 0 ; t != threads ; ++t) {
-			cpu[t] = t;
-			numa_node[t] = t / threads_per_numa;
-		}
-	else {
-		int *thread_numa = malloc(max_threads * sizeof(int));
-		for (t = 0 ; t != max_threads ; ++t)
-			thread_numa[t] = numa_node_of_cpu(t);
-		for (t = 0 ; t != threads ; ++t) {
-			int i, n = t % numa;
-			for (i = 0 ; i != max_threads ; ++i)
-				if (thread_numa[i] == n) break;
-			assert(i != max_threads);
-			thread_numa[i] = -1;
-			cpu[t] = i;
-			if (numa_node != NULL)
-				numa_node[t] = n;
-			assert(numa_node_of_cpu(i) == n);
-		}
-		free(thread_numa);
-	}
+	placement_schedule(cpu, numa_node, threads, numa);
 }
 
 inline uint64_t mulhi(uint64_t x, uint64_t y)
@@ -171,7 +148,7 @@ int distribute_bits(int bits, int numa, int pass[], int print)
 	int numa_bits = ceil_log_2(numa);
 	int end_bits = numa_bits > 0 ? 1 : 0;
 	int total_bits = bits + numa_bits;
-	int limit[] = {12, 23, 34, 45, 56, 67};
+	int limit[] = {12, 23, 34, 45, 56, 67, 78};
 	// int limit[] = {15, 29, 43, 57, 71};
 	// determine how many passes to do
 	int p, passes = 0;
@@ -197,9 +174,36 @@ int distribute_bits(int bits, int numa, int pass[], int print)
 	return passes;
 }
 
+// re-plan the passes after the first on the bits that vary across keys
+// the first pass keeps its bits, returns the shift of the second pass
+int replan_bits(uint64_t varying, const int bits[], int pass[])
+{
+	int p, passes, max_bits = 0;
+	int low = bits[0], high = bits[0];
+	for (p = 1 ; bits[p] != 0 ; ++p) {
+		if (bits[p] > max_bits)
+			max_bits = bits[p];
+		high += bits[p];
+	}
+	// trim the constant low and high bits
+	while (low < high && !(varying & (((uint64_t) 1) << low)))
+		low++;
+	while (high > low && !(varying & (((uint64_t) 1) << (high - 1))))
+		high--;
+	passes = low == high ? 0 : ceil_div(high - low, max_bits);
+	int rem_bits = high - low;
+	pass[0] = bits[0];
+	for (p = 1 ; p <= passes ; ++p) {
+		pass[p] = ceil_div(rem_bits, passes - p + 1);
+		rem_bits -= pass[p];
+	}
+	pass[p] = 0;
+	return low;
+}
+
 void partition_keys(uint64_t *keys, uint64_t *keys_out, uint64_t size,
                     uint64_t **hist, uint8_t shift_bits, uint8_t radix_bits,
-                    int thread_id, int threads, pthread_barrier_t *barrier)
+                    int thread_id, int threads, barrier_t *barrier)
 {
 	// inputs and outputs must be aligned
 	assert(0 == (15 & (size_t) keys));
@@ -233,7 +237,7 @@ void partition_keys(uint64_t *keys, uint64_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete histogram generation
-	pthread_barrier_wait(&barrier[0]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// initialize buffer
 	uint64_t *buf = mamalloc((partitions << 3) * sizeof(uint64_t));
 	for (i = p = 0 ; p != partitions ; ++p) {
@@ -286,7 +290,7 @@ void partition_keys(uint64_t *keys, uint64_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete main partition part
-	pthread_barrier_wait(&barrier[1]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// flush remaining items from buffers to output
 	for (p = 0 ; p != partitions ; ++p) {
 		uint64_t *src = &buf[p << 3];
@@ -300,13 +304,74 @@ void partition_keys(uint64_t *keys, uint64_t *keys_out, uint64_t size,
 			_mm_stream_si64((long long *) &keys_out[index++], src[offset++]);
 	}
 	// wait all threads to complete last partition part
-	pthread_barrier_wait(&barrier[2]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	free(buf);
 }
 
+// store the OR and the AND of all keys seen by a histogram
+void key_bits(__m128i k_or, __m128i k_and, uint64_t or_bits, uint64_t and_bits,
+              uint64_t *key_or, uint64_t *key_and)
+{
+	int i;
+	uint64_t v_or[2], v_and[2];
+	if (key_or == NULL) return;
+	_mm_storeu_si128((__m128i*) v_or, k_or);
+	_mm_storeu_si128((__m128i*) v_and, k_and);
+	for (i = 0 ; i != 2 ; ++i) {
+		or_bits |= v_or[i];
+		and_bits &= v_and[i];
+	}
+	*key_or = or_bits;
+	*key_and = and_bits;
+}
+
+// replicated counters for skewed input: lane j of a vector counts in
+// copy j % copies, the copies follow the histogram and are folded into it
+__m128i copy_lanes(int copies, uint64_t partitions)
+{
+	__m128i j = _mm_and_si128(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32(copies - 1));
+	return _mm_mullo_epi32(j, _mm_set1_epi32(partitions));
+}
+
+void clear_copies(uint64_t *count, uint64_t partitions, int copies)
+{
+	memset(&count[partitions], 0, (copies - 1) * partitions * sizeof(uint64_t));
+}
+
+void fold_copies(uint64_t *count, uint64_t partitions, int copies)
+{
+	uint64_t i; int j;
+	for (j = 1 ; j < copies ; ++j)
+		for (i = 0 ; i != partitions ; ++i)
+			count[i] += count[j * partitions + i];
+}
+
+// range of the node of a key, the number of delimiters below it by a
+// branchless binary search (delim[] has the upper bound of all ranges
+// but the last, in order)
+static inline int numa_range(uint64_t key, const uint64_t *delim, int ranges)
+{
+	const uint64_t *base = delim;
+	int n = ranges - 1;
+	while (n > 1) {
+		int half = n >> 1;
+		base = key > base[half - 1] ? &base[half] : base;
+		n -= half;
+	}
+	return (base - delim) + (n == 1 && key > base[0]);
+}
+
 void histogram_numa_2(uint64_t *keys, uint64_t size, uint64_t *count,
-                      uint8_t radix_bits, uint64_t delim[])
+                      uint8_t radix_bits, uint64_t delim[],
+                      int copies, uint64_t *key_or, uint64_t *key_and)
 {
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 2) << radix_bits;
+	__m128i lanes = copy_lanes(copies, copy_size);
+	clear_copies(count, copy_size, copies);
+	__m128i k_or = _mm_setzero_si128();
+	__m128i k_and = _mm_set1_epi64x(-1);
+	uint64_t or_bits = 0, and_bits = ~0;
 	assert(radix_bits <= 16);
 	uint64_t convert = ((uint64_t) 1) << 63;
 	__m128i s = _mm_set_epi32(0, 0, 0, radix_bits);
@@ -317,8 +382,11 @@ void histogram_numa_2(uint64_t *keys, uint64_t size, uint64_t *count,
 	// check for unaligned keys
 	uint64_t p = 0; i = 0;
 	uint64_t unaligned_keys[4];
-	while ((15 & ((uint64_t) keys)) && i != size)
+	while ((15 & ((uint64_t) keys)) && i != size) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	uint64_t *keys_aligned_end = &keys[(size - i) & ~3];
 	uint64_t *keys_end = &keys[size - i];
 	if (i) {
@@ -330,6 +398,8 @@ void histogram_numa_2(uint64_t *keys, uint64_t size, uint64_t *count,
 		k12 = _mm_load_si128((__m128i*) &keys[0]);
 		k34 = _mm_load_si128((__m128i*) &keys[2]);
 		keys += 4; i = 4;
+		k_or = _mm_or_si128(k_or, _mm_or_si128(k12, k34));
+		k_and = _mm_and_si128(k_and, _mm_and_si128(k12, k34));
 		unaligned_intro:;
 		__m128i h12 = _mm_and_si128(k12, m);
 		__m128i h34 = _mm_and_si128(k34, m);
@@ -343,6 +413,7 @@ void histogram_numa_2(uint64_t *keys, uint64_t size, uint64_t *count,
 		r = _mm_sub_epi32(r, e);
 		r = _mm_sll_epi32(r, s);
 		h = _mm_or_si128(h, r);
+		h = _mm_add_epi32(h, lanes);
 		do {
 			asm("movd	%1, %%eax" : "=a"(p) : "x"(h), "0"(p));
 			count[p]++;
@@ -351,14 +422,19 @@ void histogram_numa_2(uint64_t *keys, uint64_t size, uint64_t *count,
 	}
 	// histogram last 0-3 unaligned items
 	i = 0; p = 0;
-	while (keys != keys_end)
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	if (i) {
 		k12 = _mm_loadu_si128((__m128i*) &unaligned_keys[0]);
 		k34 = _mm_loadu_si128((__m128i*) &unaligned_keys[2]);
 		keys_aligned_end = keys_end;
 		goto unaligned_intro;
 	}
+	fold_copies(count, copy_size, copies);
+	key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
 }
 
 void partition_numa_2(uint64_t *keys, uint64_t *rids, uint64_t size,
@@ -508,8 +584,16 @@ void partition_numa_2(uint64_t *keys, uint64_t *rids, uint64_t size,
 }
 
 void histogram_numa_4(uint64_t *keys, uint64_t size, uint64_t *count,
-                      uint8_t radix_bits, uint64_t delim[])
+                      uint8_t radix_bits, uint64_t delim[],
+                      int copies, uint64_t *key_or, uint64_t *key_and)
 {
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 4) << radix_bits;
+	__m128i lanes = copy_lanes(copies, copy_size);
+	clear_copies(count, copy_size, copies);
+	__m128i k_or = _mm_setzero_si128();
+	__m128i k_and = _mm_set1_epi64x(-1);
+	uint64_t or_bits = 0, and_bits = ~0;
 	assert(radix_bits <= 16);
 	uint64_t convert = ((uint64_t) 1) << 63;
 	__m128i s = _mm_set_epi32(0, 0, 0, radix_bits);
@@ -522,8 +606,11 @@ void histogram_numa_4(uint64_t *keys, uint64_t size, uint64_t *count,
 	// check for unaligned keys
 	uint64_t p = 0; i = 0;
 	uint64_t unaligned_keys[4];
-	while ((15 & ((uint64_t) keys)) && i != size)
+	while ((15 & ((uint64_t) keys)) && i != size) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	uint64_t *keys_aligned_end = &keys[(size - i) & ~3];
 	uint64_t *keys_end = &keys[size - i];
 	if (i) {
@@ -535,6 +622,8 @@ void histogram_numa_4(uint64_t *keys, uint64_t size, uint64_t *count,
 		k12 = _mm_load_si128((__m128i*) &keys[0]);
 		k34 = _mm_load_si128((__m128i*) &keys[2]);
 		keys += 4; i = 4;
+		k_or = _mm_or_si128(k_or, _mm_or_si128(k12, k34));
+		k_and = _mm_and_si128(k_and, _mm_and_si128(k12, k34));
 		unaligned_intro:;
 		__m128i h12 = _mm_and_si128(k12, m);
 		__m128i h34 = _mm_and_si128(k34, m);
@@ -555,6 +644,7 @@ void histogram_numa_4(uint64_t *keys, uint64_t size, uint64_t *count,
 		r = _mm_sub_epi32(r, e2);
 		r = _mm_sll_epi32(r, s);
 		h = _mm_or_si128(h, r);
+		h = _mm_add_epi32(h, lanes);
 		do {
 			asm("movd	%1, %%eax" : "=a"(p) : "x"(h), "0"(p));
 			count[p]++;
@@ -563,14 +653,19 @@ void histogram_numa_4(uint64_t *keys, uint64_t size, uint64_t *count,
 	}
 	// histogram last 0-3 unaligned items
 	i = 0; p = 0;
-	while (keys != keys_end)
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	if (i) {
 		k12 = _mm_loadu_si128((__m128i*) &unaligned_keys[0]);
 		k34 = _mm_loadu_si128((__m128i*) &unaligned_keys[2]);
 		keys_aligned_end = keys_end;
 		goto unaligned_intro;
 	}
+	fold_copies(count, copy_size, copies);
+	key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
 }
 
 void partition_numa_4(uint64_t *keys, uint64_t *rids, uint64_t size,
@@ -729,8 +824,16 @@ void partition_numa_4(uint64_t *keys, uint64_t *rids, uint64_t size,
 }
 
 void histogram_numa_8(uint64_t *keys, uint64_t size, uint64_t *count,
-                      uint8_t radix_bits, uint64_t delim[])
+                      uint8_t radix_bits, uint64_t delim[],
+                      int copies, uint64_t *key_or, uint64_t *key_and)
 {
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 8) << radix_bits;
+	__m128i lanes = copy_lanes(copies, copy_size);
+	clear_copies(count, copy_size, copies);
+	__m128i k_or = _mm_setzero_si128();
+	__m128i k_and = _mm_set1_epi64x(-1);
+	uint64_t or_bits = 0, and_bits = ~0;
 	assert(radix_bits <= 16);
 	uint64_t convert = ((uint64_t) 1) << 63;
 	__m128i s = _mm_set_epi32(0, 0, 0, radix_bits);
@@ -747,8 +850,11 @@ void histogram_numa_8(uint64_t *keys, uint64_t size, uint64_t *count,
 	// check for unaligned keys
 	uint64_t p = 0; i = 0;
 	uint64_t unaligned_keys[4];
-	while ((15 & ((uint64_t) keys)) && i != size)
+	while ((15 & ((uint64_t) keys)) && i != size) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	uint64_t *keys_aligned_end = &keys[(size - i) & ~3];
 	uint64_t *keys_end = &keys[size - i];
 	if (i) {
@@ -760,6 +866,8 @@ void histogram_numa_8(uint64_t *keys, uint64_t size, uint64_t *count,
 		k12 = _mm_load_si128((__m128i*) &keys[0]);
 		k34 = _mm_load_si128((__m128i*) &keys[2]);
 		keys += 4; i = 4;
+		k_or = _mm_or_si128(k_or, _mm_or_si128(k12, k34));
+		k_and = _mm_and_si128(k_and, _mm_and_si128(k12, k34));
 		unaligned_intro:;
 		__m128i h12 = _mm_and_si128(k12, m);
 		__m128i h34 = _mm_and_si128(k34, m);
@@ -791,6 +899,7 @@ void histogram_numa_8(uint64_t *keys, uint64_t size, uint64_t *count,
 		r = _mm_sub_epi32(r, e3);
 		r = _mm_sll_epi32(r, s);
 		h = _mm_or_si128(h, r);
+		h = _mm_add_epi32(h, lanes);
 		do {
 			asm("movd	%1, %%eax" : "=a"(p) : "x"(h), "0"(p));
 			count[p]++;
@@ -799,14 +908,19 @@ void histogram_numa_8(uint64_t *keys, uint64_t size, uint64_t *count,
 	}
 	// histogram last 0-3 unaligned items
 	i = 0; p = 0;
-	while (keys != keys_end)
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	if (i) {
 		k12 = _mm_loadu_si128((__m128i*) &unaligned_keys[0]);
 		k34 = _mm_loadu_si128((__m128i*) &unaligned_keys[2]);
 		keys_aligned_end = keys_end;
 		goto unaligned_intro;
 	}
+	fold_copies(count, copy_size, copies);
+	key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
 }
 
 void partition_numa_8(uint64_t *keys, uint64_t *rids, uint64_t size,
@@ -979,9 +1093,99 @@ void partition_numa_8(uint64_t *keys, uint64_t *rids, uint64_t size,
 #endif
 }
 
-void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
-	       uint8_t shift_bits, uint8_t radix_bits)
+// any number of ranges up to 64 (nodes other than 2, 4 and 8), each
+// split exactly at its delimiter instead of rounded up to a power of two
+void histogram_numa_n(uint64_t *keys, uint64_t size, uint64_t *count,
+                      uint8_t radix_bits, uint64_t delim[], int ranges,
+                      int copies, uint64_t *key_or, uint64_t *key_and)
 {
+	// item i counts in copy i % copies
+	uint64_t copy_size = ((uint64_t) ranges) << radix_bits;
+	clear_copies(count, copy_size, copies);
+	uint64_t mask = (1 << radix_bits) - 1;
+	uint64_t or_bits = 0, and_bits = ~0;
+	uint64_t i;
+	for (i = 0 ; i != size ; ++i) {
+		uint64_t key = keys[i];
+		or_bits |= key;
+		and_bits &= key;
+		uint64_t p = ((uint64_t) numa_range(key, delim, ranges) << radix_bits) | (key & mask);
+		count[(i & (copies - 1)) * copy_size + p]++;
+	}
+	fold_copies(count, copy_size, copies);
+	key_bits(_mm_setzero_si128(), _mm_set1_epi32(-1), or_bits, and_bits, key_or, key_and);
+}
+
+// stream a full buffer of 8 key / rid pairs as two cache lines
+void flush_sse(uint64_t *src, uint64_t *keys_out, uint64_t *rids_out)
+{
+	__m128i r0 = _mm_load_si128((__m128i*) &src[0]);
+	__m128i r1 = _mm_load_si128((__m128i*) &src[2]);
+	__m128i r2 = _mm_load_si128((__m128i*) &src[4]);
+	__m128i r3 = _mm_load_si128((__m128i*) &src[6]);
+	__m128i r4 = _mm_load_si128((__m128i*) &src[8]);
+	__m128i r5 = _mm_load_si128((__m128i*) &src[10]);
+	__m128i r6 = _mm_load_si128((__m128i*) &src[12]);
+	__m128i r7 = _mm_load_si128((__m128i*) &src[14]);
+	_mm_stream_si128((__m128i*) &keys_out[0], _mm_unpacklo_epi64(r0, r1));
+	_mm_stream_si128((__m128i*) &keys_out[2], _mm_unpacklo_epi64(r2, r3));
+	_mm_stream_si128((__m128i*) &keys_out[4], _mm_unpacklo_epi64(r4, r5));
+	_mm_stream_si128((__m128i*) &keys_out[6], _mm_unpacklo_epi64(r6, r7));
+	_mm_stream_si128((__m128i*) &rids_out[0], _mm_unpackhi_epi64(r0, r1));
+	_mm_stream_si128((__m128i*) &rids_out[2], _mm_unpackhi_epi64(r2, r3));
+	_mm_stream_si128((__m128i*) &rids_out[4], _mm_unpackhi_epi64(r4, r5));
+	_mm_stream_si128((__m128i*) &rids_out[6], _mm_unpackhi_epi64(r6, r7));
+}
+
+void partition_numa_n(uint64_t *keys, uint64_t *rids, uint64_t size,
+                      uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                      uint64_t *keys_out, uint64_t *rids_out,
+                      uint8_t radix_bits, uint64_t delim[], int ranges)
+{
+	assert((63 & (uint64_t) keys_out) == 0);
+	assert((63 & (uint64_t) rids_out) == 0);
+	int r, partitions = ranges << radix_bits;
+	// initialize buffers (index counts 32-bit words)
+	for (r = 0 ; r != partitions ; ++r)
+		buf[(r << 4) | 14] = offsets[r] << 1;
+	uint64_t mask = (1 << radix_bits) - 1;
+	uint64_t i;
+	for (i = 0 ; i != size ; ++i) {
+		uint64_t key = keys[i];
+		uint64_t p = ((uint64_t) numa_range(key, delim, ranges) << radix_bits) | (key & mask);
+		// offset in the cache line pair
+		uint64_t *src = &buf[p << 4];
+		uint64_t index = src[14];
+		src[14] = index + 2;
+		uint64_t offset = index & 15;
+		src[offset] = key;
+		src[offset + 1] = rids[i];
+		if (offset == 14) {
+			flush_sse(src, &keys_out[(index - 14) >> 1], &rids_out[(index - 14) >> 1]);
+			// restore overwritten pointer
+			src[14] = index + 2;
+		}
+	}
+#ifdef BG
+	// check partition sanity
+	for (r = 0 ; r != partitions ; ++r) {
+		uint64_t index = buf[(r << 4) | 14] >> 1;
+		assert(index - offsets[r] == sizes[r]);
+	}
+#endif
+}
+
+void histogram_sse(uint64_t *keys, uint64_t size, uint64_t *count,
+	           uint8_t shift_bits, uint8_t radix_bits,
+	           int copies, uint64_t *key_or, uint64_t *key_and)
+{
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 1) << radix_bits;
+	__m128i lanes = copy_lanes(copies, copy_size);
+	clear_copies(count, copy_size, copies);
+	__m128i k_or = _mm_setzero_si128();
+	__m128i k_and = _mm_set1_epi64x(-1);
+	uint64_t or_bits = 0, and_bits = ~0;
 	assert(radix_bits <= 16);
 	__m128i s = _mm_set_epi32(0, 0, 0, shift_bits);
 	__m128i m = _mm_set1_epi64x((1 << radix_bits) - 1);
@@ -989,8 +1193,11 @@ void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
 	// check for unaligned keys
 	uint64_t p = 0; i = 0;
 	uint64_t unaligned_keys[4];
-	while ((15 & ((uint64_t) keys)) && i != size)
+	while ((15 & ((uint64_t) keys)) && i != size) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	uint64_t *keys_aligned_end = &keys[(size - i) & ~3];
 	uint64_t *keys_end = &keys[size - i];
 	if (i) {
@@ -1002,12 +1209,15 @@ void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
 		k12 = _mm_load_si128((__m128i*) &keys[0]);
 		k34 = _mm_load_si128((__m128i*) &keys[2]);
 		keys += 4; i = 4;
+		k_or = _mm_or_si128(k_or, _mm_or_si128(k12, k34));
+		k_and = _mm_and_si128(k_and, _mm_and_si128(k12, k34));
 		unaligned_intro:;
 		__m128i h12 = _mm_srl_epi64(k12, s);
 		__m128i h34 = _mm_srl_epi64(k34, s);
 		h12 = _mm_and_si128(h12, m);
 		h34 = _mm_and_si128(h34, m);
 		__m128i h = _mm_packus_epi32(h12, h34);
+		h = _mm_add_epi32(h, lanes);
 		do {
 			asm("movd	%1, %%eax" : "=a"(p) : "x"(h), "0"(p));
 			count[p]++;
@@ -1016,14 +1226,150 @@ void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
 	}
 	// histogram last 0-3 unaligned items
 	i = 0; p = 0;
-	while (keys != keys_end)
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
 		unaligned_keys[i++] = *keys++;
+	}
 	if (i) {
 		k12 = _mm_loadu_si128((__m128i*) &unaligned_keys[0]);
 		k34 = _mm_loadu_si128((__m128i*) &unaligned_keys[2]);
 		keys_aligned_end = keys_end;
 		goto unaligned_intro;
 	}
+	fold_copies(count, copy_size, copies);
+	key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
+}
+
+__attribute__((target("avx2")))
+void histogram_avx2(uint64_t *keys, uint64_t size, uint64_t *count,
+                    uint8_t shift_bits, uint8_t radix_bits,
+                    int copies, uint64_t *key_or, uint64_t *key_and)
+{
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 1) << radix_bits;
+	__m256i lanes = _mm256_mul_epu32(_mm256_and_si256(_mm256_set_epi64x(3, 2, 1, 0),
+	                                 _mm256_set1_epi64x(copies - 1)), _mm256_set1_epi64x(copy_size));
+	clear_copies(count, copy_size, copies);
+	__m256i k_or = _mm256_setzero_si256();
+	__m256i k_and = _mm256_set1_epi64x(-1);
+	uint64_t or_bits = 0, and_bits = ~0;
+	uint64_t *keys_end = &keys[size];
+	uint64_t partitions = 1 << radix_bits;
+	uint64_t h[4] __attribute__((aligned(32)));
+	while ((31 & ((uint64_t) keys)) && keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	__m256i m = _mm256_set1_epi64x(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint64_t *keys_aligned_end = &keys[(keys_end - keys) & ~7];
+	while (keys != keys_aligned_end) {
+		__m256i k1 = _mm256_load_si256((__m256i*) &keys[0]);
+		__m256i k2 = _mm256_load_si256((__m256i*) &keys[4]);
+		keys += 8;
+		k_or = _mm256_or_si256(k_or, _mm256_or_si256(k1, k2));
+		k_and = _mm256_and_si256(k_and, _mm256_and_si256(k1, k2));
+		k1 = _mm256_and_si256(_mm256_srl_epi64(k1, s), m);
+		k2 = _mm256_and_si256(_mm256_srl_epi64(k2, s), m);
+		k1 = _mm256_add_epi64(k1, lanes);
+		k2 = _mm256_add_epi64(k2, lanes);
+		_mm256_store_si256((__m256i*) h, k1);
+		count[h[0]]++;
+		count[h[1]]++;
+		count[h[2]]++;
+		count[h[3]]++;
+		_mm256_store_si256((__m256i*) h, k2);
+		count[h[0]]++;
+		count[h[1]]++;
+		count[h[2]]++;
+		count[h[3]]++;
+	}
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	__m128i lo_or  = _mm256_castsi256_si128(k_or);
+	__m128i hi_or  = _mm256_extracti128_si256(k_or, 1);
+	__m128i lo_and = _mm256_castsi256_si128(k_and);
+	__m128i hi_and = _mm256_extracti128_si256(k_and, 1);
+	fold_copies(count, copy_size, copies);
+	key_bits(_mm_or_si128(lo_or, hi_or), _mm_and_si128(lo_and, hi_and),
+	         or_bits, and_bits, key_or, key_and);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void histogram_avx512(uint64_t *keys, uint64_t size, uint64_t *count,
+                      uint8_t shift_bits, uint8_t radix_bits,
+                      int copies, uint64_t *key_or, uint64_t *key_and)
+{
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 1) << radix_bits;
+	__m512i lanes = _mm512_mul_epu32(_mm512_and_si512(_mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0),
+	                                 _mm512_set1_epi64(copies - 1)), _mm512_set1_epi64(copy_size));
+	clear_copies(count, copy_size, copies);
+	__m512i k_or = _mm512_setzero_si512();
+	__m512i k_and = _mm512_set1_epi64(-1);
+	uint64_t or_bits = 0, and_bits = ~0;
+	uint64_t *keys_end = &keys[size];
+	uint64_t partitions = 1 << radix_bits;
+	uint32_t h[16] __attribute__((aligned(64)));
+	int i;
+	while ((63 & ((uint64_t) keys)) && keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	__m512i m = _mm512_set1_epi64(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint64_t *keys_aligned_end = &keys[(keys_end - keys) & ~15];
+	while (keys != keys_aligned_end) {
+		__m512i k1 = _mm512_load_si512(&keys[0]);
+		__m512i k2 = _mm512_load_si512(&keys[8]);
+		keys += 16;
+		k_or = _mm512_or_si512(k_or, _mm512_or_si512(k1, k2));
+		k_and = _mm512_and_si512(k_and, _mm512_and_si512(k1, k2));
+		k1 = _mm512_and_si512(_mm512_srl_epi64(k1, s), m);
+		k2 = _mm512_and_si512(_mm512_srl_epi64(k2, s), m);
+		k1 = _mm512_add_epi64(k1, lanes);
+		k2 = _mm512_add_epi64(k2, lanes);
+		// narrow the 16 partitions to one register
+		_mm256_store_si256((__m256i*) &h[0], _mm512_cvtepi64_epi32(k1));
+		_mm256_store_si256((__m256i*) &h[8], _mm512_cvtepi64_epi32(k2));
+		for (i = 0 ; i != 16 ; ++i)
+			count[h[i]]++;
+	}
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	// fold the 512-bit masks to 128 bits
+	__m256i or_256  = _mm256_or_si256(_mm512_castsi512_si256(k_or),
+	                                  _mm512_extracti64x4_epi64(k_or, 1));
+	__m256i and_256 = _mm256_and_si256(_mm512_castsi512_si256(k_and),
+	                                   _mm512_extracti64x4_epi64(k_and, 1));
+	fold_copies(count, copy_size, copies);
+	key_bits(_mm_or_si128(_mm256_castsi256_si128(or_256),
+	                      _mm256_extracti128_si256(or_256, 1)),
+	         _mm_and_si128(_mm256_castsi256_si128(and_256),
+	                       _mm256_extracti128_si256(and_256, 1)),
+	         or_bits, and_bits, key_or, key_and);
+}
+
+void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
+               uint8_t shift_bits, uint8_t radix_bits,
+               int copies, uint64_t *key_or, uint64_t *key_and)
+{
+	int level = simd_level();
+	if (level == SIMD_AVX512)
+		histogram_avx512(keys, size, count, shift_bits, radix_bits, copies, key_or, key_and);
+	else if (level == SIMD_AVX2)
+		histogram_avx2(keys, size, count, shift_bits, radix_bits, copies, key_or, key_and);
+	else
+		histogram_sse(keys, size, count, shift_bits, radix_bits, copies, key_or, key_and);
 }
 
 void partition_offsets(uint64_t **count, int partitions, int id,
@@ -1039,10 +1385,89 @@ void partition_offsets(uint64_t **count, int partitions, int id,
 	}
 }
 
-void partition(uint64_t *keys, uint64_t *rids, uint64_t size,
-	       uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
-	       uint64_t *keys_out, uint64_t *rids_out,
-	       uint8_t shift_bits, uint8_t radix_bits)
+// fused histogram of the next pass: partition() and finalize() count the
+// next digit of the tuples they output for the thread (owner) that reads
+// that output position in the next pass, a line is counted as it flushes
+#define FUSED_COUNT_LIMIT	(1 << 18)
+
+typedef struct {
+	uint32_t *count;
+	uint64_t base;
+	uint64_t chunk;
+	uint64_t owners;
+	uint8_t shift_bits;
+	uint8_t radix_bits;
+} next_hist_t;
+
+// count the next digit of the buffered tuples at output positions [lo, hi]
+void next_count(const next_hist_t *next, const uint64_t *src, uint64_t lo, uint64_t hi)
+{
+	uint32_t shift = next->shift_bits;
+	uint64_t mask = (1 << next->radix_bits) - 1;
+	uint64_t owner = (lo - next->base) / next->chunk;
+	uint64_t end = next->base + (owner + 1) * next->chunk;
+	// the last owner also reads the remainder
+	if (owner >= next->owners - 1) {
+		owner = next->owners - 1;
+		end = ~0;
+	}
+	uint32_t *count = &next->count[owner << next->radix_bits];
+	if (hi < end)
+		for (; lo <= hi ; ++lo)
+			count[(src[(lo & 7) << 1] >> shift) & mask]++;
+	else
+		for (; lo <= hi ; ++lo) {
+			if (lo == end) {
+				count += mask + 1;
+				end = ++owner == next->owners - 1 ? ~ (uint64_t) 0 : end + next->chunk;
+			}
+			count[(src[(lo & 7) << 1] >> shift) & mask]++;
+		}
+}
+// keys copied at a time while counting, the copy leaves them in cache
+#define SHUFFLE_BLOCK	1024
+
+// copy keys to output positions [index, index + size) of the NUMA shuffle
+// and count the digit of the first local pass for their owners
+void shuffle_keys(const uint64_t *keys, uint64_t *keys_out, uint64_t size,
+                  const next_hist_t *next, uint64_t index)
+{
+	const uint64_t *keys_end = &keys[size];
+	if (next == NULL) {
+		transfer_copy(keys_out, keys, size * sizeof(uint64_t));
+		return;
+	}
+	uint32_t shift = next->shift_bits;
+	uint64_t mask = (1 << next->radix_bits) - 1;
+	while (keys != keys_end) {
+		// block of keys up to the end of the owner of this position
+		uint64_t owner = (index - next->base) / next->chunk;
+		uint64_t end = next->base + (owner + 1) * next->chunk;
+		if (owner >= next->owners - 1) {
+			owner = next->owners - 1;
+			end = ~0;
+		}
+		uint32_t *count = &next->count[owner << next->radix_bits];
+		uint64_t run = keys_end - keys;
+		if (end - index < run)
+			run = end - index;
+		if (run > SHUFFLE_BLOCK)
+			run = SHUFFLE_BLOCK;
+		transfer_copy(keys_out, keys, run * sizeof(uint64_t));
+		const uint64_t *run_end = &keys[run];
+		keys_out += run;
+		index += run;
+		while (keys != run_end)
+			count[(*keys++ >> shift) & mask]++;
+	}
+}
+
+
+void partition_sse(uint64_t *keys, uint64_t *rids, uint64_t size,
+	           uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+	           uint64_t *keys_out, uint64_t *rids_out,
+	           uint8_t shift_bits, uint8_t radix_bits,
+	           const next_hist_t *next)
 {
 	assert((63 & (uint64_t) keys_out) == 0);
 	assert((63 & (uint64_t) rids_out) == 0);
@@ -1141,6 +1566,11 @@ void partition(uint64_t *keys, uint64_t *rids, uint64_t size,
 				_mm_stream_si128((__m128i*) &dest_y[4], y1);
 				_mm_stream_si128((__m128i*) &dest_y[8], y2);
 				_mm_stream_si128((__m128i*) &dest_y[12],y3);
+				// count the next digit of the tuples of this thread
+				if (next != NULL) {
+					uint64_t first = offsets[p >> 4], lo = (index - 14) >> 1;
+					next_count(next, src, lo < first ? first : lo, index >> 1);
+				}
 				// restore overwritten pointer
 				src[14] = index + 2;
 			}
@@ -1175,8 +1605,160 @@ void partition(uint64_t *keys, uint64_t *rids, uint64_t size,
 #endif
 }
 
+// stream a full buffer of 8 key / rid pairs as two cache lines
+__attribute__((target("avx2")))
+void flush_avx2(uint64_t *src, uint64_t *keys_out, uint64_t *rids_out)
+{
+	__m256i r0 = _mm256_load_si256((__m256i*) &src[0]);
+	__m256i r1 = _mm256_load_si256((__m256i*) &src[4]);
+	__m256i r2 = _mm256_load_si256((__m256i*) &src[8]);
+	__m256i r3 = _mm256_load_si256((__m256i*) &src[12]);
+	// split columns within lanes and fix the lane order
+	__m256i x0 = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(r0, r1), _MM_SHUFFLE(3, 1, 2, 0));
+	__m256i x1 = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(r2, r3), _MM_SHUFFLE(3, 1, 2, 0));
+	__m256i y0 = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(r0, r1), _MM_SHUFFLE(3, 1, 2, 0));
+	__m256i y1 = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(r2, r3), _MM_SHUFFLE(3, 1, 2, 0));
+	_mm256_stream_si256((__m256i*) &keys_out[0], x0);
+	_mm256_stream_si256((__m256i*) &keys_out[4], x1);
+	_mm256_stream_si256((__m256i*) &rids_out[0], y0);
+	_mm256_stream_si256((__m256i*) &rids_out[4], y1);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void flush_avx512(uint64_t *src, uint64_t *keys_out, uint64_t *rids_out)
+{
+	__m512i r0 = _mm512_load_si512(&src[0]);
+	__m512i r1 = _mm512_load_si512(&src[8]);
+	__m512i even = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+	__m512i odd  = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+	// one full cache line per store
+	_mm512_stream_si512((__m512i*) keys_out, _mm512_permutex2var_epi64(r0, even, r1));
+	_mm512_stream_si512((__m512i*) rids_out, _mm512_permutex2var_epi64(r0, odd, r1));
+}
+
+__attribute__((target("avx2")))
+void partition_avx2(uint64_t *keys, uint64_t *rids, uint64_t size,
+                    uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                    uint64_t *keys_out, uint64_t *rids_out,
+                    uint8_t shift_bits, uint8_t radix_bits,
+                    const next_hist_t *next)
+{
+	assert((63 & (uint64_t) keys_out) == 0);
+	assert((63 & (uint64_t) rids_out) == 0);
+	int i, partitions = 1 << radix_bits;
+	// initialize buffers (index counts 32-bit words)
+	for (i = 0 ; i != partitions ; ++i)
+		buf[(i << 4) | 14] = offsets[i] << 1;
+	__m256i m = _mm256_set1_epi64x(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint64_t h[4] __attribute__((aligned(32)));
+	uint64_t j, n = 0, block;
+	while (n != size) {
+		// 4 partitions at a time from aligned keys, else one
+		if ((31 & ((uint64_t) &keys[n])) || size - n < 4) {
+			h[0] = (keys[n] >> shift_bits) & (partitions - 1);
+			block = 1;
+		} else {
+			__m256i k = _mm256_load_si256((__m256i*) &keys[n]);
+			k = _mm256_and_si256(_mm256_srl_epi64(k, s), m);
+			_mm256_store_si256((__m256i*) h, k);
+			block = 4;
+		}
+		for (j = 0 ; j != block ; ++j, ++n) {
+			// offset in the cache line pair
+			uint64_t *src = &buf[h[j] << 4];
+			uint64_t index = src[14];
+			src[14] = index + 2;
+			uint64_t offset = index & 15;
+			src[offset] = keys[n];
+			src[offset + 1] = rids[n];
+			if (offset == 14) {
+				flush_avx2(src, &keys_out[(index - 14) >> 1],
+				           &rids_out[(index - 14) >> 1]);
+				// count the next digit of the tuples of this thread
+				if (next != NULL) {
+					uint64_t first = offsets[h[j]], lo = (index - 14) >> 1;
+					next_count(next, src, lo < first ? first : lo, index >> 1);
+				}
+				// restore overwritten pointer
+				src[14] = index + 2;
+			}
+		}
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void partition_avx512(uint64_t *keys, uint64_t *rids, uint64_t size,
+                      uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                      uint64_t *keys_out, uint64_t *rids_out,
+                      uint8_t shift_bits, uint8_t radix_bits,
+                      const next_hist_t *next)
+{
+	assert((63 & (uint64_t) keys_out) == 0);
+	assert((63 & (uint64_t) rids_out) == 0);
+	int i, partitions = 1 << radix_bits;
+	// initialize buffers (index counts 32-bit words)
+	for (i = 0 ; i != partitions ; ++i)
+		buf[(i << 4) | 14] = offsets[i] << 1;
+	__m512i m = _mm512_set1_epi64(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint64_t h[8] __attribute__((aligned(64)));
+	uint64_t j, n = 0, block;
+	while (n != size) {
+		// 8 partitions at a time from aligned keys, else one
+		if ((63 & ((uint64_t) &keys[n])) || size - n < 8) {
+			h[0] = (keys[n] >> shift_bits) & (partitions - 1);
+			block = 1;
+		} else {
+			__m512i k = _mm512_load_si512(&keys[n]);
+			k = _mm512_and_si512(_mm512_srl_epi64(k, s), m);
+			_mm512_store_si512(h, k);
+			block = 8;
+		}
+		for (j = 0 ; j != block ; ++j, ++n) {
+			// offset in the cache line pair
+			uint64_t *src = &buf[h[j] << 4];
+			uint64_t index = src[14];
+			src[14] = index + 2;
+			uint64_t offset = index & 15;
+			src[offset] = keys[n];
+			src[offset + 1] = rids[n];
+			if (offset == 14) {
+				flush_avx512(src, &keys_out[(index - 14) >> 1],
+				             &rids_out[(index - 14) >> 1]);
+				// count the next digit of the tuples of this thread
+				if (next != NULL) {
+					uint64_t first = offsets[h[j]], lo = (index - 14) >> 1;
+					next_count(next, src, lo < first ? first : lo, index >> 1);
+				}
+				// restore overwritten pointer
+				src[14] = index + 2;
+			}
+		}
+	}
+}
+
+void partition(uint64_t *keys, uint64_t *rids, uint64_t size,
+               uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+               uint64_t *keys_out, uint64_t *rids_out,
+               uint8_t shift_bits, uint8_t radix_bits,
+               const next_hist_t *next)
+{
+	int level = simd_level();
+	if (level == SIMD_AVX512)
+		partition_avx512(keys, rids, size, offsets, sizes, buf,
+		                 keys_out, rids_out, shift_bits, radix_bits, next);
+	else if (level == SIMD_AVX2)
+		partition_avx2(keys, rids, size, offsets, sizes, buf,
+		               keys_out, rids_out, shift_bits, radix_bits, next);
+	else
+		partition_sse(keys, rids, size, offsets, sizes, buf,
+		              keys_out, rids_out, shift_bits, radix_bits, next);
+}
+
 void finalize(uint64_t *sizes, uint64_t *buf,
-	      uint64_t *keys_out, uint64_t *rids_out, int partitions)
+	      uint64_t *keys_out, uint64_t *rids_out, int partitions,
+	      const next_hist_t *next)
 {	int i;
 	// find offset to align output
 	assert((63 & (uint64_t) keys_out) == 0);
@@ -1190,6 +1772,8 @@ void finalize(uint64_t *sizes, uint64_t *buf,
 		if (rem > sizes[i])
 			off = rem - sizes[i];
 		index -= rem - off;
+		if (next != NULL && off != rem)
+			next_count(next, src, index, index + rem - off - 1);
 		while (off != rem) {
 			keys_out[index] = src[off + off];
 			rids_out[index] = src[off + off + 1];
@@ -1198,41 +1782,417 @@ void finalize(uint64_t *sizes, uint64_t *buf,
 	}
 }
 
+// count the next digit of the buffered keys at output positions [lo, hi]
+void next_count_column(const next_hist_t *next, const uint64_t *src, uint64_t lo, uint64_t hi)
+{
+	uint32_t shift = next->shift_bits;
+	uint64_t mask = (1 << next->radix_bits) - 1;
+	uint64_t owner = (lo - next->base) / next->chunk;
+	uint64_t end = next->base + (owner + 1) * next->chunk;
+	if (owner >= next->owners - 1) {
+		owner = next->owners - 1;
+		end = ~0;
+	}
+	uint32_t *count = &next->count[owner << next->radix_bits];
+	for (; lo <= hi ; ++lo) {
+		if (lo == end) {
+			count += mask + 1;
+			end = ++owner == next->owners - 1 ? ~ (uint64_t) 0 : end + next->chunk;
+		}
+		count[(src[lo & 15] >> shift) & mask]++;
+	}
+}
+
+// column buffers for rids of any width (0 for bare keys): a buffer has
+// the 16 keys in two cache lines, then the 16 rids, then the output index
+// in its last slot, both columns are streamed when the buffer fills
+int column_stride(int payload)
+{
+	return (24 + 2 * payload) & ~7;
+}
+
+static inline void stream_column(void *dst, const void *src, int bytes)
+{
+	int i;
+	for (i = 0 ; i != bytes ; i += 16)
+		_mm_stream_si128((__m128i*) &((char*) dst)[i],
+		                 _mm_load_si128((__m128i*) &((char*) src)[i]));
+}
+
+// the keys are also split across the ranges of the nodes (delim[] has
+// the upper bound of all ranges but the last), the payload is constant
+// in each caller so the rid copies and flushes are specialized
+static inline __attribute__((always_inline))
+void partition_column(uint64_t *keys, uint8_t *rids, int payload, uint64_t size,
+                      uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                      uint64_t *keys_out, uint8_t *rids_out,
+                      uint8_t shift_bits, uint8_t radix_bits,
+                      const uint64_t *delim, int ranges, const next_hist_t *next)
+{
+	assert((63 & (uint64_t) keys_out) == 0);
+	assert((15 & (uint64_t) rids_out) == 0);
+	int r, stride = column_stride(payload);
+	int partitions = ranges << radix_bits;
+	uint64_t mask = (1 << radix_bits) - 1;
+	uint64_t i;
+	// initialize partition buffers
+	for (r = 0 ; r != partitions ; ++r)
+		buf[r * stride + stride - 1] = offsets[r];
+	for (i = 0 ; i != size ; ++i) {
+		uint64_t key = keys[i];
+		r = numa_range(key, delim, ranges);
+		uint64_t p = ((uint64_t) r << radix_bits) | ((key >> shift_bits) & mask);
+		uint64_t *src = &buf[p * stride];
+		uint8_t *column = (uint8_t*) &src[16];
+		uint64_t index = src[stride - 1]++;
+		uint64_t offset = index & 15;
+		src[offset] = key;
+		memcpy(&column[offset * payload], &rids[i * payload], payload);
+		if (offset == 15) {
+			stream_column(&keys_out[index - 15], src, 128);
+			stream_column(&rids_out[(index - 15) * payload], column, 16 * payload);
+			// count the next digit of the keys of this thread
+			if (next != NULL) {
+				uint64_t first = offsets[p];
+				next_count_column(next, src, index - 15 < first ? first : index - 15, index);
+			}
+		}
+	}
+#ifdef BG
+	// check partition sanity
+	for (r = 0 ; r != partitions ; ++r) {
+		uint64_t index = buf[r * stride + stride - 1];
+		assert(index - offsets[r] == sizes[r]);
+	}
+#endif
+}
+
+void partition_columns(uint64_t *keys, uint64_t *rids, int payload, uint64_t size,
+                       uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                       uint64_t *keys_out, uint64_t *rids_out,
+                       uint8_t shift_bits, uint8_t radix_bits,
+                       const uint64_t *delim, int ranges, const next_hist_t *next)
+{
+	uint8_t *r = (uint8_t*) rids, *r_out = (uint8_t*) rids_out;
+	if (payload == 0)
+		partition_column(keys, r, 0, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else if (payload == 1)
+		partition_column(keys, r, 1, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else if (payload == 2)
+		partition_column(keys, r, 2, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else if (payload == 4)
+		partition_column(keys, r, 4, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else if (payload == 8)
+		partition_column(keys, r, 8, size, offsets, sizes, buf, keys_out, r_out,
+		                 shift_bits, radix_bits, delim, ranges, next);
+	else
+		assert(0);
+}
+
+void finalize_columns(uint64_t *sizes, uint64_t *buf,
+                      uint64_t *keys_out, uint64_t *rids_out, int payload,
+                      int partitions, const next_hist_t *next)
+{	int i, stride = column_stride(payload);
+	assert((63 & (uint64_t) keys_out) == 0);
+	// flush remaining tuples from buffers to output
+	for (i = 0 ; i != partitions ; ++i) {
+		uint64_t *src = &buf[i * stride];
+		uint8_t *column = (uint8_t*) &src[16];
+		uint64_t index = src[stride - 1];
+		uint64_t rem = index & 15;
+		uint64_t off = 0;
+		if (rem > sizes[i])
+			off = rem - sizes[i];
+		index -= rem - off;
+		if (next != NULL && off != rem)
+			next_count_column(next, src, index, index + rem - off - 1);
+		memcpy(&((uint8_t*) rids_out)[index * payload], &column[off * payload],
+		       (rem - off) * payload);
+		while (off != rem)
+			keys_out[index++] = src[off++];
+	}
+}
+
+// copy rids of payload bytes for the NUMA shuffle
+void shuffle_rids(const uint64_t *rids, uint64_t *rids_out, uint64_t size, int payload)
+{
+	transfer_copy(rids_out, rids, size * payload);
+}
+
+// rids of payload bytes at an index
+uint64_t *rids_at(uint64_t *rids, uint64_t index, int payload)
+{
+	return (uint64_t*) &((uint8_t*) rids)[index * payload];
+}
+
+// records of 2 to 8 words with the key in the first: a buffer holds 8
+// records (whole cache lines for any width), then the output index in
+// its last slot, and is streamed when full
+int record_stride(int words)
+{
+	return 8 * words + 8;
+}
+
+// count the next digit of the buffered records at output positions [lo, hi]
+void next_count_records(const next_hist_t *next, const uint64_t *src, int words,
+                        uint64_t lo, uint64_t hi)
+{
+	uint32_t shift = next->shift_bits;
+	uint64_t mask = (1 << next->radix_bits) - 1;
+	uint64_t owner = (lo - next->base) / next->chunk;
+	uint64_t end = next->base + (owner + 1) * next->chunk;
+	if (owner >= next->owners - 1) {
+		owner = next->owners - 1;
+		end = ~0;
+	}
+	uint32_t *count = &next->count[owner << next->radix_bits];
+	for (; lo <= hi ; ++lo) {
+		if (lo == end) {
+			count += mask + 1;
+			end = ++owner == next->owners - 1 ? ~ (uint64_t) 0 : end + next->chunk;
+		}
+		count[(src[(lo & 7) * words] >> shift) & mask]++;
+	}
+}
+
+// range of the node of a record, composite keys of two words (most
+// significant first) have two-word delimiters
+static inline int record_range(const uint64_t *rec, const uint64_t *delim,
+                               int ranges, int key_words)
+{
+	int r, j;
+	if (key_words == 1)
+		return numa_range(rec[0], delim, ranges);
+	for (r = j = 0 ; j != ranges - 1 ; ++j)
+		r += rec[0] > delim[j + j] ||
+		     (rec[0] == delim[j + j] && rec[1] > delim[j + j + 1]);
+	return r;
+}
+
+// histogram of a digit of the keys of records from their word digit_word,
+// split across the ranges of the nodes as partition_records() does, the
+// OR and the AND of every key word are stored
+void histogram_records(const uint64_t *recs, int words, uint64_t size, uint64_t *count,
+                       int key_words, int digit_word, uint8_t shift_bits, uint8_t radix_bits,
+                       const uint64_t *delim, int ranges, int copies,
+                       uint64_t *key_or, uint64_t *key_and)
+{
+	uint64_t copy_size = (uint64_t) ranges << radix_bits;
+	uint64_t mask = (1 << radix_bits) - 1;
+	uint64_t or_bits[2] = {0, 0}, and_bits[2] = {~0ull, ~0ull}, i;
+	int w;
+	clear_copies(count, copy_size, copies);
+	for (i = 0 ; i != size ; ++i) {
+		const uint64_t *rec = &recs[i * words];
+		for (w = 0 ; w != key_words ; ++w) {
+			or_bits[w] |= rec[w];
+			and_bits[w] &= rec[w];
+		}
+		uint64_t r = record_range(rec, delim, ranges, key_words);
+		uint64_t p = (r << radix_bits) | ((rec[digit_word] >> shift_bits) & mask);
+		count[(i & (copies - 1)) * copy_size + p]++;
+	}
+	fold_copies(count, copy_size, copies);
+	for (w = 0 ; key_or != NULL && w != key_words ; ++w) {
+		key_or[w] = or_bits[w];
+		key_and[w] = and_bits[w];
+	}
+}
+
+// the words are constant in each caller so the record copies and
+// flushes are specialized
+static inline __attribute__((always_inline))
+void partition_record(uint64_t *recs, int words, uint64_t size,
+                      uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                      uint64_t *recs_out, int key_words, int digit_word,
+                      uint8_t shift_bits, uint8_t radix_bits,
+                      const uint64_t *delim, int ranges, const next_hist_t *next)
+{
+	assert((63 & (uint64_t) recs_out) == 0);
+	int r, stride = record_stride(words);
+	int partitions = ranges << radix_bits;
+	uint64_t mask = (1 << radix_bits) - 1;
+	uint64_t i;
+	// initialize partition buffers
+	for (r = 0 ; r != partitions ; ++r)
+		buf[r * stride + stride - 1] = offsets[r];
+	for (i = 0 ; i != size ; ++i) {
+		const uint64_t *rec = &recs[i * words];
+		r = record_range(rec, delim, ranges, key_words);
+		uint64_t p = ((uint64_t) r << radix_bits) | ((rec[digit_word] >> shift_bits) & mask);
+		uint64_t *src = &buf[p * stride];
+		uint64_t index = src[stride - 1]++;
+		uint64_t offset = index & 7;
+		memcpy(&src[offset * words], rec, words * sizeof(uint64_t));
+		if (offset == 7) {
+			stream_column(&recs_out[(index - 7) * words], src, 64 * words);
+			// count the next digit of the records of this thread
+			if (next != NULL) {
+				uint64_t first = offsets[p];
+				next_count_records(next, src, words, index - 7 < first ? first : index - 7, index);
+			}
+		}
+	}
+#ifdef BG
+	// check partition sanity
+	for (r = 0 ; r != partitions ; ++r) {
+		uint64_t index = buf[r * stride + stride - 1];
+		assert(index - offsets[r] == sizes[r]);
+	}
+#endif
+}
+
+void partition_records(uint64_t *recs, int words, uint64_t size,
+                       uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                       uint64_t *recs_out, int key_words, int digit_word,
+                       uint8_t shift_bits, uint8_t radix_bits,
+                       const uint64_t *delim, int ranges, const next_hist_t *next)
+{
+	if (words == 2)
+		partition_record(recs, 2, size, offsets, sizes, buf, recs_out,
+		                 key_words, digit_word, shift_bits, radix_bits, delim, ranges, next);
+	else if (words == 3)
+		partition_record(recs, 3, size, offsets, sizes, buf, recs_out,
+		                 key_words, digit_word, shift_bits, radix_bits, delim, ranges, next);
+	else if (words == 4)
+		partition_record(recs, 4, size, offsets, sizes, buf, recs_out,
+		                 key_words, digit_word, shift_bits, radix_bits, delim, ranges, next);
+	else if (words == 5)
+		partition_record(recs, 5, size, offsets, sizes, buf, recs_out,
+		                 key_words, digit_word, shift_bits, radix_bits, delim, ranges, next);
+	else if (words == 6)
+		partition_record(recs, 6, size, offsets, sizes, buf, recs_out,
+		                 key_words, digit_word, shift_bits, radix_bits, delim, ranges, next);
+	else if (words == 7)
+		partition_record(recs, 7, size, offsets, sizes, buf, recs_out,
+		                 key_words, digit_word, shift_bits, radix_bits, delim, ranges, next);
+	else if (words == 8)
+		partition_record(recs, 8, size, offsets, sizes, buf, recs_out,
+		                 key_words, digit_word, shift_bits, radix_bits, delim, ranges, next);
+	else
+		assert(0);
+}
+
+void finalize_records(uint64_t *sizes, uint64_t *buf, uint64_t *recs_out,
+                      int words, int partitions, const next_hist_t *next)
+{	int i, stride = record_stride(words);
+	assert((63 & (uint64_t) recs_out) == 0);
+	// flush remaining records from buffers to output
+	for (i = 0 ; i != partitions ; ++i) {
+		uint64_t *src = &buf[i * stride];
+		uint64_t index = src[stride - 1];
+		uint64_t rem = index & 7;
+		uint64_t off = 0;
+		if (rem > sizes[i])
+			off = rem - sizes[i];
+		index -= rem - off;
+		if (next != NULL && off != rem)
+			next_count_records(next, src, words, index, index + rem - off - 1);
+		memcpy(&recs_out[index * words], &src[off * words],
+		       (rem - off) * words * sizeof(uint64_t));
+	}
+}
+
+// copy records to output positions [index, index + size) of the NUMA
+// shuffle and count the digit of the first local pass for their owners
+void shuffle_records(const uint64_t *recs, uint64_t *recs_out, uint64_t size, int words,
+                     const next_hist_t *next, uint64_t index)
+{
+	if (next == NULL) {
+		transfer_copy(recs_out, recs, size * words * sizeof(uint64_t));
+		return;
+	}
+	uint32_t shift = next->shift_bits;
+	uint64_t mask = (1 << next->radix_bits) - 1;
+	uint64_t owner = (index - next->base) / next->chunk;
+	uint64_t end = next->base + (owner + 1) * next->chunk;
+	if (owner >= next->owners - 1) {
+		owner = next->owners - 1;
+		end = ~0;
+	}
+	uint32_t *count = &next->count[owner << next->radix_bits];
+	uint64_t i;
+	while (size != 0) {
+		uint64_t run = size < SHUFFLE_BLOCK ? size : SHUFFLE_BLOCK;
+		transfer_copy(recs_out, recs, run * words * sizeof(uint64_t));
+		for (i = 0 ; i != run ; ++i, ++index) {
+			if (index == end) {
+				count += mask + 1;
+				end = ++owner == next->owners - 1 ? ~ (uint64_t) 0 : end + next->chunk;
+			}
+			count[(recs[i * words] >> shift) & mask]++;
+		}
+		recs += run * words;
+		recs_out += run * words;
+		size -= run;
+	}
+}
+
 void swap_ppl(uint64_t ***a, uint64_t ***b)
 {
 	uint64_t **t = *a; *a = *b; *b = t;
 }
 
-void extract_delimiters(uint64_t *sample, uint64_t sample_size, uint64_t *delimiter)
+int key_128_compare(const void *x, const void *y)
 {
-	uint64_t i, parts = 0;
-	while (delimiter[parts] != ~ (uint64_t) 0) parts++;
+	const uint64_t *a = (const uint64_t*) x;
+	const uint64_t *b = (const uint64_t*) y;
+	if (a[0] != b[0])
+		return a[0] < b[0] ? -1 : 1;
+	return a[1] < b[1] ? -1 : (a[1] > b[1] ? 1 : 0);
+}
+
+// delimiters of composite keys of two words from a sorted sample of them
+void extract_delimiters_128(uint64_t *sample, uint64_t sample_size, uint64_t *delimiter,
+                            uint64_t parts)
+{
+	uint64_t i;
 	double percentile = sample_size * 1.0 / (parts + 1);
 	for (i = 0 ; i != parts ; ++i) {
 		uint64_t index = percentile * (i + 1) - 0.001;
-		delimiter[i] = sample[index];
+		uint64_t *d = &delimiter[i + i];
+		d[0] = sample[index + index];
+		d[1] = sample[index + index + 1];
 		// search repetitions in sample
 		uint64_t start, end;
 		for (start = index ; start ; --start)
-			if (sample[start] != delimiter[i]) break;
+			if (key_128_compare(&sample[start + start], d)) break;
 		for (end = index ; end != sample_size ; ++end)
-			if (sample[end] != delimiter[i]) break;
+			if (key_128_compare(&sample[end + end], d)) break;
 		// if more repetitions after, don't include
-		if (index - start < end - index && delimiter[i])
-			delimiter[i]--;
+		if (index - start < end - index && (d[0] | d[1])) {
+			if (d[1] == 0)
+				d[0]--;
+			d[1]--;
+		}
 	}
 }
 
 typedef struct {
 	int *bits;
+	int passes;
 	double fudge;
 	uint64_t **keys;
 	uint64_t **rids;
 	uint64_t *size;
 	uint64_t **keys_buf;
 	uint64_t **rids_buf;
+	int payload;
+	int words;
+	int key_words;
 	uint64_t ***count;
 	uint64_t **numa_local_count;
+	uint64_t *key_or;
+	uint64_t *key_and;
+	uint32_t **next_count;
+	uint64_t *arrived;
+	uint64_t *drained;
+	uint64_t planned;
+	int pipelined;
 	uint64_t *sample;
 	uint64_t *sample_buf;
 	uint64_t **sample_hist;
@@ -1245,9 +2205,9 @@ typedef struct {
 	int max_numa;
 	int allocated;
 	int interleaved;
-	pthread_barrier_t *global_barrier;
-	pthread_barrier_t **local_barrier;
+	barrier_t *barrier;
 	pthread_barrier_t *sample_barrier;
+	int stable;
 } global_data_t;
 
 typedef struct {
@@ -1257,8 +2217,9 @@ typedef struct {
 	uint64_t alloc_time;
 	uint64_t sample_time;
 	uint64_t numa_shuffle_time;
-	uint64_t hist_time[8];
-	uint64_t part_time[8];
+	uint64_t numa_shuffle_bytes;
+	uint64_t hist_time[16];
+	uint64_t part_time[16];
 	global_data_t *global;
 } thread_data_t;
 
@@ -1269,7 +2230,98 @@ int uint64_compare(const void *x, const void *y)
 	return a < b ? -1 : (a > b ? 1 : 0);
 }
 
-void data_shuffling(global_data_t *d, int numa, int numa_node, int numa_local_id, int threads, int threads_per_numa, uint64_t numa_size, uint64_t total_size, uint64_t *buf, pthread_barrier_t *global_barrier, uint32_t seed, thread_data_t *a, int radix_bits, int gb) {
+// histogram counters are spread over copies when a key holds more than
+// 1/HEAVY_HITTER_SHARE of a sorted sample, so increments on skewed input
+// do not serialize on one location
+#define HISTOGRAM_COPIES	4
+#define HEAVY_HITTER_SHARE	16
+
+int histogram_copies(const uint64_t *sample, uint64_t sample_size)
+{
+	uint64_t i, run = 1, max_run = 1;
+	for (i = 1 ; i < sample_size ; ++i) {
+		run = sample[i] == sample[i - 1] ? run + 1 : 1;
+		if (run > max_run) max_run = run;
+	}
+	return sample_size && max_run * HEAVY_HITTER_SHARE >= sample_size ?
+	       HISTOGRAM_COPIES : 1;
+}
+
+
+// re-plan the local passes on the key bits that vary in any thread
+int plan_passes(const global_data_t *d, int pass_bits[])
+{
+	uint64_t key_or = 0, key_and = ~0;
+	int t;
+	for (t = 0 ; t != d->threads ; ++t) {
+		key_or |= d->key_or[t];
+		key_and &= d->key_and[t];
+	}
+	return replan_bits(key_or ^ key_and, d->bits, pass_bits);
+}
+
+// plan the local passes of composite keys on the bits that vary in any
+// thread: those of the least significant word past the first pass, then
+// those of the more significant words, in passes of at most the widest
+// planned pass, returns the number of passes with the first
+int plan_words(const global_data_t *d, int pass_bits[], int pass_shift[], int pass_word[])
+{
+	int t, w, q, p = 1, max_bits = d->bits[0];
+	for (q = 1 ; d->bits[q] != 0 ; ++q)
+		if (d->bits[q] > max_bits)
+			max_bits = d->bits[q];
+	for (w = d->key_words - 1 ; w >= 0 ; --w) {
+		uint64_t key_or = 0, key_and = ~0;
+		for (t = 0 ; t != d->threads ; ++t) {
+			key_or |= d->key_or[t * d->key_words + w];
+			key_and &= d->key_and[t * d->key_words + w];
+		}
+		uint64_t varying = key_or ^ key_and;
+		int low = w == d->key_words - 1 ? d->bits[0] : 0, high = 64;
+		// trim the constant low and high bits
+		while (low < high && !(varying & (((uint64_t) 1) << low)))
+			low++;
+		while (high > low && !(varying & (((uint64_t) 1) << (high - 1))))
+			high--;
+		int passes = ceil_div(high - low, max_bits);
+		for (q = 0 ; q != passes ; ++q, ++p) {
+			pass_bits[p] = ceil_div(high - low, passes - q);
+			pass_shift[p] = low;
+			pass_word[p] = w;
+			low += pass_bits[p];
+		}
+	}
+	pass_bits[0] = d->bits[0];
+	pass_bits[p] = 0;
+	return p;
+}
+
+// set up the fused histogram of the first local pass, NULL if the
+// counts of all owners for the widest local pass would not fit
+next_hist_t *fuse_passes(next_hist_t *next, global_data_t *d, int id,
+                         const int pass_bits[], int shift_bits, int owners, uint64_t chunk)
+{
+	int p, bits = 0;
+	for (p = 1 ; pass_bits[p] != 0 ; ++p)
+		if (pass_bits[p] > bits)
+			bits = pass_bits[p];
+	if (bits == 0 || chunk == 0 ||
+	    ((uint64_t) owners << bits) > FUSED_COUNT_LIMIT)
+		return NULL;
+	next->count = pool_scratch(id, 3, ((uint64_t) owners << bits) * sizeof(uint32_t));
+	next->base = 0;
+	next->chunk = chunk;
+	next->owners = owners;
+	next->shift_bits = shift_bits;
+	next->radix_bits = pass_bits[1];
+	// zero the counts of the first local pass and share them
+	memset(next->count, 0, ((uint64_t) owners << next->radix_bits) * sizeof(uint32_t));
+	d->next_count[id] = next->count;
+	return next;
+}
+
+// returns the size of the local node after the shuffle
+uint64_t data_shuffling(global_data_t *d, int numa, int numa_node, int numa_local_id, int threads, int threads_per_numa, uint64_t numa_size, uint64_t total_size, uint64_t *buf, barrier_t *barrier, thread_data_t *a, int radix_bits, const next_hist_t *next) {
     uint64_t **counts = d->count[numa_node];
     uint64_t tim;
     int numa_src, numa_dst, i, j, k, n, t;
@@ -1295,99 +2347,92 @@ void data_shuffling(global_data_t *d, int numa, int numa_node, int numa_local_id
             fprintf(stderr, "NUMA %d is %.2f%% of input\n", numa_node, numa_size * 100.0 / total_size);
         assert(numa_size <= max_size);
         tim = micro_time();
-        // compute starting numa offsets
+        // starting offsets of the partitions of this node in the sources
         uint64_t *numa_offset = calloc(numa, sizeof(uint64_t));
-        uint64_t *numa_part = malloc(numa * sizeof(uint64_t));
         for (numa_src = 0 ; numa_src != numa ; ++numa_src)
             for (numa_dst = 0 ; numa_dst != numa_node ; ++numa_dst)
                 numa_offset[numa_src] += transfer[numa_src][numa_dst];
-        // order of copies
-        uint64_t *order_size = malloc(numa * sizeof(uint64_t));
-        int *order = malloc(numa * sizeof(int));
+        // sizes of the partitions of this node in each source
+        int parts = 1 << radix_bits;
+        uint64_t *numa_part = calloc((uint64_t) numa * parts, sizeof(uint64_t));
         for (n = 0 ; n != numa ; ++n)
-            order[n] = n;
-        // copy one partition at a time
-        uint64_t output_partition_offset = 0;
-        for (i = 0 ; i != (1 << radix_bits) ; ++i) {
-            j = i | (numa_node << radix_bits);
-            // compute size per numa and size for thread to move
-            uint64_t thread_part = 0;
-            uint64_t part_size = 0;
-            for (n = 0 ; n != numa ; ++n) {
-                numa_part[n] = 0;
+            for (i = 0 ; i != parts ; ++i) {
+                j = i | (numa_node << radix_bits);
                 for (t = 0 ; t != threads_per_numa ; ++t)
-                    numa_part[n] += d->count[n][t][j];
-                part_size += numa_part[n];
-                thread_part += numa_part[n] / threads_per_numa;
+                    numa_part[n * parts + i] += d->count[n][t][j];
             }
-            // compute output offset
-            uint64_t output_offset = output_partition_offset + thread_part * numa_local_id;
-            // shuffle numa order
-            rand64_t *gen = rand64_init(seed);
-            for (n = 0 ; n != numa ; ++n) {
-                swap_i(&order[n], &order[rand64_next(gen) % (numa - n) + n]);
-                // compute size
-                uint64_t input_size = numa_part[n] / threads_per_numa;
-                uint64_t input_offset = input_size * numa_local_id;
-                if (numa_local_id + 1 == threads_per_numa)
-                    input_size = numa_part[n] - input_offset;
-                order_size[n] = input_size + (!n ? 0 : order_size[n - 1]);
+        // one read stream per source, sources in turn across the links
+        transfer_t *copies = malloc((uint64_t) numa * parts * sizeof(transfer_t));
+        int copy_count = transfer_plan(copies, numa_part, numa_offset, numa, parts,
+                                       numa_node, numa_local_id, threads_per_numa);
+        if (d->pipelined)
+            transfer_signal(&d->planned);
+        uint64_t remote = 0;
+        for (k = 0 ; k != copy_count ; ++k) {
+            n = copies[k].src;
+            uint64_t input_offset = copies[k].from;
+            uint64_t input_size = copies[k].size;
+            uint64_t output_offset = copies[k].to;
+            if (n != numa_node)
+                remote += input_size;
+            // copy keys and rids, or whole records
+            uint64_t *keys = &d->keys_buf[n][input_offset * d->words];
+            uint64_t *keys_out = &d->keys[numa_node][output_offset * d->words];
+            if (d->words > 1)
+                shuffle_records(keys, keys_out, input_size, d->words, next, output_offset);
+            else {
+                shuffle_keys(keys, keys_out, input_size, next, output_offset);
+                if (d->payload != 0) {
+                    uint64_t *rids = rids_at(d->rids_buf[n], input_offset, d->payload);
+                    uint64_t *rids_out = rids_at(d->rids[numa_node], output_offset, d->payload);
+                    shuffle_rids(rids, rids_out, input_size, d->payload);
+                }
             }
-            free(gen);
-            // random numa order
-            for (k = 0 ; k != numa ; ++k) {
-                n = order[k];
-                // compute input offset and size of copy
-                uint64_t input_size = numa_part[n] / threads_per_numa;
-                uint64_t input_offset = input_size * numa_local_id;
-                if (numa_local_id + 1 == threads_per_numa)
-                    input_size = numa_part[n] - input_offset;
-                input_offset += numa_offset[n];
-                // re-ordered output offset
-                uint64_t order_output_offset = output_offset + order_size[n] - input_size;
-                // copy keys and rids
-                uint64_t *keys = &d->keys_buf[n][input_offset];
-                uint64_t *rids = &d->rids_buf[n][input_offset];
-                uint64_t *keys_end = &keys[input_size];
-                uint64_t *rids_end = &rids[input_size];
-                uint64_t *keys_out = &d->keys[numa_node][order_output_offset];
-                uint64_t *rids_out = &d->rids[numa_node][order_output_offset];
-                while (keys != keys_end)
-                    _mm_stream_si64((long long int*) keys_out++, *keys++);
-                while (rids != rids_end)
-                    _mm_stream_si64((long long int*) rids_out++, *rids++);
+            // hand the tuples to their owners and the source back to its node
+            if (d->pipelined) {
+                transfer_arrive(&d->arrived[numa_node * threads_per_numa], threads_per_numa,
+                                (numa_size / threads_per_numa) & ~3, output_offset, input_size);
+                if (copies[k].last)
+                    transfer_signal(&d->drained[n]);
             }
-            output_offset += order_size[numa - 1];
-            // update numa offsets and output offset
-            for (n = 0 ; n != numa ; ++n)
-                numa_offset[n] += numa_part[n];
-            output_partition_offset += part_size;
         }
+        a->numa_shuffle_bytes = remote * (d->words > 1 ? d->words * sizeof(uint64_t) : sizeof(uint64_t) + d->payload);
         for (n = 0 ; n != numa ; ++n)
             free(transfer[n]);
-        free(order);
-        free(order_size);
         free(transfer);
+        free(copies);
         free(numa_part);
         free(numa_offset);
         tim = micro_time() - tim;
         a->numa_shuffle_time = tim;
-        // sync globally
-        pthread_barrier_wait(&global_barrier[gb++]);
+        // sync globally, or each thread waits for its tuples
+        if (!d->pipelined)
+            barrier_wait(barrier, a->id, BARRIER_GLOBAL);
     }
+    return numa_size;
 }
 
 void *sort_thread(void *arg) {
     thread_data_t *a = (thread_data_t*) arg;
     global_data_t *d = a->global;
-    int i, j, k, n, lb = 0, gb = 0, id = a->id;
+    int i, j, k, t, n, id = a->id;
     int numa = d->numa;
     int numa_node = d->numa_node[id];
     int threads = d->threads;
     int threads_per_numa = threads / numa;
-    uint32_t seed = a->seed;
-    pthread_barrier_t *local_barrier = d->local_barrier[numa_node];
-    pthread_barrier_t *global_barrier = d->global_barrier;
+    barrier_t *barrier = d->barrier;
+    // bytes per rid (0 for bare keys), the column kernels move any
+    // width other than the key width
+    int payload = d->payload;
+    int key_only = payload == 0;
+    int columns = payload != sizeof(uint64_t);
+    // words per record, records of more than the key carry no rids,
+    // composite keys are the first key_words words (most significant
+    // first) and their passes start on the last
+    int words = d->words;
+    int records = words > 1;
+    int key_words = d->key_words;
+    int digit_word = key_words - 1;
 
     int numa_local_id = 0;
     for (i = 0 ; i != id ; ++i)
@@ -1398,13 +2443,8 @@ void *sort_thread(void *arg) {
     for (n = 0 ; n != numa ; ++n)
         total_size += d->size[n];
 
-    if (threads <= d->max_threads)
-        cpu_bind(d->cpu[id]);
-    if (numa <= d->max_numa)
-        memory_bind(d->numa_node[id]);
-
     int radix_bits = d->bits[0];
-    int partitions = (1 << radix_bits) * (numa == 3 ? 4 : numa);
+    int partitions = (1 << radix_bits) * numa;
     int max_partitions = partitions;
     for (i = 1 ; d->bits[i] != 0 ; ++i) {
         int parts = 1 << d->bits[i];
@@ -1412,9 +2452,13 @@ void *sort_thread(void *arg) {
             max_partitions = parts;
     }
 
-    uint64_t *offsets = malloc(max_partitions * sizeof(uint64_t));
-    uint64_t *count = calloc(max_partitions, sizeof(uint64_t));
-    uint64_t *buf = mamalloc((max_partitions << 4) * sizeof(uint64_t));
+    uint64_t *offsets = pool_scratch(id, 0, max_partitions * sizeof(uint64_t));
+    // counts have room for the histogram copies
+    uint64_t *count = pool_scratch(id, 1, max_partitions * HISTOGRAM_COPIES * sizeof(uint64_t));
+    memset(count, 0, max_partitions * sizeof(uint64_t));
+    int stride = records ? record_stride(words) :
+                 columns ? column_stride(payload) : 16;
+    uint64_t *buf = pool_scratch(id, 2, max_partitions * stride * sizeof(uint64_t));
     d->count[numa_node][numa_local_id] = count;
     uint64_t numa_size = d->size[numa_node];
     uint64_t size = numa_size / threads_per_numa;
@@ -1427,36 +2471,60 @@ void *sort_thread(void *arg) {
         if (!numa_local_id) {
             uint64_t cap = d->size[numa_node] * d->fudge;
             if (d->interleaved) {
-                d->keys_buf[numa_node] = numa_alloc_interleaved(cap * sizeof(uint64_t));
-                d->rids_buf[numa_node] = numa_alloc_interleaved(cap * sizeof(uint64_t));
+                d->keys_buf[numa_node] = numa_alloc_interleaved(cap * words * sizeof(uint64_t));
+                if (!key_only)
+                    d->rids_buf[numa_node] = numa_alloc_interleaved(cap * payload);
             } else {
-                d->keys_buf[numa_node] = mamalloc(cap * sizeof(uint64_t));
-                d->rids_buf[numa_node] = mamalloc(cap * sizeof(uint64_t));
+                d->keys_buf[numa_node] = mamalloc(cap * words * sizeof(uint64_t));
+                if (!key_only)
+                    d->rids_buf[numa_node] = mamalloc(cap * payload);
             }
         }
-        pthread_barrier_wait(&local_barrier[lb++]);
+        barrier_wait(barrier, id, BARRIER_NUMA);
     }
 
-    uint64_t *keys = &d->keys[numa_node][offset];
-    uint64_t *rids = &d->rids[numa_node][offset];
+    uint64_t *keys = &d->keys[numa_node][offset * words];
+    uint64_t *rids = key_only ? NULL : rids_at(d->rids[numa_node], offset, payload);
     uint64_t *keys_end = NULL, *rids_end = NULL;
     if (!d->allocated) {
-        uint64_t *keys_buf = &d->keys_buf[numa_node][offset];
-        uint64_t *rids_buf = &d->rids_buf[numa_node][offset];
+        uint64_t *keys_buf = &d->keys_buf[numa_node][offset * words];
         uint64_t p;
-        for (p = 0 ; p != size ; ++p)
+        for (p = 0 ; p != size * words ; ++p)
             _mm_stream_si64((long long int*) &keys_buf[p], 0);
-        for (p = 0 ; p != size ; ++p)
-            _mm_stream_si64((long long int*) &rids_buf[p], 0);
-        pthread_barrier_wait(&local_barrier[lb++]);
+        if (!key_only) {
+            uint64_t *rids_buf = rids_at(d->rids_buf[numa_node], offset, payload);
+            if (columns)
+                memset(rids_buf, 0, size * payload);
+            else
+                for (p = 0 ; p != size ; ++p)
+                    _mm_stream_si64((long long int*) &rids_buf[p], 0);
+        }
+        barrier_wait(barrier, id, BARRIER_NUMA);
     }
     tim = micro_time() - tim;
     a->alloc_time = tim;
 
     tim = micro_time();
-    uint64_t *delimiter = calloc(numa, sizeof(uint64_t));
-    delimiter[numa - 1] = ~0;
-    if (numa > 1) {
+    uint64_t *delimiter = calloc(numa * key_words, sizeof(uint64_t));
+    for (i = 0 ; i != key_words ; ++i)
+        delimiter[(numa - 1) * key_words + i] = ~0;
+    if (numa > 1 && key_words > 1) {
+        // sort the sample of composite keys on one thread
+        uint64_t p, sample_size = (d->sample_size / threads) & ~15;
+        uint64_t *sample = &d->sample[sample_size * id * key_words];
+        if (id + 1 == threads)
+            sample_size = d->sample_size - sample_size * id;
+        rand64_t *gen = rand64_init(a->seed);
+        for (p = 0 ; p != sample_size ; ++p)
+            memcpy(&sample[p * key_words], &keys[mulhi(rand64_next(gen), size) * words],
+                   key_words * sizeof(uint64_t));
+        free(gen);
+        barrier_wait(barrier, id, BARRIER_GLOBAL);
+        if (id == 0)
+            qsort(d->sample, d->sample_size, key_words * sizeof(uint64_t), key_128_compare);
+        barrier_wait(barrier, id, BARRIER_GLOBAL);
+        extract_delimiters_128(d->sample, d->sample_size, delimiter, numa - 1);
+    } else if (numa > 1) {
         assert((d->sample_size & 3) == 0);
         uint64_t p, sample_size = (d->sample_size / threads) & ~15;
         uint64_t *sample = &d->sample[sample_size * id];
@@ -1464,35 +2532,59 @@ void *sort_thread(void *arg) {
             sample_size = d->sample_size - sample_size * id;
         rand64_t *gen = rand64_init(a->seed);
         for (p = 0 ; p != sample_size ; ++p)
-            sample[p] = keys[mulhi(rand64_next(gen), size)];
-        partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 0, 8, id, threads, &global_barrier[gb]);
-        partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 8, 8, id, threads, &global_barrier[gb + 3]);
-        partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 16, 8, id, threads, &global_barrier[gb + 6]);
-        partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 24, 8, id, threads, &global_barrier[gb + 9]);
-        partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 32, 8, id, threads, &global_barrier[gb + 12]);
-        partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 40, 8, id, threads, &global_barrier[gb + 15]);
-        partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 48, 8, id, threads, &global_barrier[gb + 18]);
-        partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 56, 8, id, threads, &global_barrier[gb + 21]);
-        gb += 24;
-        extract_delimiters(d->sample, d->sample_size, delimiter);
+            sample[p] = keys[mulhi(rand64_next(gen), size) * words];
+        partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 0, 8, id, threads, barrier);
+        partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 8, 8, id, threads, barrier);
+        partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 16, 8, id, threads, barrier);
+        partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 24, 8, id, threads, barrier);
+        partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 32, 8, id, threads, barrier);
+        partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 40, 8, id, threads, barrier);
+        partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 48, 8, id, threads, barrier);
+        partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 56, 8, id, threads, barrier);
+        sample_delimiters_64(d->sample, d->sample_size, delimiter, NULL);
 
 		// for (size_t i = 0; i < 16; i++) {
         // 	printf("Delimiter %d = %lu\n", i, delimiter[i]);
     	// }
 		// printf("Done \n\n");
     }
+    // spread histogram counters if a few keys dominate
+    int copies;
+    if (numa > 1 && key_words == 1)
+        copies = histogram_copies(d->sample, d->sample_size);
+    else {
+        uint64_t local[256];
+        uint64_t p, local_size = size < 256 ? size : 256;
+        rand64_t *gen = rand64_init(a->seed ^ 1);
+        for (p = 0 ; p != local_size ; ++p)
+            local[p] = keys[mulhi(rand64_next(gen), size) * words + digit_word];
+        free(gen);
+        qsort(local, local_size, sizeof(uint64_t), uint64_compare);
+        copies = histogram_copies(local, local_size);
+    }
     tim = micro_time() - tim;
     a->sample_time = tim;
 
     tim = micro_time();
-    if (numa == 1)
-        histogram(keys, size, count, 0, radix_bits);
+    if (records)
+        histogram_records(keys, words, size, count, key_words, digit_word, 0, radix_bits,
+                          delimiter, partitions >> radix_bits, copies,
+                          &d->key_or[id * key_words], &d->key_and[id * key_words]);
+    else if (numa == 1)
+        histogram(keys, size, count, 0, radix_bits, copies,
+                  &d->key_or[id], &d->key_and[id]);
     else if (numa == 2)
-        histogram_numa_2(keys, size, count, radix_bits, delimiter);
-    else if (numa <= 4)
-        histogram_numa_4(keys, size, count, radix_bits, delimiter);
-    else if (numa <= 8)
-        histogram_numa_8(keys, size, count, radix_bits, delimiter);
+        histogram_numa_2(keys, size, count, radix_bits, delimiter, copies,
+                         &d->key_or[id], &d->key_and[id]);
+    else if (numa == 4)
+        histogram_numa_4(keys, size, count, radix_bits, delimiter, copies,
+                         &d->key_or[id], &d->key_and[id]);
+    else if (numa == 8)
+        histogram_numa_8(keys, size, count, radix_bits, delimiter, copies,
+                         &d->key_or[id], &d->key_and[id]);
+    else
+        histogram_numa_n(keys, size, count, radix_bits, delimiter, numa, copies,
+                         &d->key_or[id], &d->key_and[id]);
     tim = micro_time() - tim;
     a->hist_time[0] = tim;
 
@@ -1504,7 +2596,20 @@ void *sort_thread(void *arg) {
     }
     d->numa_local_count[id] = numa_local_count;
 
-    pthread_barrier_wait(&local_barrier[lb++]);
+    barrier_wait(barrier, id, BARRIER_NUMA);
+
+    // one node has the key bits of all threads and can count the first
+    // local pass while partitioning the first
+    int pass_bits[16], pass_shift[16], pass_word[16], shift_bits = 0, counted = 0;
+    next_hist_t next_hist, *next = NULL;
+    if (numa == 1 && key_words > 1)
+        plan_words(d, pass_bits, pass_shift, pass_word);
+    else if (numa == 1) {
+        shift_bits = plan_passes(d, pass_bits);
+        next = fuse_passes(&next_hist, d, id, pass_bits, shift_bits, threads,
+                           (numa_size / threads) & ~3);
+        counted = next != NULL;
+    }
 
     tim = micro_time();
 	uint64_t **counts = d->count[numa_node];
@@ -1512,25 +2617,53 @@ void *sort_thread(void *arg) {
 			  threads_per_numa, offsets);
 	// partition range partitioned data in local nodes
 	uint64_t *keys_out = d->keys_buf[numa_node];
-	uint64_t *rids_out = d->rids_buf[numa_node];
-    if (numa == 1)
-        partition(keys, rids, size, offsets, count, buf, keys_out, rids_out, 0, radix_bits);
+	uint64_t *rids_out = key_only ? NULL : d->rids_buf[numa_node];
+    if (records)
+        partition_records(keys, words, size, offsets, count, buf, keys_out, key_words,
+                          digit_word, 0, radix_bits, delimiter, partitions >> radix_bits, next);
+    else if (columns)
+        partition_columns(keys, rids, payload, size, offsets, count, buf, keys_out, rids_out,
+                          0, radix_bits, delimiter, partitions >> radix_bits, next);
+    else if (numa == 1)
+        partition(keys, rids, size, offsets, count, buf, keys_out, rids_out, 0, radix_bits, next);
     else if (numa == 2)
         partition_numa_2(keys, rids, size, offsets, count, buf, keys_out, rids_out, radix_bits, delimiter);
-    else if (numa <= 4)
+    else if (numa == 4)
         partition_numa_4(keys, rids, size, offsets, count, buf, keys_out, rids_out, radix_bits, delimiter);
-    else if (numa <= 8)
+    else if (numa == 8)
         partition_numa_8(keys, rids, size, offsets, count, buf, keys_out, rids_out, radix_bits, delimiter);
-
-    pthread_barrier_wait(&local_barrier[lb++]);
-    finalize(count, buf, keys_out, rids_out, partitions);
+    else
+        partition_numa_n(keys, rids, size, offsets, count, buf, keys_out, rids_out,
+                         radix_bits, delimiter, numa);
+
+    barrier_wait(barrier, id, BARRIER_NUMA);
+    if (records)
+        finalize_records(count, buf, keys_out, words, partitions, next);
+    else if (columns)
+        finalize_columns(count, buf, keys_out, rids_out, payload, partitions, next);
+    else
+        finalize(count, buf, keys_out, rids_out, partitions, next);
     tim = micro_time() - tim;
     a->part_time[0] = tim;
 
     pthread_barrier_wait(d->sample_barrier);
     a->numa_shuffle_time = 0;
 
-    data_shuffling(d, numa, numa_node, numa_local_id, threads, threads_per_numa, numa_size, total_size, buf, global_barrier, seed, a, radix_bits, gb);
+    // skip passes over key bits that never vary and count the first
+    // local pass while shuffling
+    if (numa > 1 && key_words > 1)
+        plan_words(d, pass_bits, pass_shift, pass_word);
+    else if (numa > 1) {
+        uint64_t shuffled_size = 0;
+        for (t = 0 ; t != threads ; ++t)
+            shuffled_size += d->numa_local_count[t][numa_node];
+        shift_bits = plan_passes(d, pass_bits);
+        next = fuse_passes(&next_hist, d, id, pass_bits, shift_bits, threads_per_numa,
+                           (shuffled_size / threads_per_numa) & ~3);
+        counted = next != NULL;
+    }
+
+    numa_size = data_shuffling(d, numa, numa_node, numa_local_id, threads, threads_per_numa, numa_size, total_size, buf, barrier, a, radix_bits, next);
 
     uint64_t **keys_a = numa > 1 ? d->keys : d->keys_buf;
     uint64_t **rids_a = numa > 1 ? d->rids : d->rids_buf;
@@ -1544,38 +2677,83 @@ void *sort_thread(void *arg) {
     counts = d->count[numa_node];
     count = d->count[numa_node][numa_local_id];
     int pass = 0;
-    int shift_bits = 0;
-    while (d->bits[++pass]) {
+    while (pass_bits[++pass]) {
         if (pass != 1)
-            pthread_barrier_wait(&local_barrier[lb++]);
-        keys = &keys_a[numa_node][offset];
-        rids = &rids_a[numa_node][offset];
+            barrier_wait(barrier, id, BARRIER_NUMA);
+        else if (d->pipelined) {
+            // the histograms are free and the tuples of this thread are in
+            transfer_wait(&d->planned, threads);
+            transfer_wait(&d->arrived[numa_node * threads_per_numa + numa_local_id], size);
+        }
+        keys = &keys_a[numa_node][offset * words];
         keys_out = keys_b[numa_node];
-        rids_out = rids_b[numa_node];
-        shift_bits += radix_bits;
-        radix_bits = d->bits[pass];
+        if (!key_only) {
+            rids = rids_at(rids_a[numa_node], offset, payload);
+            rids_out = rids_b[numa_node];
+        }
+        radix_bits = pass_bits[pass];
         partitions = 1 << radix_bits;
         memset(count, 0, partitions * sizeof(uint64_t));
+        if (key_words > 1) {
+            shift_bits = pass_shift[pass];
+            digit_word = pass_word[pass];
+        }
+        // histogram, or the sum of the counts for this thread
         tim = micro_time();
-        histogram(keys, size, count, shift_bits, radix_bits);
+        if (counted) {
+            for (t = 0 ; t != threads ; ++t)
+                if (d->numa_node[t] == numa_node) {
+                    uint32_t *c = &d->next_count[t][numa_local_id << radix_bits];
+                    for (i = 0 ; i != partitions ; ++i)
+                        count[i] += c[i];
+                }
+        } else if (records)
+            histogram_records(keys, words, size, count, key_words, digit_word,
+                              shift_bits, radix_bits, NULL, 1, copies, NULL, NULL);
+        else
+            histogram(keys, size, count, shift_bits, radix_bits, copies, NULL, NULL);
         tim = micro_time() - tim;
         a->hist_time[pass] = tim;
-        pthread_barrier_wait(&local_barrier[lb++]);
+        barrier_wait(barrier, id, BARRIER_NUMA);
+        // the output is a source of the transfer until every thread drained it
+        if (pass == 1 && d->pipelined)
+            transfer_wait(&d->drained[numa_node], threads);
         tim = micro_time();
         partition_offsets(counts, partitions, numa_local_id, threads_per_numa, offsets);
-        partition(keys, rids, size, offsets, count, buf, keys_out, rids_out, shift_bits, radix_bits);
+        // count the next pass after others read the counts of this one
+        counted = next != NULL && pass_bits[pass + 1] != 0;
+        if (counted) {
+            next->shift_bits = shift_bits + radix_bits;
+            next->radix_bits = pass_bits[pass + 1];
+            memset(next->count, 0, (threads_per_numa << next->radix_bits) * sizeof(uint32_t));
+        }
+        if (records)
+            partition_records(keys, words, size, offsets, count, buf, keys_out, key_words,
+                              digit_word, shift_bits, radix_bits, NULL, 1, counted ? next : NULL);
+        else if (columns)
+            partition_columns(keys, rids, payload, size, offsets, count, buf, keys_out, rids_out,
+                              shift_bits, radix_bits, NULL, 1, counted ? next : NULL);
+        else
+            partition(keys, rids, size, offsets, count, buf, keys_out, rids_out, shift_bits, radix_bits,
+                      counted ? next : NULL);
         tim = micro_time() - tim;
         a->part_time[pass] = tim;
-        pthread_barrier_wait(&local_barrier[lb++]);
-        finalize(count, buf, keys_out, rids_out, partitions);
+        barrier_wait(barrier, id, BARRIER_NUMA);
+        if (records)
+            finalize_records(count, buf, keys_out, words, partitions, counted ? next : NULL);
+        else if (columns)
+            finalize_columns(count, buf, keys_out, rids_out, payload, partitions, counted ? next : NULL);
+        else
+            finalize(count, buf, keys_out, rids_out, partitions, counted ? next : NULL);
         swap_ppl(&keys_a, &keys_b);
         swap_ppl(&rids_a, &rids_b);
+        shift_bits += radix_bits;
     }
-    free(buf);
-    free(offsets);
+    if (id == 0)
+        d->passes = pass;
     if (numa > 1 && !numa_local_id)
         d->size[numa_node] = numa_size;
-    pthread_exit(NULL);
+    return NULL;
 }
 
 
@@ -1583,15 +2761,14 @@ void *sort_thread_old(void *arg)
 {
 	thread_data_t *a = (thread_data_t*) arg;
 	global_data_t *d = a->global;
-	int i, j, k, t, n, lb = 0, gb = 0, id = a->id;
+	int i, j, k, t, n, id = a->id;
 	int numa = d->numa;
 	int numa_node = d->numa_node[id];
 	int numa_dst, numa_src;
 	int threads = d->threads;
 	int threads_per_numa = threads / numa;
 	uint32_t seed = a->seed;
-	pthread_barrier_t *local_barrier = d->local_barrier[numa_node];
-	pthread_barrier_t *global_barrier = d->global_barrier;
+	barrier_t *barrier = d->barrier;
 	// id in local numa threads
 	int numa_local_id = 0;
 	for (i = 0 ; i != id ; ++i)
@@ -1602,11 +2779,6 @@ void *sort_thread_old(void *arg)
 	uint64_t total_size = 0;
 	for (n = 0 ; n != numa ; ++n)
 		total_size += d->size[n];
-	// bind thread and its allocation
-	if (threads <= d->max_threads)
-		cpu_bind(d->cpu[id]);
-	if (numa <= d->max_numa)
-		memory_bind(d->numa_node[id]);
 	// size for histograms
 	int radix_bits = d->bits[0];
 	int partitions = (1 << radix_bits) * (numa == 3 ? 4 : numa);
@@ -1638,7 +2810,7 @@ void *sort_thread_old(void *arg)
 				d->rids_buf[numa_node] = mamalloc(cap * sizeof(uint64_t));
 			}
 		}
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 	}
 	uint64_t *keys = &d->keys[numa_node][offset];
 	uint64_t *rids = &d->rids[numa_node][offset];
@@ -1651,7 +2823,7 @@ void *sort_thread_old(void *arg)
 			_mm_stream_si64((long long int*) &keys_buf[p], 0);
 		for (p = 0 ; p != size ; ++p)
 			_mm_stream_si64((long long int*) &rids_buf[p], 0);
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 	}
 	tim = micro_time() - tim;
 	a->alloc_time = tim;
@@ -1670,36 +2842,35 @@ void *sort_thread_old(void *arg)
 			sample[p] = keys[mulhi(rand64_next(gen), size)];
 		// (in-parallel) LSB radix-sort the sample
 		partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 0, 8,
-		               id, threads, &global_barrier[gb]);
+		               id, threads, barrier);
 		partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 8, 8,
-		               id, threads, &global_barrier[gb + 3]);
+		               id, threads, barrier);
 		partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 16, 8,
-		               id, threads, &global_barrier[gb + 6]);
+		               id, threads, barrier);
 		partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 24, 8,
-		               id, threads, &global_barrier[gb + 9]);
+		               id, threads, barrier);
 		partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 32, 8,
-		               id, threads, &global_barrier[gb + 12]);
+		               id, threads, barrier);
 		partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 40, 8,
-		               id, threads, &global_barrier[gb + 15]);
+		               id, threads, barrier);
 		partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 48, 8,
-		               id, threads, &global_barrier[gb + 18]);
+		               id, threads, barrier);
 		partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 56, 8,
-		               id, threads, &global_barrier[gb + 21]);
-		gb += 24;
-		extract_delimiters(d->sample, d->sample_size, delimiter);
+		               id, threads, barrier);
+		sample_delimiters_64(d->sample, d->sample_size, delimiter, NULL);
 	}
 	tim = micro_time() - tim;
 	a->sample_time = tim;
 	// histogram
 	tim = micro_time();
 	if (numa == 1)
-		histogram(keys, size, count, 0, radix_bits);
+		histogram(keys, size, count, 0, radix_bits, 1, NULL, NULL);
 	else if (numa == 2)
-		histogram_numa_2(keys, size, count, radix_bits, delimiter);
+		histogram_numa_2(keys, size, count, radix_bits, delimiter, 1, NULL, NULL);
 	else if (numa <= 4)
-		histogram_numa_4(keys, size, count, radix_bits, delimiter);
+		histogram_numa_4(keys, size, count, radix_bits, delimiter, 1, NULL, NULL);
 	else if (numa <= 8)
-		histogram_numa_8(keys, size, count, radix_bits, delimiter);
+		histogram_numa_8(keys, size, count, radix_bits, delimiter, 1, NULL, NULL);
 	tim = micro_time() - tim;
 	a->hist_time[0] = tim;
 	// local counts for numa transfer
@@ -1711,7 +2882,7 @@ void *sort_thread_old(void *arg)
 	}
 	d->numa_local_count[id] = numa_local_count;
 	// local sync and partition
-	pthread_barrier_wait(&local_barrier[lb++]);
+	barrier_wait(barrier, id, BARRIER_NUMA);
 	// offsets of output partitions
 	tim = micro_time();
 	uint64_t **counts = d->count[numa_node];
@@ -1722,7 +2893,7 @@ void *sort_thread_old(void *arg)
 	uint64_t *rids_out = d->rids_buf[numa_node];
 	if (numa == 1)
 		partition(keys, rids, size, offsets, count, buf,
-		          keys_out, rids_out, 0, radix_bits);
+		          keys_out, rids_out, 0, radix_bits, NULL);
 	else if (numa == 2)
 		partition_numa_2(keys, rids, size, offsets, count, buf,
 		                 keys_out, rids_out, radix_bits, delimiter);
@@ -1733,8 +2904,8 @@ void *sort_thread_old(void *arg)
 		partition_numa_8(keys, rids, size, offsets, count, buf,
 		                 keys_out, rids_out, radix_bits, delimiter);
 	// local sync and finalize
-	pthread_barrier_wait(&local_barrier[lb++]);
-	finalize(count, buf, keys_out, rids_out, partitions);
+	barrier_wait(barrier, id, BARRIER_NUMA);
+	finalize(count, buf, keys_out, rids_out, partitions, NULL);
 	tim = micro_time() - tim;
 	a->part_time[0] = tim;
 	// synchronize globally
@@ -1842,7 +3013,7 @@ void *sort_thread_old(void *arg)
 		tim = micro_time() - tim;
 		a->numa_shuffle_time = tim;
 		// sync globally
-		pthread_barrier_wait(&global_barrier[gb++]);
+		barrier_wait(barrier, id, BARRIER_GLOBAL);
 	}
 	// input and outputs
 	uint64_t **keys_a = numa > 1 ? d->keys : d->keys_buf;
@@ -1861,7 +3032,7 @@ void *sort_thread_old(void *arg)
 	while (d->bits[++pass]) {
 		// sync transfer phase
 		if (pass != 1)
-			pthread_barrier_wait(&local_barrier[lb++]);
+			barrier_wait(barrier, id, BARRIER_NUMA);
 		// start phase
 		keys = &keys_a[numa_node][offset];
 		rids = &rids_a[numa_node][offset];
@@ -1873,23 +3044,23 @@ void *sort_thread_old(void *arg)
 		memset(count, 0, partitions * sizeof(uint64_t));
 		// histogram
 		tim = micro_time();
-		histogram(keys, size, count, shift_bits, radix_bits);
+		histogram(keys, size, count, shift_bits, radix_bits, 1, NULL, NULL);
 		tim = micro_time() - tim;
 		a->hist_time[pass] = tim;
 		// sync histogram result
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 		// compute offsets and partition
 		tim = micro_time();
 		partition_offsets(counts, partitions, numa_local_id,
 				  threads_per_numa, offsets);
 		partition(keys, rids, size, offsets, count, buf,
-			  keys_out, rids_out, shift_bits, radix_bits);
+			  keys_out, rids_out, shift_bits, radix_bits, NULL);
 		tim = micro_time() - tim;
 		a->part_time[pass] = tim;
 		// sync partitioning across threads
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 		// finalize partitions
-		finalize(count, buf, keys_out, rids_out, partitions);
+		finalize(count, buf, keys_out, rids_out, partitions, NULL);
 		swap_ppl(&keys_a, &keys_b);
 		swap_ppl(&rids_a, &rids_b);
 	}
@@ -1900,35 +3071,31 @@ void *sort_thread_old(void *arg)
 	pthread_exit(NULL);
 }
 
-int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
-         int numa, int bits, double fudge, uint64_t **keys_buf, uint64_t **rids_buf,
-         char **description, uint64_t *times, int interleaved)
+int lsb_64_sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
+                int numa, int bits, double fudge, uint64_t **keys_buf, uint64_t **rids_buf,
+                int payload, int record, int key_words, char **description, uint64_t *times,
+                int interleaved)
 {
 	int i, j, p, t, n, bits_space[8];
-	int bit_passes = distribute_bits(bits, numa, bits_space, 0);
+	// composite keys sort all their bits
+	int bit_passes = distribute_bits(key_words > 1 ? 64 : bits, numa, bits_space, 0);
 	int threads_per_numa = threads / numa;
-	pthread_t *id = malloc(threads * sizeof(pthread_t));
-	thread_data_t *data = malloc(threads * sizeof(thread_data_t));
+	thread_data_t *data = calloc(threads, sizeof(thread_data_t));
+	// rids have payload bytes each (no rids sorts the keys alone)
+	assert(rids == NULL || payload == 1 || payload == 2 || payload == 4 || payload == 8);
+	// keys are records of up to 64 bytes with the key first (no rids)
+	assert(record % sizeof(uint64_t) == 0 && record >= (int) sizeof(uint64_t) && record <= 64);
+	assert(record == sizeof(uint64_t) || rids == NULL);
+	// composite keys of two words lead records
+	assert(key_words == 1 || (key_words == 2 && record >= 2 * (int) sizeof(uint64_t)));
 	// check aligned input
 	for (i = 0 ; i != numa ; ++i) {
 		assert((15 & (uint64_t) keys[i]) == 0);
-		assert((15 & (uint64_t) rids[i]) == 0);
+		assert(rids == NULL || (15 & (uint64_t) rids[i]) == 0);
 	}
-	// initialize global barriers
-	int local_barriers = 32;
-	int global_barriers = 28;
+	// initialize sample barrier
 	pthread_barrier_t sample_barrier;
-	pthread_barrier_t *global_barrier = malloc(global_barriers * sizeof(pthread_barrier_t));
-	pthread_barrier_t **local_barrier = malloc(numa * sizeof(pthread_barrier_t*));
 	pthread_barrier_init(&sample_barrier, NULL, threads + 1);
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_init(&global_barrier[t], NULL, threads);
-	// initialize local barriers
-	for (n = 0 ; n != numa ; ++n) {
-		local_barrier[n] = malloc(local_barriers * sizeof(pthread_barrier_t));
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_init(&local_barrier[n][t], NULL, threads_per_numa);
-	}
 	// universal meta data
 	global_data_t global;
 	global.numa = numa;
@@ -1942,9 +3109,10 @@ int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
 	global.size = size;
 	global.keys_buf = keys_buf;
 	global.rids_buf = rids_buf;
+	global.payload = rids == NULL ? 0 : payload;
+	global.words = record / sizeof(uint64_t);
+	global.key_words = key_words;
 	global.interleaved = interleaved;
-	global.global_barrier = global_barrier;
-	global.local_barrier = local_barrier;
 	global.sample_barrier = &sample_barrier;
 	// total array size
 	uint64_t total_size = 0;
@@ -1954,9 +3122,11 @@ int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
 	if (numa > 1) {
 		global.sample_size = 0.001 * total_size;
 		global.sample_size &= ~15;
-		if (global.sample_size > 100000)
-			global.sample_size = 100000;
-		global.sample	  = numa_alloc_interleaved(global.sample_size * sizeof(uint64_t));
+		// as many sampled keys per range past 8 nodes
+		uint64_t max_sample = numa > 8 ? 12500 * numa : 100000;
+		if (global.sample_size > max_sample)
+			global.sample_size = max_sample;
+		global.sample	  = numa_alloc_interleaved(global.sample_size * key_words * sizeof(uint64_t));
 		global.sample_buf = numa_alloc_interleaved(global.sample_size * sizeof(uint64_t));
 		global.sample_hist = malloc(threads * sizeof(uint64_t*));
 		for (t = 0 ; t != threads ; ++t)
@@ -1966,12 +3136,12 @@ int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
 	if (keys_buf[0] == NULL)
 		for (n = 0 ; n != numa ; ++n) {
 			assert(keys_buf[n] == NULL);
-			assert(rids_buf[n] == NULL);
+			assert(rids == NULL || rids_buf[n] == NULL);
 		}
 	else
 		for (n = 0 ; n != numa ; ++n) {
 			assert(keys_buf[n] != NULL);
-			assert(rids_buf[n] != NULL);
+			assert(rids == NULL || rids_buf[n] != NULL);
 		}
 	global.allocated = keys_buf[0] != NULL;
 	// counts
@@ -1981,22 +3151,31 @@ int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
 	global.numa_local_count = malloc(threads * sizeof(uint64_t*));
+	global.key_or = malloc(threads * key_words * sizeof(uint64_t));
+	global.key_and = malloc(threads * key_words * sizeof(uint64_t));
+	global.next_count = malloc(threads * sizeof(uint32_t*));
+	// tuples in per thread, threads done per source node, plans made
+	global.arrived = calloc(threads, sizeof(uint64_t));
+	global.drained = calloc(numa, sizeof(uint64_t));
+	global.planned = 0;
+	global.pipelined = numa > 1 && transfer_pipelined();
 	schedule_threads(global.cpu, global.numa_node, threads, numa);
-	// spawn threads
+	global.barrier = barrier_init(threads, global.cpu, global.numa_node, NULL);
+	// start workers
 	for (t = 0 ; t != threads ; ++t) {
 		data[t].id = t;
 		data[t].seed = rand();
 		data[t].global = &global;
-		pthread_create(&id[t], NULL, sort_thread, (void*) &data[t]);
 	}
+	pool_start(threads, threads <= global.max_threads ? global.cpu : NULL,
+	           sort_thread, data, sizeof(thread_data_t));
 	// free sample data
 	pthread_barrier_wait(&sample_barrier);
 	pthread_barrier_destroy(&sample_barrier);
-	numa_free(global.sample,     global.sample_size * sizeof(uint32_t));
+	numa_free(global.sample,     global.sample_size * key_words * sizeof(uint32_t));
 	numa_free(global.sample_buf, global.sample_size * sizeof(uint32_t));
-	// join threads
-	for (t = 0 ; t != threads ; ++t)
-		pthread_join(id[t], NULL);
+	// wait for workers
+	pool_wait();
 	// assemble times
 	uint64_t at = 0, dt = 0, st = 0;
 	uint64_t ht[] = {0, 0, 0, 0, 0, 0, 0, 0};
@@ -2026,38 +3205,47 @@ int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
 	times[13]= ht[5] / threads; description[13]= "6th radix histogram time:   ";
 	times[14]= pt[5] / threads; description[14]= "6th radix partition time:   ";
 	description[15] = NULL;
-	// destroy barriers
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_destroy(&global_barrier[t]);
-	for (n = 0 ; n != numa ; ++n) {
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_destroy(&local_barrier[n][t]);
-		free(local_barrier[n]);
+#ifndef CHIPLETSORT_LIBRARY
+	// data moved between nodes over the time of the slowest copier
+	if (numa > 1) {
+		uint64_t bytes = 0, slowest = 1;
+		for (t = 0 ; t != threads ; ++t) {
+			bytes += data[t].numa_shuffle_bytes;
+			if (data[t].numa_shuffle_time > slowest)
+				slowest = data[t].numa_shuffle_time;
+		}
+		fprintf(stderr, "Inter-node transfer: %.1f MB at %.2f GB / sec\n",
+		        bytes / (1024.0 * 1024), (bytes * 1000000.0) / (slowest * 1024.0 * 1024 * 1024));
 	}
-	free(local_barrier);
-	free(global_barrier);
+#endif
+	// destroy barrier
+	barrier_destroy(global.barrier);
 	// release memory
-	free(id);
 	free(global.numa_node);
 	free(global.cpu);
-	for (i = 0 ; i != numa ; ++i) {
-		for (j = 0 ; j != threads_per_numa ; ++j)
-			free(global.count[i][j]);
+	for (i = 0 ; i != numa ; ++i)
 		free(global.count[i]);
-	}
 	if (numa > 1) {
-		numa_free(global.sample,     global.sample_size * sizeof(uint64_t));
+		numa_free(global.sample,     global.sample_size * key_words * sizeof(uint64_t));
 		numa_free(global.sample_buf, global.sample_size * sizeof(uint64_t));
 	}
 	for (i = 0 ; i != threads ; ++i)
 		free(global.numa_local_count[i]);
 	free(global.numa_local_count);
+	free(global.key_or);
+	free(global.key_and);
+	free(global.next_count);
+	free(global.arrived);
+	free(global.drained);
 	free(global.count);
 	free(data);
+	bit_passes = global.passes;
 	if (numa > 1) bit_passes++;
 	return bit_passes & 1;
 }
 
+#ifndef CHIPLETSORT_LIBRARY
+
 void *check_thread(void *arg)
 {
 	thread_data_t *a = (thread_data_t*) arg;
@@ -2084,10 +3272,14 @@ void *check_thread(void *arg)
 		rids =	&d->rids[numa_node][offset];
 	uint64_t *keys_end = &keys[size];
 	uint64_t sum = 0;
-	uint64_t pkey = 0;
+	uint64_t pkey = 0, prid = 0;
 	while (keys != keys_end) {
 		uint64_t key = *keys++;
-		if (rids) assert(key == *rids++);
+		// stable sorts keep equal keys in the order of their rids
+		if (rids && d->stable) {
+			assert(key != pkey || *rids >= prid);
+			prid = *rids++;
+		} else if (rids) assert(key == *rids++);
 		assert(key >= pkey);
 		sum += key;
 		pkey = key;
@@ -2096,7 +3288,7 @@ void *check_thread(void *arg)
 	pthread_exit(NULL);
 }
 
-uint64_t check(uint64_t **keys, uint64_t **rids, uint64_t *size, int numa, int same)
+uint64_t check(uint64_t **keys, uint64_t **rids, uint64_t *size, int numa, int same, int stable)
 {
 	int max_threads = hardware_threads();
 	int n, t, threads = 0;
@@ -2107,7 +3299,8 @@ uint64_t check(uint64_t **keys, uint64_t **rids, uint64_t *size, int numa, int s
 	global.threads = threads;
 	global.numa = numa;
 	global.keys = keys;
-	global.rids = same ? rids : NULL;
+	global.rids = same || stable ? rids : NULL;
+	global.stable = stable;
 	global.size = size;
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
@@ -2121,6 +3314,10 @@ uint64_t check(uint64_t **keys, uint64_t **rids, uint64_t *size, int numa, int s
 	}
 	for (n = 1 ; n != numa ; ++n)
 		assert(keys[n][0] >= keys[n - 1][size[n - 1] - 1]);
+	if (stable)
+		for (n = 1 ; n != numa ; ++n)
+			assert(keys[n][0] != keys[n - 1][size[n - 1] - 1] ||
+			       rids[n][0] >= rids[n - 1][size[n - 1] - 1]);
 	uint64_t checksum = 0;
 	for (t = 0 ; t != threads ; ++t) {
 		pthread_join(id[t], NULL);
@@ -2173,10 +3370,79 @@ uint64_t read_from_file(uint64_t **keys, uint64_t *size, int numa, const char *n
 	return checksum;
 }
 
+// composite keys lead with few distinct values, as tenants
+#define TENANTS	13
+
+// records of words with the key first and key + j in word j, or zeros
+// without keys (for buffers), composite keys are (key % TENANTS, key)
+uint64_t *make_records(const uint64_t *keys, uint64_t size, uint64_t cap, int words,
+                       int key_words, int node, int interleaved)
+{
+	uint64_t i, bytes = cap * words * sizeof(uint64_t);
+	int j;
+	uint64_t *recs = interleaved ? numa_alloc_interleaved(bytes) :
+	                               numa_alloc_onnode(bytes, node);
+	assert(recs != NULL);
+	if (keys == NULL)
+		memset(recs, 0, bytes);
+	else
+		for (i = 0 ; i != size ; ++i) {
+			for (j = 0 ; j != words ; ++j)
+				recs[i * words + j] = keys[i] + j;
+			if (key_words > 1) {
+				recs[i * words] = keys[i] % TENANTS;
+				recs[i * words + 1] = keys[i];
+			}
+		}
+	return recs;
+}
+
+uint64_t check_records(uint64_t **recs, uint64_t *size, int numa, int words, int key_words)
+{
+	uint64_t i, sum = 0, ptenant = 0, pkey = 0;
+	int n, j;
+	for (n = 0 ; n != numa ; ++n)
+		for (i = 0 ; i != size[n] ; ++i) {
+			const uint64_t *rec = &recs[n][i * words];
+			uint64_t tenant = key_words > 1 ? rec[0] : 0;
+			uint64_t key = rec[key_words - 1];
+			assert(tenant > ptenant || (tenant == ptenant && key >= pkey));
+			assert(key_words == 1 || tenant == key % TENANTS);
+			for (j = key_words ; j != words ; ++j)
+				assert(rec[j] == key + j);
+			sum += key;
+			ptenant = tenant;
+			pkey = key;
+		}
+	return sum;
+}
+
 int main(int argc, char **argv)
 {
 	int r, i, max_threads = hardware_threads();
 	int max_numa = numa_max_node() + 1;
+	placement_init(&argc, argv, "linear");
+	// equal keys in the order of their rids, which are the input positions
+	const char *stable_option = option(&argc, argv, "stable", "CHIPLET_STABLE");
+	int stable = stable_option != NULL && atoi(stable_option);
+	// sort records of 16 to 64 bytes led by the key instead of pairs
+	const char *record_option = option(&argc, argv, "record", "CHIPLET_RECORD");
+	int record = record_option != NULL ? atoi(record_option) : 0;
+	if (record_option != NULL && (record < 16 || record > 64 || record % 8)) {
+		fprintf(stderr, "Unknown record size: %s (16 to 64 bytes, multiple of 8)\n", record_option);
+		exit(EXIT_FAILURE);
+	}
+	// and by composite keys of two words
+	const char *key_words_option = option(&argc, argv, "key-words", "CHIPLET_KEY_WORDS");
+	int key_words = key_words_option != NULL ? atoi(key_words_option) : 1;
+	if (key_words != 1 && key_words != 2) {
+		fprintf(stderr, "Unknown key words: %s (1, 2)\n", key_words_option);
+		exit(EXIT_FAILURE);
+	}
+	if (key_words > 1 && record == 0)
+		record = 2 * sizeof(uint64_t);
+	int words = record / sizeof(uint64_t);
+	double tuple_bytes = record ? record : 16.0;
 	uint64_t tuples = argc > 1 ? atoi(argv[1]) : 1000;
 	int threads = argc > 2 ? atoi(argv[2]) : max_threads;
 	int numa = argc > 3 ? atoi(argv[3]) : max_numa;
@@ -2200,7 +3466,7 @@ int main(int argc, char **argv)
 	int same_key_payload = 1;
 	tuples *= 1000000;
 	assert(bits > 0 && bits <= 64);
-	assert(numa > 0 && numa <= 8);
+	assert(numa > 0 && numa <= 64);
 	assert(threads >= numa && threads % numa == 0);
 	uint64_t tuples_per_numa = tuples / numa;
 	double fudge = 1.1;
@@ -2211,7 +3477,9 @@ int main(int argc, char **argv)
 	uint32_t seed = micro_time();
 	srand(seed);
 	fprintf(stderr, "Tuples: %.2f mil. (%.1f GB)\n", tuples / 1000000.0,
-			(tuples * 16.0) / (1024 * 1024 * 1024));
+			(tuples * tuple_bytes) / (1024 * 1024 * 1024));
+	if (record)
+		fprintf(stderr, "Records: %d bytes (%d-bit keys)\n", record, key_words * 64);
 	fprintf(stderr, "NUMA nodes: %d\n", numa);
 	if (interleaved)
 		fprintf(stderr, "Memory interleaved\n");
@@ -2224,6 +3492,8 @@ int main(int argc, char **argv)
 	fprintf(stderr, "Hardware threads: %d (%d per NUMA)\n",
 			max_threads, max_threads / max_numa);
 	fprintf(stderr, "Threads: %d (%d per NUMA)\n", threads, threads / numa);
+	fprintf(stderr, "Placement: %s\n", placement_name());
+	fprintf(stderr, "SIMD: %s\n", simd_name(simd_level()));
 	fprintf(stderr, "Sorting bits: %d\n", bits);
 	for (i = 0 ; i != numa ; ++i) {
 		size[i] = tuples_per_numa;
@@ -2253,10 +3523,23 @@ int main(int argc, char **argv)
 		same_key_payload = 0;
 		sum_v = init_64(rids, size, cap, threads, numa, 64, 0.0, 0, interleaved);
 	}
-	if (allocated) {
+	// records replace the keys and the rids
+	uint64_t *recs[numa], *recs_buf[numa];
+	for (i = 0 ; record && i != numa ; ++i) {
+		recs[i] = make_records(keys[i], size[i], cap[i], words, key_words, i, interleaved);
+		recs_buf[i] = allocated ? make_records(NULL, 0, cap[i], words, key_words, i, interleaved) : NULL;
+	}
+	if (allocated && !record) {
 		init_64(keys_buf, size, cap, threads, numa, 0, 0.0, 0, interleaved);
 		init_64(rids_buf, size, cap, threads, numa, 0, 0.0, 0, interleaved);
 	}
+	if (stable && !record) {
+		uint64_t p, at = 0;
+		for (i = 0 ; i != numa ; ++i)
+			for (p = 0 ; p != size[i] ; ++p)
+				rids[i][p] = at++;
+		same_key_payload = 0;
+	}
 	t = micro_time() - t;
 	fprintf(stderr, "Generation time: %ld us\n", t);
 	fprintf(stderr, "Generation rate: %.1f mrps\n", tuples * 1.0 / t);
@@ -2275,8 +3558,13 @@ int main(int argc, char **argv)
 
 	// call parallel sort
 	t = micro_time();
-	r = sort(keys, rids, size, threads, numa, bits, fudge,
-	         keys_buf, rids_buf, desc, times, interleaved);
+	if (record)
+		r = lsb_64_sort(recs, NULL, size, threads, numa, bits, fudge,
+		                recs_buf, NULL, 0, record, key_words, desc, times, interleaved);
+	else
+		r = lsb_64_sort(keys, rids, size, threads, numa, bits, fudge,
+		                keys_buf, rids_buf, sizeof(uint64_t), sizeof(uint64_t), 1,
+		                desc, times, interleaved);
 	t = micro_time() - t;
 
 	// PerfCounter_stopCounters(pc);
@@ -2289,10 +3577,10 @@ int main(int argc, char **argv)
 
 	// print bit passes
 	int bits_space[8];
-	distribute_bits(bits, numa, bits_space, 1);
+	distribute_bits(key_words > 1 ? 64 : bits, numa, bits_space, 1);
 	// print sort times
 	fprintf(stderr, "Sort time: %ld us\n", t);
-	double gigs = (tuples * 16.0) / (1024 * 1024 * 1024);
+	double gigs = (tuples * tuple_bytes) / (1024 * 1024 * 1024);
 	fprintf(stderr, "Sort rate: %.1f mrps (%.2f GB / sec)\n",
 		tuples * 1.0 / t, (gigs * 1000000) / t);
 	// compute total time
@@ -2312,8 +3600,17 @@ int main(int argc, char **argv)
 	else fprintf(stderr, "Destination remained the same\n");
 	uint64_t **keys_out = r ? keys_buf : keys;
 	uint64_t **rids_out = r ? rids_buf : rids;
-	uint64_t checksum = check(keys_out, rids_out, size, numa, same_key_payload);
+	uint64_t checksum = record ? check_records(r ? recs_buf : recs, size, numa, words, key_words) :
+	                    check(keys_out, rids_out, size, numa, same_key_payload, stable);
 	assert(checksum == sum_k);
+	for (i = 0 ; record && i != numa ; ++i) {
+		numa_free(recs[i], cap[i] * record);
+		// the sort allocates missing buffers
+		if (allocated || interleaved)
+			numa_free(recs_buf[i], cap[i] * record);
+		else
+			free(recs_buf[i]);
+	}
 	// free sort data
 	for (i = 0 ; i != numa ; ++i)
 		if (interleaved) {
@@ -2331,3 +3628,5 @@ int main(int argc, char **argv)
 		tuples * 1.0 / t, (gigs * 1000000) / t);
 	return EXIT_SUCCESS;
 }
+
+#endif
@@ -15,16 +15,21 @@
 #include <numaif.h>
 #undef _GNU_SOURCE
 
-#ifdef AVX
 #include <immintrin.h>
-#else
-#include <smmintrin.h>
-#endif
 
 #include "rand.h"
 #include "util.h"
-
+#include "topology.h"
+#include "placement.h"
+#include "barrier.h"
+#include "pool.h"
+#include "options.h"
+#include "stable.h"
+#include "simd.h"
+
+#ifndef CHIPLETSORT_LIBRARY
 #include "perf_counter.h"
+#endif
 
 #include <sys/mman.h>
 #include <errno.h>
@@ -50,50 +55,17 @@ int hardware_threads(void)
 	return cpus;
 }
 
-#define CHIPLETS 16
-#define CORES_PER_CHIPLET 8
-#define CORES_PER_NUMA_NODE 64
-
-int calculateCore(int core) {
-    int base = (core % CHIPLETS) * CORES_PER_CHIPLET;  // This calculates the multiple of 8 part
-    int cycle = core / CHIPLETS;       // This determines whether to add 0 or 1
-    
-    if (cycle % 2 == 0) {
-        return base;
-    } else {
-        return base + 1;
-    }
-}
-
-int calculatePattern(int n) {
-	int blockSize = 128;
-	int groupSize = 16;
-
-    int base = (n / blockSize) * blockSize;  // Calculate the base value for the current block
-    int offset = n % blockSize;              // Calculate the offset within the current block
-
-    // Calculate the output based on the offset
-    return base + (offset / groupSize) + (offset % groupSize) * (blockSize / groupSize);
-}
-
 void cpu_bind(int cpu_id)
 {
-	//Chiplet Local
-	// int newCore = cpu_id;
-	// Chiplet Mixed
-	int newCore = calculatePattern(cpu_id);
-
 	cpu_set_t cpu_set;
 	CPU_ZERO(&cpu_set);
-	CPU_SET(newCore, &cpu_set);
+	CPU_SET(cpu_id, &cpu_set);
 	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
-
-	int numa_node = newCore / CORES_PER_NUMA_NODE;
-	numa_node = numa_node % 2;
-    unsigned long nodemask = 1UL << numa_node;
-    if (set_mempolicy(MPOL_BIND, &nodemask, sizeof(nodemask) * 8) == -1) {
-        printf("set_mempolicy error");
-    }  
+	// allocate from the node of the chiplet
+	int numa_node = topology_numa_of_cpu(cpu_id);
+	unsigned long nodemask = 1UL << numa_node;
+	if (set_mempolicy(MPOL_BIND, &nodemask, sizeof(nodemask) * 8) == -1)
+		printf("set_mempolicy error");
 }
 
 void memory_bind(int cpu_id)
@@ -138,35 +110,7 @@ void swap_i(int *x, int *y)
 
 void schedule_threads(int *cpu, int *numa_node, int threads, int numa)
 {
-	int max_numa = numa_max_node() + 1;
-	int max_threads = hardware_threads();
-	int max_threads_per_numa = max_threads / max_numa;
-	int t, threads_per_numa = threads / numa;
-	assert(numa > 0 && threads >= numa && threads % numa == 0);
-	if (numa > max_numa ||
-	    threads > max_threads ||
-	    threads_per_numa > max_threads_per_numa)
-		for (t = 0 ; t != threads ; ++t) {
-			cpu[t] = t;
-			numa_node[t] = t / threads_per_numa;
-		}
-	else {
-		int *thread_numa = malloc(max_threads * sizeof(int));
-		for (t = 0 ; t != max_threads ; ++t)
-			thread_numa[t] = numa_node_of_cpu(t);
-		for (t = 0 ; t != threads ; ++t) {
-			int i, n = t % numa;
-			for (i = 0 ; i != max_threads ; ++i)
-				if (thread_numa[i] == n) break;
-			assert(i != max_threads);
-			thread_numa[i] = -1;
-			cpu[t] = i;
-			if (numa_node != NULL)
-				numa_node[t] = n;
-			assert(numa_node_of_cpu(i) == n);
-		}
-		free(thread_numa);
-	}
+	placement_schedule(cpu, numa_node, threads, numa);
 }
 
 inline uint64_t mulhi(uint64_t x, uint64_t y)
@@ -232,9 +176,36 @@ int distribute_bits(int bits, int numa, int pass[], int print)
 	return passes;
 }
 
+// re-plan the passes after the first on the bits that vary across keys
+// the first pass keeps its bits, returns the shift of the second pass
+int replan_bits(uint64_t varying, const int bits[], int pass[])
+{
+	int p, passes, max_bits = 0;
+	int low = bits[0], high = bits[0];
+	for (p = 1 ; bits[p] != 0 ; ++p) {
+		if (bits[p] > max_bits)
+			max_bits = bits[p];
+		high += bits[p];
+	}
+	// trim the constant low and high bits
+	while (low < high && !(varying & (((uint64_t) 1) << low)))
+		low++;
+	while (high > low && !(varying & (((uint64_t) 1) << (high - 1))))
+		high--;
+	passes = low == high ? 0 : ceil_div(high - low, max_bits);
+	int rem_bits = high - low;
+	pass[0] = bits[0];
+	for (p = 1 ; p <= passes ; ++p) {
+		pass[p] = ceil_div(rem_bits, passes - p + 1);
+		rem_bits -= pass[p];
+	}
+	pass[p] = 0;
+	return low;
+}
+
 void partition_keys(uint64_t *keys, uint64_t *keys_out, uint64_t size,
                     uint64_t **hist, uint8_t shift_bits, uint8_t radix_bits,
-                    int thread_id, int threads, pthread_barrier_t *barrier)
+                    int thread_id, int threads, barrier_t *barrier)
 {
 	// inputs and outputs must be aligned
 	assert(0 == (15 & (size_t) keys));
@@ -268,7 +239,7 @@ void partition_keys(uint64_t *keys, uint64_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete histogram generation
-	pthread_barrier_wait(&barrier[0]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// initialize buffer
 	uint64_t *buf = mamalloc((partitions << 3) * sizeof(uint64_t));
 	for (i = p = 0 ; p != partitions ; ++p) {
@@ -321,7 +292,7 @@ void partition_keys(uint64_t *keys, uint64_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete main partition part
-	pthread_barrier_wait(&barrier[1]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// flush remaining items from buffers to output
 	for (p = 0 ; p != partitions ; ++p) {
 		uint64_t *src = &buf[p << 3];
@@ -335,7 +306,7 @@ void partition_keys(uint64_t *keys, uint64_t *keys_out, uint64_t size,
 			_mm_stream_si64((long long *) &keys_out[index++], src[offset++]);
 	}
 	// wait all threads to complete last partition part
-	pthread_barrier_wait(&barrier[2]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// free(buf);
 
 }
@@ -347,9 +318,55 @@ void free_with_hugepages(uint64_t *ptr, uint64_t size) {
 }
 
 
-void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
-               uint8_t shift_bits, uint8_t radix_bits)
+// store the OR and the AND of all keys seen by a histogram
+void key_bits(__m128i k_or, __m128i k_and, uint64_t or_bits, uint64_t and_bits,
+              uint64_t *key_or, uint64_t *key_and)
+{
+	int i;
+	uint64_t v_or[2], v_and[2];
+	if (key_or == NULL) return;
+	_mm_storeu_si128((__m128i*) v_or, k_or);
+	_mm_storeu_si128((__m128i*) v_and, k_and);
+	for (i = 0 ; i != 2 ; ++i) {
+		or_bits |= v_or[i];
+		and_bits &= v_and[i];
+	}
+	*key_or = or_bits;
+	*key_and = and_bits;
+}
+
+// replicated counters for skewed input: lane j of a vector counts in
+// copy j % copies, the copies follow the histogram and are folded into it
+__m128i copy_lanes(int copies, uint64_t partitions)
+{
+	__m128i j = _mm_and_si128(_mm_set_epi32(3, 2, 1, 0), _mm_set1_epi32(copies - 1));
+	return _mm_mullo_epi32(j, _mm_set1_epi32(partitions));
+}
+
+void clear_copies(uint64_t *count, uint64_t partitions, int copies)
+{
+	memset(&count[partitions], 0, (copies - 1) * partitions * sizeof(uint64_t));
+}
+
+void fold_copies(uint64_t *count, uint64_t partitions, int copies)
+{
+	uint64_t i; int j;
+	for (j = 1 ; j < copies ; ++j)
+		for (i = 0 ; i != partitions ; ++i)
+			count[i] += count[j * partitions + i];
+}
+
+void histogram_sse(uint64_t *keys, uint64_t size, uint64_t *count,
+                   uint8_t shift_bits, uint8_t radix_bits,
+                   int copies, uint64_t *key_or, uint64_t *key_and)
 {
+    // lane j counts in copy j % copies
+    uint64_t copy_size = ((uint64_t) 1) << radix_bits;
+    __m128i lanes = copy_lanes(copies, copy_size);
+    clear_copies(count, copy_size, copies);
+    __m128i k_or = _mm_setzero_si128();
+    __m128i k_and = _mm_set1_epi64x(-1);
+    uint64_t or_bits = 0, and_bits = ~0;
     assert(radix_bits <= 16);
     __m128i s = _mm_set_epi32(0, 0, 0, shift_bits);
     __m128i m = _mm_set1_epi64x((1 << radix_bits) - 1);
@@ -361,6 +378,8 @@ void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
     uint64_t unaligned_keys[4];
     int unaligned_count = 0;
     while (((uintptr_t)keys & 15) && size > 0) {
+        or_bits |= *keys;
+        and_bits &= *keys;
         unaligned_keys[unaligned_count++] = *keys++;
         size--;
     }
@@ -375,6 +394,8 @@ void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
         k12 = _mm_load_si128((__m128i*) &keys[0]);
         k34 = _mm_load_si128((__m128i*) &keys[2]);
         keys += 4;
+        k_or = _mm_or_si128(k_or, _mm_or_si128(k12, k34));
+        k_and = _mm_and_si128(k_and, _mm_and_si128(k12, k34));
 
         __m128i h12 = _mm_srl_epi64(k12, s);
         __m128i h34 = _mm_srl_epi64(k34, s);
@@ -382,6 +403,8 @@ void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
         h34 = _mm_and_si128(h34, m);
         __m128i h = _mm_packus_epi32(h12, h34);
 
+        h = _mm_add_epi32(h, lanes);
+
         for (i = 0; i < 4; i++) {
             asm("movd %1, %%eax" : "=a"(p) : "x"(h), "0"(p));
             count[p]++;
@@ -404,6 +427,8 @@ void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
         h34 = _mm_and_si128(h34, m);
         __m128i h = _mm_packus_epi32(h12, h34);
 
+        h = _mm_add_epi32(h, lanes);
+
         for (i = 0; i < unaligned_count; i++) {
             asm("movd %1, %%eax" : "=a"(p) : "x"(h), "0"(p));
             count[p]++;
@@ -414,6 +439,8 @@ void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
     // Handle the final unaligned keys
     unaligned_count = 0;
     while (keys < keys_end) {
+        or_bits |= *keys;
+        and_bits &= *keys;
         unaligned_keys[unaligned_count++] = *keys++;
     }
     if (unaligned_count > 0) {
@@ -430,12 +457,147 @@ void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
         h34 = _mm_and_si128(h34, m);
         __m128i h = _mm_packus_epi32(h12, h34);
 
+        h = _mm_add_epi32(h, lanes);
+
         for (i = 0; i < unaligned_count; i++) {
             asm("movd %1, %%eax" : "=a"(p) : "x"(h), "0"(p));
             count[p]++;
             h = _mm_shuffle_epi32(h, _MM_SHUFFLE(0, 3, 2, 1));
         }
     }
+    fold_copies(count, copy_size, copies);
+    key_bits(k_or, k_and, or_bits, and_bits, key_or, key_and);
+}
+
+__attribute__((target("avx2")))
+void histogram_avx2(uint64_t *keys, uint64_t size, uint64_t *count,
+                    uint8_t shift_bits, uint8_t radix_bits,
+                    int copies, uint64_t *key_or, uint64_t *key_and)
+{
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 1) << radix_bits;
+	__m256i lanes = _mm256_mul_epu32(_mm256_and_si256(_mm256_set_epi64x(3, 2, 1, 0),
+	                                 _mm256_set1_epi64x(copies - 1)), _mm256_set1_epi64x(copy_size));
+	clear_copies(count, copy_size, copies);
+	__m256i k_or = _mm256_setzero_si256();
+	__m256i k_and = _mm256_set1_epi64x(-1);
+	uint64_t or_bits = 0, and_bits = ~0;
+	uint64_t *keys_end = &keys[size];
+	uint64_t partitions = 1 << radix_bits;
+	uint64_t h[4] __attribute__((aligned(32)));
+	while ((31 & ((uint64_t) keys)) && keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	__m256i m = _mm256_set1_epi64x(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint64_t *keys_aligned_end = &keys[(keys_end - keys) & ~7];
+	while (keys != keys_aligned_end) {
+		__m256i k1 = _mm256_load_si256((__m256i*) &keys[0]);
+		__m256i k2 = _mm256_load_si256((__m256i*) &keys[4]);
+		keys += 8;
+		k_or = _mm256_or_si256(k_or, _mm256_or_si256(k1, k2));
+		k_and = _mm256_and_si256(k_and, _mm256_and_si256(k1, k2));
+		k1 = _mm256_and_si256(_mm256_srl_epi64(k1, s), m);
+		k2 = _mm256_and_si256(_mm256_srl_epi64(k2, s), m);
+		k1 = _mm256_add_epi64(k1, lanes);
+		k2 = _mm256_add_epi64(k2, lanes);
+		_mm256_store_si256((__m256i*) h, k1);
+		count[h[0]]++;
+		count[h[1]]++;
+		count[h[2]]++;
+		count[h[3]]++;
+		_mm256_store_si256((__m256i*) h, k2);
+		count[h[0]]++;
+		count[h[1]]++;
+		count[h[2]]++;
+		count[h[3]]++;
+	}
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	__m128i lo_or  = _mm256_castsi256_si128(k_or);
+	__m128i hi_or  = _mm256_extracti128_si256(k_or, 1);
+	__m128i lo_and = _mm256_castsi256_si128(k_and);
+	__m128i hi_and = _mm256_extracti128_si256(k_and, 1);
+	fold_copies(count, copy_size, copies);
+	key_bits(_mm_or_si128(lo_or, hi_or), _mm_and_si128(lo_and, hi_and),
+	         or_bits, and_bits, key_or, key_and);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void histogram_avx512(uint64_t *keys, uint64_t size, uint64_t *count,
+                      uint8_t shift_bits, uint8_t radix_bits,
+                      int copies, uint64_t *key_or, uint64_t *key_and)
+{
+	// lane j counts in copy j % copies
+	uint64_t copy_size = ((uint64_t) 1) << radix_bits;
+	__m512i lanes = _mm512_mul_epu32(_mm512_and_si512(_mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0),
+	                                 _mm512_set1_epi64(copies - 1)), _mm512_set1_epi64(copy_size));
+	clear_copies(count, copy_size, copies);
+	__m512i k_or = _mm512_setzero_si512();
+	__m512i k_and = _mm512_set1_epi64(-1);
+	uint64_t or_bits = 0, and_bits = ~0;
+	uint64_t *keys_end = &keys[size];
+	uint64_t partitions = 1 << radix_bits;
+	uint32_t h[16] __attribute__((aligned(64)));
+	int i;
+	while ((63 & ((uint64_t) keys)) && keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	__m512i m = _mm512_set1_epi64(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint64_t *keys_aligned_end = &keys[(keys_end - keys) & ~15];
+	while (keys != keys_aligned_end) {
+		__m512i k1 = _mm512_load_si512(&keys[0]);
+		__m512i k2 = _mm512_load_si512(&keys[8]);
+		keys += 16;
+		k_or = _mm512_or_si512(k_or, _mm512_or_si512(k1, k2));
+		k_and = _mm512_and_si512(k_and, _mm512_and_si512(k1, k2));
+		k1 = _mm512_and_si512(_mm512_srl_epi64(k1, s), m);
+		k2 = _mm512_and_si512(_mm512_srl_epi64(k2, s), m);
+		k1 = _mm512_add_epi64(k1, lanes);
+		k2 = _mm512_add_epi64(k2, lanes);
+		// narrow the 16 partitions to one register
+		_mm256_store_si256((__m256i*) &h[0], _mm512_cvtepi64_epi32(k1));
+		_mm256_store_si256((__m256i*) &h[8], _mm512_cvtepi64_epi32(k2));
+		for (i = 0 ; i != 16 ; ++i)
+			count[h[i]]++;
+	}
+	while (keys != keys_end) {
+		or_bits |= *keys;
+		and_bits &= *keys;
+		count[(*keys++ >> shift_bits) & (partitions - 1)]++;
+	}
+	// fold the 512-bit masks to 128 bits
+	__m256i or_256  = _mm256_or_si256(_mm512_castsi512_si256(k_or),
+	                                  _mm512_extracti64x4_epi64(k_or, 1));
+	__m256i and_256 = _mm256_and_si256(_mm512_castsi512_si256(k_and),
+	                                   _mm512_extracti64x4_epi64(k_and, 1));
+	fold_copies(count, copy_size, copies);
+	key_bits(_mm_or_si128(_mm256_castsi256_si128(or_256),
+	                      _mm256_extracti128_si256(or_256, 1)),
+	         _mm_and_si128(_mm256_castsi256_si128(and_256),
+	                       _mm256_extracti128_si256(and_256, 1)),
+	         or_bits, and_bits, key_or, key_and);
+}
+
+void histogram(uint64_t *keys, uint64_t size, uint64_t *count,
+               uint8_t shift_bits, uint8_t radix_bits,
+               int copies, uint64_t *key_or, uint64_t *key_and)
+{
+	int level = simd_level();
+	if (level == SIMD_AVX512)
+		histogram_avx512(keys, size, count, shift_bits, radix_bits, copies, key_or, key_and);
+	else if (level == SIMD_AVX2)
+		histogram_avx2(keys, size, count, shift_bits, radix_bits, copies, key_or, key_and);
+	else
+		histogram_sse(keys, size, count, shift_bits, radix_bits, copies, key_or, key_and);
 }
 
 void histogram_old(uint64_t *keys, uint64_t size, uint64_t *count,
@@ -908,7 +1070,47 @@ void partition_bultin_expect(uint64_t* keys, uint64_t* rids, uint64_t size, uint
 #endif
 }
 
-void partition(uint64_t* keys, uint64_t* rids, uint64_t size, uint64_t* offsets, uint64_t* sizes, uint64_t* buf, uint64_t* keys_out, uint64_t* rids_out, uint8_t shift_bits, uint8_t radix_bits) {
+// fused histogram of the next pass: partition() and finalize() count the
+// next digit of the tuples they output for the thread (owner) that reads
+// that output position in the next pass, a line is counted as it flushes
+#define FUSED_COUNT_LIMIT	(1 << 18)
+
+typedef struct {
+	uint32_t *count;
+	uint64_t base;
+	uint64_t chunk;
+	uint64_t owners;
+	uint8_t shift_bits;
+	uint8_t radix_bits;
+} next_hist_t;
+
+// count the next digit of the buffered tuples at output positions [lo, hi]
+void next_count(const next_hist_t *next, const uint64_t *src, uint64_t lo, uint64_t hi)
+{
+	uint32_t shift = next->shift_bits;
+	uint64_t mask = (1 << next->radix_bits) - 1;
+	uint64_t owner = (lo - next->base) / next->chunk;
+	uint64_t end = next->base + (owner + 1) * next->chunk;
+	// the last owner also reads the remainder
+	if (owner >= next->owners - 1) {
+		owner = next->owners - 1;
+		end = ~0;
+	}
+	uint32_t *count = &next->count[owner << next->radix_bits];
+	if (hi < end)
+		for (; lo <= hi ; ++lo)
+			count[(src[(lo & 7) << 1] >> shift) & mask]++;
+	else
+		for (; lo <= hi ; ++lo) {
+			if (lo == end) {
+				count += mask + 1;
+				end = ++owner == next->owners - 1 ? ~ (uint64_t) 0 : end + next->chunk;
+			}
+			count[(src[(lo & 7) << 1] >> shift) & mask]++;
+		}
+}
+
+void partition_sse(uint64_t* keys, uint64_t* rids, uint64_t size, uint64_t* offsets, uint64_t* sizes, uint64_t* buf, uint64_t* keys_out, uint64_t* rids_out, uint8_t shift_bits, uint8_t radix_bits, const next_hist_t* next) {
     assert((63 & (uint64_t)keys_out) == 0);
     assert((63 & (uint64_t)rids_out) == 0);
     assert(radix_bits <= 16);
@@ -1032,6 +1234,12 @@ void partition(uint64_t* keys, uint64_t* rids, uint64_t size, uint64_t* offsets,
                 _mm_stream_si128((__m128i*)&dest_y[8], y2);
                 _mm_stream_si128((__m128i*)&dest_y[12], y3);
 
+                // Count the next digit of the tuples of this thread
+                if (next != NULL) {
+                    uint64_t first = offsets[p >> 4], lo = (index - 14) >> 1;
+                    next_count(next, src, lo < first ? first : lo, index >> 1);
+                }
+
                 // Restore overwritten pointer
                 src[14] = index + 2;
             }
@@ -1070,6 +1278,157 @@ void partition(uint64_t* keys, uint64_t* rids, uint64_t size, uint64_t* offsets,
 #endif
 }
 
+// stream a full buffer of 8 key / rid pairs as two cache lines
+__attribute__((target("avx2")))
+void flush_avx2(uint64_t *src, uint64_t *keys_out, uint64_t *rids_out)
+{
+	__m256i r0 = _mm256_load_si256((__m256i*) &src[0]);
+	__m256i r1 = _mm256_load_si256((__m256i*) &src[4]);
+	__m256i r2 = _mm256_load_si256((__m256i*) &src[8]);
+	__m256i r3 = _mm256_load_si256((__m256i*) &src[12]);
+	// split columns within lanes and fix the lane order
+	__m256i x0 = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(r0, r1), _MM_SHUFFLE(3, 1, 2, 0));
+	__m256i x1 = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(r2, r3), _MM_SHUFFLE(3, 1, 2, 0));
+	__m256i y0 = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(r0, r1), _MM_SHUFFLE(3, 1, 2, 0));
+	__m256i y1 = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(r2, r3), _MM_SHUFFLE(3, 1, 2, 0));
+	_mm256_stream_si256((__m256i*) &keys_out[0], x0);
+	_mm256_stream_si256((__m256i*) &keys_out[4], x1);
+	_mm256_stream_si256((__m256i*) &rids_out[0], y0);
+	_mm256_stream_si256((__m256i*) &rids_out[4], y1);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void flush_avx512(uint64_t *src, uint64_t *keys_out, uint64_t *rids_out)
+{
+	__m512i r0 = _mm512_load_si512(&src[0]);
+	__m512i r1 = _mm512_load_si512(&src[8]);
+	__m512i even = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+	__m512i odd  = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+	// one full cache line per store
+	_mm512_stream_si512((__m512i*) keys_out, _mm512_permutex2var_epi64(r0, even, r1));
+	_mm512_stream_si512((__m512i*) rids_out, _mm512_permutex2var_epi64(r0, odd, r1));
+}
+
+__attribute__((target("avx2")))
+void partition_avx2(uint64_t *keys, uint64_t *rids, uint64_t size,
+                    uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                    uint64_t *keys_out, uint64_t *rids_out,
+                    uint8_t shift_bits, uint8_t radix_bits,
+                    const next_hist_t *next)
+{
+	assert((63 & (uint64_t) keys_out) == 0);
+	assert((63 & (uint64_t) rids_out) == 0);
+	int i, partitions = 1 << radix_bits;
+	// initialize buffers (index counts 32-bit words)
+	for (i = 0 ; i != partitions ; ++i)
+		buf[(i << 4) | 14] = offsets[i] << 1;
+	__m256i m = _mm256_set1_epi64x(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint64_t h[4] __attribute__((aligned(32)));
+	uint64_t j, n = 0, block;
+	while (n != size) {
+		// 4 partitions at a time from aligned keys, else one
+		if ((31 & ((uint64_t) &keys[n])) || size - n < 4) {
+			h[0] = (keys[n] >> shift_bits) & (partitions - 1);
+			block = 1;
+		} else {
+			__m256i k = _mm256_load_si256((__m256i*) &keys[n]);
+			k = _mm256_and_si256(_mm256_srl_epi64(k, s), m);
+			_mm256_store_si256((__m256i*) h, k);
+			block = 4;
+		}
+		for (j = 0 ; j != block ; ++j, ++n) {
+			// offset in the cache line pair
+			uint64_t *src = &buf[h[j] << 4];
+			uint64_t index = src[14];
+			src[14] = index + 2;
+			uint64_t offset = index & 15;
+			src[offset] = keys[n];
+			src[offset + 1] = rids[n];
+			if (offset == 14) {
+				flush_avx2(src, &keys_out[(index - 14) >> 1],
+				           &rids_out[(index - 14) >> 1]);
+				// count the next digit of the tuples of this thread
+				if (next != NULL) {
+					uint64_t first = offsets[h[j]], lo = (index - 14) >> 1;
+					next_count(next, src, lo < first ? first : lo, index >> 1);
+				}
+				// restore overwritten pointer
+				src[14] = index + 2;
+			}
+		}
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+void partition_avx512(uint64_t *keys, uint64_t *rids, uint64_t size,
+                      uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+                      uint64_t *keys_out, uint64_t *rids_out,
+                      uint8_t shift_bits, uint8_t radix_bits,
+                      const next_hist_t *next)
+{
+	assert((63 & (uint64_t) keys_out) == 0);
+	assert((63 & (uint64_t) rids_out) == 0);
+	int i, partitions = 1 << radix_bits;
+	// initialize buffers (index counts 32-bit words)
+	for (i = 0 ; i != partitions ; ++i)
+		buf[(i << 4) | 14] = offsets[i] << 1;
+	__m512i m = _mm512_set1_epi64(partitions - 1);
+	__m128i s = _mm_cvtsi32_si128(shift_bits);
+	uint64_t h[8] __attribute__((aligned(64)));
+	uint64_t j, n = 0, block;
+	while (n != size) {
+		// 8 partitions at a time from aligned keys, else one
+		if ((63 & ((uint64_t) &keys[n])) || size - n < 8) {
+			h[0] = (keys[n] >> shift_bits) & (partitions - 1);
+			block = 1;
+		} else {
+			__m512i k = _mm512_load_si512(&keys[n]);
+			k = _mm512_and_si512(_mm512_srl_epi64(k, s), m);
+			_mm512_store_si512(h, k);
+			block = 8;
+		}
+		for (j = 0 ; j != block ; ++j, ++n) {
+			// offset in the cache line pair
+			uint64_t *src = &buf[h[j] << 4];
+			uint64_t index = src[14];
+			src[14] = index + 2;
+			uint64_t offset = index & 15;
+			src[offset] = keys[n];
+			src[offset + 1] = rids[n];
+			if (offset == 14) {
+				flush_avx512(src, &keys_out[(index - 14) >> 1],
+				             &rids_out[(index - 14) >> 1]);
+				// count the next digit of the tuples of this thread
+				if (next != NULL) {
+					uint64_t first = offsets[h[j]], lo = (index - 14) >> 1;
+					next_count(next, src, lo < first ? first : lo, index >> 1);
+				}
+				// restore overwritten pointer
+				src[14] = index + 2;
+			}
+		}
+	}
+}
+
+void partition(uint64_t *keys, uint64_t *rids, uint64_t size,
+               uint64_t *offsets, uint64_t *sizes, uint64_t *buf,
+               uint64_t *keys_out, uint64_t *rids_out,
+               uint8_t shift_bits, uint8_t radix_bits,
+               const next_hist_t *next)
+{
+	int level = simd_level();
+	if (level == SIMD_AVX512)
+		partition_avx512(keys, rids, size, offsets, sizes, buf,
+		                 keys_out, rids_out, shift_bits, radix_bits, next);
+	else if (level == SIMD_AVX2)
+		partition_avx2(keys, rids, size, offsets, sizes, buf,
+		               keys_out, rids_out, shift_bits, radix_bits, next);
+	else
+		partition_sse(keys, rids, size, offsets, sizes, buf,
+		              keys_out, rids_out, shift_bits, radix_bits, next);
+}
+
 void partition_normal(uint64_t* keys, uint64_t* rids, uint64_t size, uint64_t* offsets, uint64_t* sizes, uint64_t* buf, uint64_t* keys_out, uint64_t* rids_out, uint8_t shift_bits, uint8_t radix_bits) {
     assert((63 & (uint64_t)keys_out) == 0);
     assert((63 & (uint64_t)rids_out) == 0);
@@ -1234,7 +1593,8 @@ void partition_normal(uint64_t* keys, uint64_t* rids, uint64_t size, uint64_t* o
 }
 
 void finalize(uint64_t *sizes, uint64_t *buf,
-	      uint64_t *keys_out, uint64_t *rids_out, int partitions)
+	      uint64_t *keys_out, uint64_t *rids_out, int partitions,
+	      const next_hist_t *next)
 {	int i;
 	// find offset to align output
 	assert((63 & (uint64_t) keys_out) == 0);
@@ -1248,6 +1608,8 @@ void finalize(uint64_t *sizes, uint64_t *buf,
 		if (rem > sizes[i])
 			off = rem - sizes[i];
 		index -= rem - off;
+		if (next != NULL && off != rem)
+			next_count(next, src, index, index + rem - off - 1);
 		while (off != rem) {
 			keys_out[index] = src[off + off];
 			rids_out[index] = src[off + off + 1];
@@ -1283,6 +1645,7 @@ void extract_delimiters(uint64_t *sample, uint64_t sample_size, uint64_t *delimi
 
 typedef struct {
 	int *bits;
+	int passes;
 	double fudge;
 	uint64_t **keys;
 	uint64_t **rids;
@@ -1291,6 +1654,9 @@ typedef struct {
 	uint64_t **rids_buf;
 	uint64_t ***count;
 	uint64_t **numa_local_count;
+	uint64_t *key_or;
+	uint64_t *key_and;
+	uint32_t **next_count;
 	uint64_t *sample;
 	uint64_t *sample_buf;
 	uint64_t **sample_hist;
@@ -1303,9 +1669,9 @@ typedef struct {
 	int max_numa;
 	int allocated;
 	int interleaved;
-	pthread_barrier_t *global_barrier;
-	pthread_barrier_t **local_barrier;
+	barrier_t *barrier;
 	pthread_barrier_t *sample_barrier;
+	int stable;
 } global_data_t;
 
 typedef struct {
@@ -1327,22 +1693,75 @@ int uint64_compare(const void *x, const void *y)
 	return a < b ? -1 : (a > b ? 1 : 0);
 }
 
+// histogram counters are spread over copies when a key holds more than
+// 1/HEAVY_HITTER_SHARE of a sorted sample, so increments on skewed input
+// do not serialize on one location
+#define HISTOGRAM_COPIES	4
+#define HEAVY_HITTER_SHARE	16
+
+int histogram_copies(const uint64_t *sample, uint64_t sample_size)
+{
+	uint64_t i, run = 1, max_run = 1;
+	for (i = 1 ; i < sample_size ; ++i) {
+		run = sample[i] == sample[i - 1] ? run + 1 : 1;
+		if (run > max_run) max_run = run;
+	}
+	return sample_size && max_run * HEAVY_HITTER_SHARE >= sample_size ?
+	       HISTOGRAM_COPIES : 1;
+}
+
+
+
+
+// re-plan the local passes on the key bits that vary in any thread
+int plan_passes(const global_data_t *d, int pass_bits[])
+{
+	uint64_t key_or = 0, key_and = ~0;
+	int t;
+	for (t = 0 ; t != d->threads ; ++t) {
+		key_or |= d->key_or[t];
+		key_and &= d->key_and[t];
+	}
+	return replan_bits(key_or ^ key_and, d->bits, pass_bits);
+}
 
+// set up the fused histogram of the first local pass, NULL if the
+// counts of all owners for the widest local pass would not fit
+next_hist_t *fuse_passes(next_hist_t *next, global_data_t *d, int id,
+                         const int pass_bits[], int shift_bits, int owners, uint64_t chunk)
+{
+	int p, bits = 0;
+	for (p = 1 ; pass_bits[p] != 0 ; ++p)
+		if (pass_bits[p] > bits)
+			bits = pass_bits[p];
+	if (bits == 0 || chunk == 0 ||
+	    ((uint64_t) owners << bits) > FUSED_COUNT_LIMIT)
+		return NULL;
+	next->count = pool_scratch(id, 3, ((uint64_t) owners << bits) * sizeof(uint32_t));
+	next->base = 0;
+	next->chunk = chunk;
+	next->owners = owners;
+	next->shift_bits = shift_bits;
+	next->radix_bits = pass_bits[1];
+	// zero the counts of the first local pass and share them
+	memset(next->count, 0, ((uint64_t) owners << next->radix_bits) * sizeof(uint32_t));
+	d->next_count[id] = next->count;
+	return next;
+}
 
 void *sort_thread(void *arg)
 {
 
 	thread_data_t *a = (thread_data_t*) arg;
 	global_data_t *d = a->global;
-	int i, j, k, t, n, lb = 0, gb = 0, id = a->id;
+	int i, j, k, t, n, id = a->id;
 	int numa = d->numa;
 	int numa_node = d->numa_node[id];
 	int numa_dst, numa_src;
 	int threads = d->threads;
 	int threads_per_numa = threads / numa;
 	uint32_t seed = a->seed;
-	pthread_barrier_t *local_barrier = d->local_barrier[numa_node];
-	pthread_barrier_t *global_barrier = d->global_barrier;
+	barrier_t *barrier = d->barrier;
 	// id in local numa threads
 	int numa_local_id = 0;
 	for (i = 0 ; i != id ; ++i)
@@ -1352,9 +1771,6 @@ void *sort_thread(void *arg)
 	uint64_t total_size = 0;
 	for (n = 0 ; n != numa ; ++n)
 		total_size += d->size[n];
-	// bind thread and its allocation
-	if (threads <= d->max_threads)
-		cpu_bind(id);
 	// size for histograms
 	int radix_bits = d->bits[0];
 	int partitions = (1 << radix_bits) * (numa == 3 ? 4 : numa);
@@ -1365,9 +1781,11 @@ void *sort_thread(void *arg)
 			max_partitions = parts;
 	}
 	// initial histogram and buffers
-	uint64_t *offsets = malloc(max_partitions * sizeof(uint64_t));
-	uint64_t *count = calloc(max_partitions, sizeof(uint64_t));
-	uint64_t *buf = mamalloc((max_partitions << 4) * sizeof(uint64_t));
+	uint64_t *offsets = pool_scratch(id, 0, max_partitions * sizeof(uint64_t));
+	// counts have room for the histogram copies
+	uint64_t *count = pool_scratch(id, 1, max_partitions * HISTOGRAM_COPIES * sizeof(uint64_t));
+	memset(count, 0, max_partitions * sizeof(uint64_t));
+	uint64_t *buf = pool_scratch(id, 2, (max_partitions << 4) * sizeof(uint64_t));
 	d->count[numa_node][numa_local_id] = count;
 	uint64_t numa_size = d->size[numa_node];
 	uint64_t size = numa_size / threads_per_numa;
@@ -1386,7 +1804,7 @@ void *sort_thread(void *arg)
 				d->rids_buf[numa_node] = mamalloc(cap * sizeof(uint64_t));
 			}
 		}
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 	}
 	uint64_t *keys = &d->keys[numa_node][offset];
 	uint64_t *rids = &d->rids[numa_node][offset];
@@ -1399,7 +1817,7 @@ void *sort_thread(void *arg)
 			_mm_stream_si64((long long int*) &keys_buf[p], 0);
 		for (p = 0 ; p != size ; ++p)
 			_mm_stream_si64((long long int*) &rids_buf[p], 0);
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 	}
 	tim = micro_time() - tim;
 	a->alloc_time = tim;
@@ -1407,11 +1825,24 @@ void *sort_thread(void *arg)
 	tim = micro_time();
 	uint64_t *delimiter = calloc(numa, sizeof(uint64_t));
 	delimiter[numa - 1] = ~0;
+	// spread histogram counters if a few keys dominate
+	int copies;
+	{
+		uint64_t local[256];
+		uint64_t p, local_size = size < 256 ? size : 256;
+		rand64_t *gen = rand64_init(a->seed ^ 1);
+		for (p = 0 ; p != local_size ; ++p)
+			local[p] = keys[mulhi(rand64_next(gen), size)];
+		free(gen);
+		qsort(local, local_size, sizeof(uint64_t), uint64_compare);
+		copies = histogram_copies(local, local_size);
+	}
 	tim = micro_time() - tim;
 	a->sample_time = tim;
 	// histogram
 	tim = micro_time();
-	histogram(keys, size, count, 0, radix_bits);
+	histogram(keys, size, count, 0, radix_bits, copies,
+	          &d->key_or[id], &d->key_and[id]);
 	tim = micro_time() - tim;
 	a->hist_time[0] = tim;
 	// local counts for numa transfer
@@ -1423,7 +1854,17 @@ void *sort_thread(void *arg)
 	}
 	d->numa_local_count[id] = numa_local_count;
 	// local sync and partition
-	pthread_barrier_wait(&local_barrier[lb++]);
+	barrier_wait(barrier, id, BARRIER_NUMA);
+	// one node has the key bits of all threads and can count the first
+	// local pass while partitioning the first
+	int pass_bits[8], shift_bits = 0, counted = 0;
+	next_hist_t next_hist, *next = NULL;
+	if (numa == 1) {
+		shift_bits = plan_passes(d, pass_bits);
+		next = fuse_passes(&next_hist, d, id, pass_bits, shift_bits, threads,
+		                   (numa_size / threads) & ~3);
+		counted = next != NULL;
+	}
 	// offsets of output partitions
 	tim = micro_time();
 	uint64_t **counts = d->count[numa_node];
@@ -1433,15 +1874,21 @@ void *sort_thread(void *arg)
 	uint64_t *keys_out = d->keys_buf[numa_node];
 	uint64_t *rids_out = d->rids_buf[numa_node];
 	partition(keys, rids, size, offsets, count, buf,
-	          keys_out, rids_out, 0, radix_bits);
+	          keys_out, rids_out, 0, radix_bits, next);
 	// local sync and finalize
-	pthread_barrier_wait(&local_barrier[lb++]);
-	finalize(count, buf, keys_out, rids_out, partitions);
+	barrier_wait(barrier, id, BARRIER_NUMA);
+	finalize(count, buf, keys_out, rids_out, partitions, next);
 	tim = micro_time() - tim;
 	a->part_time[0] = tim;
 	// synchronize globally
 	pthread_barrier_wait(d->sample_barrier);
 	a->numa_shuffle_time = 0;
+	// skip passes over key bits that never vary
+	if (numa > 1) {
+		shift_bits = plan_passes(d, pass_bits);
+		next = fuse_passes(&next_hist, d, id, pass_bits, shift_bits, threads_per_numa,
+		                   (numa_size / threads_per_numa) & ~3);
+	}
 	// input and outputs
 	uint64_t **keys_a = numa > 1 ? d->keys : d->keys_buf;
 	uint64_t **rids_a = numa > 1 ? d->rids : d->rids_buf;
@@ -1455,76 +1902,82 @@ void *sort_thread(void *arg)
 	counts = d->count[numa_node];
 	count = d->count[numa_node][numa_local_id];
 	int pass = 0;
-	int shift_bits = 0;
-	while (d->bits[++pass]) {
+	while (pass_bits[++pass]) {
 		// sync transfer phase
 		if (pass != 1)
-			pthread_barrier_wait(&local_barrier[lb++]);
+			barrier_wait(barrier, id, BARRIER_NUMA);
 		// start phase
 		keys = &keys_a[numa_node][offset];
 		rids = &rids_a[numa_node][offset];
 		keys_out = keys_b[numa_node];
 		rids_out = rids_b[numa_node];
-		shift_bits += radix_bits;
-		radix_bits = d->bits[pass];
+		radix_bits = pass_bits[pass];
 		partitions = 1 << radix_bits;
 		memset(count, 0, partitions * sizeof(uint64_t));
-		// histogram
+		// histogram, or the sum of the counts for this thread
 		tim = micro_time();
-		histogram(keys, size, count, shift_bits, radix_bits);
+		if (counted) {
+			for (t = 0 ; t != threads ; ++t)
+				if (d->numa_node[t] == numa_node) {
+					uint32_t *c = &d->next_count[t][numa_local_id << radix_bits];
+					for (i = 0 ; i != partitions ; ++i)
+						count[i] += c[i];
+				}
+		} else
+			histogram(keys, size, count, shift_bits, radix_bits, copies, NULL, NULL);
 		tim = micro_time() - tim;
 		a->hist_time[pass] = tim;
 		// sync histogram result
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 		// compute offsets and partition
 		tim = micro_time();
 		partition_offsets(counts, partitions, numa_local_id,
 				  threads_per_numa, offsets);
+		// count the next pass after others read the counts of this one
+		counted = next != NULL && pass_bits[pass + 1] != 0;
+		if (counted) {
+			next->shift_bits = shift_bits + radix_bits;
+			next->radix_bits = pass_bits[pass + 1];
+			memset(next->count, 0, (threads_per_numa << next->radix_bits) * sizeof(uint32_t));
+		}
 		partition(keys, rids, size, offsets, count, buf,
-			  keys_out, rids_out, shift_bits, radix_bits);
+			  keys_out, rids_out, shift_bits, radix_bits,
+			  counted ? next : NULL);
 		tim = micro_time() - tim;
 		a->part_time[pass] = tim;
 		// sync partitioning across threads
-		pthread_barrier_wait(&local_barrier[lb++]);
+		barrier_wait(barrier, id, BARRIER_NUMA);
 		// finalize partitions
-		finalize(count, buf, keys_out, rids_out, partitions);
+		finalize(count, buf, keys_out, rids_out, partitions,
+			 counted ? next : NULL);
 		swap_ppl(&keys_a, &keys_b);
 		swap_ppl(&rids_a, &rids_b);
+		shift_bits += radix_bits;
 	}
+	if (id == 0)
+		d->passes = pass;
 	if (numa > 1 && !numa_local_id)
 		d->size[numa_node] = numa_size;
-	pthread_exit(NULL);
+	return NULL;
 }
 
-int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
-         int numa, int bits, double fudge, uint64_t **keys_buf, uint64_t **rids_buf,
-         char **description, uint64_t *times, int interleaved)
+int chiplet_lsb_64_sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
+                        int numa, int bits, double fudge, uint64_t **keys_buf, uint64_t **rids_buf,
+                        char **description, uint64_t *times, int interleaved)
 {
 	int i, j, p, t, n, bits_space[8];
 	int bit_passes = distribute_bits(bits, numa, bits_space, 0);
 	int threads_per_numa = threads / numa;
-	pthread_t *id = mamalloc(threads * sizeof(pthread_t));
 	thread_data_t *data = mamalloc(threads * sizeof(thread_data_t));
+	memset(data, 0, threads * sizeof(thread_data_t));
 	// check aligned input
 	for (i = 0 ; i != numa ; ++i) {
 		assert((15 & (uint64_t) keys[i]) == 0);
 		assert((15 & (uint64_t) rids[i]) == 0);
 	}
-	// initialize global barriers
-	int local_barriers = 32;
-	int global_barriers = 28;
+	// initialize sample barrier
 	pthread_barrier_t sample_barrier;
-	pthread_barrier_t *global_barrier = malloc(global_barriers * sizeof(pthread_barrier_t));
-	pthread_barrier_t **local_barrier = malloc(numa * sizeof(pthread_barrier_t*));
 	pthread_barrier_init(&sample_barrier, NULL, threads + 1);
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_init(&global_barrier[t], NULL, threads);
-	// initialize local barriers
-	for (n = 0 ; n != numa ; ++n) {
-		local_barrier[n] = malloc(local_barriers * sizeof(pthread_barrier_t));
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_init(&local_barrier[n][t], NULL, threads_per_numa);
-	}
 	// universal meta data
 	global_data_t global;
 	global.numa = numa;
@@ -1539,8 +1992,6 @@ int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
 	global.keys_buf = keys_buf;
 	global.rids_buf = rids_buf;
 	global.interleaved = interleaved;
-	global.global_barrier = global_barrier;
-	global.local_barrier = local_barrier;
 	global.sample_barrier = &sample_barrier;
 	// total array size
 	uint64_t total_size = 0;
@@ -1566,22 +2017,26 @@ int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
 	global.numa_local_count = malloc(threads * sizeof(uint64_t*));
+	global.key_or = malloc(threads * sizeof(uint64_t));
+	global.key_and = malloc(threads * sizeof(uint64_t));
+	global.next_count = malloc(threads * sizeof(uint32_t*));
 	schedule_threads(global.cpu, global.numa_node, threads, numa);
-	// spawn threads
+	global.barrier = barrier_init(threads, global.cpu, global.numa_node, NULL);
+	// start workers
 	for (t = 0 ; t != threads ; ++t) {
 		data[t].id = t;
 		data[t].seed = rand();
 		data[t].global = &global;
-		pthread_create(&id[t], NULL, sort_thread, (void*) &data[t]);
 	}
+	pool_start(threads, threads <= global.max_threads ? global.cpu : NULL,
+	           sort_thread, data, sizeof(thread_data_t));
 	// free sample data
 	pthread_barrier_wait(&sample_barrier);
 	pthread_barrier_destroy(&sample_barrier);
 	numa_free(global.sample,     global.sample_size * sizeof(uint32_t));
 	numa_free(global.sample_buf, global.sample_size * sizeof(uint32_t));
-	// join threads
-	for (t = 0 ; t != threads ; ++t)
-		pthread_join(id[t], NULL);
+	// wait for workers
+	pool_wait();
 	// assemble times
 	uint64_t at = 0, dt = 0, st = 0;
 	uint64_t ht[] = {0, 0, 0, 0, 0, 0, 0, 0};
@@ -1611,32 +2066,27 @@ int sort(uint64_t **keys, uint64_t **rids, uint64_t *size, int threads,
 	times[13]= ht[5] / threads; description[13]= "6th radix histogram time:   ";
 	times[14]= pt[5] / threads; description[14]= "6th radix partition time:   ";
 	description[15] = NULL;
-	// destroy barriers
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_destroy(&global_barrier[t]);
-	for (n = 0 ; n != numa ; ++n) {
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_destroy(&local_barrier[n][t]);
-		free(local_barrier[n]);
-	}
-	free(local_barrier);
-	free(global_barrier);
+	// destroy barrier
+	barrier_destroy(global.barrier);
 	// release memory
 	free(global.numa_node);
 	free(global.cpu);
-	for (i = 0 ; i != numa ; ++i) {
-		for (j = 0 ; j != threads_per_numa ; ++j)
-			free(global.count[i][j]);
+	for (i = 0 ; i != numa ; ++i)
 		free(global.count[i]);
-	}
 	for (i = 0 ; i != threads ; ++i)
 		free(global.numa_local_count[i]);
 	free(global.numa_local_count);
+	free(global.key_or);
+	free(global.key_and);
+	free(global.next_count);
 	free(global.count);
+	bit_passes = global.passes;
 	if (numa > 1) bit_passes++;
 	return bit_passes & 1;
 }
 
+#ifndef CHIPLETSORT_LIBRARY
+
 void *check_thread(void *arg)
 {
 	thread_data_t *a = (thread_data_t*) arg;
@@ -1663,10 +2113,14 @@ void *check_thread(void *arg)
 		rids =	&d->rids[numa_node][offset];
 	uint64_t *keys_end = &keys[size];
 	uint64_t sum = 0;
-	uint64_t pkey = 0;
+	uint64_t pkey = 0, prid = 0;
 	while (keys != keys_end) {
 		uint64_t key = *keys++;
-		if (rids) assert(key == *rids++);
+		// stable sorts keep equal keys in the order of their rids
+		if (rids && d->stable) {
+			assert(key != pkey || *rids >= prid);
+			prid = *rids++;
+		} else if (rids) assert(key == *rids++);
 		assert(key >= pkey);
 		sum += key;
 		pkey = key;
@@ -1675,7 +2129,7 @@ void *check_thread(void *arg)
 	pthread_exit(NULL);
 }
 
-uint64_t check(uint64_t **keys, uint64_t **rids, uint64_t *size, int numa, int same)
+uint64_t check(uint64_t **keys, uint64_t **rids, uint64_t *size, int numa, int same, int stable)
 {
 	int max_threads = hardware_threads();
 	int n, t, threads = 0;
@@ -1686,7 +2140,8 @@ uint64_t check(uint64_t **keys, uint64_t **rids, uint64_t *size, int numa, int s
 	global.threads = threads;
 	global.numa = numa;
 	global.keys = keys;
-	global.rids = same ? rids : NULL;
+	global.rids = same || stable ? rids : NULL;
+	global.stable = stable;
 	global.size = size;
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
@@ -1700,6 +2155,10 @@ uint64_t check(uint64_t **keys, uint64_t **rids, uint64_t *size, int numa, int s
 	}
 	for (n = 1 ; n != numa ; ++n)
 		assert(keys[n][0] >= keys[n - 1][size[n - 1] - 1]);
+	if (stable)
+		for (n = 1 ; n != numa ; ++n)
+			assert(keys[n][0] != keys[n - 1][size[n - 1] - 1] ||
+			       rids[n][0] >= rids[n - 1][size[n - 1] - 1]);
 	uint64_t checksum = 0;
 	for (t = 0 ; t != threads ; ++t) {
 		pthread_join(id[t], NULL);
@@ -1708,7 +2167,6 @@ uint64_t check(uint64_t **keys, uint64_t **rids, uint64_t *size, int numa, int s
 	free(global.numa_node);
 	free(global.cpu);
 	free(data);
-	free(id);
 	return checksum;
 }
 
@@ -1756,6 +2214,11 @@ int main(int argc, char **argv)
 {
 	int r, i, max_threads = hardware_threads();
 	int max_numa = numa_max_node() + 1;
+	placement_init(&argc, argv, "mixed");
+	// equal keys in the order of their rids, which are the input positions,
+	// on more than one node at the cost of a tie-break pass over the output
+	const char *stable_option = option(&argc, argv, "stable", "CHIPLET_STABLE");
+	int stable = stable_option != NULL && atoi(stable_option);
 	uint64_t tuples = argc > 1 ? atoi(argv[1]) : 1000;
 	int threads = argc > 2 ? atoi(argv[2]) : max_threads;
 	int numa = argc > 3 ? atoi(argv[3]) : max_numa;
@@ -1803,7 +2266,10 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Buffers not pre-allocated\n");
 	fprintf(stderr, "Hardware threads: %d (%d per NUMA)\n",
 			max_threads, max_threads / max_numa);
+	topology_print(topology());
 	fprintf(stderr, "Threads: %d (%d per NUMA)\n", threads, threads / numa);
+	fprintf(stderr, "Placement: %s\n", placement_name());
+	fprintf(stderr, "SIMD: %s\n", simd_name(simd_level()));
 	fprintf(stderr, "Sorting bits: %d\n", bits);
 	for (i = 0 ; i != numa ; ++i) {
 		size[i] = tuples_per_numa;
@@ -1837,6 +2303,13 @@ int main(int argc, char **argv)
 		init_64(keys_buf, size, cap, threads, numa, 0, 0.0, 0, interleaved);
 		init_64(rids_buf, size, cap, threads, numa, 0, 0.0, 0, interleaved);
 	}
+	if (stable) {
+		uint64_t p, at = 0;
+		for (i = 0 ; i != numa ; ++i)
+			for (p = 0 ; p != size[i] ; ++p)
+				rids[i][p] = at++;
+		same_key_payload = 0;
+	}
 	t = micro_time() - t;
 	fprintf(stderr, "Generation time: %ld us\n", t);
 	fprintf(stderr, "Generation rate: %.1f mrps\n", tuples * 1.0 / t);
@@ -1855,8 +2328,14 @@ int main(int argc, char **argv)
     PerfCounter_startCounters(pc);
 	
 	t = micro_time();
-	r = sort(keys, rids, size, threads, numa, bits, fudge,
-	         keys_buf, rids_buf, desc, times, interleaved);
+	r = chiplet_lsb_64_sort(keys, rids, size, threads, numa, bits, fudge,
+	                        keys_buf, rids_buf, desc, times, interleaved);
+	// put the rids of equal keys in order across nodes
+	uint64_t stable_time = micro_time();
+	if (stable && numa > 1)
+		stable_ties((void**) (r ? keys_buf : keys), (void**) (r ? rids_buf : rids),
+		            size, numa, sizeof(uint64_t), sizeof(uint64_t), threads, NULL);
+	stable_time = micro_time() - stable_time;
 	t = micro_time() - t;
 
 	PerfCounter_stopCounters(pc);
@@ -1872,6 +2351,8 @@ int main(int argc, char **argv)
 	distribute_bits(bits, numa, bits_space, 1);
 	// print sort times
 	fprintf(stderr, "Sort time: %ld us\n", t);
+	if (stable && numa > 1)
+		fprintf(stderr, "Stable tie-break time: %ld us\n", stable_time);
 	double gigs = (tuples * 16.0) / (1024 * 1024 * 1024);
 	fprintf(stderr, "Sort rate: %.1f mrps (%.2f GB / sec)\n",
 		tuples * 1.0 / t, (gigs * 1000000) / t);
@@ -1892,7 +2373,7 @@ int main(int argc, char **argv)
 	else fprintf(stderr, "Destination remained the same\n");
 	uint64_t **keys_out = r ? keys_buf : keys;
 	uint64_t **rids_out = r ? rids_buf : rids;
-	uint64_t checksum = check(keys_out, rids_out, size, numa, same_key_payload);
+	uint64_t checksum = check(keys_out, rids_out, size, numa, same_key_payload, stable);
 	// assert(checksum == sum_k);
 	// free sort data
 	for (i = 0 ; i != numa ; ++i)
@@ -1911,3 +2392,5 @@ int main(int argc, char **argv)
 		tuples * 1.0 / t, (gigs * 1000000) / t);
 	return EXIT_SUCCESS;
 }
+
+#endif
@@ -55,6 +55,12 @@
 
 #include "rand.h"
 #include "util.h"
+#include "placement.h"
+#include "barrier.h"
+#include "pool.h"
+#include "options.h"
+#include "stable.h"
+#include "sample.h"
 
 
 uint64_t micro_time(void)
@@ -183,39 +189,64 @@ inline uint64_t binary_search_64(uint64_t *keys, uint64_t size, uint64_t key)
 
 void schedule_threads(int *cpu, int *numa_node, int threads, int numa)
 {
-	int max_numa = numa_max_node() + 1;
-	int max_threads = hardware_threads();
-	int max_threads_per_numa = max_threads / max_numa;
-	int t, threads_per_numa = threads / numa;
-	assert(numa > 0 && threads >= numa && threads % numa == 0);
-	if (numa > max_numa ||
-	    threads > max_threads ||
-	    threads_per_numa > max_threads_per_numa)
-		for (t = 0 ; t != threads ; ++t) {
-			cpu[t] = t;
-			numa_node[t] = t / threads_per_numa;
-		}
-	else {
-		int *thread_numa = malloc(max_threads * sizeof(int));
-		for (t = 0 ; t != max_threads ; ++t)
-			thread_numa[t] = numa_node_of_cpu(t);
-		for (t = 0 ; t != threads ; ++t) {
-			int i, n = t % numa;
-			for (i = 0 ; i != max_threads ; ++i)
-				if (thread_numa[i] == n) break;
-			assert(i != max_threads);
-			thread_numa[i] = -1;
-			cpu[t] = i;
-			if (numa_node != NULL)
-				numa_node[t] = n;
-			assert(numa_node_of_cpu(i) == n);
-		}
-		free(thread_numa);
+	placement_schedule(cpu, numa_node, threads, numa);
+}
+
+// 16-way search tree over the (converted) delimiters: level[0] is the
+// root and level[levels - 1] the delimiters, every delimiter of a level
+// is the last one of a node in the level below, unused root slots hold
+// the largest key
+uint32_t *range_tree(uint32_t *delim, uint64_t partitions,
+		     uint32_t **level, int *levels)
+{
+	assert(partitions >= 16 && partitions <= 1024);
+	assert((partitions & (partitions - 1)) == 0);
+	assert((15 & (uint64_t) delim) == 0);
+	uint64_t i, n = partitions, tree_size = 0;
+	int l = 0;
+	do {
+		tree_size += (n + 15) & ~15;
+		n >>= 4; l++;
+	} while (n > 1);
+	*levels = l;
+	uint32_t *tree = mamalloc(tree_size * sizeof(uint32_t));
+	uint32_t convert = ((uint32_t) 1) << 31;
+	for (i = 0 ; i != partitions ; ++i)
+		tree[i] = delim[i] - convert;
+	uint32_t *below = tree;
+	level[--l] = below;
+	for (n = partitions ; l ; n >>= 4) {
+		uint32_t *above = &below[n];
+		uint64_t m = n >> 4;
+		for (i = 0 ; i != ((m + 15) & ~15) ; ++i)
+			above[i] = i < m ? below[(i << 4) | 15] : ~0 - convert;
+		level[--l] = below = above;
+	}
+	return tree;
+}
+
+// range of a converted key in all lanes, 16 delimiters per level
+inline uint64_t range_search(__m128i k, uint32_t **level, int levels)
+{
+	uint64_t p = 0;
+	int l;
+	for (l = 0 ; l != levels ; ++l) {
+		__m128i *node = (__m128i*) &level[l][p << 4];
+		__m128i f1 = _mm_cmpgt_epi32(k, _mm_load_si128(&node[0]));
+		__m128i f2 = _mm_cmpgt_epi32(k, _mm_load_si128(&node[1]));
+		__m128i f3 = _mm_cmpgt_epi32(k, _mm_load_si128(&node[2]));
+		__m128i f4 = _mm_cmpgt_epi32(k, _mm_load_si128(&node[3]));
+		__m128i f12 = _mm_packs_epi32(f1, f2);
+		__m128i f34 = _mm_packs_epi32(f3, f4);
+		__m128i f = _mm_packs_epi16(f12, f34);
+		// first delimiter not less than the key
+		p = (p << 4) | __builtin_ctz(~_mm_movemask_epi8(f));
 	}
+	return p;
 }
 
-void range_histogram(uint32_t *keys, uint8_t *ranges, uint64_t size,
-		     uint64_t *count, uint32_t delim[])
+void range_histogram(uint32_t *keys, uint16_t *ranges, uint64_t size,
+		     uint64_t *count, uint32_t delim[], uint64_t partitions)
 {
 	assert((15 & (uint64_t) keys) == 0);
 	assert((15 & (uint64_t) delim) == 0);
@@ -223,68 +254,29 @@ void range_histogram(uint32_t *keys, uint8_t *ranges, uint64_t size,
 	if (!size) return;
 	uint32_t *keys_end = &keys[size];
 	uint64_t p = 0, q = 0; uint8_t i;
-	uint64_t convert = 1 << 31;
-	uint32_t *cdelim = mamalloc(128 * sizeof(uint32_t));
-	for (p = 0 ; p != 128 ; ++p)
-		cdelim[p] = delim[p] - convert;
-	__m128i c = _mm_set1_epi32(convert);
-	__m128i d1 = _mm_set1_epi32(cdelim[15]);
-	__m128i d2 = _mm_set1_epi32(cdelim[31]);
-	__m128i d3 = _mm_set1_epi32(cdelim[47]);
-	__m128i d4 = _mm_set1_epi32(cdelim[63]);
-	__m128i d5 = _mm_set1_epi32(cdelim[79]);
-	__m128i d6 = _mm_set1_epi32(cdelim[95]);
-	__m128i d7 = _mm_set1_epi32(cdelim[111]);
-	__m128i I = _mm_set1_epi32(~0);
-	int32_t *ranges_32 = (int32_t*) ranges;
+	uint32_t *level[4];
+	int levels;
+	uint32_t *tree = range_tree(delim, partitions, level, &levels);
+	__m128i c = _mm_set1_epi32(((uint32_t) 1) << 31);
+	int64_t *ranges_64 = (int64_t*) ranges;
 	do {
 		__m128i k = _mm_load_si128((__m128i*) keys);
 		keys += 4;
 		k = _mm_sub_epi32(k, c);
-		__m128i e1 = _mm_cmpgt_epi32(k, d4);
-		__m128i d26 = _mm_blendv_epi8(d2, d6, e1);
-		__m128i d15 = _mm_blendv_epi8(d1, d5, e1);
-		__m128i d37 = _mm_blendv_epi8(d3, d7, e1);
-		__m128i e2 = _mm_cmpgt_epi32(k, d26);
-		__m128i d1357 = _mm_blendv_epi8(d15, d37, e2);
-		__m128i e3 = _mm_cmpgt_epi32(k, d1357);
-		__m128i r = _mm_setzero_si128();
-		r = _mm_sub_epi32(r, e1);
-		r = _mm_add_epi32(r, r);
-		r = _mm_sub_epi32(r, e2);
-		r = _mm_add_epi32(r, r);
-		r = _mm_sub_epi32(r, e3);
-		r = _mm_slli_epi32(r, 4);
 		uint64_t ra = 0;
-		for (i = 0 ; i != 32 ; i += 8) {
-			asm("movd	%1, %%eax" : "=a"(p) : "x"(r), "0"(p));
-			__m128i di1 = _mm_load_si128((__m128i*) &cdelim[p]);
-			__m128i di2 = _mm_load_si128((__m128i*) &cdelim[p + 4]);
-			__m128i di3 = _mm_load_si128((__m128i*) &cdelim[p + 8]);
-			__m128i di4 = _mm_load_si128((__m128i*) &cdelim[p + 12]);
+		for (i = 0 ; i != 64 ; i += 16) {
 			__m128i k_x4 = _mm_shuffle_epi32(k, 0);
-			__m128i f1 = _mm_cmpgt_epi32(k_x4, di1);
-			__m128i f2 = _mm_cmpgt_epi32(k_x4, di2);
-			__m128i f3 = _mm_cmpgt_epi32(k_x4, di3);
-			__m128i f4 = _mm_cmpgt_epi32(k_x4, di4);
-			__m128i f12 = _mm_packs_epi32(f1, f2);
-			__m128i f34 = _mm_packs_epi32(f3, f4);
-			__m128i f = _mm_packs_epi16(f12, f34);
-			f = _mm_xor_si128(f, I);
-			asm("pmovmskb	%1, %%ebx" : "=b"(q) : "x"(f), "0"(q));
-			asm("bsfl	%%ebx, %%ebx" : "=b"(q) : "0"(q) : "cc");
-			p |= q;
+			p = range_search(k_x4, level, levels);
 			count[p]++;
 #ifdef BG
-			uint32_t key = keys[(i >> 3) - 4];
+			uint32_t key = keys[(i >> 4) - 4];
 			assert(p == 0 || key > delim[p - 1]);
 			assert(key <= delim[p]);
 #endif
 			ra |= (p << i);
 			k = _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 2, 1));
-			r = _mm_shuffle_epi32(r, _MM_SHUFFLE(0, 3, 2, 1));
 		}
-		_mm_stream_si32(ranges_32++, ra);
+		_mm_stream_si64((long long*) ranges_64++, ra);
 	} while (keys != keys_end);
 #ifdef BG
 	keys -= size;
@@ -295,10 +287,10 @@ void range_histogram(uint32_t *keys, uint8_t *ranges, uint64_t size,
 		assert(key <= delim[q]);
 	}
 #endif
-	free(cdelim);
+	free(tree);
 }
 
-void partition_known(uint32_t *keys, uint32_t *rids, uint8_t *ranges, uint64_t size,
+void partition_known(uint32_t *keys, uint32_t *rids, uint16_t *ranges, uint64_t size,
 		     uint64_t *sizes, uint32_t *keys_out, uint32_t *rids_out,
 		     uint64_t partitions)
 {
@@ -320,11 +312,10 @@ void partition_known(uint32_t *keys, uint32_t *rids, uint8_t *ranges, uint64_t s
 	// loop of data partitioning
 	uint32_t *keys_end = &keys[size];
 	do {
-		__m128i d = _mm_load_si128((__m128i*) ranges);
 		for (i = 0 ; i != 16 ; i += 4) {
 			__m128i k = _mm_load_si128((__m128i*) &keys[i]);
 			__m128i v = _mm_load_si128((__m128i*) &rids[i]);
-			__m128i h = _mm_cvtepu8_epi32(d);
+			__m128i h = _mm_cvtepu16_epi32(_mm_loadl_epi64((__m128i*) &ranges[i]));
 			h = _mm_slli_epi32(h, 4);
 			for (j = 0 ; j != 4 ; ++j) {
 				// extract partition
@@ -376,8 +367,6 @@ void partition_known(uint32_t *keys, uint32_t *rids, uint8_t *ranges, uint64_t s
 				k = _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 2, 1));
 				v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 2, 1));
 			}
-			// rotate 16 hashes
-			d = _mm_shuffle_epi32(d, _MM_SHUFFLE(0, 3, 2, 1));
 		}
 		// update pointers
 		keys += 16;
@@ -426,11 +415,11 @@ void check_range_partition(uint32_t *keys, uint64_t size, uint64_t *count,
 }
 
 uint64_t range_partition_to_blocks(uint32_t *keys, uint32_t *rids, uint64_t size,
-	    uint32_t *keys_out, uint32_t *rids_out, uint32_t delim[],
-	    volatile uint8_t *partition, uint64_t block_offset, uint64_t block_cap,
+	    uint32_t *keys_out, uint32_t *rids_out, uint32_t delim[], int partitions,
+	    volatile int16_t *partition, uint64_t block_offset, uint64_t block_cap,
 	    uint64_t *open_block_index, uint64_t *open_block_size)
 {
-	int i, partitions = 128;
+	int i;
 	assert((15 & (uint64_t) keys) == 0);
 	assert((15 & (uint64_t) rids) == 0);
 	assert((63 & (uint64_t) keys_out) == 0);
@@ -440,7 +429,7 @@ uint64_t range_partition_to_blocks(uint32_t *keys, uint32_t *rids, uint64_t size
 	// initialize buffers
 	uint8_t block_cap_bits = log_2(block_cap);
 	uint64_t block_cap_mask = block_cap - 1;
-	uint64_t p = 0, q = 0;
+	uint64_t p = 0;
 	uint64_t blocks = partitions;
 	uint64_t *buf = mamalloc((partitions << 4) * sizeof(uint64_t));
 	for (i = 0 ; i != partitions ; ++i) {
@@ -448,56 +437,18 @@ uint64_t range_partition_to_blocks(uint32_t *keys, uint32_t *rids, uint64_t size
 		partition[i + block_offset] = i;
 	}
 	// main partition loop
-	uint32_t *cdelim = mamalloc(128 * sizeof(uint32_t));
-	uint64_t convert = 1 << 31;
-	for (p = 0 ; p != 128 ; ++p)
-		cdelim[p] = delim[p] - convert;
-	__m128i c = _mm_set1_epi32(convert);
-	__m128i d1 = _mm_set1_epi32(cdelim[15]);
-	__m128i d2 = _mm_set1_epi32(cdelim[31]);
-	__m128i d3 = _mm_set1_epi32(cdelim[47]);
-	__m128i d4 = _mm_set1_epi32(cdelim[63]);
-	__m128i d5 = _mm_set1_epi32(cdelim[79]);
-	__m128i d6 = _mm_set1_epi32(cdelim[95]);
-	__m128i d7 = _mm_set1_epi32(cdelim[111]);
-	__m128i I = _mm_set1_epi32(~0); p = 0;
+	uint32_t *level[4];
+	int levels;
+	uint32_t *tree = range_tree(delim, partitions, level, &levels);
+	__m128i c = _mm_set1_epi32(((uint32_t) 1) << 31);
 	while (keys != keys_end) {
 		__m128i k = _mm_load_si128((__m128i*) keys);
 		__m128i v = _mm_load_si128((__m128i*) rids);
 		keys += 4; rids += 4;
 		k = _mm_sub_epi32(k, c);
-		__m128i e1 = _mm_cmpgt_epi32(k, d4);
-		__m128i d26 = _mm_blendv_epi8(d2, d6, e1);
-		__m128i d15 = _mm_blendv_epi8(d1, d5, e1);
-		__m128i d37 = _mm_blendv_epi8(d3, d7, e1);
-		__m128i e2 = _mm_cmpgt_epi32(k, d26);
-		__m128i d1357 = _mm_blendv_epi8(d15, d37, e2);
-		__m128i e3 = _mm_cmpgt_epi32(k, d1357);
-		__m128i r = _mm_setzero_si128();
-		r = _mm_sub_epi32(r, e1);
-		r = _mm_add_epi32(r, r);
-		r = _mm_sub_epi32(r, e2);
-		r = _mm_add_epi32(r, r);
-		r = _mm_sub_epi32(r, e3);
-		r = _mm_slli_epi32(r, 4);
 		for (i = 0 ; i != 4 ; ++i) {
-			asm("movd	%1, %%eax" : "=a"(p) : "x"(r), "0"(p));
-			__m128i di1 = _mm_load_si128((__m128i*) &cdelim[p]);
-			__m128i di2 = _mm_load_si128((__m128i*) &cdelim[p + 4]);
-			__m128i di3 = _mm_load_si128((__m128i*) &cdelim[p + 8]);
-			__m128i di4 = _mm_load_si128((__m128i*) &cdelim[p + 12]);
 			__m128i k_x4 = _mm_shuffle_epi32(k, 0);
-			__m128i f1 = _mm_cmpgt_epi32(k_x4, di1);
-			__m128i f2 = _mm_cmpgt_epi32(k_x4, di2);
-			__m128i f3 = _mm_cmpgt_epi32(k_x4, di3);
-			__m128i f4 = _mm_cmpgt_epi32(k_x4, di4);
-			__m128i f12 = _mm_packs_epi32(f1, f2);
-			__m128i f34 = _mm_packs_epi32(f3, f4);
-			__m128i f = _mm_packs_epi16(f12, f34);
-			f = _mm_xor_si128(f, I);
-			asm("pmovmskb	%1, %%ebx" : "=b"(q) : "x"(f), "0"(q));
-			asm("bsfl	%%ebx, %%ebx" : "=b"(q) : "0"(q) : "cc");
-			p |= q;
+			p = range_search(k_x4, level, levels);
 #ifdef BG
 			uint32_t key = keys[i - 4];
 			assert(p == 0 || key > delim[p - 1]);
@@ -557,12 +508,11 @@ uint64_t range_partition_to_blocks(uint32_t *keys, uint32_t *rids, uint64_t size
 				}
 			}
 			// rotate
-			r = _mm_shuffle_epi32(r, _MM_SHUFFLE(0, 3, 2, 1));
 			k = _mm_shuffle_epi32(k, _MM_SHUFFLE(0, 3, 2, 1));
 			v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 3, 2, 1));
 		}
 	}
-	free(cdelim);
+	free(tree);
 	// flush remaining items from buffers to output
 	for (i = 0 ; i != partitions ; ++i) {
 		uint64_t *src = &buf[i << 4];
@@ -680,7 +630,7 @@ void partition_ip_buf(uint32_t *keys, uint32_t *rids, uint64_t size,
 	keys -= virtual_add;
 	rids -= virtual_add;
 	// initialize buffers
-	uint64_t to = virtual_add;
+	uint64_t to = virtual_add, last = virtual_add + size;
 	for (i = 0 ; i != partitions ; ++i) {
 		uint64_t from = to;
 		to += sizes[i];
@@ -751,36 +701,44 @@ void partition_ip_buf(uint32_t *keys, uint32_t *rids, uint64_t size,
 		}
 		float *keys_out = (float*) &keys[index - 16];
 		float *rids_out = (float*) &rids[index - 16];
-		// load first half buffered cache line
-		__m128 r0 = _mm_load_ps((float*) &addr[0]);
-		__m128 r1 = _mm_load_ps((float*) &addr[2]);
-		__m128 r2 = _mm_load_ps((float*) &addr[4]);
-		__m128 r3 = _mm_load_ps((float*) &addr[6]);
-		// split half line
-		__m128 x0 = _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(2, 0, 2, 0));
-		__m128 y0 = _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(3, 1, 3, 1));
-		__m128 x1 = _mm_shuffle_ps(r2, r3, _MM_SHUFFLE(2, 0, 2, 0));
-		__m128 y1 = _mm_shuffle_ps(r2, r3, _MM_SHUFFLE(3, 1, 3, 1));
-		// stream half line
-		_mm_stream_ps(&keys_out[16], x0);
-		_mm_stream_ps(&rids_out[16], y0);
-		_mm_stream_ps(&keys_out[20], x1);
-		_mm_stream_ps(&rids_out[20], y1);
-		// load second half buffered cache line
-		__m128 r4 = _mm_load_ps((float*) &addr[8]);
-		__m128 r5 = _mm_load_ps((float*) &addr[10]);
-		__m128 r6 = _mm_load_ps((float*) &addr[12]);
-		__m128 r7 = _mm_load_ps((float*) &addr[14]);
-		// split half line
-		__m128 x2 = _mm_shuffle_ps(r4, r5, _MM_SHUFFLE(2, 0, 2, 0));
-		__m128 y2 = _mm_shuffle_ps(r4, r5, _MM_SHUFFLE(3, 1, 3, 1));
-		__m128 x3 = _mm_shuffle_ps(r6, r7, _MM_SHUFFLE(2, 0, 2, 0));
-		__m128 y3 = _mm_shuffle_ps(r6, r7, _MM_SHUFFLE(3, 1, 3, 1));
-		// stream half line
-		_mm_stream_ps(&keys_out[24], x2);
-		_mm_stream_ps(&rids_out[24], y2);
-		_mm_stream_ps(&keys_out[28], x3);
-		_mm_stream_ps(&rids_out[28], y3);
+		// the last line of the range may hold items of another thread
+		if (index + 16 > last)
+			for (j = 0 ; index + j != last ; ++j) {
+				keys[index + j] = (uint32_t)  addr[j];
+				rids[index + j] = (uint32_t) (addr[j] >> 32);
+			}
+		else {
+			// load first half buffered cache line
+			__m128 r0 = _mm_load_ps((float*) &addr[0]);
+			__m128 r1 = _mm_load_ps((float*) &addr[2]);
+			__m128 r2 = _mm_load_ps((float*) &addr[4]);
+			__m128 r3 = _mm_load_ps((float*) &addr[6]);
+			// split half line
+			__m128 x0 = _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 y0 = _mm_shuffle_ps(r0, r1, _MM_SHUFFLE(3, 1, 3, 1));
+			__m128 x1 = _mm_shuffle_ps(r2, r3, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 y1 = _mm_shuffle_ps(r2, r3, _MM_SHUFFLE(3, 1, 3, 1));
+			// stream half line
+			_mm_stream_ps(&keys_out[16], x0);
+			_mm_stream_ps(&rids_out[16], y0);
+			_mm_stream_ps(&keys_out[20], x1);
+			_mm_stream_ps(&rids_out[20], y1);
+			// load second half buffered cache line
+			__m128 r4 = _mm_load_ps((float*) &addr[8]);
+			__m128 r5 = _mm_load_ps((float*) &addr[10]);
+			__m128 r6 = _mm_load_ps((float*) &addr[12]);
+			__m128 r7 = _mm_load_ps((float*) &addr[14]);
+			// split half line
+			__m128 x2 = _mm_shuffle_ps(r4, r5, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 y2 = _mm_shuffle_ps(r4, r5, _MM_SHUFFLE(3, 1, 3, 1));
+			__m128 x3 = _mm_shuffle_ps(r6, r7, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 y3 = _mm_shuffle_ps(r6, r7, _MM_SHUFFLE(3, 1, 3, 1));
+			// stream half line
+			_mm_stream_ps(&keys_out[24], x2);
+			_mm_stream_ps(&rids_out[24], y2);
+			_mm_stream_ps(&keys_out[28], x3);
+			_mm_stream_ps(&rids_out[28], y3);
+		}
 		// load half items from columns
 		__m128i x4 = _mm_load_si128((__m128i*) &keys_out[0]);
 		__m128i y4 = _mm_load_si128((__m128i*) &rids_out[0]);
@@ -933,7 +891,7 @@ void local_radixsort(uint32_t *keys, uint32_t *rids, uint64_t size,
 
 void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 		    uint64_t **hist, uint8_t shift_bits, uint8_t radix_bits,
-		    int thread_id, int threads, pthread_barrier_t *barrier)
+		    int thread_id, int threads, barrier_t *barrier)
 {
 	// inputs and outputs must be aligned
 	assert(0 == (15 & (size_t) keys));
@@ -964,7 +922,7 @@ void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete histogram generation
-	pthread_barrier_wait(&barrier[0]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// initialize buffer
 	uint64_t *index = malloc(partitions * sizeof(uint64_t));
 	uint32_t *buf = mamalloc((partitions << 4) * sizeof(uint32_t));
@@ -1008,7 +966,7 @@ void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 		}
 	}
 	// wait all threads to complete main partition part
-	pthread_barrier_wait(&barrier[1]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	// flush remaining items from buffers to output
 	for (p = 0 ; p != partitions ; ++p) {
 		uint32_t *src = &buf[p << 4];
@@ -1022,7 +980,7 @@ void partition_keys(uint32_t *keys, uint32_t *keys_out, uint64_t size,
 			_mm_stream_si32(&keys_out[indexl++], src[offset++]);
 	}
 	// wait all threads to complete last partition part
-	pthread_barrier_wait(&barrier[2]);
+	barrier_wait(barrier, thread_id, BARRIER_GLOBAL);
 	free(index);
 	free(buf);
 }
@@ -1185,26 +1143,6 @@ uint64_t inject(uint32_t *keys, uint32_t *rids, uint64_t *size,
 	return total;
 }
 
-void extract_delimiters(uint32_t *sample, uint64_t sample_size, uint32_t *delimiter)
-{
-	uint64_t i, parts = 0;
-	while (delimiter[parts] != ~0) parts++;
-	double percentile = sample_size * 1.0 / (parts + 1);
-	for (i = 0 ; i != parts ; ++i) {
-		uint64_t index = percentile * (i + 1) - 0.001;
-		delimiter[i] = sample[index];
-		// search repetitions in sample
-		uint64_t start, end;
-		for (start = index ; start ; --start)
-			if (sample[start] != delimiter[i]) break;
-		for (end = index ; end != sample_size ; ++end)
-			if (sample[end] != delimiter[i]) break;
-		// if more repetitions after, don't include
-		if (index - start < end - index && delimiter[i])
-			delimiter[i]--;
-	}
-}
-
 inline uint8_t ceil_log(uint64_t x)
 {
 	uint8_t p = 0;
@@ -1288,7 +1226,7 @@ typedef struct {
 	uint64_t **thread_total_blocks;
 	volatile uint64_t **thread_unused_blocks;
 	// block map of items
-	volatile int8_t **block_map;
+	volatile int16_t **block_map;
 	uint64_t **count_blocks;
 	uint64_t *numa_blocks;
 	volatile uint64_t *more_blocks;
@@ -1324,9 +1262,10 @@ typedef struct {
 	int threads;
 	int max_numa;
 	int max_threads;
-	pthread_barrier_t *global_barrier;
-	pthread_barrier_t **local_barrier;
+	barrier_t *barrier;
 	pthread_barrier_t *sample_barrier;
+	int fanout;
+	int stable;
 } global_data_t;
 
 typedef struct {
@@ -1352,27 +1291,20 @@ void *sort_thread(void *arg)
 	thread_data_t *a = (thread_data_t*) arg;
 	global_data_t *d = a->global;
 	int i, j, t, n, id = a->id;
-	int lb = 0, gb = 0;
 	uint64_t p, b, q, l;
 	int numa = d->numa;
 	int numa_node = d->numa_node[id];
 	int numa_dst, numa_src;
 	int threads = d->threads;
 	int threads_per_numa = threads / numa;
-	pthread_barrier_t *local_barrier = d->local_barrier[numa_node];
-	pthread_barrier_t *global_barrier = d->global_barrier;
+	barrier_t *barrier = d->barrier;
 	// id in local numa threads
 	int numa_local_id = 0;
 	for (i = 0 ; i != id ; ++i)
 		if (d->numa_node[i] == numa_node)
 			numa_local_id++;
-/*	// bind thread and its allocation
-	if (threads <= d->max_threads)
-		cpu_bind(d->cpu[id]);
-	if (numa <= d->max_numa)
-		memory_bind(d->numa_node[id]);
-*/	// block info
-	int range_partitions = 128;
+	// block info
+	int range_partitions = d->fanout;
 	uint64_t block_cap = d->block_cap;
 	uint8_t block_cap_bits = log_2(block_cap);
 	// inputs, outputs and size
@@ -1397,33 +1329,40 @@ void *sort_thread(void *arg)
 #endif
 	// (in-parallel) LSB radix-sort the sample
 	partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 0, 8,
-	               id, threads, &global_barrier[gb]);
+	               id, threads, barrier);
 	partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 8, 8,
-	               id, threads, &global_barrier[gb + 3]);
+	               id, threads, barrier);
 	partition_keys(d->sample, d->sample_buf, d->sample_size, d->sample_hist, 16, 8,
-	               id, threads, &global_barrier[gb + 6]);
+	               id, threads, barrier);
 	partition_keys(d->sample_buf, d->sample, d->sample_size, d->sample_hist, 24, 8,
-	               id, threads, &global_barrier[gb + 9]);
-	gb += 12;
+	               id, threads, barrier);
 	tim = micro_time() - tim;
 	a->sample_time = tim;
-	// extract delimiters from sample
+	// extract delimiters from sample (one per thread)
 	uint64_t half_range_partitions = range_partitions >> 1;
 	uint32_t *numa_delimiter = malloc(numa * sizeof(uint32_t));
 	uint32_t *range_delimiter = mamalloc(range_partitions * sizeof(uint32_t));
-	uint32_t *thread_delimiter = calloc(half_range_partitions, sizeof(uint32_t));
-	thread_delimiter[half_range_partitions - 1] = ~0;
-	extract_delimiters(d->sample, d->sample_size, thread_delimiter);
-	for (p = 0 ; p != half_range_partitions ; ++p)
-		range_delimiter[p] = thread_delimiter[p];
+	uint32_t *thread_delimiter = calloc(threads, sizeof(uint32_t));
+	thread_delimiter[threads - 1] = ~0;
+	sample_delimiters_32(d->sample, d->sample_size, thread_delimiter, NULL);
+	for (t = 0 ; t != threads ; ++t)
+		range_delimiter[t] = thread_delimiter[t];
+	// more sampled ranges up to half the partitions
+	q = half_range_partitions - threads;
+	uint32_t *more_delimiter = calloc(q + 1, sizeof(uint32_t));
+	more_delimiter[q] = ~0;
+	sample_delimiters_32(d->sample, d->sample_size, more_delimiter, NULL);
+	for (p = 0 ; p != q ; ++p)
+		range_delimiter[threads + p] = more_delimiter[p];
+	free(more_delimiter);
 	// numa numa_delimiters
-	q = half_range_partitions / numa;
-	for (p = 0 ; p != numa ; ++p)
-		numa_delimiter[p] = range_delimiter[(p + 1) * q - 1];
-	// radix ranges
+	for (n = 0 ; n != numa ; ++n)
+		numa_delimiter[n] = thread_delimiter[(n + 1) * threads_per_numa - 1];
+	// radix ranges (local sort of the low bits)
 	uint8_t log_half_range_partitions = log_2(range_partitions) - 1;
+	uint8_t local_bits = 32 - log_half_range_partitions;
 	for (p = 0 ; p != half_range_partitions ; ++p) {
-		uint64_t delim = (p << (32 - log_half_range_partitions)) - 1;
+		uint64_t delim = (p << local_bits) - 1;
 		range_delimiter[p + half_range_partitions] = delim;
 	}
 	qsort(range_delimiter, range_partitions, sizeof(uint32_t), uint32_compare);
@@ -1440,24 +1379,24 @@ void *sort_thread(void *arg)
 	uint64_t alloced_blocks = alloced_size >> block_cap_bits;
 	uint64_t max_local_blocks = 1 + numa_blocks +
 				    threads_per_numa * range_partitions;
-	fprintf(stderr, "max_local_blocks = %d, alloced_blocks = %d\n", max_local_blocks, alloced_blocks);
 	assert(max_local_blocks <= alloced_blocks);
 	if (!numa_local_id) {
-		int8_t *block_map = malloc(alloced_blocks * sizeof(uint8_t));
+		int16_t *block_map = malloc(alloced_blocks * sizeof(int16_t));
 		d->numa_blocks[numa_node] = numa_blocks;
 		d->block_map[numa_node] = block_map;
 	}
 	// synchronize local nodes (to get block space)
-	pthread_barrier_wait(&local_barrier[lb++]);
+	barrier_wait(barrier, id, BARRIER_NUMA);
 	// set block map
-	volatile int8_t **block_map = d->block_map;
-	volatile int8_t *local_block_map = d->block_map[numa_node];
+	volatile int16_t **block_map = d->block_map;
+	volatile int16_t *local_block_map = d->block_map[numa_node];
 	// reset the indicators of free blocks
 	uint64_t max_blocks_size = max_local_blocks / threads_per_numa;
 	uint64_t max_blocks_offset = max_blocks_size * numa_local_id;
 	if (numa_local_id + 1 == threads_per_numa)
 		max_blocks_size = max_local_blocks - max_blocks_offset;
-	memset((void*) &local_block_map[max_blocks_offset], -1, max_blocks_size);
+	memset((void*) &local_block_map[max_blocks_offset], -1,
+	       max_blocks_size * sizeof(int16_t));
 	// determine numa destination per range partition
 	if (!id) {
 		int *numa_dest = malloc(range_partitions * sizeof(int));
@@ -1477,14 +1416,16 @@ void *sort_thread(void *arg)
 	// allocate space for first read
 	uint32_t *keys_space = mamalloc(block_cap * range_partitions * sizeof(uint32_t));
 	uint32_t *rids_space = mamalloc(block_cap * range_partitions * sizeof(uint32_t));
-	int8_t *ranges = mamalloc(block_cap * range_partitions * sizeof(int8_t));
+	uint16_t *ranges = mamalloc(block_cap * range_partitions * sizeof(uint16_t));
 	// range partition histogram of the first items and save destinations
 	tim = micro_time();
 	uint64_t copy_part = min(size, block_cap * range_partitions);
-	range_histogram(keys, ranges, copy_part, count, range_delimiter);
+	range_histogram(keys, ranges, copy_part, count, range_delimiter,
+			range_partitions);
 	// (range) partition from destinations and store in buffer space
 	partition_known(keys, rids, ranges, copy_part, count,
 			keys_space, rids_space, range_partitions);
+	free(ranges);
 	tim = micro_time() - tim;
 	a->partition_first_time = tim;
 	// broadcast extra items
@@ -1497,7 +1438,7 @@ void *sort_thread(void *arg)
 	}
 	assert(o == copy_part);
 	// synchronize local nodes (to get block space)
-	pthread_barrier_wait(&local_barrier[lb++]);
+	barrier_wait(barrier, id, BARRIER_NUMA);
 	free(count);
 	// range partition the data and store back in block fashion
 	uint32_t *mid_keys = &keys[copy_part];
@@ -1506,7 +1447,8 @@ void *sort_thread(void *arg)
 	uint64_t *open_block_size = malloc(range_partitions * sizeof(uint64_t));
 	tim = micro_time();
 	b = range_partition_to_blocks(mid_keys, mid_rids, size - copy_part, keys, rids,
-				      range_delimiter, local_block_map, prev_blocks,
+				      range_delimiter, range_partitions,
+				      local_block_map, prev_blocks,
 				      block_cap, open_block_index, open_block_size);
 	tim = micro_time() - tim;
 	a->partition_blocks_time = tim;
@@ -1522,7 +1464,7 @@ void *sort_thread(void *arg)
 	// check data in blocks
 	if (!numa_local_id) {
 		for (b = 0 ; b != max_local_blocks ; ++b) {
-			int8_t r = local_block_map[b];
+			int16_t r = local_block_map[b];
 			if (r < 0) continue;
 			uint64_t block_size = block_cap;
 			for (t = 0 ; t != threads_per_numa ; ++t)
@@ -1534,7 +1476,7 @@ void *sort_thread(void *arg)
 		}
 		fprintf(stderr, "Block ranges checked %d / %d\n", numa_node + 1, numa);
 	}
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 #endif
 	d->max_block_index[id] = calloc(numa, sizeof(uint64_t));
 	tim = micro_time();
@@ -1650,7 +1592,7 @@ void *sort_thread(void *arg)
 	tim = micro_time() - tim;
 	a->combine_time = tim;
 	// synchronize all threads
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 	// compute extra items of current numa node
 	uint64_t extra_numa_size = 0;
 	for (p = 0 ; p != range_partitions ; ++p)
@@ -1663,25 +1605,25 @@ void *sort_thread(void *arg)
 			max_block_index = d->max_block_index[t][numa_node];
 	assert(max_block_index != 0);
 	// sync globally
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 #ifdef BG
 	if (!numa_local_id) {
 		fprintf(stderr, "NUMA %d max block (empty & full): %ld\n",
 				 numa_node, max_block_index);
 		for (b = 0 ; b != max_local_blocks ; ++b) {
-			int8_t r = local_block_map[b];
+			int16_t r = local_block_map[b];
 			if (r < 0) continue;
 			check_range(&keys[b << block_cap_bits], block_cap, r, range_delimiter);
 		}
 		fprintf(stderr, "Full blocks checked %d / %d\n", numa_node + 1, numa);
 	}
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 	if (!numa_local_id) {
 		for (p = 0 ; p != range_partitions ; ++p)
 			check_range(d->half_block_keys[p], d->half_block_size[p], p, range_delimiter);
 		fprintf(stderr, "Half blocks checked %d / %d\n", numa_node + 1, numa);
 	}
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 #endif
 	// search for first empty and swap with last full block
 	numa_blocks = max_block_index + 1;
@@ -1744,7 +1686,7 @@ void *sort_thread(void *arg)
 	tim = micro_time() - tim;
 	a->compact_time = tim;
 	// synchronize all threads
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 	// update local numa blocks
 	assert(numa_blocks <= alloced_blocks);
 	if (!numa_local_id) {
@@ -1764,13 +1706,13 @@ void *sort_thread(void *arg)
 		// count blocks of each partition
 		uint64_t *count_blocks = calloc(range_partitions, sizeof(uint64_t));
 		for (b = 0 ; b != numa_blocks ; ++b) {
-			int8_t r = local_block_map[b];
+			int16_t r = local_block_map[b];
 			count_blocks[r]++;
 		}
 		d->count_blocks[numa_node] = count_blocks;
 	}
 	// synchronize all threads
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 	// generate partition counts and offsets before swaps
 	assert(numa_blocks == d->numa_blocks[numa_node]);
 	volatile uint64_t *moved = d->moved;
@@ -1804,7 +1746,7 @@ void *sort_thread(void *arg)
 #ifdef BG
 	if (!numa_local_id) {
 		for (b = 0 ; b != numa_blocks ; ++b) {
-			int8_t r = local_block_map[b];
+			int16_t r = local_block_map[b];
 			assert(r >= 0);
 			check_range(&keys[b << block_cap_bits], block_cap, r, range_delimiter);
 		}
@@ -1812,7 +1754,7 @@ void *sort_thread(void *arg)
 		fprintf(stderr, "Blocks before balance: (%d / %d): %ld\n",
 				 numa_node + 1, numa, numa_blocks);
 	}
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 #endif
 	// move data across remote NUMA nodes to achieve correct balancing
 	int64_t *diff = malloc(numa * sizeof(int64_t));
@@ -1865,11 +1807,11 @@ void *sort_thread(void *arg)
 	a->balance_time = tim;
 	numa_blocks = numa_final_blocks[numa_node];
 	// synchronize all threads
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 #ifdef BG
 	if (!numa_local_id) {
 		for (b = 0 ; b != numa_blocks ; ++b) {
-			int8_t r = local_block_map[b];
+			int16_t r = local_block_map[b];
 			assert(r >= 0);
 			check_range(&keys[b << block_cap_bits], block_cap, r, range_delimiter);
 		}
@@ -1877,11 +1819,12 @@ void *sort_thread(void *arg)
 		fprintf(stderr, "Blocks after balance: (%d / %d): %ld\n",
 				 numa_node + 1, numa, numa_blocks);
 	}
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 #endif
 	free(numa_final_blocks);
 	// store open slots of last blocks
-	uint64_t *open_block = malloc(range_partitions * sizeof(uint64_t));
+	uint64_t open_cap = range_partitions;
+	uint64_t *open_block = malloc(open_cap * sizeof(uint64_t));
 	// allocate buffers (previous extra used for last item processing)
 	uint32_t *keys_buf = malloc(block_cap * sizeof(uint32_t));
 	uint32_t *rids_buf = malloc(block_cap * sizeof(uint32_t));
@@ -1944,6 +1887,20 @@ void *sort_thread(void *arg)
 			block_stream(cycle_key, keys_buf, block_cap);
 			block_stream(cycle_rid, rids_buf, block_cap);
 		} else {
+			// grow the private space if other threads took the slots
+			// of more ranges than it holds
+			if (last == open_cap) {
+				uint32_t *more_keys = mamalloc((open_cap << (block_cap_bits + 1)) * sizeof(uint32_t));
+				uint32_t *more_rids = mamalloc((open_cap << (block_cap_bits + 1)) * sizeof(uint32_t));
+				memcpy(more_keys, keys_space, (open_cap << block_cap_bits) * sizeof(uint32_t));
+				memcpy(more_rids, rids_space, (open_cap << block_cap_bits) * sizeof(uint32_t));
+				free(keys_space);
+				free(rids_space);
+				keys_space = more_keys;
+				rids_space = more_rids;
+				open_cap <<= 1;
+				open_block = realloc(open_block, open_cap * sizeof(uint64_t));
+			}
 			// destination is private space
 			uint32_t *key = &keys_space[last << block_cap_bits];
 			uint32_t *rid = &rids_space[last << block_cap_bits];
@@ -1967,7 +1924,7 @@ void *sort_thread(void *arg)
 	d->keys_space[id] = keys_space;
 	d->rids_space[id] = rids_space;
 	// synchronize all threads
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 	// space to store pointers of last blocks
 	uint32_t **last_keys = malloc(threads * sizeof(uint32_t*));
 	uint32_t **last_rids = malloc(threads * sizeof(uint32_t*));
@@ -2020,7 +1977,7 @@ void *sort_thread(void *arg)
 	free(last_keys);
 	free(last_rids);
 	// synchronize all threads
-	pthread_barrier_wait(&global_barrier[gb++]);
+	barrier_wait(barrier, id, BARRIER_GLOBAL);
 	free(keys_space);
 	free(rids_space);
 	free(numa_offsets);
@@ -2030,7 +1987,7 @@ void *sort_thread(void *arg)
 	if (!numa_local_id) {
 		for (p = 0 ; d->numa_dest[p] != numa_node ; ++p);
 		uint64_t p_from = p;
-		for (; d->numa_dest[p] == numa_node ; ++p);
+		for (; p != (uint64_t) range_partitions && d->numa_dest[p] == numa_node ; ++p);
 		uint64_t p_to = p;
 		uint64_t max_size = d->size[numa_node] * d->fudge;
 		tim = micro_time();
@@ -2052,9 +2009,9 @@ void *sort_thread(void *arg)
 		for (p = p_from ; p != p_to ; ++p) {
 			uint64_t size = block_cap * sizes[p] + d->half_block_size[p];
 			check_range(key, size, p, range_delimiter);
-			uint32_t high_bits = key[0] >> 26;
+			uint32_t high_bits = key[0] >> local_bits;
 			for (q = 0 ; q != size ; ++q)
-				assert((key[q] >> 26) == high_bits);
+				assert((key[q] >> local_bits) == high_bits);
 			key += size;
 		}
 		fprintf(stderr, "Partitioning for %d / %d checked!\n",
@@ -2062,7 +2019,7 @@ void *sort_thread(void *arg)
 #endif
 	}
 	// synchronize local threads
-	pthread_barrier_wait(&local_barrier[lb++]);
+	barrier_wait(barrier, id, BARRIER_NUMA);
 	// find thread local starting partition
 	int rid = numa_node * threads_per_numa + numa_local_id;
 	uint32_t min_delim = !rid ? 0 : thread_delimiter[rid - 1] + 1;
@@ -2071,8 +2028,7 @@ void *sort_thread(void *arg)
 		a->local_sort_tuples = 0;
 		a->local_sort_time = 0;
 		free(sizes);
-		assert(gb < 48 && lb < 32);
-		pthread_exit(NULL);
+		return NULL;
 	}
 	for (p = 0 ; range_delimiter[p] < min_delim ; ++p);
 	uint64_t p_from = p;
@@ -2105,7 +2061,7 @@ void *sort_thread(void *arg)
 	for (; p != p_to ; ++p) {
 		uint64_t size = sizes[p] * block_cap + d->half_block_size[p];
 		if (size == 0) continue;
-		i = schedule_passes(size, 26, radix_bits, buffered);
+		i = schedule_passes(size, local_bits, radix_bits, buffered);
 		for (j = 0 ; j != i ; ++j)
 			if (radix_bits[j] > allocated_bits[j]) {
 				hist[j] = realloc(hist[j], (1 << radix_bits[j]) * sizeof(uint64_t));
@@ -2126,18 +2082,21 @@ void *sort_thread(void *arg)
 	a->local_sort_time = tim;
 	a->local_sort_tuples = local_tuples;
 	free(sizes);
-	assert(gb < 48 && lb < 32);
-	pthread_exit(NULL);
+	return NULL;
 }
 
-void sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
-          int threads, int numa, double fudge,
-          char **description, uint64_t *times)
+void msb_32_sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
+                 int threads, int numa, double fudge, int fanout,
+                 char **description, uint64_t *times)
 {
 	int i, j, t, n;
-//	assert(threads == 64);
-	// global 6 bits + 64 range partitions (local 26 bits)
-	uint64_t p, range_partitions = 128;
+	// half the range partitions are sampled with a range per thread and
+	// half are radix ranges (global log(fanout / 2) bits, the rest local)
+	if (!fanout)
+		for (fanout = 128 ; fanout < threads * 2 ; fanout <<= 1);
+	assert(fanout >= 16 && fanout <= 1024 && (fanout & (fanout - 1)) == 0);
+	assert(threads * 2 <= fanout);
+	uint64_t p, range_partitions = fanout;
 	// check aligned input
 	for (i = 0 ; i != numa ; ++i) {
 		assert((15 & (uint64_t) keys[i]) == 0);
@@ -2147,23 +2106,10 @@ void sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	uint64_t total_size = 0;
 	for (n = 0 ; n != numa ; ++n)
 		total_size += size[n];
-	// initialize global barriers
-	int local_barriers = 32;
-	int global_barriers = 48;
+	// initialize sample barrier
 	pthread_barrier_t sample_barrier;
-	pthread_barrier_t *global_barrier = malloc(global_barriers * sizeof(pthread_barrier_t));
-	pthread_barrier_t **local_barrier = malloc(numa * sizeof(pthread_barrier_t*));
 	pthread_barrier_init(&sample_barrier, NULL, threads + 1);
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_init(&global_barrier[t], NULL, threads);
-	// initialize local barriers
 	int threads_per_numa = threads / numa;
-	for (n = 0 ; n != numa ; ++n) {
-		local_barrier[n] = malloc(local_barriers * sizeof(pthread_barrier_t));
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_init(&local_barrier[n][t], NULL, threads_per_numa);
-	}
-	pthread_t *id = malloc(threads * sizeof(pthread_t));
 	thread_data_t *data = malloc(threads * sizeof(thread_data_t));
 	// universal meta data
 	global_data_t global;
@@ -2178,9 +2124,17 @@ void sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	global.ranges_closed = calloc(1, sizeof(uint64_t));
 //	global.block_cap = 4096;
 	global.block_cap = 512;
+	// smaller blocks (down to 64 tuples) if a node has no room within
+	// the fudge factor for the blocks its threads leave open, one per
+	// range each, or a thread has fewer blocks than ranges
+	for (n = 0 ; n != numa ; ++n)
+		while (global.block_cap > 64 &&
+		       ((uint64_t) (size[n] * fudge) / global.block_cap <
+		        2 + size[n] / global.block_cap + threads_per_numa * range_partitions ||
+		        size[n] / threads_per_numa / global.block_cap < range_partitions))
+			global.block_cap >>= 1;
 	global.fudge = fudge;
-	global.global_barrier = global_barrier;
-	global.local_barrier = local_barrier;
+	global.fanout = fanout;
 	global.sample_barrier = &sample_barrier;
 	// allocate the sample
 	global.sample_size = 0.005 * total_size;
@@ -2193,7 +2147,7 @@ void sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	for (t = 0 ; t != threads ; ++t)
 		global.sample_hist[t] = malloc(256 * sizeof(uint64_t));
 	// counts
-	global.block_map = malloc(numa * sizeof(uint8_t*));
+	global.block_map = malloc(numa * sizeof(int16_t*));
 	global.numa_blocks = malloc(numa * sizeof(uint64_t*));
 	global.count_blocks = malloc(numa * sizeof(uint64_t*));
 	global.more_blocks = calloc(numa, sizeof(uint64_t));
@@ -2229,20 +2183,21 @@ void sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
 	schedule_threads(global.cpu, global.numa_node, threads, numa);
-	// spawn threads
+	global.barrier = barrier_init(threads, global.cpu, global.numa_node, NULL);
+	// start workers
 	for (t = 0 ; t != threads ; ++t) {
 		data[t].id = t;
 		data[t].global = &global;
-		pthread_create(&id[t], NULL, sort_thread, (void*) &data[t]);
 	}
+	pool_start(threads, NULL,
+	           sort_thread, data, sizeof(thread_data_t));
 	// free sample data
 	pthread_barrier_wait(&sample_barrier);
 	pthread_barrier_destroy(&sample_barrier);
 	numa_free(global.sample,     global.sample_size * sizeof(uint32_t));
 	numa_free(global.sample_buf, global.sample_size * sizeof(uint32_t));
-	// join threads
-	for (t = 0 ; t != threads ; ++t)
-		pthread_join(id[t], NULL);
+	// wait for workers
+	pool_wait();
 	// check total size
 	uint64_t total_size_after = 0;
 	for (n = 0 ; n != numa ; ++n)
@@ -2277,25 +2232,16 @@ void sort(uint32_t **keys, uint32_t **rids, uint64_t *size,
 	times[8] = it / numa;	  description[8] = "Injection of data time:   ";
 	times[9] = ls / threads;  description[9] = "Local radixsort time:     ";
 	description[10] = NULL;
-	// destroy barriers
-	for (t = 0 ; t != global_barriers ; ++t)
-		pthread_barrier_destroy(&global_barrier[t]);
-	for (n = 0 ; n != numa ; ++n) {
-		for (t = 0 ; t != local_barriers ; ++t)
-			pthread_barrier_destroy(&local_barrier[n][t]);
-		free(local_barrier[n]);
-	}
-	free(global_barrier);
-	free(local_barrier);
+	// destroy barrier
+	barrier_destroy(global.barrier);
 	// release memory
-	numa_free(global.sample,     global.sample_size * sizeof(uint32_t));
-	numa_free(global.sample_buf, global.sample_size * sizeof(uint32_t));
-	free(id);
 	free(global.numa_node);
 	free(global.cpu);
 	free(data);
 }
 
+#ifndef CHIPLETSORT_LIBRARY
+
 void *check_thread(void *arg)
 {
 	thread_data_t *a = (thread_data_t*) arg;
@@ -2322,10 +2268,14 @@ void *check_thread(void *arg)
 		rids =	&d->rids[numa_node][offset];
 	uint32_t *keys_end = &keys[size];
 	uint64_t sum = 0;
-	uint32_t pkey = 0;
+	uint32_t pkey = 0, prid = 0;
 	while (keys != keys_end) {
 		uint32_t key = *keys++;
-		if (rids) assert(key == *rids++);
+		// stable sorts keep equal keys in the order of their rids
+		if (rids && d->stable) {
+			assert(key != pkey || *rids >= prid);
+			prid = *rids++;
+		} else if (rids) assert(key == *rids++);
 		assert(key >= pkey);
 		sum += key;
 		pkey = key;
@@ -2334,7 +2284,7 @@ void *check_thread(void *arg)
 	pthread_exit(NULL);
 }
 
-uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int same)
+uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int same, int stable)
 {
 	int max_threads = hardware_threads();
 	int n, t, threads = 0;
@@ -2345,7 +2295,8 @@ uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int s
 	global.threads = threads;
 	global.numa = numa;
 	global.keys = keys;
-	global.rids = same ? rids : NULL;
+	global.rids = same || stable ? rids : NULL;
+	global.stable = stable;
 	global.size = size;
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
@@ -2359,6 +2310,10 @@ uint64_t check(uint32_t **keys, uint32_t **rids, uint64_t *size, int numa, int s
 	}
 	for (n = 1 ; n != numa ; ++n)
 		assert(keys[n][0] >= keys[n - 1][size[n - 1] - 1]);
+	if (stable)
+		for (n = 1 ; n != numa ; ++n)
+			assert(keys[n][0] != keys[n - 1][size[n - 1] - 1] ||
+			       rids[n][0] >= rids[n - 1][size[n - 1] - 1]);
 	uint64_t checksum = 0;
 	for (t = 0 ; t != threads ; ++t) {
 		pthread_join(id[t], NULL);
@@ -2413,8 +2368,16 @@ uint64_t read_from_file(uint32_t **keys, uint64_t *size, int numa, const char *n
 
 int main(int argc, char **argv)
 {
+	placement_init(&argc, argv, "linear");
+	// equal keys in the order of their rids, which are the input positions,
+	// at the cost of a tie-break pass over the output (stable.h)
+	const char *stable_option = option(&argc, argv, "stable", "CHIPLET_STABLE");
+	int stable = stable_option != NULL && atoi(stable_option);
+	// range partitions (0 picks the least for the threads)
+	const char *fanout_option = option(&argc, argv, "fanout", "CHIPLET_FANOUT");
+	int fanout = fanout_option != NULL ? atoi(fanout_option) : 0;
 	uint64_t tuples = argc > 1 ? atoi(argv[1]) : 1000;
-	int threads = argc > 2 ? atoi(argv[2]) : 64;
+	int threads = argc > 2 ? atoi(argv[2]) : hardware_threads();
 	int numa = argc > 3 ? atoi(argv[3]) : numa_max_node() + 1;
 	tuples *= (uint64_t) 1000000;
 	char *name = NULL;
@@ -2430,7 +2393,6 @@ int main(int argc, char **argv)
 		}
 	double fudge = theta != 0.0 ? 2.0 : 1.2;
 	assert(numa > 0 && threads >= numa && threads % numa == 0);
-//	assert(threads == 64);
 	uint64_t tuples_per_numa = tuples / numa;
 	uint64_t capacity_per_numa = tuples_per_numa * fudge;
 	uint32_t *keys[numa], *rids[numa];
@@ -2444,6 +2406,7 @@ int main(int argc, char **argv)
 	fprintf(stderr, "NUMA nodes: %d\n", numa);
 	fprintf(stderr, "Hardware threads: %d (%d per NUMA)\n", threads, threads / numa);
 	fprintf(stderr, "Threads: %d (%d per NUMA)\n", threads, threads / numa);
+	fprintf(stderr, "Placement: %s\n", placement_name());
 	for (i = 0 ; i != numa ; ++i) {
 		size[i] = tuples_per_numa;
 		cap[i] = size[i] * fudge;
@@ -2478,6 +2441,13 @@ int main(int argc, char **argv)
 		same_key_payload = 0;
 		sum_v = init_32(rids, size, cap, threads, numa, 32, 0.0, 0, 0);
 	}
+	if (stable) {
+		uint64_t p, at = 0;
+		for (i = 0 ; i != numa ; ++i)
+			for (p = 0 ; p != size[i] ; ++p)
+				rids[i][p] = at++;
+		same_key_payload = 0;
+	}
 	t = micro_time() - t;
 	fprintf(stderr, "Generation time: %ld us\n", t);
 	fprintf(stderr, "Generation rate: %.1f mrps\n", tuples * 1.0 / t);
@@ -2487,10 +2457,18 @@ int main(int argc, char **argv)
 	char *desc[12];
 	// call parallel sort
 	t = micro_time();
-	sort(keys, rids, size, threads, numa, fudge, desc, times);
+	msb_32_sort(keys, rids, size, threads, numa, fudge, fanout, desc, times);
+	// put the rids of equal keys in order
+	uint64_t stable_time = micro_time();
+	if (stable)
+		stable_ties((void**) keys, (void**) rids, size, numa,
+		            sizeof(uint32_t), sizeof(uint32_t), threads, NULL);
+	stable_time = micro_time() - stable_time;
 	t = micro_time() - t;
 	// print sort times
 	fprintf(stderr, "Sort time: %ld us\n", t);
+	if (stable)
+		fprintf(stderr, "Stable tie-break time: %ld us\n", stable_time);
 	double gigs = (tuples * 8.0) / (1024 * 1024 * 1024);
 	fprintf(stderr, "Sort rate: %.1f mrps (%.2f GB / sec)\n", tuples * 1.0 / t, (gigs * 1000000) / t);
 	// compute total time
@@ -2506,7 +2484,7 @@ int main(int argc, char **argv)
 	for (i = 0 ; i != numa ; ++i)
 		fprintf(stderr, "Node %d:%6.2f%%\n", i, size[i] * 100.0 / tuples);
 	// check sort order and sum
-	checksum = check(keys, rids, size, numa, same_key_payload);
+	checksum = check(keys, rids, size, numa, same_key_payload, stable);
 	assert(checksum == sum_k);
 	fprintf(stderr, "Checksum: %lu\n", checksum);
 	// free sort data
@@ -2518,3 +2496,5 @@ int main(int argc, char **argv)
 		tuples * 1.0 / t, (gigs * 1000000) / t);
 	return EXIT_SUCCESS;
 }
+
+#endif
@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "options.h"
+
+
+static void remove_args(int *argc, char **argv, int i, int n)
+{
+	int j;
+	for (j = i ; j + n <= *argc ; ++j)
+		argv[j] = argv[j + n];
+	*argc -= n;
+}
+
+const char *option(int *argc, char **argv, const char *name, const char *env)
+{
+	int i;
+	size_t len = strlen(name);
+	for (i = 1 ; i < *argc ; ++i) {
+		const char *arg = argv[i];
+		if (strncmp(arg, "--", 2) || strncmp(&arg[2], name, len))
+			continue;
+		arg = &arg[len + 2];
+		if (*arg == '=') {
+			remove_args(argc, argv, i, 1);
+			return &arg[1];
+		}
+		if (*arg == 0 && i + 1 < *argc) {
+			arg = argv[i + 1];
+			remove_args(argc, argv, i, 2);
+			return arg;
+		}
+	}
+	return env != NULL ? getenv(env) : NULL;
+}
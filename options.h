@@ -0,0 +1,11 @@
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+/* Returns the value of "--name=value" or "--name value" and removes
+ * it from argv, so positional arguments keep their position. If the
+ * flag is missing the environment variable env is used instead, and
+ * NULL is returned if neither is set.
+ */
+const char *option(int *argc, char **argv, const char *name, const char *env);
+
+#endif
@@ -0,0 +1,212 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#undef _GNU_SOURCE
+
+#include "topology.h"
+#include "placement.h"
+#include "options.h"
+
+
+enum {
+	PLACEMENT_LINEAR,
+	PLACEMENT_LOCAL,
+	PLACEMENT_MIXED,
+	PLACEMENT_SMT,
+	PLACEMENT_FILE
+};
+
+static const char *policy_names[] = {"linear", "local", "mixed", "smt", "file"};
+
+static int policy = PLACEMENT_LINEAR;
+static int *file_cpu = NULL;
+static int file_cpus = 0;
+static char policy_name[256] = "linear";
+
+// the current list is kept if the file cannot be read or lists no CPUs
+static int read_cpu_file(const char *name)
+{
+	FILE *fp = fopen(name, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Cannot open placement file: %s\n", name);
+		return -1;
+	}
+	int first, last, c, *cpu = NULL, cpus = 0;
+	while (fscanf(fp, " %d", &first) == 1) {
+		last = first;
+		if (fscanf(fp, " - %d", &last) != 1)
+			last = first;
+		for (c = first ; c <= last ; ++c) {
+			cpu = realloc(cpu, (cpus + 1) * sizeof(int));
+			cpu[cpus++] = c;
+		}
+		if (fscanf(fp, " ,") < 0) break;
+	}
+	fclose(fp);
+	if (!cpus) {
+		fprintf(stderr, "No CPUs in placement file: %s\n", name);
+		return -1;
+	}
+	free(file_cpu);
+	file_cpu = cpu;
+	file_cpus = cpus;
+	return 0;
+}
+
+int placement_set(const char *name)
+{
+	int p;
+	if (!strncmp(name, "file:", 5)) {
+		if (read_cpu_file(&name[5]) < 0)
+			return -1;
+		policy = PLACEMENT_FILE;
+	} else {
+		for (p = 0 ; p != PLACEMENT_FILE ; ++p)
+			if (!strcmp(name, policy_names[p])) break;
+		if (p == PLACEMENT_FILE) {
+			fprintf(stderr, "Unknown placement: %s "
+					"(linear, local, mixed, smt, file:PATH)\n", name);
+			return -1;
+		}
+		policy = p;
+	}
+	snprintf(policy_name, sizeof(policy_name), "%s", name);
+	return 0;
+}
+
+void placement_init(int *argc, char **argv, const char *fallback)
+{
+	const char *name = option(argc, argv, "placement", "CHIPLET_PLACEMENT");
+	if (placement_set(name != NULL ? name : fallback) < 0)
+		exit(EXIT_FAILURE);
+}
+
+const char *placement_name(void)
+{
+	return policy_name;
+}
+
+// cpus of L3 domain, either cores before siblings or siblings together
+static int l3_cpus(const topology_t *topo, int l3, int *list, int packed)
+{
+	int i, s, size = 0, more = 1;
+	if (packed) {
+		for (i = 0 ; i != topo->l3_core_count[l3] ; ++i) {
+			int core = topo->l3_core[l3][i];
+			for (s = 0 ; s != topo->core_cpu_count[core] ; ++s)
+				list[size++] = topo->core_cpu[core][s];
+		}
+		return size;
+	}
+	for (s = 0 ; more ; ++s) {
+		more = 0;
+		for (i = 0 ; i != topo->l3_core_count[l3] ; ++i) {
+			int core = topo->l3_core[l3][i];
+			if (s < topo->core_cpu_count[core]) {
+				list[size++] = topo->core_cpu[core][s];
+				more = 1;
+			}
+		}
+	}
+	return size;
+}
+
+// machine nodes covered by logical node n when using numa nodes
+static int numa_covers(const topology_t *topo, int node, int n, int numa)
+{
+	if (numa >= topo->numa_nodes)
+		return node == n % topo->numa_nodes;
+	return node * numa / topo->numa_nodes == n;
+}
+
+// order in which the cpus of logical node n receive threads
+static int node_order(const topology_t *topo, int n, int numa, int *order)
+{
+	int i, r, c, node, size = 0;
+	if (policy == PLACEMENT_FILE) {
+		for (i = 0 ; i != file_cpus ; ++i) {
+			c = file_cpu[i];
+			if (c < topo->cpus && topo->cpu[c].numa >= 0 &&
+			    numa_covers(topo, topo->cpu[c].numa, n, numa))
+				order[size++] = c;
+		}
+		// listed cpus ignore the node split
+		if (!size)
+			for (i = 0 ; i != file_cpus ; ++i)
+				order[size++] = file_cpu[i];
+		return size;
+	}
+	if (policy == PLACEMENT_LINEAR) {
+		for (c = 0 ; c != topo->cpus ; ++c)
+			if (topo->cpu[c].numa >= 0 &&
+			    numa_covers(topo, topo->cpu[c].numa, n, numa))
+				order[size++] = c;
+		return size;
+	}
+	// L3 domains of the logical node
+	int domains = 0;
+	int *domain = malloc(topo->l3_domains * sizeof(int));
+	int *domain_size = malloc(topo->l3_domains * sizeof(int));
+	int **domain_cpus = malloc(topo->l3_domains * sizeof(int*));
+	for (node = 0 ; node != topo->numa_nodes ; ++node)
+		if (numa_covers(topo, node, n, numa))
+			for (i = 0 ; i != topo->numa_l3_count[node] ; ++i) {
+				int l3 = topo->numa_l3[node][i];
+				domain_cpus[domains] = malloc(topo->cpus * sizeof(int));
+				domain_size[domains] = l3_cpus(topo, l3, domain_cpus[domains],
+							       policy == PLACEMENT_SMT);
+				domain[domains++] = l3;
+			}
+	if (policy == PLACEMENT_LOCAL)
+		for (i = 0 ; i != domains ; ++i)
+			for (r = 0 ; r != domain_size[i] ; ++r)
+				order[size++] = domain_cpus[i][r];
+	else {
+		int more = 1;
+		for (r = 0 ; more ; ++r) {
+			more = 0;
+			for (i = 0 ; i != domains ; ++i)
+				if (r < domain_size[i]) {
+					order[size++] = domain_cpus[i][r];
+					more = 1;
+				}
+		}
+	}
+	for (i = 0 ; i != domains ; ++i)
+		free(domain_cpus[i]);
+	free(domain_cpus);
+	free(domain_size);
+	free(domain);
+	return size;
+}
+
+void placement_schedule(int *cpu, int *numa_node, int threads, int numa)
+{
+	const topology_t *topo = topology();
+	int t, n, i;
+	int *order = malloc((topo->cpus + file_cpus) * sizeof(int));
+	assert(numa > 0 && threads >= numa && threads % numa == 0);
+	for (n = 0 ; n != numa ; ++n) {
+		int size = node_order(topo, n, numa, order);
+		// logical nodes that share a machine node split its cpus
+		i = numa > topo->numa_nodes ? n / topo->numa_nodes * (threads / numa) : 0;
+		for (t = n ; t < threads ; t += numa, ++i) {
+			cpu[t] = size ? order[i % size] : t;
+			if (numa_node != NULL)
+				numa_node[t] = n;
+		}
+	}
+	free(order);
+}
+
+void placement_bind(int cpu)
+{
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	CPU_SET(cpu, &cpu_set);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
+}
@@ -0,0 +1,31 @@
+#ifndef _PLACEMENT_H_
+#define _PLACEMENT_H_
+
+/* Thread placement policies over the machine topology:
+ *
+ *   linear     CPUs of each node in id order (the original scheduling)
+ *   local      fill one L3 domain (chiplet) before moving to the next
+ *   mixed      round-robin across the L3 domains, SMT siblings last
+ *   smt        one thread per L3 domain, then the SMT sibling of it
+ *   file:PATH  CPUs listed in PATH (ids or ranges such as 0-7,64-71)
+ *
+ * Thread t always works on logical NUMA node t % numa and only uses
+ * CPUs of that node. The policy is picked by --placement=NAME on the
+ * command line or by the CHIPLET_PLACEMENT environment variable.
+ *
+ * placement_set() returns -1 and keeps the current policy for an
+ * unknown name or a file that cannot be read or lists no CPUs, and
+ * placement_init() exits.
+ */
+
+void placement_init(int *argc, char **argv, const char *fallback);
+
+int placement_set(const char *name);
+
+const char *placement_name(void);
+
+void placement_schedule(int *cpu, int *numa_node, int threads, int numa);
+
+void placement_bind(int cpu);
+
+#endif
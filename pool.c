@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <numaif.h>
+#undef _GNU_SOURCE
+
+#include "topology.h"
+#include "placement.h"
+#include "pool.h"
+
+
+typedef struct {
+	pthread_t thread;
+	int id;
+	int cpu;
+	int next_cpu;
+	uint64_t batch;
+	void *(*func)(void*);
+	void *arg;
+	void *scratch[POOL_SCRATCH_SLOTS];
+	size_t scratch_size[POOL_SCRATCH_SLOTS];
+} worker_t;
+
+static worker_t **workers = NULL;
+static int worker_count = 0;
+static int batch_threads = 0;
+static int running = 0;
+static uint64_t batch = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static void worker_bind(worker_t *w)
+{
+	const topology_t *topo = topology();
+	if (w->next_cpu == w->cpu) return;
+	w->cpu = w->next_cpu;
+	if (w->cpu < 0) {
+		// unbound: all cpus and default memory policy
+		int c;
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+		for (c = 0 ; c != topo->cpus ; ++c)
+			if (topo->cpu[c].numa >= 0)
+				CPU_SET(c, &cpu_set);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
+		set_mempolicy(MPOL_DEFAULT, NULL, 0);
+		return;
+	}
+	placement_bind(w->cpu);
+	unsigned long nodemask = 1UL << topology_numa_of_cpu(w->cpu);
+	if (set_mempolicy(MPOL_BIND, &nodemask, sizeof(nodemask) * 8) == -1)
+		fprintf(stderr, "set_mempolicy error\n");
+}
+
+static void *worker(void *arg)
+{
+	worker_t *w = (worker_t*) arg;
+	pthread_mutex_lock(&lock);
+	for (;;) {
+		while (w->batch == batch)
+			pthread_cond_wait(&start_cond, &lock);
+		w->batch = batch;
+		if (w->id >= batch_threads) continue;
+		pthread_mutex_unlock(&lock);
+		worker_bind(w);
+		w->func(w->arg);
+		pthread_mutex_lock(&lock);
+		if (--running == 0)
+			pthread_cond_signal(&done_cond);
+	}
+	return NULL;
+}
+
+void pool_start(int threads, const int *cpu, void *(*func)(void*),
+                void *arg, size_t arg_size)
+{
+	int t;
+	pthread_mutex_lock(&lock);
+	assert(running == 0);
+	if (threads > worker_count) {
+		workers = realloc(workers, threads * sizeof(worker_t*));
+		for (t = worker_count ; t != threads ; ++t) {
+			worker_t *w = calloc(1, sizeof(worker_t));
+			w->id = t;
+			w->cpu = -1;
+			w->batch = batch;
+			workers[t] = w;
+			pthread_create(&w->thread, NULL, worker, (void*) w);
+		}
+		worker_count = threads;
+	}
+	for (t = 0 ; t != threads ; ++t) {
+		worker_t *w = workers[t];
+		w->func = func;
+		w->arg = &((char*) arg)[t * arg_size];
+		w->next_cpu = cpu != NULL ? cpu[t] : -1;
+	}
+	batch_threads = threads;
+	running = threads;
+	batch++;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void pool_wait(void)
+{
+	pthread_mutex_lock(&lock);
+	while (running != 0)
+		pthread_cond_wait(&done_cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void *pool_scratch(int id, int slot, size_t size)
+{
+	assert(id < worker_count && slot < POOL_SCRATCH_SLOTS);
+	worker_t *w = workers[id];
+	if (w->scratch_size[slot] < size) {
+		free(w->scratch[slot]);
+		w->scratch[slot] = NULL;
+		int r = posix_memalign(&w->scratch[slot], 64, size);
+		assert(r == 0);
+		w->scratch_size[slot] = size;
+	}
+	return w->scratch[slot];
+}
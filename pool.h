@@ -0,0 +1,30 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+/* Worker threads that outlive a single sort:
+ *
+ * pool_start() hands arg[t] (arg_size bytes apart) to worker t for
+ * t < threads, creating workers the first time they are needed, and
+ * pool_wait() returns once all of them are done. A worker is pinned
+ * to cpu[t] and bound to the memory of its NUMA node, and it is only
+ * rebound when the cpu changes, so repeated sorts on the same
+ * placement skip thread creation and binding. With cpu NULL the
+ * workers are left unbound. One batch runs at a time.
+ *
+ * pool_scratch() returns a 64-byte aligned buffer of worker id that
+ * is kept between batches (histograms, partition buffers) and only
+ * grows. It must be called from the worker itself.
+ */
+
+#define POOL_SCRATCH_SLOTS 8
+
+void pool_start(int threads, const int *cpu, void *(*func)(void*),
+                void *arg, size_t arg_size);
+
+void pool_wait(void);
+
+void *pool_scratch(int id, int slot, size_t size);
+
+#endif
@@ -0,0 +1,53 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "sample.h"
+
+
+void sample_delimiters_32(const uint32_t *sample, uint64_t sample_size,
+                          uint32_t *delimiter, const int *weight)
+{
+	uint64_t i, parts = 0, total = 0, sum = 0;
+	while (delimiter[parts] != ~ (uint32_t) 0) parts++;
+	for (i = 0 ; i <= parts ; ++i)
+		total += weight != NULL ? weight[i] : 1;
+	double percentile = sample_size * 1.0 / total;
+	for (i = 0 ; i != parts ; ++i) {
+		sum += weight != NULL ? weight[i] : 1;
+		uint64_t index = percentile * sum - 0.001;
+		delimiter[i] = sample[index];
+		// search repetitions in sample
+		uint64_t start, end;
+		for (start = index ; start ; --start)
+			if (sample[start] != delimiter[i]) break;
+		for (end = index ; end != sample_size ; ++end)
+			if (sample[end] != delimiter[i]) break;
+		// if more repetitions after, don't include
+		if (index - start < end - index && delimiter[i])
+			delimiter[i]--;
+	}
+}
+
+void sample_delimiters_64(const uint64_t *sample, uint64_t sample_size,
+                          uint64_t *delimiter, const int *weight)
+{
+	uint64_t i, parts = 0, total = 0, sum = 0;
+	while (delimiter[parts] != ~ (uint64_t) 0) parts++;
+	for (i = 0 ; i <= parts ; ++i)
+		total += weight != NULL ? weight[i] : 1;
+	double percentile = sample_size * 1.0 / total;
+	for (i = 0 ; i != parts ; ++i) {
+		sum += weight != NULL ? weight[i] : 1;
+		uint64_t index = percentile * sum - 0.001;
+		delimiter[i] = sample[index];
+		// search repetitions in sample
+		uint64_t start, end;
+		for (start = index ; start ; --start)
+			if (sample[start] != delimiter[i]) break;
+		for (end = index ; end != sample_size ; ++end)
+			if (sample[end] != delimiter[i]) break;
+		// if more repetitions after, don't include
+		if (index - start < end - index && delimiter[i])
+			delimiter[i]--;
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef _SAMPLE_H_
+#define _SAMPLE_H_
+
+#include <stdint.h>
+
+/* Delimiters of a range split from a sorted sample of the keys:
+ *
+ * The engines draw a random sample of the keys, sort it and split the
+ * keys into ranges at its percentiles (across nodes, threads or groups).
+ * delimiter[] holds the inclusive upper key of every range, the last
+ * one is ~0 and the ranges are as many as the entries up to it. Range i
+ * takes a share of the sample in proportion to weight[i], or an equal
+ * one if weight is NULL. A delimiter that falls in a run of equal keys
+ * leaves the run to the next range if most of it follows.
+ *
+ * The library reuses them to see how even the split of an engine would
+ * be before picking it.
+ */
+
+void sample_delimiters_32(const uint32_t *sample, uint64_t sample_size,
+                          uint32_t *delimiter, const int *weight);
+
+void sample_delimiters_64(const uint64_t *sample, uint64_t sample_size,
+                          uint64_t *delimiter, const int *weight);
+
+#endif
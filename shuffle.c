@@ -45,6 +45,7 @@
 #include <numa.h>
 
 #include "rand.h"
+#include "placement.h"
 
 
 static int hardware_threads(void)
@@ -456,6 +457,7 @@ typedef struct {
 	int seed;
 	int threads;
 	int thread_id;
+	int cpu;
 	uint64_t size;
 	void *data;
 	void *space;
@@ -471,6 +473,7 @@ static void *run(void *arg)
 	uint64_t p_target, p, unique, *hist;
 	uint64_t partitions = 256;
 	assert(d->mode == 32 || d->mode == 64);
+	placement_bind(d->cpu);
 	uint32_t *data_32 = (uint32_t*) d->data;
 	uint64_t *data_64 = (uint64_t*) d->data;
 	uint32_t *space_32 = (uint32_t*) d->space;
@@ -510,6 +513,7 @@ static void shuffle(void *array, uint64_t size, int mode)
 	int t, threads = hardware_threads();
 	if (threads > 256) threads = 256;
 	pthread_t id[threads];
+	int cpu[threads];
 	thread_data_t data[threads];
 	uint64_t *parallel_hist[threads];
 	pthread_barrier_t barrier[3];
@@ -522,9 +526,11 @@ static void shuffle(void *array, uint64_t size, int mode)
 		parallel_hist[t] = malloc(256 * sizeof(uint64_t));
 	for (t = 0 ; t != 3 ; ++t)
 		pthread_barrier_init(&barrier[t], NULL, threads);
+	placement_schedule(cpu, NULL, threads, 1);
 	for (t = 0 ; t != threads ; ++t) {
 		data[t].mode = mode;
 		data[t].thread_id = t;
+		data[t].cpu = cpu[t];
 		data[t].threads = threads;
 		data[t].seed = rand();
 		data[t].data = array;
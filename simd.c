@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simd.h"
+
+
+static const char *names[] = {"sse", "avx2", "avx512"};
+
+static int detect(void)
+{
+	int level = SIMD_SSE;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		level = SIMD_AVX2;
+	if (__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw"))
+		level = SIMD_AVX512;
+	// optional lower level
+	const char *env = getenv("CHIPLET_SIMD");
+	if (env != NULL) {
+		int l;
+		for (l = SIMD_SSE ; l <= SIMD_AVX512 ; ++l)
+			if (!strcmp(env, names[l])) break;
+		if (l > SIMD_AVX512)
+			fprintf(stderr, "Unknown SIMD level: %s\n", env);
+		else if (l < level)
+			level = l;
+	}
+	return level;
+}
+
+int simd_level(void)
+{
+	static int level = -1;
+	if (level < 0)
+		level = detect();
+	return level;
+}
+
+const char *simd_name(int level)
+{
+	return names[level];
+}
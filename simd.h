@@ -0,0 +1,23 @@
+#ifndef _SIMD_H_
+#define _SIMD_H_
+
+/* Widest vector kernels the CPU runs, detected once with CPUID:
+ *
+ *   sse      128-bit kernels (always available, the fallback)
+ *   avx2     256-bit shifts and masks, 256-bit streaming flushes
+ *   avx512   512-bit shifts and masks, one 64-byte streaming store
+ *            per flushed cache line (needs AVX-512 F and BW)
+ *
+ * The CHIPLET_SIMD environment variable can lower the level (for
+ * comparing the kernels), a level the CPU lacks is never picked.
+ */
+
+#define SIMD_SSE	0
+#define SIMD_AVX2	1
+#define SIMD_AVX512	2
+
+int simd_level(void);
+
+const char *simd_name(int level);
+
+#endif
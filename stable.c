@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "pool.h"
+#include "stable.h"
+
+
+// runs of equal keys shorter than this are insertion sorted
+#define STABLE_INSERT_CUTOFF	16
+
+typedef struct {
+	int id;
+	int threads;
+	int numa;
+	int key_width;
+	int rid_width;
+	char **keys;
+	char **rids;
+	const uint64_t *size;
+	uint64_t total;
+	stable_order_t order;
+	void *arg;
+} stable_data_t;
+
+// a tuple on the nodes, past the last one node is numa
+typedef struct {
+	int node;
+	uint64_t index;
+} cursor_t;
+
+static inline uint64_t load(const char *array, uint64_t i, int width)
+{
+	switch (width) {
+	case 1: return ((const uint8_t*) array)[i];
+	case 2: return ((const uint16_t*) array)[i];
+	case 4: return ((const uint32_t*) array)[i];
+	default: return ((const uint64_t*) array)[i];
+	}
+}
+
+static inline void store(char *array, uint64_t i, uint64_t value, int width)
+{
+	switch (width) {
+	case 1: ((uint8_t*) array)[i] = value; break;
+	case 2: ((uint16_t*) array)[i] = value; break;
+	case 4: ((uint32_t*) array)[i] = value; break;
+	default: ((uint64_t*) array)[i] = value;
+	}
+}
+
+static void seek(const stable_data_t *d, cursor_t *c, uint64_t at)
+{
+	c->node = 0;
+	while (c->node != d->numa && at >= d->size[c->node])
+		at -= d->size[c->node++];
+	c->index = at;
+}
+
+static inline void next(const stable_data_t *d, cursor_t *c)
+{
+	if (++c->index != d->size[c->node]) return;
+	c->index = 0;
+	do c->node++;
+	while (c->node != d->numa && d->size[c->node] == 0);
+}
+
+static inline uint64_t key_at(const stable_data_t *d, const cursor_t *c)
+{
+	return load(d->keys[c->node], c->index, d->key_width);
+}
+
+static inline uint64_t rid_at(const stable_data_t *d, const cursor_t *c)
+{
+	return load(d->rids[c->node], c->index, d->rid_width);
+}
+
+static int compare_64(const void *x, const void *y)
+{
+	uint64_t a = *(const uint64_t*) x, b = *(const uint64_t*) y;
+	return a < b ? -1 : a > b ? 1 : 0;
+}
+
+static void sort_rids(uint64_t *rids, uint64_t size)
+{
+	uint64_t i, j;
+	if (size >= STABLE_INSERT_CUTOFF) {
+		qsort(rids, size, sizeof(uint64_t), compare_64);
+		return;
+	}
+	for (i = 1 ; i < size ; ++i) {
+		uint64_t rid = rids[i];
+		for (j = i ; j && rids[j - 1] > rid ; --j)
+			rids[j] = rids[j - 1];
+		rids[j] = rid;
+	}
+}
+
+static void *stable_thread(void *arg)
+{
+	stable_data_t *d = (stable_data_t*) arg;
+	uint64_t from = (d->total * d->id) / d->threads;
+	uint64_t to = (d->total * (d->id + 1)) / d->threads;
+	uint64_t i, j, k, cap = 0, *buf = NULL;
+	cursor_t c, start;
+	if (from == to) return NULL;
+	// the run going on at the start of the share is of a previous thread
+	seek(d, &c, from);
+	i = from;
+	if (from != 0) {
+		seek(d, &start, from - 1);
+		uint64_t prev = key_at(d, &start);
+		for (; i != to && key_at(d, &c) == prev ; ++i)
+			next(d, &c);
+	}
+	while (i < to) {
+		start = c;
+		uint64_t key = key_at(d, &c), rid = rid_at(d, &c);
+		int sorted = 1;
+		for (j = i + 1, next(d, &c) ; j != d->total && key_at(d, &c) == key ; ++j) {
+			uint64_t r = rid_at(d, &c);
+			sorted &= r >= rid;
+			rid = r;
+			next(d, &c);
+		}
+		if (j - i == 1 || (sorted && d->order == NULL)) {
+			i = j;
+			continue;
+		}
+		// runs may span nodes and are sorted in a buffer
+		if (j - i > cap) {
+			free(buf);
+			cap = j - i;
+			buf = malloc(cap * sizeof(uint64_t));
+		}
+		cursor_t p = start;
+		for (k = 0 ; k != j - i ; ++k, next(d, &p))
+			buf[k] = rid_at(d, &p);
+		if (d->order != NULL)
+			d->order(buf, j - i, d->arg);
+		else
+			sort_rids(buf, j - i);
+		p = start;
+		for (k = 0 ; k != j - i ; ++k, next(d, &p))
+			store(d->rids[p.node], p.index, buf[k], d->rid_width);
+		i = j;
+	}
+	free(buf);
+	return NULL;
+}
+
+void stable_runs(void **keys, void **rids, const uint64_t *size, int numa,
+                 int key_width, int rid_width, int threads, const int *cpu,
+                 stable_order_t order, void *arg)
+{
+	int t, n;
+	uint64_t total = 0;
+	assert(key_width == 4 || key_width == 8);
+	assert(rid_width == 1 || rid_width == 2 || rid_width == 4 || rid_width == 8);
+	for (n = 0 ; n != numa ; ++n)
+		total += size[n];
+	stable_data_t *data = malloc(threads * sizeof(stable_data_t));
+	for (t = 0 ; t != threads ; ++t) {
+		data[t].id = t;
+		data[t].threads = threads;
+		data[t].numa = numa;
+		data[t].key_width = key_width;
+		data[t].rid_width = rid_width;
+		data[t].keys = (char**) keys;
+		data[t].rids = (char**) rids;
+		data[t].size = size;
+		data[t].total = total;
+		data[t].order = order;
+		data[t].arg = arg;
+	}
+	pool_start(threads, cpu, stable_thread, data, sizeof(stable_data_t));
+	pool_wait();
+	free(data);
+}
+
+void stable_ties(void **keys, void **rids, const uint64_t *size, int numa,
+                 int key_width, int rid_width, int threads, const int *cpu)
+{
+	stable_runs(keys, rids, size, numa, key_width, rid_width, threads, cpu,
+	            NULL, NULL);
+}
@@ -0,0 +1,40 @@
+#ifndef _STABLE_H_
+#define _STABLE_H_
+
+#include <stdint.h>
+
+/* Stable order of sorted tuples by their rids:
+ *
+ * stable_ties() takes the sorted output of an engine, keys[n] and
+ * rids[n] of size[n] for n < numa read in node order as one array of
+ * keys of key_width bytes (4 or 8) and rids of rid_width bytes (1, 2,
+ * 4 or 8), and sorts the rids of every run of equal keys, including
+ * runs that span nodes. With rids that are the input positions of the
+ * tuples (row ids), equal keys keep their input order.
+ *
+ * The LSB engines are stable, their NUMA transfer keeps the order of
+ * the sources (see transfer.h), except the 64-bit chiplet engine across
+ * nodes. The MSB engines (in-place partitioning) and the comparison
+ * engines (comb sort) always need it.
+ *
+ * The threads run on the worker pool pinned to cpu[t] (NULL leaves
+ * them unbound), each one takes the runs that start in its share.
+ * Runs already in order are only read.
+ *
+ * stable_runs() walks the runs the same way and hands every run of more
+ * than one tuple to order(), with its rids widened to 64 bits in a
+ * private buffer, to be put in any order that is written back (the
+ * string argsort orders them by the strings past the sorted prefixes).
+ * A NULL order() is stable_ties().
+ */
+
+typedef void (*stable_order_t)(uint64_t *rids, uint64_t size, void *arg);
+
+void stable_ties(void **keys, void **rids, const uint64_t *size, int numa,
+                 int key_width, int rid_width, int threads, const int *cpu);
+
+void stable_runs(void **keys, void **rids, const uint64_t *size, int numa,
+                 int key_width, int rid_width, int threads, const int *cpu,
+                 stable_order_t order, void *arg);
+
+#endif
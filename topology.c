@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <numa.h>
+#undef _GNU_SOURCE
+
+#include "topology.h"
+
+
+static int hardware_threads(void)
+{
+	char name[40];
+	struct stat st;
+	int cpus = -1;
+	do {
+		sprintf(name, "/sys/devices/system/cpu/cpu%d", ++cpus);
+	} while (stat(name, &st) == 0);
+	return cpus;
+}
+
+static int read_line(const char *name, char *line, int size)
+{
+	FILE *fp = fopen(name, "r");
+	if (fp == NULL) return 0;
+	int ok = fgets(line, size, fp) != NULL;
+	fclose(fp);
+	return ok;
+}
+
+static int read_int(const char *name, int value)
+{
+	char line[32];
+	if (read_line(name, line, sizeof(line)))
+		value = atoi(line);
+	return value;
+}
+
+static int cpu_online(int cpu)
+{
+	char name[80];
+	struct stat st;
+	sprintf(name, "/sys/devices/system/cpu/cpu%d/topology", cpu);
+	if (stat(name, &st) != 0) return 0;
+	// cpu0 usually has no online file
+	sprintf(name, "/sys/devices/system/cpu/cpu%d/online", cpu);
+	return read_int(name, 1);
+}
+
+// sysfs lists are sorted so the leader is the first cpu
+static int list_leader(const char *name, int cpu)
+{
+	char line[4096];
+	if (!read_line(name, line, sizeof(line)))
+		return cpu;
+	return atoi(line);
+}
+
+static int l3_leader(int cpu)
+{
+	char name[80];
+	int i;
+	for (i = 0 ; i != 16 ; ++i) {
+		sprintf(name, "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+		if (read_int(name, -1) != 3) continue;
+		sprintf(name, "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+		return list_leader(name, cpu);
+	}
+	return -1;
+}
+
+static int dense_id(int *keys, int *count, int key)
+{
+	int i;
+	for (i = 0 ; i != *count ; ++i)
+		if (keys[i] == key) return i;
+	keys[(*count)++] = key;
+	return i;
+}
+
+static void append(int **list, int *count, int item)
+{
+	list[0] = realloc(list[0], (*count + 1) * sizeof(int));
+	list[0][(*count)++] = item;
+}
+
+static topology_t *discover(void)
+{
+	char name[80];
+	int c, cpus = hardware_threads();
+	int use_numa = numa_available() != -1;
+	int max_numa = use_numa ? numa_max_node() + 1 : 1;
+	topology_t *topo = calloc(1, sizeof(topology_t));
+	topo->cpus = cpus;
+	topo->cpu = malloc(cpus * sizeof(topology_cpu_t));
+	int *socket_key = malloc(cpus * sizeof(int));
+	int *l3_key = malloc(cpus * sizeof(int));
+	int *core_key = malloc(cpus * sizeof(int));
+	int *core_l3 = malloc(cpus * sizeof(int));
+	topo->core_cpu = calloc(cpus, sizeof(int*));
+	topo->core_cpu_count = calloc(cpus, sizeof(int));
+	// assign dense ids in cpu order
+	for (c = 0 ; c != cpus ; ++c) {
+		topology_cpu_t *t = &topo->cpu[c];
+		if (!cpu_online(c)) {
+			t->socket = t->numa = t->l3 = t->core = t->smt = -1;
+			continue;
+		}
+		topo->online_cpus++;
+		sprintf(name, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", c);
+		t->socket = dense_id(socket_key, &topo->sockets, read_int(name, 0));
+		t->numa = use_numa ? numa_node_of_cpu(c) : 0;
+		if (t->numa < 0) t->numa = 0;
+		if (t->numa >= topo->numa_nodes)
+			topo->numa_nodes = t->numa + 1;
+		// an L3 that spans NUMA nodes (SNC) is split per node
+		int leader = l3_leader(c);
+		if (leader < 0) leader = cpus + t->numa;
+		t->l3 = dense_id(l3_key, &topo->l3_domains, leader * max_numa + t->numa);
+		sprintf(name, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", c);
+		int cores = topo->cores;
+		t->core = dense_id(core_key, &topo->cores, list_leader(name, c));
+		if (cores != topo->cores)
+			core_l3[t->core] = t->l3;
+		t->smt = topo->core_cpu_count[t->core];
+		append(&topo->core_cpu[t->core], &topo->core_cpu_count[t->core], c);
+	}
+	assert(topo->online_cpus > 0);
+	// build the tree
+	topo->numa_l3 = calloc(topo->numa_nodes, sizeof(int*));
+	topo->numa_l3_count = calloc(topo->numa_nodes, sizeof(int));
+	topo->l3_numa = malloc(topo->l3_domains * sizeof(int));
+	topo->l3_core = calloc(topo->l3_domains, sizeof(int*));
+	topo->l3_core_count = calloc(topo->l3_domains, sizeof(int));
+	for (c = 0 ; c != cpus ; ++c) {
+		topology_cpu_t *t = &topo->cpu[c];
+		if (t->numa < 0 || t->smt != 0) continue;
+		if (topo->l3_core_count[t->l3] == 0) {
+			topo->l3_numa[t->l3] = t->numa;
+			append(&topo->numa_l3[t->numa], &topo->numa_l3_count[t->numa], t->l3);
+		}
+		assert(core_l3[t->core] == t->l3);
+		append(&topo->l3_core[t->l3], &topo->l3_core_count[t->l3], t->core);
+	}
+	free(socket_key);
+	free(l3_key);
+	free(core_key);
+	free(core_l3);
+	return topo;
+}
+
+static topology_t *machine = NULL;
+static pthread_once_t machine_once = PTHREAD_ONCE_INIT;
+
+static void machine_init(void)
+{
+	machine = discover();
+}
+
+const topology_t *topology(void)
+{
+	pthread_once(&machine_once, machine_init);
+	return machine;
+}
+
+void topology_print(const topology_t *topo)
+{
+	fprintf(stderr, "Topology: %d sockets, %d NUMA nodes, %d L3 domains, "
+			"%d cores, %d threads\n", topo->sockets, topo->numa_nodes,
+			topo->l3_domains, topo->cores, topo->online_cpus);
+}
+
+int topology_numa_of_cpu(int cpu)
+{
+	const topology_t *topo = topology();
+	if (cpu < 0 || cpu >= topo->cpus || topo->cpu[cpu].numa < 0)
+		return 0;
+	return topo->cpu[cpu].numa;
+}
+
+int topology_l3_of_cpu(int cpu)
+{
+	const topology_t *topo = topology();
+	if (cpu < 0 || cpu >= topo->cpus || topo->cpu[cpu].l3 < 0)
+		return 0;
+	return topo->cpu[cpu].l3;
+}
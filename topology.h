@@ -0,0 +1,51 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+/* Machine topology discovered from sysfs at startup:
+ *
+ *   socket -> NUMA node -> L3 domain (CCD / CCX) -> core -> SMT sibling
+ *
+ * L3 domains are read from cpuN/cache/indexM/shared_cpu_list (level 3),
+ * cores from cpuN/topology/thread_siblings_list and NUMA nodes from
+ * libnuma. Machines without an L3 entry get one domain per NUMA node.
+ * All ids are dense and start from 0. CPUs that are offline have all
+ * their fields set to -1.
+ */
+
+typedef struct {
+	int socket;
+	int numa;
+	int l3;
+	int core;
+	int smt;
+} topology_cpu_t;
+
+typedef struct {
+	int cpus;
+	int online_cpus;
+	int sockets;
+	int numa_nodes;
+	int l3_domains;
+	int cores;
+	topology_cpu_t *cpu;
+	// L3 domains of each NUMA node
+	int *numa_l3_count;
+	int **numa_l3;
+	// NUMA node and cores of each L3 domain
+	int *l3_numa;
+	int *l3_core_count;
+	int **l3_core;
+	// logical CPUs (SMT siblings) of each core
+	int *core_cpu_count;
+	int **core_cpu;
+} topology_t;
+
+const topology_t *topology(void);
+
+void topology_print(const topology_t *topo);
+
+int topology_numa_of_cpu(int cpu);
+
+int topology_l3_of_cpu(int cpu);
+
+#endif
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <assert.h>
+#include <immintrin.h>
+
+#include "simd.h"
+#include "transfer.h"
+
+
+// bytes of the source read ahead of the copy, enough lines in flight
+// to cover the latency of a remote node
+#define TRANSFER_PREFETCH	2048
+
+// polls of a counter before yielding the cpu
+#define TRANSFER_SPIN		(1 << 14)
+
+int transfer_plan(transfer_t *copies, const uint64_t *part, const uint64_t *base,
+                  int numa, int partitions, int node, int local_id, int threads_per_node)
+{
+	int i, k, m, n, c = 0;
+	for (k = 0 ; k != numa ; ++k) {
+		// sources in turn, shifted by node and by thread
+		n = (node + local_id + k) % numa;
+		const uint64_t *p = &part[(uint64_t) n * partitions];
+		uint64_t total = 0;
+		for (i = 0 ; i != partitions ; ++i)
+			total += p[i];
+		uint64_t lo = (total * local_id) / threads_per_node;
+		uint64_t hi = (total * (local_id + 1)) / threads_per_node;
+		// walk partitions and their output offsets up to the share
+		uint64_t at = 0, out = 0;
+		int first = c;
+		for (i = 0 ; i != partitions && at < hi ; ++i) {
+			uint64_t before = 0, after = 0;
+			for (m = 0 ; m != numa ; ++m)
+				if (m < n) before += part[(uint64_t) m * partitions + i];
+				else if (m > n) after += part[(uint64_t) m * partitions + i];
+			uint64_t from = at > lo ? at : lo;
+			uint64_t to = at + p[i] < hi ? at + p[i] : hi;
+			if (from < to) {
+				copies[c].src = n;
+				copies[c].from = base[n] + from;
+				copies[c].to = out + before + from - at;
+				copies[c].size = to - from;
+				copies[c].last = 0;
+				c++;
+			}
+			out += before + p[i] + after;
+			at += p[i];
+		}
+		// the last copy of every source, empty if the share is
+		if (c == first) {
+			copies[c].src = n;
+			copies[c].from = base[n];
+			copies[c].to = 0;
+			copies[c].size = 0;
+			c++;
+		}
+		copies[c - 1].last = 1;
+	}
+	assert(c <= numa * partitions);
+	return c;
+}
+
+// copy lines of 64 bytes to an aligned output
+static void copy_sse(char *out, const char *in, uint64_t lines)
+{
+	while (lines--) {
+		_mm_prefetch(&in[TRANSFER_PREFETCH], _MM_HINT_NTA);
+		__m128i x0 = _mm_loadu_si128((const __m128i*) &in[0]);
+		__m128i x1 = _mm_loadu_si128((const __m128i*) &in[16]);
+		__m128i x2 = _mm_loadu_si128((const __m128i*) &in[32]);
+		__m128i x3 = _mm_loadu_si128((const __m128i*) &in[48]);
+		_mm_stream_si128((__m128i*) &out[0], x0);
+		_mm_stream_si128((__m128i*) &out[16], x1);
+		_mm_stream_si128((__m128i*) &out[32], x2);
+		_mm_stream_si128((__m128i*) &out[48], x3);
+		in += 64;
+		out += 64;
+	}
+}
+
+__attribute__((target("avx2")))
+static void copy_avx2(char *out, const char *in, uint64_t lines)
+{
+	while (lines--) {
+		_mm_prefetch(&in[TRANSFER_PREFETCH], _MM_HINT_NTA);
+		__m256i x0 = _mm256_loadu_si256((const __m256i*) &in[0]);
+		__m256i x1 = _mm256_loadu_si256((const __m256i*) &in[32]);
+		_mm256_stream_si256((__m256i*) &out[0], x0);
+		_mm256_stream_si256((__m256i*) &out[32], x1);
+		in += 64;
+		out += 64;
+	}
+}
+
+__attribute__((target("avx512f")))
+static void copy_avx512(char *out, const char *in, uint64_t lines)
+{
+	while (lines--) {
+		_mm_prefetch(&in[TRANSFER_PREFETCH], _MM_HINT_NTA);
+		_mm512_stream_si512((__m512i*) out, _mm512_loadu_si512(in));
+		in += 64;
+		out += 64;
+	}
+}
+
+void transfer_copy(void *dst, const void *src, uint64_t bytes)
+{
+	char *out = (char*) dst;
+	const char *in = (const char*) src;
+	// regular stores up to the first line of the output
+	uint64_t head = (64 - ((uint64_t) out & 63)) & 63;
+	if (head > bytes) head = bytes;
+	memcpy(out, in, head);
+	out += head;
+	in += head;
+	bytes -= head;
+	uint64_t lines = bytes >> 6;
+	int level = simd_level();
+	if (level == SIMD_AVX512)
+		copy_avx512(out, in, lines);
+	else if (level == SIMD_AVX2)
+		copy_avx2(out, in, lines);
+	else
+		copy_sse(out, in, lines);
+	out += lines << 6;
+	in += lines << 6;
+	memcpy(out, in, bytes & 63);
+}
+
+int transfer_pipelined(void)
+{
+	static int pipelined = -1;
+	if (pipelined < 0) {
+		const char *env = getenv("CHIPLET_PIPELINE");
+		pipelined = env == NULL || atoi(env) != 0;
+	}
+	return pipelined;
+}
+
+void transfer_arrive(uint64_t *arrived, uint64_t owners, uint64_t chunk,
+                     uint64_t to, uint64_t size)
+{
+	// streamed tuples are visible before the counters
+	_mm_sfence();
+	while (size != 0) {
+		uint64_t owner = chunk ? to / chunk : owners - 1;
+		uint64_t run = size;
+		if (owner >= owners - 1)
+			owner = owners - 1;
+		else if ((owner + 1) * chunk - to < run)
+			run = (owner + 1) * chunk - to;
+		__sync_fetch_and_add(&arrived[owner], run);
+		to += run;
+		size -= run;
+	}
+}
+
+void transfer_signal(uint64_t *counter)
+{
+	__sync_fetch_and_add(counter, 1);
+}
+
+void transfer_wait(uint64_t *counter, uint64_t target)
+{
+	int s;
+	for (s = 0 ; s != TRANSFER_SPIN ; ++s) {
+		if (*(volatile uint64_t*) counter == target) break;
+		_mm_pause();
+	}
+	while (*(volatile uint64_t*) counter != target)
+		sched_yield();
+	__sync_synchronize();
+}
+
+int transfer_direct(void)
+{
+	static int direct = -1;
+	if (direct < 0) {
+		const char *env = getenv("CHIPLET_DIRECT");
+		direct = env != NULL && atoi(env) != 0;
+	}
+	return direct;
+}
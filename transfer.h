@@ -0,0 +1,85 @@
+#ifndef _TRANSFER_H_
+#define _TRANSFER_H_
+
+#include <stdint.h>
+
+/* NUMA transfer of the range partitioned tuples:
+ *
+ * After the range-radix pass every source node holds the partitions
+ * of each destination node one after the other, part[n][i] tuples of
+ * partition i for this node in source n starting at base[n]. The
+ * destination lays out partition i as the parts of sources 0, 1, ..
+ * in turn, so the transfer keeps the input order (stable).
+ *
+ * transfer_plan() gives the copies of one thread of the destination.
+ * The thread takes a contiguous share of the tuples of every source,
+ * one read stream per source split only where partitions end, and
+ * starts with a different source than the other threads of its node
+ * and than the same thread of other nodes. At every step the links
+ * between two nodes carry the same number of streams instead of a
+ * random number. Copies are listed in the order to run them, the
+ * last one of each source is flagged (and empty if the share is).
+ *
+ * transfer_copy() streams bytes with non-temporal stores of the
+ * widest vector (simd.h), whole cache lines of the output, and
+ * prefetches the source a few KB ahead, past the end of the copy into
+ * the next one of the same stream.
+ */
+
+typedef struct {
+	int src;
+	uint64_t from;
+	uint64_t to;
+	uint64_t size;
+	int last;
+} transfer_t;
+
+// part[n * partitions + i], room for numa * partitions copies
+int transfer_plan(transfer_t *copies, const uint64_t *part, const uint64_t *base,
+                  int numa, int partitions, int node, int local_id, int threads_per_node);
+
+void transfer_copy(void *dst, const void *src, uint64_t bytes);
+
+/* Pipelined transfer:
+ *
+ * Instead of a global barrier after the transfer, a thread starts the
+ * first local pass once its own range of the destination is in. The
+ * copiers add the tuples they wrote to the arrival counter of each
+ * owner (the thread that reads that range in the next pass, chunk
+ * tuples each, the last one takes the rest), after the counts of the
+ * fused histogram. The local pass overwrites the sources of the node,
+ * so it only partitions once every thread drained the node: a thread
+ * signals the drain counter of a source after its last copy from it.
+ * Other nodes may still be copying meanwhile. The plans read the
+ * histograms of all nodes, which the local pass reuses, so threads
+ * also signal a counter once they made their plan.
+ *
+ * CHIPLET_PIPELINE=0 keeps the barrier (for comparing the two).
+ */
+
+int transfer_pipelined(void);
+
+void transfer_arrive(uint64_t *arrived, uint64_t owners, uint64_t chunk,
+                     uint64_t to, uint64_t size);
+
+void transfer_signal(uint64_t *counter);
+
+void transfer_wait(uint64_t *counter, uint64_t target);
+
+/* Direct scatter:
+ *
+ * The range-radix pass streams each line straight to the node of its
+ * range, at offsets from the histograms of all nodes in the layout of
+ * the transfer, so there is no transfer. Remote lines are written once
+ * at the full line size, but the writes of a thread spread over all
+ * links and the pass waits for the slowest node twice (global syncs
+ * before and after it). It has not been measured against the transfer
+ * yet, bench_direct.sh compares the two on 2 and 4 nodes, so the
+ * transfer stays the default.
+ *
+ * CHIPLET_DIRECT=1 enables it (tuples of keys and 32-bit rids only).
+ */
+
+int transfer_direct(void);
+
+#endif
@@ -52,6 +52,7 @@
 #undef _GNU_SOURCE
 
 #include "rand.h"
+#include "placement.h"
 
 
 static uint64_t micro_time(void)
@@ -75,51 +76,12 @@ static int cpus(void)
 	return cpu_num;
 }
 
-static void cpu_bind(int cpu_id)
-{
-	cpu_set_t cpu_set;
-	CPU_ZERO(&cpu_set);
-	CPU_SET(cpu_id, &cpu_set);
-	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpu_set);
-}
-
-static void memory_bind(int cpu_id)
-{
-	char numa_id_str[12];
-	struct bitmask *numa_node;
-	int numa_id = numa_node_of_cpu(cpu_id);
-	sprintf(numa_id_str, "%d", numa_id);
-	numa_node = numa_parse_nodestring(numa_id_str);
-	numa_set_membind(numa_node);
-	numa_free_nodemask(numa_node);
-}
-
 static void *mamalloc(size_t size)
 {
 	void *ptr = NULL;
 	return posix_memalign(&ptr, 64, size) ? NULL : ptr;
 }
 
-static void schedule_threads(int *cpu, int *numa_node, int threads, int numa)
-{
-	int t, max_threads = cpus();
-	int *thread_numa = malloc(max_threads * sizeof(int));
-	for (t = 0 ; t != max_threads ; ++t)
-		thread_numa[t] = numa_node_of_cpu(t);
-	for (t = 0 ; t != threads ; ++t) {
-		int i, n = t % numa;
-		for (i = 0 ; i != max_threads ; ++i)
-			if (thread_numa[i] == n) break;
-	//	assert(i != max_threads);
-		thread_numa[i] = -1;
-		cpu[t] = i;
-		if (numa_node != NULL)
-			numa_node[t] = n;
-	//	assert(numa_node_of_cpu(i) == n);
-	}
-	free(thread_numa);
-}
-
 typedef struct {
 	uint32_t **data;
 	uint64_t *size;
@@ -157,10 +119,9 @@ static void *zipf_thread(void *arg)
 	for (i = 0 ; i != id ; ++i)
 		if (d->numa_node[i] == numa_node)
 			numa_local_id++;
-	// bind thread and its allocation
-/*	cpu_bind(d->cpu[id]);
-	memory_bind(d->cpu[id]);
-*/	// allocate space
+	// bind thread
+	placement_bind(d->cpu[id]);
+	// allocate space
 	uint64_t numa_size = d->size[numa_node];
 	if (numa_local_id == 0 && d->data[numa_node] == NULL)
 		d->data[numa_node] = mamalloc(numa_size * sizeof(uint32_t));
@@ -277,7 +238,7 @@ uint64_t zipf_32(uint32_t **data, uint64_t *size, uint32_t *values,
 	global.barrier = barrier;
 	global.cpu = malloc(threads * sizeof(int));
 	global.numa_node = malloc(threads * sizeof(int));
-	schedule_threads(global.cpu, global.numa_node, threads, numa);
+	placement_schedule(global.cpu, global.numa_node, threads, numa);
 	thread_data_t *thread_data = malloc(threads * sizeof(thread_data_t));
 	pthread_t *id = malloc(threads * sizeof(pthread_t));
 	for (t = 0 ; t != threads ; ++t) {